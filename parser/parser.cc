@@ -1,10 +1,36 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <map>
 #include <string>
 #include <vector>
 #include <math.h>
 #include <float.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <thread>
 
 ////////////////////////////////
 /////  class declarations  /////
@@ -18,6 +44,11 @@ class OutputStream {
     virtual void write(std::string) = 0;
     virtual void write(double d);
     virtual void newline();
+    // The result of an evaluation, and the error that took its place.
+    // Errors are reported on stderr by the REPL, so text streams leave
+    // them out.
+    virtual void writeResult(double d);
+    virtual void writeError(std::string msg) {}
 };
 
 class FileOutputStream : public OutputStream {
@@ -33,7 +64,96 @@ class FileOutputStream : public OutputStream {
     void write(std::string text);
 };
 
+class StringOutputStream : public OutputStream {
+    private:
+
+    std::string text;
+
+    public:
+
+    using OutputStream::write;
+    void write(std::string text);
+    std::string str() { return text; }
+};
+
+// Results as binary, for programs rather than people: either raw 8-byte
+// little-endian doubles, with NaN in place of errors, or framed records of
+// a status byte (0) followed by the double, or the status byte (1), a 4-byte
+// little-endian length, and the error message. Text, such as commands
+// write, goes to a stream of its own, if there is one, so that it can't be
+// taken for results, or else passes through as is. Output is collected in
+// a large buffer and handed to the destination stream, which stays owned
+// by the caller, like the text stream, in big chunks.
+class BinaryOutputStream : public OutputStream {
+    private:
+
+    OutputStream *dest;
+    OutputStream *text;
+    bool framed;
+    std::string buffer;
+
+    static const int BUFSIZE = 1 << 20;
+
+    void put(uint64_t x, int bytes);
+
+    public:
+
+    BinaryOutputStream(OutputStream *dest, bool framed, OutputStream *text = NULL)
+            : dest(dest), text(text), framed(framed) { buffer.reserve(BUFSIZE); }
+    ~BinaryOutputStream();
+    using OutputStream::write;
+    void write(std::string text);
+    void writeResult(double d);
+    void writeError(std::string msg);
+    void flush();
+};
+
+class Context;
 class Function;
+class TaskPool;
+
+// How the transcendental functions are computed; see Math
+enum { PRECISION_EXACT, PRECISION_FAST, PRECISION_APPROX };
+
+// Limits on one evaluation: a number of steps, where a call counts the
+// nodes of the function's body and a TileProgram its ops for every row,
+// and a deadline; and a flag that cancels it from anywhere, a signal
+// handler included. Contexts count steps on their own and settle up every
+// CHECK_STEPS, at calls, tail-call loops and tiles, and in the loops of
+// native code, so in between the checks cost next to nothing. Settling
+// notes the function being entered, so an evaluation that is stopped can
+// say where its steps went.
+class Budget {
+
+    private:
+
+    long long maxSteps;
+    double start, deadline;
+    std::atomic<long long> steps;
+    std::atomic<bool> cancelled;
+    std::mutex lock;
+    std::map<Function *, long long> spent;     // Guarded by lock
+    std::string stopped;                        // Guarded by lock
+
+    public:
+
+    static const int CHECK_STEPS = 4096;
+
+    // No limit where maxSteps or seconds is 0
+    Budget(long long maxSteps = 0, double seconds = 0) : cancelled(false) { restart(maxSteps, seconds); }
+    // Starts over, for the next evaluation
+    void restart(long long maxSteps, double seconds);
+    void cancel() { cancelled = true; }
+    // Adds n steps, taken in f (NULL outside any function); false, with
+    // why in *error, if the evaluation has to stop. c names the functions.
+    bool charge(long long n, Function *f, Context *c, std::string *error);
+    // The steps that may be taken before the next charge: CHECK_STEPS, or
+    // fewer near the limit, so that the limit is kept to the step
+    long long headroom() {
+        long long left = maxSteps - steps.load(std::memory_order_relaxed);
+        return maxSteps == 0 || left >= CHECK_STEPS ? CHECK_STEPS : left > 0 ? left : 1;
+    }
+};
 
 class Context {
 
@@ -43,18 +163,191 @@ class Context {
     std::map<std::string, Function *> functions;
     std::vector<std::map<std::string, double> *> parameters;
 
+    // A Context created for evaluating part of an expression on another
+    // thread. It has its own parameter stack, and a copy of the parameters
+    // the evaluation that spawned it could see, taken when it is created:
+    // that evaluation goes on pushing and popping frames of its own in the
+    // meantime. Everything else it sees through its parent.
+    Context *parent;
+    std::map<std::string, double> inherited;
+    int baseDepth;
+    TaskPool *pool;
+
+    // Recursion control. A Call in tail position does not evaluate its
+    // target itself; it leaves the target and its arguments here, and
+    // Function::eval picks them up and runs them in the current frame.
+    bool tailCalls;
+    bool reassociation;
+    bool hoisting;
+    bool polynomials;
+    bool profiling;
+    int maxDepth;
+    Function *tailFunction;
+    // Bytes of stack held back below the deepest frame, and the most a
+    // level of exported code takes
+    static const int STACK_RESERVE = 256 * 1024;
+    static const int NATIVE_FRAME = 256;
+    std::vector<double> tailArgs;
+
+    // Accuracy traded for speed: the precision of the transcendental
+    // functions, and whether TilePrograms compute in single precision
+    int precision;
+    bool floatBatches;
+
+    // Evaluation errors. There is no way to return an error from eval(),
+    // so the first error is recorded here, and evaluation unwinds as
+    // quickly as it can once it is set.
+    std::string errorMsg;
+
+    // Shared objects loaded by Exporter, and the bytes they take
+    std::vector<void *> libraries;
+    size_t libraryBytes;
+
+    // Memory: the bytes taken by the definitions (their names, and the
+    // Functions with their trees), kept up to date as they change; by
+    // compiled code, Programs and native, and the server's parsed
+    // expressions, which can be evicted and built again; and the quotas on
+    // both together, and on one function, or 0
+    size_t defined;
+    std::atomic<long long> compiled;
+    size_t memoryLimit, functionLimit;
+
+    // Limits for every evaluation, and the Budget of the one in progress,
+    // with the steps counted here and not yet charged to it, how many there
+    // may be before they are, and the function that took the last of them
+    long long stepLimit;
+    double timeLimit;
+    Budget *budget;
+    long long unsettled, settleAt;
+    Function *charging;
+
+    bool settle(Function *f);
+    size_t variableBytes(const std::string &name);
+    size_t functionBytes(const std::string &name, Function *f);
+    bool admit(std::string name, size_t bytes, bool function, std::string *error);
+
     public:
 
+    Context() : parent(NULL), baseDepth(0), pool(NULL), tailCalls(true), reassociation(false), hoisting(false), polynomials(false), profiling(false), maxDepth(10000), tailFunction(NULL), precision(PRECISION_EXACT), floatBatches(false), libraryBytes(0), defined(0), compiled(0), memoryLimit(0), functionLimit(0), stepLimit(0), timeLimit(0), budget(NULL), unsettled(0), settleAt(Budget::CHECK_STEPS), charging(NULL) {}
+    Context(Context *parent);
     ~Context();
     void setVariable(std::string name, double value);
     double getVariable(std::string name);
+    std::map<std::string, double> &getVariables() { return variables; }
     void setFunction(std::string name, Function *function);
     Function *getFunction(std::string name);
-    void push(std::vector<std::string> &names, std::vector<double> &values);
+    std::map<std::string, Function *> &getFunctions() { return functions; }
+    // Definitions, within the quotas: false, with why in *error, if they
+    // would be exceeded even with the compiled code evicted. A Function
+    // that is not defined is deleted.
+    bool define(std::string name, double value, std::string *error);
+    bool define(std::string name, Function *function, std::string *error);
+    void addLibrary(void *lib, size_t bytes);
+    bool push(std::vector<std::string> &names, std::vector<double> &values);
+    // Reuses the top frame for a tail call, if the target can't tell the
+    // difference; false if it could, and a frame has to be pushed instead
+    bool rebind(std::vector<std::string> &names, std::vector<double> &values, bool closed);
     void pop();
+    double *parameter(std::string &name);
+    // Writes the variables and functions, through a DumpWriter
     void dump(OutputStream *os, bool alg);
+    // The variables and functions as definitions that recreate them when
+    // read back by assign(), one per line
+    std::string serialize();
+
+    bool useTailCalls() { return tailCalls; }
+    void setTailCalls(bool on) { tailCalls = on; }
+    bool useReassociation() { return reassociation; }
+    void setReassociation(bool on) { reassociation = on; }
+    bool useHoisting() { return hoisting; }
+    void setHoisting(bool on) { hoisting = on; }
+    bool usePolynomials() { return polynomials; }
+    void setPolynomials(bool on) { polynomials = on; }
+    int getPrecision() { return precision; }
+    void setPrecision(int p);
+    bool useFloatBatches() { return floatBatches; }
+    void setFloatBatches(bool on) { floatBatches = on; }
+    TaskPool *getPool() { return pool; }
+    void setThreads(int threads);
+    // Memory in use, in bytes, and the quotas; 0 for none
+    size_t memory() { return defined + compiled; }
+    size_t getMemoryLimit() { return memoryLimit; }
+    void setMemoryLimit(size_t bytes) { memoryLimit = bytes; }
+    size_t getFunctionLimit() { return functionLimit; }
+    void setFunctionLimit(size_t bytes) { functionLimit = bytes; }
+    // Adds to the bytes taken by definitions and compiled code
+    void account(long long definitions, long long code) { defined += definitions; compiled += code; }
+    // Adds the bytes of code built during evaluations, when nothing can be
+    // evicted to make room: false, with nothing added, if they don't fit
+    // in the quota
+    bool admitCode(size_t bytes);
+    // Drops all compiled code; returns the bytes freed
+    size_t evict();
+    void stats(OutputStream *os);
+    bool isProfiling() { return profiling; }
+    void setProfiling(bool on);
+    void profile(OutputStream *os);
+    void profileFolded(OutputStream *os);
+    void resetProfile();
+    int getMaxDepth() { return maxDepth; }
+    int depth() { return baseDepth + parameters.size(); }
+    // Recursion stops at maxDepth, or when the stack of the thread runs
+    // low, whichever comes first, so that no maxDepth overflows it. The
+    // bytes of stack left, and the levels exported code may go deeper.
+    static size_t stackRoom();
+    int available();
+    void setMaxDepth(int depth) { maxDepth = depth; }
+    void setTailCall(Function *f, std::vector<double> &args);
+    Function *takeTailCall(std::vector<double> *args);
+    // Steps and seconds each evaluation may take; 0 for no limit
+    long long getStepLimit() { return stepLimit; }
+    void setStepLimit(long long steps) { stepLimit = steps; }
+    double getTimeLimit() { return timeLimit; }
+    void setTimeLimit(double seconds) { timeLimit = seconds; }
+    Budget *getBudget() { return budget; }
+    void setBudget(Budget *b) {
+        budget = b;
+        unsettled = 0;
+        settleAt = b == NULL ? Budget::CHECK_STEPS : b->headroom();
+    }
+    // Counts n steps, taken in f, against the Budget, if there is one;
+    // false, with the error set, once the evaluation has to stop
+    bool charge(long long n, Function *f) {
+        if (budget == NULL)
+            return true;
+        charging = f;
+        return (unsettled += n) < settleAt || settle(f);
+    }
+    // Charges the steps a child Context took and has not charged, once it
+    // is done; false, with the error set, if the evaluation has to stop
+    bool join(Context *child);
+    // The steps exported code may take before it charges them
+    long long headroom() { return budget == NULL ? Budget::CHECK_STEPS : std::max(settleAt - unsettled, 1LL); }
+    // The name of a function, for messages
+    std::string nameOf(Function *f);
+
+    void error(std::string msg);
+    bool failed() { return !errorMsg.empty(); }
+    std::string errorMessage() { return errorMsg; }
+    void clearError();
+};
+
+enum Opcode {
+    OP_ABS, OP_ACOS, OP_ASIN, OP_ATAN, OP_CALL, OP_COS, OP_DIFFERENCE,
+    OP_EXP, OP_IDENTITY, OP_IF, OP_LITERAL, OP_LOG, OP_MAX, OP_MIN,
+    OP_NEGATIVE, OP_POSITIVE, OP_POWER, OP_PRODUCT, OP_QUOTIENT, OP_SIN,
+    OP_SQRT, OP_SUM, OP_TAN, OP_VARIABLE, OP_FORK, OP_PROBE,
+    OP_POLY, OP_CHEBYSHEV, OP_WINDOW,
+    // Numeric, from OP_INTEGRATE to OP_SOLVE
+    OP_INTEGRATE, OP_MINIMIZE, OP_RMAX, OP_RMIN, OP_RPROD, OP_RSUM, OP_SOLVE,
+    // Only used in Programs and TilePrograms
+    OP_JUMP, OP_JUMPZERO, OP_PARAM, OP_COLLAPSE, OP_FALLBACK
 };
 
+static inline bool isNumeric(int op) {
+    return op >= OP_INTEGRATE && op <= OP_SOLVE;
+}
+
 class Evaluator {
 
     private:
@@ -68,9 +361,27 @@ class Evaluator {
 
     int pos() { return tpos; }
 
+    // Deletes a subtree. Destructors use this for their operands instead
+    // of deleting them directly, so that the deletion of a tree of any
+    // depth runs in constant stack.
+    static void release(Evaluator *ev);
+
+    // Tree structure, for code that walks or rewrites trees without
+    // knowing about every node type.
+    virtual int opcode() = 0;
+    virtual int arity() { return 0; }
+    virtual Evaluator *operand(int i) { return NULL; }
+    virtual void setOperand(int i, Evaluator *ev) {}
+
     virtual double eval(Context *c) = 0;
-    virtual void printAlg(OutputStream *os) = 0;
-    virtual void printRpn(OutputStream *os) = 0;
+    // Evaluate in tail position. Nodes that can pass tail position on to
+    // one of their operands override this; Call overrides it to hand its
+    // target back to Function::eval instead of recursing into it.
+    virtual double evalTail(Context *c) { return eval(c); }
+    // The text of the tree, in algebraic form or in RPN, as DumpWriter
+    // writes it
+    void printAlg(OutputStream *os);
+    void printRpn(OutputStream *os);
 };
 
 class Abs : public Evaluator {
@@ -82,10 +393,12 @@ class Abs : public Evaluator {
     public:
 
     Abs(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_ABS; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Abs();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Acos : public Evaluator {
@@ -97,10 +410,12 @@ class Acos : public Evaluator {
     public:
 
     Acos(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_ACOS; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Acos();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Asin : public Evaluator {
@@ -112,10 +427,12 @@ class Asin : public Evaluator {
     public:
 
     Asin(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_ASIN; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Asin();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Atan : public Evaluator {
@@ -127,10 +444,12 @@ class Atan : public Evaluator {
     public:
 
     Atan(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_ATAN; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Atan();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Call : public Evaluator {
@@ -143,10 +462,57 @@ class Call : public Evaluator {
     public:
 
     Call(int pos, std::string name, std::vector<Evaluator *> *evs) : Evaluator(pos), name(name), evs(evs) {}
+    int opcode() { return OP_CALL; }
+    int arity() { return evs->size(); }
+    Evaluator *operand(int i) { return (*evs)[i]; }
+    void setOperand(int i, Evaluator *ev) { (*evs)[i] = ev; }
+    std::string getName() { return name; }
     ~Call();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
+    double evalTail(Context *c);
+    double invoke(Context *c, double *args, bool tail);
+};
+
+// A surrogate for an expensive function of x on [lo, hi]: the interval is
+// cut into equal pieces, each with a Chebyshev series of the same degree.
+// Outside the interval, the fallback, normally the original function's
+// body, is evaluated instead; like the branches of an If, only when it is
+// needed.
+class Chebyshev : public Evaluator {
+
+    private:
+
+    Evaluator *x, *fallback;
+    double lo, hi, scale;
+    int degree;
+    std::vector<double> coefs;  // degree + 1 for every piece
+
+    public:
+
+    // Fits are tried with this many pieces at most, and of this degree
+    static const int MAX_PIECES = 1024;
+    static const int FIT_DEGREE = 20;
+
+    Chebyshev(int pos, Evaluator *x, Evaluator *fallback, double lo, double hi, int degree, std::vector<double> &coefs);
+    int opcode() { return OP_CHEBYSHEV; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? x : fallback; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) x = ev; else fallback = ev; }
+    ~Chebyshev();
+    double eval(Context *c);
+    double evalTail(Context *c);
+
+    double getLo() { return lo; }
+    double getHi() { return hi; }
+    int getDegree() { return degree; }
+    std::vector<double> &coefficients() { return coefs; }
+    bool covers(double v) { return v >= lo && v <= hi; }
+    // The approximation at v, which must be covered
+    double evaluate(double v);
+
+    // Approximates f, a function of one parameter, within tol on
+    // [lo, hi]; returns NULL if that takes too many pieces, or f fails
+    static Chebyshev *fit(Function *f, double lo, double hi, double tol, Context *c, double *maxError, std::string *error);
 };
 
 class Cos : public Evaluator {
@@ -158,10 +524,12 @@ class Cos : public Evaluator {
     public:
 
     Cos(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_COS; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Cos();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Difference : public Evaluator {
@@ -173,10 +541,12 @@ class Difference : public Evaluator {
     public:
 
     Difference(int pos, Evaluator *left, Evaluator *right) : Evaluator(pos), left(left), right(right) {}
+    int opcode() { return OP_DIFFERENCE; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? left : right; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) left = ev; else right = ev; }
     ~Difference();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Exp : public Evaluator {
@@ -188,23 +558,96 @@ class Exp : public Evaluator {
     public:
 
     Exp(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_EXP; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Exp();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
+// Evaluates the expensive operands of a Call, Max, Min or binary operator
+// in parallel, then combines them in operand order, so the result does not
+// depend on scheduling. Inserted by Optimizer::parallelize().
+class Fork : public Evaluator {
+
+    private:
+
+    Evaluator *ev;
+    std::vector<bool> heavy;
+
+    double run(Context *c, bool tail);
+
+    public:
+
+    Fork(Evaluator *ev, std::vector<bool> &heavy) : Evaluator(ev->pos()), ev(ev), heavy(heavy) {}
+    int opcode() { return OP_FORK; }
+    Evaluator *getOperand() { return ev; }
+    ~Fork();
+    double eval(Context *c);
+    double evalTail(Context *c);
+};
+
+class Program;
+
+// Execution tiers, slowest to fastest
+enum { TIER_TREE, TIER_BYTECODE, TIER_NATIVE };
+
+// Functions start out evaluating their bodies by walking the tree, and
+// are compiled to a Program once they have been called HOT_CALLS times.
+// The tree stays around, so evaluations that are already under way simply
+// finish on it. The native tier is only reached through the export
+// command; see Exporter.
 class Function {
 
+    public:
+
+    // Native code for a function: takes the arguments and the recursion
+    // depth still available, and sets *error if that was exceeded (1), or
+    // the Budget ran out (2)
+    typedef double (*Native)(const double *args, int available, int *error);
+
     private:
 
     std::vector<std::string> paramNames;
     Evaluator *evaluator;
+    int size;       // Nodes in the body: the steps a call takes
+    size_t bytes;   // Bytes the body takes
+    Context *owner; // The Context it is defined in, which accounts for it
+    std::atomic<Program *> program;
+    std::atomic<Native> native;
+    std::atomic<long> calls;
+    std::atomic<long> hotAt;    // The call count at which to promote
+    std::mutex promoting;
+    bool closed;    // Whether the body sees nothing but its parameters
+
+    double evalBody(Context *c, bool tail);
+    double evalNative(Native fn, std::vector<double> &params, Context *c);
+    void promote(Context *c);
 
     public:
 
-    Function(std::vector<std::string> &paramNames, Evaluator *ev) : paramNames(paramNames), evaluator(ev) {}
+    static const long HOT_CALLS = 1000;
+
+    Function(std::vector<std::string> &paramNames, Evaluator *ev);
     ~Function();
+    int arity() { return paramNames.size(); }
+    int tier() { return native != NULL ? TIER_NATIVE : program != NULL ? TIER_BYTECODE : TIER_TREE; }
+    Native getNative() { return native; }
+    void setNative(Native fn) { native = fn; }
+    const char *tierName();
+    long callCount() { return calls; }
+    std::vector<std::string> &params() { return paramNames; }
+    Evaluator *body() { return evaluator; }
+    void setBody(Evaluator *ev);
+    int nodeCount() { return size; }
+    // Bytes taken by the Function and its body, and by its Program
+    size_t footprint();
+    size_t codeBytes();
+    void setOwner(Context *c) { owner = c; }
+    // Drops the Program, if the body can be walked without it; returns
+    // the bytes freed
+    size_t evict();
     double eval(std::vector<double> params, Context *c);
     void printAlg(OutputStream *os);
     void printRpn(OutputStream *os);
@@ -219,10 +662,31 @@ class Identity : public Evaluator {
     public:
 
     Identity(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_IDENTITY; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Identity();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
+    double evalTail(Context *c);
+};
+
+class If : public Evaluator {
+
+    private:
+
+    Evaluator *cond, *ifTrue, *ifFalse;
+
+    public:
+
+    If(int pos, Evaluator *cond, Evaluator *ifTrue, Evaluator *ifFalse) : Evaluator(pos), cond(cond), ifTrue(ifTrue), ifFalse(ifFalse) {}
+    int opcode() { return OP_IF; }
+    int arity() { return 3; }
+    Evaluator *operand(int i) { return i == 0 ? cond : i == 1 ? ifTrue : ifFalse; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) cond = ev; else if (i == 1) ifTrue = ev; else ifFalse = ev; }
+    ~If();
+    double eval(Context *c);
+    double evalTail(Context *c);
 };
 
 class Literal : public Evaluator {
@@ -234,9 +698,9 @@ class Literal : public Evaluator {
     public:
 
     Literal(int pos, double value) : Evaluator(pos), value(value) {}
+    int opcode() { return OP_LITERAL; }
+    double getValue() { return value; }
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Log : public Evaluator {
@@ -248,10 +712,12 @@ class Log : public Evaluator {
     public:
 
     Log(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_LOG; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Log();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Max : public Evaluator {
@@ -263,10 +729,12 @@ class Max : public Evaluator {
     public:
 
     Max(int pos, std::vector<Evaluator *> *evs) : Evaluator(pos), evs(evs) {}
+    int opcode() { return OP_MAX; }
+    int arity() { return evs->size(); }
+    Evaluator *operand(int i) { return (*evs)[i]; }
+    void setOperand(int i, Evaluator *ev) { (*evs)[i] = ev; }
     ~Max();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Min : public Evaluator {
@@ -278,10 +746,12 @@ class Min : public Evaluator {
     public:
 
     Min(int pos, std::vector<Evaluator *> *evs) : Evaluator(pos), evs(evs) {}
+    int opcode() { return OP_MIN; }
+    int arity() { return evs->size(); }
+    Evaluator *operand(int i) { return (*evs)[i]; }
+    void setOperand(int i, Evaluator *ev) { (*evs)[i] = ev; }
     ~Min();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Negative : public Evaluator {
@@ -293,10 +763,81 @@ class Negative : public Evaluator {
     public:
 
     Negative(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_NEGATIVE; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Negative();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
+};
+
+// Builtins that evaluate the function of one parameter named by f many
+// times. integrate(f, a, b[, tol]) refines the integral until its
+// estimated error is within tol, or 1e-10 of the integral of |f| by
+// default; solve(f, x0) or solve(f, a, b) returns a root, and
+// minimize(f, x0) or minimize(f, a, b) the location of a local minimum,
+// near x0 or in [a, b]. sum(f, a, b), prod(f, a, b), rmax(f, a, b) and
+// rmin(f, a, b) combine f(a), f(a+1), ... up to b. f is evaluated through
+// its native code, or else a TileProgram, as many points at a time as the
+// algorithm allows.
+class Numeric : public Evaluator {
+
+    private:
+
+    int op;
+    std::string name;
+    std::vector<Evaluator *> *evs;
+
+    public:
+
+    // Integrals are cut into this many pieces at most, and root and
+    // minimum searches take this many steps at most
+    static const int MAX_PIECES = 1 << 16;
+    static const int MAX_STEPS = 2000;
+    // Reductions are done in superblocks of this many tiles, each by one
+    // thread, and combined in a fixed order
+    static const int SUPERBLOCK = 64;
+
+    Numeric(int pos, int op, std::string name, std::vector<Evaluator *> *evs) : Evaluator(pos), op(op), name(name), evs(evs) {}
+    int opcode() { return op; }
+    int arity() { return evs->size(); }
+    Evaluator *operand(int i) { return (*evs)[i]; }
+    void setOperand(int i, Evaluator *ev) { (*evs)[i] = ev; }
+    std::string getName() { return name; }
+    ~Numeric();
+    double eval(Context *c);
+    // The result for the given values of the operands
+    double compute(Context *c, const double *args);
+    // The opcode of a builtin, or -1, and the other way around
+    static int opcode(std::string keyword);
+    static const char *keyword(int op);
+};
+
+// c0 + c1*x + ... + cn*x^n, for the operands x, c0, ..., cn. Written as
+// poly(x,c0,...,cn), or built by Optimizer::polynomials(). Evaluated in
+// Horner form, or in Estrin form from ESTRIN_DEGREE on, where independent
+// multiplications can overlap; multiply-adds are fused where the target
+// does that quickly.
+class Polynomial : public Evaluator {
+
+    private:
+
+    std::vector<Evaluator *> *evs;
+
+    public:
+
+    static const int ESTRIN_DEGREE = 8;
+
+    Polynomial(int pos, std::vector<Evaluator *> *evs) : Evaluator(pos), evs(evs) {}
+    int opcode() { return OP_POLY; }
+    int arity() { return evs->size(); }
+    Evaluator *operand(int i) { return (*evs)[i]; }
+    void setOperand(int i, Evaluator *ev) { (*evs)[i] = ev; }
+    ~Polynomial();
+    double eval(Context *c);
+
+    // The polynomial with the n coefficients c, at x
+    static double evaluate(double x, const double *c, int n);
 };
 
 class Positive : public Evaluator {
@@ -308,10 +849,13 @@ class Positive : public Evaluator {
     public:
 
     Positive(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_POSITIVE; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Positive();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
+    double evalTail(Context *c);
 };
 
 class Power : public Evaluator {
@@ -323,10 +867,46 @@ class Power : public Evaluator {
     public:
 
     Power(int pos, Evaluator *left, Evaluator *right) : Evaluator(pos), left(left), right(right) {}
+    int opcode() { return OP_POWER; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? left : right; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) left = ev; else right = ev; }
     ~Power();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
+};
+
+// Counts the evaluations of the subtree below it, and the time they take.
+// Probes are only present while profiling is on, so that evaluation pays
+// nothing for the profiler otherwise.
+class Probe : public Evaluator {
+
+    private:
+
+    Evaluator *ev;
+    bool body;                  // Whether it is the root of a function body
+    std::atomic<long> hits;
+    std::atomic<long> elapsed;
+    std::atomic<long> callees;  // For calls: the part of elapsed spent in
+                                // the bodies of the functions called
+
+    double run(Context *c, bool tail);
+
+    public:
+
+    Probe(Evaluator *ev, bool body = false) : Evaluator(ev->pos()), ev(ev), body(body), hits(0), elapsed(0), callees(0) {}
+    int opcode() { return OP_PROBE; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
+    ~Probe();
+    long count() { return hits; }
+    long ticks() { return elapsed; }
+    long calleeTicks() { return callees; }
+    void reset() { hits = 0; elapsed = 0; callees = 0; }
+    double eval(Context *c);
+    double evalTail(Context *c);
+
+    static uint64_t clock();
 };
 
 class Product : public Evaluator {
@@ -338,10 +918,12 @@ class Product : public Evaluator {
     public:
 
     Product(int pos, Evaluator *left, Evaluator *right) : Evaluator(pos), left(left), right(right) {}
+    int opcode() { return OP_PRODUCT; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? left : right; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) left = ev; else right = ev; }
     ~Product();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Quotient : public Evaluator {
@@ -353,10 +935,12 @@ class Quotient : public Evaluator {
     public:
 
     Quotient(int pos, Evaluator *left, Evaluator *right) : Evaluator(pos), left(left), right(right) {}
+    int opcode() { return OP_QUOTIENT; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? left : right; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) left = ev; else right = ev; }
     ~Quotient();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Sin : public Evaluator {
@@ -368,10 +952,12 @@ class Sin : public Evaluator {
     public:
 
     Sin(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_SIN; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Sin();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Sqrt : public Evaluator {
@@ -383,10 +969,12 @@ class Sqrt : public Evaluator {
     public:
 
     Sqrt(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_SQRT; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Sqrt();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Sum : public Evaluator {
@@ -398,10 +986,12 @@ class Sum : public Evaluator {
     public:
 
     Sum(int pos, Evaluator *left, Evaluator *right) : Evaluator(pos), left(left), right(right) {}
+    int opcode() { return OP_SUM; }
+    int arity() { return 2; }
+    Evaluator *operand(int i) { return i == 0 ? left : right; }
+    void setOperand(int i, Evaluator *ev) { if (i == 0) left = ev; else right = ev; }
     ~Sum();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Tan : public Evaluator {
@@ -413,10 +1003,12 @@ class Tan : public Evaluator {
     public:
 
     Tan(int pos, Evaluator *ev) : Evaluator(pos), ev(ev) {}
+    int opcode() { return OP_TAN; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return ev; }
+    void setOperand(int i, Evaluator *ev) { this->ev = ev; }
     ~Tan();
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
 class Variable : public Evaluator {
@@ -428,1130 +1020,10108 @@ class Variable : public Evaluator {
     public:
 
     Variable(int pos, std::string name) : Evaluator(pos), name(name) {}
+    int opcode() { return OP_VARIABLE; }
+    std::string getName() { return name; }
     double eval(Context *c);
-    void printAlg(OutputStream *os);
-    void printRpn(OutputStream *os);
 };
 
-//////////////////////////
-/////  OutputStream  /////
-//////////////////////////
+// msum(x, n), mmean(x, n), mmin(x, n), mmax(x, n) and mvar(x, n): the sum,
+// mean, minimum, maximum or sample variance of the last n values of x,
+// where every evaluation of the node is one tick of a stream, as in the
+// stream command; until n values have been seen, of those there are. Each
+// tick takes constant time, whatever n (amortized, for the minimum and
+// maximum): the values are kept in a ring, the sum with compensation, the
+// variance by Welford's update and its inverse, and the minimum or maximum
+// at the front of a deque of the values that can still become one.
+class Window : public Evaluator {
 
-void OutputStream::write(double d) {
-    char buf[50];
-    sprintf(buf, "%.9g", d);
-    write(buf);
-}
-void OutputStream::newline() {
-    write("\n");
-}
+    public:
 
-//////////////////////////////
-/////  FileOutputStream  /////
-//////////////////////////////
+    enum { SUM, MEAN, MIN, MAX, VARIANCE };
 
-FileOutputStream::~FileOutputStream() {
-    fclose(file);
-}
+    private:
 
-void FileOutputStream::write(std::string text) {
-    const char *s = text.c_str();
-    fwrite(s, 1, strlen(s), file);
-    if (autoFlush)
-        fflush(file);
-}
+    int kind, size;
+    Evaluator *x;
+    std::mutex lock;
+    std::vector<double> ring;
+    long long ticks;
+    // Of the finite values in the window: how many, their Neumaier sum,
+    // and their mean and sum of squared deviations; the others are counted
+    long long count;
+    double sum, comp;
+    double mean, m2;
+    int nans, plus, minus;
+    std::deque<std::pair<long long, double> > extremes;
+
+    void add(double v, int sign);
 
-/////////////////////
-/////  Context  /////
-/////////////////////
+    public:
 
-Context::~Context() {
-    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
-        delete it->second;
-    for (int i = 0; i < parameters.size(); i++)
-        delete parameters[i];
-}
+    // Windows can be this long at most
+    static const int MAX_SIZE = 1 << 24;
+
+    Window(int pos, int kind, Evaluator *x, int size);
+    int opcode() { return OP_WINDOW; }
+    int arity() { return 1; }
+    Evaluator *operand(int i) { return x; }
+    void setOperand(int i, Evaluator *ev) { x = ev; }
+    int getKind() { return kind; }
+    int getSize() { return size; }
+    ~Window();
+    double eval(Context *c);
+    // Takes the next value of x, and returns the aggregate
+    double update(double v);
+    // The kind of a builtin, or -1, and the other way around
+    static int kindOf(std::string keyword);
+    static const char *keyword(int kind);
+};
 
-void Context::setVariable(std::string name, double value) {
-    variables[name] = value;
-}
+// The transcendental functions, at each precision. Exact is the C
+// library's. Fast uses the fdlibm range reductions and polynomials, without
+// their special cases, and stays within a few ULPs; approximate uses short
+// series, and stays within about 1e-7 relative. Arguments those don't
+// handle (huge, infinite, NaN, subnormal) go to the C library. Batches
+// computed in single precision use the C library's float functions.
+class Math {
 
-double Context::getVariable(std::string name) {
-    for (int i = parameters.size() - 1; i >= 0; i--) {
-        std::map<std::string, double> *m = parameters[i];
-        std::map<std::string, double>::iterator t = m->find(name);
-        if (t != m->end())
-            return (*m)[name];
-    }
-    std::map<std::string, double>::iterator t = variables.find(name);
-    if (t != variables.end())
-        return 0;
-    else
-        return variables[name];
-}
+    private:
 
-void Context::setFunction(std::string name, Function *function) {
-    std::map<std::string, Function *>::iterator it = functions.find(name);
-    if (it != functions.end())
-        delete it->second;
-    functions[name] = function;
-}
+    static int reduce(double x, double *y0, double *y1);
+    static double kernelSin(double x, double y);
+    static double kernelCos(double x, double y);
+    static double approxSinKernel(double x);
+    static double approxCosKernel(double x);
+    static double approxAsinKernel(double x);
 
-Function *Context::getFunction(std::string name) {
-    return functions[name];
-}
+    public:
 
-void Context::push(std::vector<std::string> &names, std::vector<double> &values) {
-    std::map<std::string, double> *h = new std::map<std::string, double>;
-    for (int i = 0; i < names.size(); i++)
-        (*h)[names[i]] = values[i];
-    parameters.push_back(h);
-}
+    static double fastSin(double x);
+    static double fastCos(double x);
+    static double fastTan(double x);
+    static double fastExp(double x);
+    static double fastLog(double x);
+    static double fastAsin(double x);
+    static double fastAcos(double x);
+    static double fastAtan(double x);
+    static double fastPow(double x, double y);
+
+    static double approxSin(double x);
+    static double approxCos(double x);
+    static double approxTan(double x);
+    static double approxExp(double x);
+    static double approxLog(double x);
+    static double approxAsin(double x);
+    static double approxAcos(double x);
+    static double approxAtan(double x);
+    static double approxPow(double x, double y);
+
+    static double sin(double x, int p) { return p == PRECISION_EXACT ? ::sin(x) : p == PRECISION_FAST ? fastSin(x) : approxSin(x); }
+    static double cos(double x, int p) { return p == PRECISION_EXACT ? ::cos(x) : p == PRECISION_FAST ? fastCos(x) : approxCos(x); }
+    static double tan(double x, int p) { return p == PRECISION_EXACT ? ::tan(x) : p == PRECISION_FAST ? fastTan(x) : approxTan(x); }
+    static double exp(double x, int p) { return p == PRECISION_EXACT ? ::exp(x) : p == PRECISION_FAST ? fastExp(x) : approxExp(x); }
+    static double log(double x, int p) { return p == PRECISION_EXACT ? ::log(x) : p == PRECISION_FAST ? fastLog(x) : approxLog(x); }
+    static double asin(double x, int p) { return p == PRECISION_EXACT ? ::asin(x) : p == PRECISION_FAST ? fastAsin(x) : approxAsin(x); }
+    static double acos(double x, int p) { return p == PRECISION_EXACT ? ::acos(x) : p == PRECISION_FAST ? fastAcos(x) : approxAcos(x); }
+    static double atan(double x, int p) { return p == PRECISION_EXACT ? ::atan(x) : p == PRECISION_FAST ? fastAtan(x) : approxAtan(x); }
+    static double pow(double x, double y, int p) { return p == PRECISION_EXACT ? ::pow(x, y) : p == PRECISION_FAST ? fastPow(x, y) : approxPow(x, y); }
+
+    static float sin(float x, int p) { return sinf(x); }
+    static float cos(float x, int p) { return cosf(x); }
+    static float tan(float x, int p) { return tanf(x); }
+    static float exp(float x, int p) { return expf(x); }
+    static float log(float x, int p) { return logf(x); }
+    static float asin(float x, int p) { return asinf(x); }
+    static float acos(float x, int p) { return acosf(x); }
+    static float atan(float x, int p) { return atanf(x); }
+    static float pow(float x, float y, int p) { return powf(x, y); }
+
+    // The function of a unary or binary opcode, for n arguments
+    template <class T> static void apply(int op, int p, const T *x, const T *y, T *out, int n);
+
+    // Error and speed of every tier, against the C library, over sampled
+    // arguments
+    static void report(OutputStream *os);
+};
 
-void Context::pop() {
-    int n = parameters.size() - 1;
-    delete parameters[n];
-    parameters.erase(parameters.begin() + n);
-}
+// An Evaluator tree flattened into postfix code, evaluated with an
+// explicit value stack. Trees too deep to be evaluated recursively are
+// run this way, and so are the bodies of hot functions; the nodes stay
+// owned by the tree. A function body is compiled with the function's
+// parameter names, and references to those are read straight from the
+// top frame, instead of being looked up by name every time.
+class Program {
 
-void Context::dump(OutputStream *os, bool alg) {
-    for (std::map<std::string, double>::iterator it = variables.begin(); it != variables.end(); it++) {
-        os->write(it->first);
-        os->write("=");
-        os->write(it->second);
-        os->newline();
-    }
-    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++) {
-        os->write(it->first);
-        os->write(alg ? "=" : ":");
-        if (alg)
-            it->second->printAlg(os);
-        else
-            it->second->printRpn(os);
-        os->newline();
-    }
-}
+    private:
 
-/////////////////
-/////  Abs  /////
-/////////////////
+    struct Instr {
+        int op;
+        int arg;        // Operand count, jump target, tail call flag,
+                        // or parameter index
+        double value;   // For OP_LITERAL
+        Evaluator *ev;  // For OP_VARIABLE, OP_CALL, OP_CHEBYSHEV and the
+                        // Numeric opcodes
+    };
 
-Abs::~Abs() {
-    delete ev;
-}
+    std::vector<Instr> code;
+    std::vector<std::string> params;
+    int maxStack;
 
-double Abs::eval(Context *c) {
-    return fabs(ev->eval(c));
-}
+    void compile(Evaluator *ev);
+    double run(Context *c, bool tail);
 
-void Abs::printAlg(OutputStream *os) {
-    os->write("abs(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    public:
 
-void Abs::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" abs");
-}
+    // Trees nested deeper than this are evaluated as Programs
+    static const int DEEP_TREE = 1000;
 
-//////////////////
-/////  Acos  /////
-//////////////////
+    Program(Evaluator *ev);
+    Program(Evaluator *ev, std::vector<std::string> &params);
+    double eval(Context *c) { return run(c, false); }
+    double evalTail(Context *c) { return run(c, true); }
 
-Acos::~Acos() {
-    delete ev;
-}
+    static int depth(Evaluator *ev);
+    size_t bytes();
+};
 
-double Acos::eval(Context *c) {
-    return acos(ev->eval(c));
-}
+class Profiler {
 
-void Acos::printAlg(OutputStream *os) {
-    os->write("acos(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    public:
 
-void Acos::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" acos");
-}
+    static Evaluator *instrument(Evaluator *ev);
+    static Evaluator *strip(Evaluator *ev);
+    static void reset(Evaluator *ev);
+    // The time spent in a function's own nodes, leaving out the functions
+    // it calls, so that the times of all functions add up
+    static long selfTime(Function *f);
+    static void report(std::string name, Function *f, long total, OutputStream *os);
+    static void folded(std::string name, Function *f, OutputStream *os);
+};
 
-//////////////////
-/////  Asin  /////
-//////////////////
+// Operational numbers, for every kind of command, from the REPL and the
+// server: how long its phases take, in HDR-style histograms, and how many
+// heap allocations it makes, counted by the replacement operator new. A
+// Command times itself and its Phases on the thread it runs on; work done
+// for it on other threads counts to no command.
+class Telemetry {
 
-Asin::~Asin() {
-    delete ev;
-}
+    public:
 
-double Asin::eval(Context *c) {
-    return asin(ev->eval(c));
-}
+    enum { PARSE, BIND, EVAL, FORMAT, TOTAL, PHASES };
+    enum { REPL_EVAL, REPL_DEFINE, REPL_COMMAND, SERVER_EVAL, SERVER_DEFINE, COMMANDS };
 
-void Asin::printAlg(OutputStream *os) {
-    os->write("asin(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    // Log-linear buckets: exact below 2 * SUB, then SUB buckets for every
+    // power of two, so values are kept within 1 part in SUB; up to 2^40
+    class Histogram {
 
-void Asin::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" asin");
-}
+        public:
 
-//////////////////
-/////  Atan  /////
-//////////////////
+        static const int SUB_BITS = 5;
+        static const int SUB = 1 << SUB_BITS;
+        // bucket() returns up to (40 - SUB_BITS + 1) * SUB - 1, for 2^40 - 1
+        static const int BUCKETS = (40 - SUB_BITS + 1) * SUB;
 
-Atan::~Atan() {
-    delete ev;
-}
+        private:
 
-double Atan::eval(Context *c) {
-    return atan(ev->eval(c));
-}
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> n, sum, max;
 
-void Atan::printAlg(OutputStream *os) {
-    os->write("atan(");
-    ev->printAlg(os);
-    os->write(")");
-}
+        static int bucket(uint64_t v);
+        static uint64_t upper(int b);
 
-void Atan::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" atan");
-}
+        public:
 
-//////////////////
-/////  Call  /////
-//////////////////
+        void record(uint64_t v);
+        uint64_t count() { return n; }
+        uint64_t total() { return sum; }
+        uint64_t maximum() { return max; }
+        // The value that q of the recorded values are at or below
+        uint64_t percentile(double q);
+        void reset();
+    };
 
-Call::~Call() {
-    for (int i = 0; i < evs->size(); i++)
-        delete (*evs)[i];
-    delete evs;
-}
+    class Command {
 
-double Call::eval(Context *c) {
-    int n = evs->size();
-    std::vector<double> values(n);
-    for (int i = 0; i < n; i++)
-        values[i] = (*evs)[i]->eval(c);
-    Function *f = c->getFunction(name);
-    double res = f->eval(values, c);
-    return res;
-}
+        private:
 
-void Call::printAlg(OutputStream *os) {
-    os->write(name);
-    os->write("(");
-    for (int i = 0; i < evs->size(); i++) {
-        if (i != 0)
-            os->write(",");
-        (*evs)[i]->printAlg(os);
-    }
-    os->write(")");
-}
+        int kind;
+        uint64_t start, allocations, bytes;
 
-void Call::printRpn(OutputStream *os) {
-    for (int i = 0; i < evs->size(); i++) {
-        (*evs)[i]->printRpn(os);
-        os->write(" ");
-    }
-    os->write(name);
-}
+        public:
 
-/////////////////
-/////  Cos  /////
-/////////////////
+        Command(int kind);
+        ~Command();
+        // For commands whose kind is known once they have been looked at
+        void setKind(int k) { kind = k; }
+    };
 
-Cos::~Cos() {
-    delete ev;
-}
+    // A phase of the command in progress on this thread; a phase within
+    // a phase counts to the outer one
+    class Phase {
 
-double Cos::eval(Context *c) {
-    return cos(ev->eval(c));
-}
+        private:
 
-void Cos::printAlg(OutputStream *os) {
-    os->write("cos(");
-    ev->printAlg(os);
-    os->write(")");
-}
+        int phase;
+        uint64_t start;
 
-void Cos::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" ");
-}
+        public:
 
-////////////////////////
-/////  Difference  /////
-////////////////////////
+        Phase(int phase);
+        ~Phase();
+    };
 
-Difference::~Difference() {
-    delete left;
-    delete right;
-}
+    // Called by operator new
+    static void allocated(size_t n);
 
-double Difference::eval(Context *c) {
-    return left->eval(c) - right->eval(c);
-}
+    static void report(OutputStream *os);
+    static std::string prometheus();
+    // Writes text, in the Prometheus format, to a file, replacing it at
+    // once, so a scraper never sees it half written
+    static bool write(std::string file, std::string text, std::string *error);
+    static void reset();
+};
 
-void Difference::printAlg(OutputStream *os) {
-    left->printAlg(os);
-    os->write("-");
-    right->printAlg(os);
-}
+// An expression compiled for evaluation over many rows at once, a tile of
+// up to TILE rows at a time. Per-row inputs are named; for every tile, the
+// caller supplies an array of values for each input, and receives an array
+// of results. Calls to non-recursive functions are inlined; subtrees that
+// can't be evaluated a tile at a time (recursive calls, and conditionals
+// that contain them) are evaluated row by row, as usual. When hoisting is
+// on, subtrees that don't depend on the inputs are evaluated once, when
+// the TileProgram is compiled. With float batches on, tiles are computed
+// in single precision, except for the subtrees evaluated row by row.
+class TileProgram {
 
-void Difference::printRpn(OutputStream *os) {
-    left->printRpn(os);
-    os->write(" ");
-    right->printRpn(os);
-    os->write(" -");
-}
+    private:
 
-/////////////////
-/////  Exp  /////
-/////////////////
+    struct Op {
+        int op;
+        int arg;            // Operand count, input or stack slot
+        Evaluator *ev;      // For OP_FALLBACK, OP_CHEBYSHEV and OP_WINDOW
+        Program *program;   // For OP_FALLBACK on deep trees, and deep
+                            // fallbacks of OP_CHEBYSHEV
+        std::vector<double> fill;   // For OP_LITERAL
+        std::vector<float> fillF;   // The same, in single precision
+        std::vector<std::string> names;     // For OP_FALLBACK: the names
+        std::vector<int> sources;           // visible to ev, and where their
+                                            // values come from (see source())
+    };
+
+    // Names in scope while compiling: inlined parameters, innermost
+    // first, then the inputs
+    struct Scope {
+        std::vector<std::string> names;
+        std::vector<int> slots;
+    };
+
+    std::vector<Op *> code;
+    std::vector<std::string> inputs;
+    std::vector<bool> used;
+    std::vector<Scope> scopes;
+    std::vector<Function *> active;
+    std::map<int, double> constants;    // Stack slots known in advance
+    std::string hoistError;
+    Function *function;                 // Whose body this is, if any; its
+                                        // Budget is charged for the steps
+    // While compiling: how many If branches the node being compiled is
+    // in, and the names the nodes seen so far refer to, directly or
+    // through the functions they call, and whether they call any
+    struct Refs {
+        std::vector<std::string> names;
+        bool calls;
+    };
+    int conditional;
+    std::map<Evaluator *, Refs> refs;
+    int sp, maxStack;
+    std::vector<double> scratch;
+    std::vector<double *> cur;
+    // Single precision: the same, and where inputs and results are
+    // converted
+    bool single;
+    std::vector<float> scratchF, inF, outF;
+    std::vector<float *> curF;
+    std::vector<const float *> inPtrF;
+
+    void emit(Op *op, int pops, int pushes);
+    void compile(Evaluator *ev, Context *c);
+    Op *rowwise(Evaluator *ev, Context *c);
+    void fallback(Evaluator *ev, Context *c);
+    bool hoist(Evaluator *ev, Context *c);
+    Refs &references(Evaluator *ev, Context *c);
+    int source(std::string name);
+    template <class T> bool execute(Context *c, const T **in, int n, T *out, T *scr, T **cur);
+    template <class T> bool row(Context *c, Op *op, Evaluator *ev, const T **in, T **cur, int i, std::vector<double> &values, double *res);
+    static double *literal(Op *op, double *) { return &op->fill[0]; }
+    static float *literal(Op *op, float *) { return &op->fillF[0]; }
 
-Exp::~Exp() {
-    delete ev;
-}
+    public:
 
-double Exp::eval(Context *c) {
-    return exp(ev->eval(c));
-}
+    static const int TILE = 512;
 
-void Exp::printAlg(OutputStream *os) {
-    os->write("exp(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    // In single precision if the Context says so, unless exact is set; f
+    // is the function whose body ev is, for budgets
+    TileProgram(Evaluator *ev, std::vector<std::string> &inputs, Context *c, bool exact = false, Function *f = NULL);
+    ~TileProgram();
+    // Evaluates n <= TILE rows; false if an error occurred
+    bool run(Context *c, const double **in, int n, double *out);
+    // Whether the values of an input are used at all
+    bool uses(int input) { return used[input]; }
+};
 
-void Exp::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" exp");
-}
+// A column of doubles in a binary file, in native byte order, mapped into
+// memory
+class Column {
 
-//////////////////////
-/////  Function  /////
-//////////////////////
+    private:
 
-Function::~Function() {
-    delete evaluator;
-}
+    void *map;
+    size_t size;
+    std::string file;
 
-double Function::eval(std::vector<double> params, Context *c) {
-    c->push(paramNames, params);
-    double ret = evaluator->eval(c);
-    c->pop();
-    return ret;
-}
+    Column(void *map, size_t size, std::string file) : map(map), size(size), file(file) {}
 
-void Function::printAlg(OutputStream *os) {
-    os->write("(");
-    for (int i = 0; i < paramNames.size(); i++) {
-        if (i != 0)
-            os->write(",");
-        os->write(paramNames[i]);
-    }
-    os->write(")=>");
-    evaluator->printAlg(os);
-}
+    public:
 
-void Function::printRpn(OutputStream *os) {
-    for (int i = 0; i < paramNames.size(); i++) {
-        os->write(paramNames[i]);
-        os->write(" ");
-    }
-    evaluator->printRpn(os);
-}
+    ~Column();
+    const double *data() { return (const double *) map; }
+    long rows() { return size / sizeof(double); }
+    std::string path() { return file; }
 
-//////////////////////
-/////  Identity  /////
-//////////////////////
+    static Column *open(std::string file, std::string *error);
+};
 
-Identity::~Identity() {
-    delete ev;
-}
+// Variables bound to Columns, for evaluating expressions over every row.
+// A parameter of a function is bound by the name f(x); the expression f,
+// on its own, then stands for f called with its bound parameters.
+class ColumnSet {
 
-double Identity::eval(Context *c) {
-    return ev->eval(c);
-}
+    private:
 
-void Identity::printAlg(OutputStream *os) {
-    os->write("(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    std::map<std::string, Column *> columns;
 
-void Identity::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-}
+    public:
 
-/////////////////////
-/////  Literal  /////
-/////////////////////
+    ~ColumnSet();
+    bool bind(std::string name, std::string file, std::string *error);
+    void unbind(std::string name);
+    // The names bound, in the order TilePrograms over them take their
+    // inputs, and the files they are bound to
+    std::vector<std::string> names();
+    std::string path(std::string name) { return columns[name]->path(); }
+    // Takes ev, parsed, and returns it, or, if it is a function name on
+    // its own, the call with the columns bound to its parameters; NULL,
+    // with ev deleted, if one is not bound
+    Evaluator *expand(Evaluator *ev, Context *c, std::string *error);
+    // The length of the bound columns tp uses, or of all of them, if it
+    // uses none; -1 if there are none, or they differ
+    long rows(TileProgram *tp, std::string *error);
+    // Evaluates tp for n rows from first; false if an error occurred
+    bool run(Context *c, TileProgram *tp, long first, long n, double *out);
+    // Evaluates ev for every row of the bound columns it uses, and writes
+    // the results to a new column file; returns the number of rows, or -1
+    // on error
+    long evaluate(Context *c, Evaluator *ev, std::string file, std::string *error);
+};
 
-double Literal::eval(Context *c) {
-    return value;
-}
+// Monte Carlo estimates of the expected value of a function of random
+// arguments. The arguments of sample i are drawn from Philox4x32-10, a
+// counter-based generator (Salmon et al., "Parallel Random Numbers: As
+// Easy as 1, 2, 3"), with the seed as the key and i and the argument as
+// the counter, so every sample is the same however the work is split.
+// Samples are taken a tile at a time, in superblocks that are summarized
+// by one thread each and combined in a fixed order.
+class MonteCarlo {
 
-void Literal::printAlg(OutputStream *os) {
-    os->write(value);
-}
+    public:
 
-void Literal::printRpn(OutputStream *os) {
-    os->write(value);
-}
+    enum { UNIFORM, NORMAL, EXPONENTIAL, CONSTANT };
 
-/////////////////
-/////  Log  /////
-/////////////////
+    // uniform(p, q), normal(p, q) with mean p and standard deviation q,
+    // exponential(p) with rate p, or the constant p
+    struct Distribution {
+        int kind;
+        double p, q;
+    };
 
-Log::~Log() {
-    delete ev;
-}
+    struct Estimate {
+        double mean, variance, error;
+    };
 
-double Log::eval(Context *c) {
-    return log(ev->eval(c));
-}
+    static const int SUPERBLOCK = 64;
 
-void Log::printAlg(OutputStream *os) {
-    os->write("log(");
-    ev->printAlg(os);
-    os->write(")");
-}
+    // n samples of f, with one Distribution for every parameter; false if
+    // an error occurred, which is left in c
+    static bool run(Function *f, long long n, std::vector<Distribution> &dists, uint64_t seed, Context *c, Estimate *res);
+};
 
-void Log::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" log");
-}
+class Optimizer {
 
-/////////////////
-/////  Max  /////
-/////////////////
+    public:
 
-Max::~Max() {
-    for (int i = 0; i < evs->size(); i++)
-        delete (*evs)[i];
-    delete evs;
-}
+    // Subtrees estimated to cost at least this many cycles are worth
+    // evaluating on another thread
+    static const int FORK_COST = 20000;
+
+    static Evaluator *reassociate(Evaluator *ev);
+    // The cycles an evaluation of a tree is estimated to take, and, in
+    // *costs, those of every node with its operands. By default, the
+    // estimate uses fixed cycle counts, so that decisions made on it, like
+    // parallelize()'s, are the same from run to run and machine to
+    // machine; with measured, it uses those calibrate() found, if any, for
+    // reports
+    static double cost(Evaluator *ev, Context *c, std::map<Evaluator *, double> *costs = NULL, bool measured = false);
+    // Measures the cycles that cost() counts for each kind of node, for
+    // the measured estimates; once, at startup
+    static void calibrate();
+    static bool calibrated();
+    static Evaluator *parallelize(Evaluator *ev, Context *c);
+    // A copy of a tree, without Probes and Forks, and with the named
+    // variables replaced by values
+    static Evaluator *copy(Evaluator *ev, std::vector<std::string> &names, std::vector<double> &values);
+    // Replaces constant subtrees by their values
+    static Evaluator *fold(Evaluator *ev, Context *c);
+    // The names of the variables a tree refers to, directly or through
+    // the functions it calls
+    static void references(Evaluator *ev, Context *c, std::vector<std::string> *names);
+    // Whether a tree, or a function it calls, has a Window, whose value
+    // depends on how often it has been evaluated before
+    static bool stateful(Evaluator *ev, Context *c);
+    // The subtrees that occur more than once, by their RPN, and cost at
+    // least worth cycles each by costs, with how often they occur,
+    // costliest first. Parentheses and Probes, which print like their
+    // operands, aren't occurrences of their own.
+    static void repeats(Evaluator *ev, std::map<Evaluator *, double> &costs, double worth,
+            std::vector<std::pair<Evaluator *, int> > *out);
+    // A new function like f, with some of its parameters fixed
+    static Function *specialize(Function *f, std::vector<std::string> &names, std::vector<double> &values, Context *c, std::string *error);
+    // Replaces polynomials in one variable by Polynomial nodes
+    static Evaluator *polynomials(Evaluator *ev, Context *c);
+};
 
-double Max::eval(Context *c) {
-    double res = -DBL_MAX;
-    for (int i = 0; i < evs->size(); i++) {
-        double x = (*evs)[i]->eval(c);
-        if (x > res)
-            res = x;
-    }
-    return res;
-}
+// Translates the functions of a Context into C++, builds them into a
+// shared object with the system compiler, and loads it, so the functions
+// run as native code from then on. Only closed sets of functions can be
+// translated: functions that refer to variables other than their own
+// parameters, call functions that are missing or themselves can't be
+// translated, use Numeric or Window builtins, or are too deep to compile,
+// stay interpreted.
+class Exporter {
 
-void Max::printAlg(OutputStream *os) {
-    os->write("max(");
-    for (int i = 0; i < evs->size(); i++) {
-        if (i != 0)
-            os->write(",");
-        (*evs)[i]->printAlg(os);
-    }
-    os->write(")");
-}
+    private:
 
-void Max::printRpn(OutputStream *os) {
-    for (int i = 0; i < evs->size(); i++) {
-        (*evs)[i]->printRpn(os);
-        os->write(" ");
-    }
-    os->write((double) evs->size());
-    os->write(" max");
-}
+    // Names go into the C++ source as they are, so only functions whose
+    // name and parameters are C++ identifiers are exported
+    static bool identifier(const std::string &name);
+    static std::string symbol(std::string name) { return "f_" + name; }
+    static std::string literal(double d);
+    static bool exportable(Function *f, Context *c);
+    static void expr(Evaluator *ev, std::string *out);
+    static void tail(Evaluator *ev, std::string name, Function *self, std::map<std::string, int> &ids, std::string *out, int indent);
 
-/////////////////
-/////  Min  /////
-/////////////////
+    public:
 
-Min::~Min() {
-    for (int i = 0; i < evs->size(); i++)
-        delete (*evs)[i];
-    delete evs;
-}
+    // Writes <base>.cc, builds <base>.so and loads it; returns the number
+    // of functions that now run natively, or -1 on error
+    static int run(Context *c, std::string base, std::string *error);
+};
 
-double Min::eval(Context *c) {
-    double res = DBL_MAX;
-    for (int i = 0; i < evs->size(); i++) {
-        double x = (*evs)[i]->eval(c);
-        if (x < res)
-            res = x;
-    }
-    return res;
-}
+// Writes the variables and functions of a Context, for dump, every
+// function followed by the tier it runs in, in brackets. The text is
+// rendered straight into a buffer, and handed to the destination in
+// chunks of BUFSIZE, so a large Context costs a few big writes rather than
+// a write, and with the REPL's stream a flush, for every name, operator
+// and number. The algebraic form has only the parentheses the parser
+// needs, whatever the shape of the tree: those of the source are not kept
+// as such, and trees built by the Optimizer get the ones they lack.
+// A DumpWriter can also take a snapshot of a Context, with copies of the
+// function bodies, and write that on a thread of its own, while the
+// Context goes on being used and changed.
+class DumpWriter : public OutputStream {
 
-void Min::printAlg(OutputStream *os) {
-    os->write("min(");
-    for (int i = 0; i < evs->size(); i++) {
-        if (i != 0)
-            os->write(",");
-        (*evs)[i]->printAlg(os);
-    }
-    os->write(")");
-}
+    private:
 
-void Min::printRpn(OutputStream *os) {
-    for (int i = 0; i < evs->size(); i++) {
-        (*evs)[i]->printRpn(os);
-        os->write(" ");
-    }
-    os->write((double) evs->size());
-    os->write(" min");
-}
+    struct Definition {
+        std::string name;
+        std::vector<std::string> params;
+        Evaluator *body;
+        const char *tier;
+    };
+
+    OutputStream *dest;
+    bool alg;
+    std::string buffer;
+    // The snapshot, and the thread that writes it; a started DumpWriter
+    // owns its destination
+    std::vector<std::pair<std::string, double> > variables;
+    std::vector<Definition> functions;
+    std::thread thread;
+    std::atomic<bool> finished;
+
+    // Operator precedence, loosest first
+    enum { EXPR, TERM, FACTOR, THING };
+
+    static const int BUFSIZE = 1 << 20;
+
+    // Writes d as "%.9g" does, and returns the length
+    static int format(double d, char *buf, int size);
+    void run();
+
+    // A node being written by algebraic()
+    struct Frame {
+        Evaluator *ev;
+        int level;
+        bool start, tight, parens;
+        int next;
+    };
 
-//////////////////////
-/////  Negative  /////
-//////////////////////
+    public:
 
-Negative::~Negative() {
-    delete ev;
-}
+    DumpWriter(OutputStream *dest, bool alg) : dest(dest), alg(alg), finished(false) { buffer.reserve(BUFSIZE); }
+    // Waits for a started DumpWriter to finish
+    ~DumpWriter();
+    using OutputStream::write;
+    void write(std::string text);
+    void write(double d);
+    void variable(const std::string &name, double value);
+    void function(const std::string &name, std::vector<std::string> &params, Evaluator *body, const char *tier);
+    void flush();
+    // Appends the text of a tree, in algebraic form or in RPN, and of a
+    // number. Exact text has numbers in full, and infinities and NaNs as
+    // expressions, so that it reads back as the same tree.
+    static void algebraic(Evaluator *ev, std::string *out, bool exact = false);
+    static void rpn(Evaluator *ev, std::string *out);
+    static void number(double d, std::string *out, bool exact = false);
+    // Copies the definitions of c, and writes them on a new thread
+    void start(Context *c);
+    bool done() { return finished; }
+};
 
-double Negative::eval(Context *c) {
-    return -ev->eval(c);
-}
+// A work-stealing thread pool. Every worker has its own deque of tasks; it
+// takes work from the back of its own deque, and steals from the front of
+// the others' when it runs out. Threads waiting for a task run other tasks
+// in the meantime, so nested fork-join does not deadlock.
+class TaskPool {
 
-void Negative::printAlg(OutputStream *os) {
-    os->write("-");
-    ev->printAlg(os);
-}
+    public:
 
-void Negative::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" +/-");
-}
+    class Task {
+        public:
+        std::atomic<bool> done;
+        Task() : done(false) {}
+        virtual ~Task() {}
+        virtual void run() = 0;
+    };
 
-//////////////////////
-/////  Positive  /////
-//////////////////////
+    private:
 
-Positive::~Positive() {
-    delete ev;
-}
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task *> tasks;
+    };
 
-double Positive::eval(Context *c) {
-    return ev->eval(c);
-}
+    std::vector<Queue *> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> pending;
+    std::atomic<bool> stopping;
+    std::mutex idleLock;
+    std::condition_variable idle;
 
-void Positive::printAlg(OutputStream *os) {
-    os->write("+");
-    ev->printAlg(os);
-}
+    static thread_local TaskPool *current;
+    static thread_local int self;
 
-void Positive::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" nop");
-}
+    Task *find(int me);
+    void work(int me);
 
-///////////////////
-/////  Power  /////
-///////////////////
+    public:
 
-Power::~Power() {
-    delete left;
-    delete right;
-}
+    TaskPool(int threads);
+    ~TaskPool();
+    int size() { return workers.size(); }
+    void submit(Task *t);
+    void wait(Task *t);
+};
 
-double Power::eval(Context *c) {
-    return pow(left->eval(c), right->eval(c));
-}
+//////////////////////////
+/////  OutputStream  /////
+//////////////////////////
 
-void Power::printAlg(OutputStream *os) {
-    left->printAlg(os);
-    os->write("^");
-    right->printAlg(os);
+void OutputStream::write(double d) {
+    char buf[50];
+    sprintf(buf, "%.9g", d);
+    write(buf);
+}
+void OutputStream::newline() {
+    write("\n");
 }
 
-void Power::printRpn(OutputStream *os) {
-    left->printRpn(os);
-    os->write(" ");
-    right->printRpn(os);
-    os->write(" ^");
+void OutputStream::writeResult(double d) {
+    write(d);
+    newline();
 }
 
-/////////////////////
-/////  Product  /////
-/////////////////////
+//////////////////////////////
+/////  FileOutputStream  /////
+//////////////////////////////
 
-Product::~Product() {
-    delete left;
-    delete right;
+FileOutputStream::~FileOutputStream() {
+    fclose(file);
 }
 
-double Product::eval(Context *c) {
-    return left->eval(c) * right->eval(c);
+void FileOutputStream::write(std::string text) {
+    fwrite(text.data(), 1, text.length(), file);
+    if (autoFlush)
+        fflush(file);
 }
 
-void Product::printAlg(OutputStream *os) {
-    left->printAlg(os);
-    os->write("*");
-    right->printAlg(os);
+////////////////////////////////
+/////  StringOutputStream  /////
+////////////////////////////////
+
+void StringOutputStream::write(std::string text) {
+    this->text += text;
 }
 
-void Product::printRpn(OutputStream *os) {
-    left->printRpn(os);
-    os->write(" ");
-    right->printRpn(os);
-    os->write(" *");
+////////////////////////////////
+/////  BinaryOutputStream  /////
+////////////////////////////////
+
+BinaryOutputStream::~BinaryOutputStream() {
+    flush();
 }
 
-//////////////////////
-/////  Quotient  /////
-//////////////////////
+void BinaryOutputStream::put(uint64_t x, int bytes) {
+    char b[8];
+    for (int i = 0; i < bytes; i++)
+        b[i] = (char) (x >> (8 * i));
+    buffer.append(b, bytes);
+}
 
-Quotient::~Quotient() {
-    delete left;
-    delete right;
+void BinaryOutputStream::write(std::string text) {
+    if (this->text != NULL) {
+        this->text->write(text);
+        return;
+    }
+    buffer += text;
+    if (buffer.length() >= BUFSIZE)
+        flush();
 }
 
-double Quotient::eval(Context *c) {
-    return left->eval(c) / right->eval(c);
+void BinaryOutputStream::writeResult(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    if (framed)
+        put(0, 1);
+    put(bits, 8);
+    if (buffer.length() >= BUFSIZE)
+        flush();
 }
 
-void Quotient::printAlg(OutputStream *os) {
-    left->printAlg(os);
-    os->write("/");
-    right->printAlg(os);
+void BinaryOutputStream::writeError(std::string msg) {
+    if (framed) {
+        put(1, 1);
+        put(msg.length(), 4);
+        buffer += msg;
+        if (buffer.length() >= BUFSIZE)
+            flush();
+    } else
+        writeResult(NAN);
 }
 
-void Quotient::printRpn(OutputStream *os) {
-    left->printRpn(os);
-    os->write(" ");
-    right->printRpn(os);
-    os->write(" /");
+void BinaryOutputStream::flush() {
+    if (!buffer.empty()) {
+        dest->write(buffer);
+        buffer.clear();
+    }
 }
 
-/////////////////
-/////  Sin  /////
-/////////////////
+////////////////////
+/////  Budget  /////
+////////////////////
 
-Sin::~Sin() {
-    delete ev;
+static double monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-double Sin::eval(Context *c) {
-    return sin(ev->eval(c));
+void Budget::restart(long long maxSteps, double seconds) {
+    this->maxSteps = maxSteps;
+    start = monotonic();
+    deadline = seconds > 0 ? start + seconds : 0;
+    steps = 0;
+    cancelled = false;
+    std::lock_guard<std::mutex> g(lock);
+    spent.clear();
+    stopped.clear();
 }
 
-void Sin::printAlg(OutputStream *os) {
-    os->write("sin(");
-    ev->printAlg(os);
-    os->write(")");
+bool Budget::charge(long long n, Function *f, Context *c, std::string *error) {
+    long long total = steps.fetch_add(n, std::memory_order_relaxed) + n;
+    const char *why = cancelled ? "cancelled"
+        : maxSteps > 0 && total > maxSteps ? "out of steps"
+        : deadline > 0 && monotonic() > deadline ? "out of time" : NULL;
+    std::lock_guard<std::mutex> g(lock);
+    spent[f] += n;
+    if (why == NULL && stopped.empty())
+        return true;
+    if (stopped.empty()) {
+        // Why, after how much, and the functions that took the most
+        char buf[100];
+        snprintf(buf, sizeof(buf), "%s after %lld steps, %.3g s", why, total, monotonic() - start);
+        stopped = buf;
+        std::vector<std::pair<long long, Function *> > top;
+        long long all = 0;
+        for (std::map<Function *, long long>::iterator it = spent.begin(); it != spent.end(); it++) {
+            top.push_back(std::make_pair(it->second, it->first));
+            all += it->second;
+        }
+        std::sort(top.rbegin(), top.rend());
+        for (int i = 0; i < top.size() && i < 3; i++) {
+            snprintf(buf, sizeof(buf), " %.0f%%", 100.0 * top[i].first / all);
+            stopped += (i == 0 ? "; " : ", ") + (top[i].second == NULL ? std::string("top level") : c->nameOf(top[i].second)) + buf;
+        }
+    }
+    *error = stopped;
+    return false;
 }
 
-void Sin::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" sin");
+/////////////////////
+/////  Context  /////
+/////////////////////
+
+Context::Context(Context *parent) : parent(parent), pool(parent->pool), tailCalls(parent->tailCalls), reassociation(parent->reassociation), hoisting(parent->hoisting), polynomials(parent->polynomials), profiling(parent->profiling), maxDepth(parent->maxDepth), tailFunction(NULL), precision(parent->precision), floatBatches(parent->floatBatches), libraryBytes(0), defined(0), compiled(0), memoryLimit(0), functionLimit(0), stepLimit(parent->stepLimit), timeLimit(parent->timeLimit), budget(parent->budget), unsettled(0), charging(NULL) {
+    settleAt = budget == NULL ? Budget::CHECK_STEPS : budget->headroom();
+    baseDepth = parent->baseDepth + parent->parameters.size();
+    // From the top frame down, so that the innermost of several
+    // parameters with the same name wins
+    for (int i = parent->parameters.size() - 1; i >= 0; i--)
+        inherited.insert(parent->parameters[i]->begin(), parent->parameters[i]->end());
+    inherited.insert(parent->inherited.begin(), parent->inherited.end());
 }
 
-//////////////////
-/////  Sqrt  /////
-//////////////////
+Context::~Context() {
+    // Steps that no join() took count all the same; the evaluation finds
+    // out whether they were too many when it next charges
+    if (parent != NULL && budget != NULL && unsettled > 0) {
+        std::string why;
+        budget->charge(unsettled, charging, this, &why);
+    }
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        delete it->second;
+    for (int i = 0; i < parameters.size(); i++)
+        delete parameters[i];
+    for (int i = 0; i < libraries.size(); i++)
+        dlclose(libraries[i]);
+    if (parent == NULL)
+        delete pool;
+}
 
-Sqrt::~Sqrt() {
-    delete ev;
+void Context::setPrecision(int p) {
+    // Exported code was built with the old functions
+    if (p != precision)
+        for (std::map<std::string, Function *>::iterator f = functions.begin(); f != functions.end(); f++)
+            f->second->setNative(NULL);
+    precision = p;
 }
 
-double Sqrt::eval(Context *c) {
-    return sqrt(ev->eval(c));
+void Context::setVariable(std::string name, double value) {
+    std::pair<std::map<std::string, double>::iterator, bool> r = variables.insert(std::make_pair(name, value));
+    if (r.second)
+        defined += variableBytes(name);
+    else
+        r.first->second = value;
+}
+
+double Context::getVariable(std::string name) {
+    for (int i = parameters.size() - 1; i >= 0; i--) {
+        std::map<std::string, double> *m = parameters[i];
+        std::map<std::string, double>::iterator t = m->find(name);
+        if (t != m->end())
+            return t->second;
+    }
+    if (parent != NULL) {
+        std::map<std::string, double>::iterator t = inherited.find(name);
+        if (t != inherited.end())
+            return t->second;
+        // The globals, without the frames of the root's own evaluation
+        Context *root = parent;
+        while (root->parent != NULL)
+            root = root->parent;
+        t = root->variables.find(name);
+        return t != root->variables.end() ? t->second : 0;
+    }
+    std::map<std::string, double>::iterator t = variables.find(name);
+    if (t != variables.end())
+        return t->second;
+    else
+        return 0;
 }
 
-void Sqrt::printAlg(OutputStream *os) {
-    os->write("sqrt(");
-    ev->printAlg(os);
-    os->write(")");
+void Context::setFunction(std::string name, Function *function) {
+    std::map<std::string, Function *>::iterator it = functions.find(name);
+    if (it != functions.end()) {
+        // Exported code calls the old definition directly
+        for (std::map<std::string, Function *>::iterator f = functions.begin(); f != functions.end(); f++)
+            f->second->setNative(NULL);
+        account(-(long long) functionBytes(name, it->second), -(long long) it->second->codeBytes());
+        delete it->second;
+    }
+    functions[name] = function;
+    account(functionBytes(name, function), function->codeBytes());
+    function->setOwner(this);
+    if (profiling)
+        function->setBody(Profiler::instrument(function->body()));
 }
 
-void Sqrt::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" sqrt");
+// The bytes a string keeps on the heap; short ones are kept inside it
+static size_t heapBytes(const std::string &s) {
+    static const size_t inside = std::string().capacity();
+    return s.capacity() > inside ? s.capacity() + 1 : 0;
 }
 
-/////////////////
-/////  Sum  /////
-/////////////////
+// What a std::map node takes besides its value
+static const size_t MAP_NODE = 4 * sizeof(void *);
 
-Sum::~Sum() {
-    delete left;
-    delete right;
+size_t Context::variableBytes(const std::string &name) {
+    return MAP_NODE + sizeof(std::pair<const std::string, double>) + heapBytes(name);
 }
 
-double Sum::eval(Context *c) {
-    return left->eval(c) + right->eval(c);
+size_t Context::functionBytes(const std::string &name, Function *f) {
+    return MAP_NODE + sizeof(std::pair<const std::string, Function *>) + heapBytes(name) + f->footprint();
 }
 
-void Sum::printAlg(OutputStream *os) {
-    left->printAlg(os);
-    os->write("+");
-    right->printAlg(os);
+bool Context::admit(std::string name, size_t bytes, bool function, std::string *error) {
+    // Compiled code goes first; it comes back once it is needed again
+    for (int pass = 0; pass < 2 && memoryLimit > 0; pass++) {
+        size_t replaced = 0;
+        if (function) {
+            std::map<std::string, Function *>::iterator it = functions.find(name);
+            if (it != functions.end())
+                replaced = functionBytes(name, it->second) + it->second->codeBytes();
+        } else if (variables.find(name) != variables.end())
+            replaced = variableBytes(name);
+        if (memory() - replaced + bytes <= memoryLimit)
+            break;
+        if (pass == 0 && evict() > 0)
+            continue;
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Out of memory: %s needs %zu bytes, and %zu of the quota of %zu are in use",
+                name.c_str(), bytes, memory() - replaced, memoryLimit);
+        *error = buf;
+        return false;
+    }
+    return true;
 }
 
-void Sum::printRpn(OutputStream *os) {
-    left->printRpn(os);
-    os->write(" ");
-    right->printRpn(os);
-    os->write(" +");
+bool Context::define(std::string name, double value, std::string *error) {
+    if (!admit(name, variableBytes(name), false, error))
+        return false;
+    setVariable(name, value);
+    return true;
 }
 
-/////////////////
-/////  Tan  /////
-/////////////////
+// Whether the parser takes name(...) as a builtin, so that a function by
+// that name could never be called
+static bool isBuiltin(std::string name) {
+    static const char *names[] = {
+        "sin", "cos", "tan", "asin", "acos", "atan", "log", "exp", "sqrt",
+        "abs", "if", "poly", "chebyshev", "max", "min"
+    };
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (name == names[i])
+            return true;
+    return Window::kindOf(name) != -1 || Numeric::opcode(name) != -1;
+}
 
-Tan::~Tan() {
-    delete ev;
+bool Context::define(std::string name, Function *function, std::string *error) {
+    if (isBuiltin(name)) {
+        *error = "Error: " + name + " is a builtin";
+        delete function;
+        return false;
+    }
+    size_t bytes = functionBytes(name, function);
+    if (functionLimit > 0 && bytes > functionLimit) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Out of memory: %s takes %zu bytes, over the quota of %zu for a function",
+                name.c_str(), bytes, functionLimit);
+        *error = buf;
+        delete function;
+        return false;
+    }
+    if (!admit(name, bytes + function->codeBytes(), true, error)) {
+        delete function;
+        return false;
+    }
+    setFunction(name, function);
+    return true;
 }
 
-double Tan::eval(Context *c) {
-    return tan(ev->eval(c));
+void Context::addLibrary(void *lib, size_t bytes) {
+    libraries.push_back(lib);
+    libraryBytes += bytes;
+    compiled += bytes;
 }
 
-void Tan::printAlg(OutputStream *os) {
-    os->write("tan(");
-    ev->printAlg(os);
-    os->write(")");
+bool Context::admitCode(size_t bytes) {
+    long long in = compiled;
+    do {
+        if (memoryLimit > 0 && defined + in + bytes > memoryLimit)
+            return false;
+    } while (!compiled.compare_exchange_weak(in, in + bytes));
+    return true;
 }
 
-void Tan::printRpn(OutputStream *os) {
-    ev->printRpn(os);
-    os->write(" tan");
+size_t Context::evict() {
+    // Only between evaluations, when no compiled code is running
+    size_t freed = 0;
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        freed += it->second->evict();
+    if (!libraries.empty()) {
+        for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+            it->second->setNative(NULL);
+        for (int i = 0; i < libraries.size(); i++)
+            dlclose(libraries[i]);
+        libraries.clear();
+        freed += libraryBytes;
+        libraryBytes = 0;
+    }
+    compiled -= freed;
+    return freed;
 }
 
-//////////////////////
-/////  Variable  /////
-//////////////////////
+void Context::stats(OutputStream *os) {
+    char buf[256];
+    size_t vars = 0, trees = 0, code = 0;
+    int programs = 0;
+    std::vector<std::pair<long long, std::string> > order;
+    for (std::map<std::string, double>::iterator it = variables.begin(); it != variables.end(); it++)
+        vars += variableBytes(it->first);
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++) {
+        size_t b = functionBytes(it->first, it->second), k = it->second->codeBytes();
+        trees += b;
+        code += k;
+        programs += k > 0;
+        order.push_back(std::make_pair(-(long long) (b + k), it->first));
+    }
+    snprintf(buf, sizeof(buf), "variables: %zu, %zu bytes", variables.size(), vars);
+    os->write(buf);
+    os->newline();
+    snprintf(buf, sizeof(buf), "functions: %zu, %zu bytes", functions.size(), trees);
+    os->write(buf);
+    os->newline();
+    snprintf(buf, sizeof(buf), "bytecode: %d programs, %zu bytes", programs, code);
+    os->write(buf);
+    os->newline();
+    snprintf(buf, sizeof(buf), "native: %zu libraries, %zu bytes", libraries.size(), libraryBytes);
+    os->write(buf);
+    os->newline();
+    // What is left of the compiled bytes: a server's parsed expressions
+    long long parsed = compiled - (long long) (code + libraryBytes);
+    if (parsed > 0) {
+        snprintf(buf, sizeof(buf), "parse cache: %lld bytes", parsed);
+        os->write(buf);
+        os->newline();
+    }
+    snprintf(buf, sizeof(buf), "total: %zu bytes; quota %zu, %zu for a function", memory(), memoryLimit, functionLimit);
+    os->write(buf);
+    os->newline();
+
+    // The biggest functions
+    const int SHOWN = 20;
+    std::sort(order.begin(), order.end());
+    for (int i = 0; i < order.size() && i < SHOWN; i++) {
+        Function *f = functions[order[i].second];
+        snprintf(buf, sizeof(buf), "  %s: %d nodes, %zu bytes, %zu bytes of bytecode, %s", order[i].second.c_str(),
+                f->nodeCount(), functionBytes(order[i].second, f), f->codeBytes(), f->tierName());
+        os->write(buf);
+        os->newline();
+    }
+    if (order.size() > SHOWN) {
+        snprintf(buf, sizeof(buf), "  and %zu more", order.size() - SHOWN);
+        os->write(buf);
+        os->newline();
+    }
+}
 
-double Variable::eval(Context *c) {
-    return c->getVariable(name);
+Function *Context::getFunction(std::string name) {
+    if (parent != NULL)
+        return parent->getFunction(name);
+    std::map<std::string, Function *>::iterator it = functions.find(name);
+    return it == functions.end() ? NULL : it->second;
 }
 
-void Variable::printAlg(OutputStream *os) {
-    os->write(name);
+size_t Context::stackRoom() {
+    static thread_local char *floor = NULL;
+    if (floor == NULL) {
+        char *base = NULL;
+        size_t size = 0;
+#ifdef __APPLE__
+        size = pthread_get_stacksize_np(pthread_self());
+        base = (char *) pthread_get_stackaddr_np(pthread_self()) - size;
+#else
+        pthread_attr_t attr;
+        void *addr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+                base = (char *) addr;
+            pthread_attr_destroy(&attr);
+        }
+#endif
+        // Held back for what runs on top of the deepest frame: one body's
+        // worth of nested nodes, library calls and signal handlers
+        size_t reserve = std::min(size / 4, (size_t) STACK_RESERVE);
+        floor = base == NULL ? (char *) 1 : base + reserve;
+    }
+    char here;
+    return &here > floor ? &here - floor : 0;
 }
 
-void Variable::printRpn(OutputStream *os) {
-    os->write(name);
+int Context::available() {
+    size_t levels = stackRoom() / NATIVE_FRAME;
+    int d = maxDepth - depth();
+    return levels < d ? (int) levels : d;
 }
 
-//////////////////////////////////////
-/////  here is where it happens  /////
-//////////////////////////////////////
+bool Context::push(std::vector<std::string> &names, std::vector<double> &values) {
+    if (baseDepth + parameters.size() >= maxDepth || stackRoom() == 0) {
+        error("recursion too deep");
+        return false;
+    }
+    std::map<std::string, double> *h = new std::map<std::string, double>;
+    for (int i = 0; i < names.size(); i++)
+        (*h)[names[i]] = values[i];
+    parameters.push_back(h);
+    return true;
+}
 
-class Lexer {
+bool Context::rebind(std::vector<std::string> &names, std::vector<double> &values, bool closed) {
+    // Scoping is dynamic, so the target of a call sees the caller's
+    // bindings, unless its own parameters shadow them. The top frame can
+    // only be reused if every binding in it is shadowed anyway, as in
+    // self-recursion, where the existing map nodes are simply overwritten,
+    // or if the target looks at nothing but its parameters.
+    std::map<std::string, double> *h = parameters.back();
+    bool shadowed = h->size() <= names.size();
+    for (std::map<std::string, double>::iterator it = h->begin(); shadowed && it != h->end(); it++)
+        shadowed = std::find(names.begin(), names.end(), it->first) != names.end();
+    if (!shadowed) {
+        if (!closed)
+            return false;
+        h->clear();
+    }
+    for (int i = 0; i < names.size(); i++)
+        (*h)[names[i]] = values[i];
+    return true;
+}
 
-    private:
+// The value of a parameter in the top frame, or NULL if there is none
+double *Context::parameter(std::string &name) {
+    if (parameters.empty())
+        return NULL;
+    std::map<std::string, double>::iterator it = parameters.back()->find(name);
+    return it == parameters.back()->end() ? NULL : &it->second;
+}
 
-    std::string text;
-    int pos;
+void Context::pop() {
+    int n = parameters.size() - 1;
+    delete parameters[n];
+    parameters.erase(parameters.begin() + n);
+}
 
-    public:
+void Context::setTailCall(Function *f, std::vector<double> &args) {
+    tailFunction = f;
+    tailArgs.swap(args);
+}
 
-    Lexer(std::string text) {
-        this->text = text;
-        pos = 0;
+Function *Context::takeTailCall(std::vector<double> *args) {
+    Function *f = tailFunction;
+    if (f != NULL) {
+        tailFunction = NULL;
+        args->swap(tailArgs);
     }
+    return f;
+}
 
-    int lpos() {
-        return pos;
+void Context::setThreads(int threads) {
+    delete pool;
+    pool = threads > 1 ? new TaskPool(threads) : NULL;
+}
+
+void Context::setProfiling(bool on) {
+    if (on == profiling)
+        return;
+    profiling = on;
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++) {
+        Function *f = it->second;
+        f->setBody(on ? Profiler::instrument(f->body()) : Profiler::strip(f->body()));
     }
+}
 
-    bool nextToken(std::string *tok, int *tpos) {
-        while (pos < text.length() && text[pos] == ' ')
-            pos++;
-        if (pos == text.length()) {
-            *tok = "";
-            *tpos = pos;
-            return true;
-        }
-        int start = pos;
-        *tpos = start;
-        char c = text[pos++];
-        // Compound symbols
-        if (c == '<' || c == '>') {
-            if (pos < text.length()) {
-                char c2 = text[pos + 1];
-                if (c2 == '=' || c == '<' && c2 == '>') {
-                    pos++;
-                    *tok = text.substr(start, 2);
-                    return true;
-                }
-            }
-            *tok = text.substr(start, 1);
-            return true;
-        }
-        // One-character symbols
-        if (c == '+' || c == '-' || c == '*' || c == '/'
-                || c == '(' || c == ')' || c == '[' || c == ']'
-                || c == '^' || c == ':' || c == '=') {
-                // Note: 42S mul/div/NE/LE/GE symbols!
-            *tok = text.substr(start, 1);
-            return true;
+void Context::profile(OutputStream *os) {
+    // Functions by their own time, hottest first
+    std::vector<std::pair<long, std::string> > order;
+    long total = 0;
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++) {
+        long t = Profiler::selfTime(it->second);
+        order.push_back(std::make_pair(-t, it->first));
+        total += t;
+    }
+    std::sort(order.begin(), order.end());
+    for (int i = 0; i < order.size(); i++)
+        Profiler::report(order[i].second, functions[order[i].second], total, os);
+}
+
+void Context::resetProfile() {
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        Profiler::reset(it->second->body());
+}
+
+void Context::profileFolded(OutputStream *os) {
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        Profiler::folded(it->first, it->second, os);
+}
+
+bool Context::settle(Function *f) {
+    std::string why;
+    long long n = unsettled;
+    unsettled = 0;
+    if (budget->charge(n, f, this, &why)) {
+        settleAt = budget->headroom();
+        return true;
+    }
+    error(why);
+    return false;
+}
+
+bool Context::join(Context *child) {
+    if (budget == NULL)
+        return true;
+    unsettled += child->unsettled;
+    child->unsettled = 0;
+    return settle(child->charging);
+}
+
+std::string Context::nameOf(Function *f) {
+    if (parent != NULL)
+        return parent->nameOf(f);
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        if (it->second == f)
+            return it->first;
+    return "?";
+}
+
+void Context::error(std::string msg) {
+    if (errorMsg.empty())
+        errorMsg = msg;
+}
+
+void Context::clearError() {
+    errorMsg = "";
+    tailFunction = NULL;
+}
+
+void Context::dump(OutputStream *os, bool alg) {
+    DumpWriter w(os, alg);
+    for (std::map<std::string, double>::iterator it = variables.begin(); it != variables.end(); it++)
+        w.variable(it->first, it->second);
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++)
+        w.function(it->first, it->second->params(), it->second->body(), it->second->tierName());
+}
+
+std::string Context::serialize() {
+    std::string text;
+    for (std::map<std::string, double>::iterator it = variables.begin(); it != variables.end(); it++) {
+        text += it->first;
+        text += '=';
+        DumpWriter::number(it->second, &text, true);
+        text += '\n';
+    }
+    for (std::map<std::string, Function *>::iterator it = functions.begin(); it != functions.end(); it++) {
+        std::vector<std::string> &params = it->second->params();
+        text += it->first;
+        text += '(';
+        for (int i = 0; i < params.size(); i++) {
+            if (i != 0)
+                text += ',';
+            text += params[i];
         }
-        // What's left at this point is numbers and names.
-        // Which one we're currently looking at depends on its
-        // first character; if that's a digit or a decimal,
-        // it's a number; anything else, it's a name.
-        bool multi_dot = false;
-        if (c == '.' || c >= '0' && c <= '9') {
-            int state = c == '.' ? 1 : 0;
-            int d0 = c == '.' ? 0 : 1;
-            int d1 = 0, d2 = 0;
-            while (pos < text.length()) {
-                c = text[pos];
-                switch (state) {
-                    case 0:
-                        if (c == '.')
-                            state = 1;
-                        else if (c == 'E' || c == 'e')
-                            // Note: 42S exponent symbol!
-                            state = 2;
-                        else if (c >= '0' && c <= '9')
-                            d0++;
-                        else
-                            goto done;
-                        break;
-                    case 1:
-                        if (c == '.') {
-                            multi_dot = true;
-                            goto done;
-                        }
-                        else if (c == 'E' || c == 'e')
-                            // Note: 42S exponent symbol!
-                            state = 2;
-                        else if (c >= '0' && c <= '9')
-                            d1++;
-                        else
-                            goto done;
-                        break;
-                    case 2:
-                        if (c == '-' || c == '+')
-                            state = 3;
-                        else if (c >= '0' && c <= '9') {
-                            d2++;
-                            state = 3;
-                        } else
-                            goto done;
-                        break;
-                    case 3:
-                        if (c >= '0' && c <= '9')
-                            d2++;
-                        else
+        text += ")=";
+        DumpWriter::algebraic(it->second->body(), &text, true);
+        text += '\n';
+    }
+    return text;
+}
+
+///////////////////////
+/////  Evaluator  /////
+///////////////////////
+
+void Evaluator::release(Evaluator *ev) {
+    static thread_local std::vector<Evaluator *> pending;
+    static thread_local bool releasing = false;
+    if (ev == NULL)
+        return;
+    pending.push_back(ev);
+    if (releasing)
+        return;
+    // Outermost call: delete nodes one at a time. Their destructors
+    // call release() for their operands, which only queues them here.
+    releasing = true;
+    while (!pending.empty()) {
+        ev = pending.back();
+        pending.pop_back();
+        delete ev;
+    }
+    releasing = false;
+}
+
+void Evaluator::printAlg(OutputStream *os) {
+    std::string text;
+    DumpWriter::algebraic(this, &text);
+    os->write(text);
+}
+
+void Evaluator::printRpn(OutputStream *os) {
+    std::string text;
+    DumpWriter::rpn(this, &text);
+    os->write(text);
+}
+
+/////////////////
+/////  Abs  /////
+/////////////////
+
+Abs::~Abs() {
+    release(ev);
+}
+
+double Abs::eval(Context *c) {
+    return fabs(ev->eval(c));
+}
+
+//////////////////
+/////  Acos  /////
+//////////////////
+
+Acos::~Acos() {
+    release(ev);
+}
+
+double Acos::eval(Context *c) {
+    return Math::acos(ev->eval(c), c->getPrecision());
+}
+
+//////////////////
+/////  Asin  /////
+//////////////////
+
+Asin::~Asin() {
+    release(ev);
+}
+
+double Asin::eval(Context *c) {
+    return Math::asin(ev->eval(c), c->getPrecision());
+}
+
+//////////////////
+/////  Atan  /////
+//////////////////
+
+Atan::~Atan() {
+    release(ev);
+}
+
+double Atan::eval(Context *c) {
+    return Math::atan(ev->eval(c), c->getPrecision());
+}
+
+//////////////////
+/////  Call  /////
+//////////////////
+
+Call::~Call() {
+    for (int i = 0; i < evs->size(); i++)
+        release((*evs)[i]);
+    delete evs;
+}
+
+double Call::eval(Context *c) {
+    int n = evs->size();
+    std::vector<double> values(n);
+    for (int i = 0; i < n; i++)
+        values[i] = (*evs)[i]->eval(c);
+    if (c->failed())
+        return 0;
+    Function *f = c->getFunction(name);
+    if (f == NULL) {
+        c->error("undefined function " + name);
+        return 0;
+    }
+    double res = f->eval(values, c);
+    return res;
+}
+
+double Call::evalTail(Context *c) {
+    int n = evs->size();
+    std::vector<double> values(n);
+    for (int i = 0; i < n; i++)
+        values[i] = (*evs)[i]->eval(c);
+    if (c->failed())
+        return 0;
+    Function *f = c->getFunction(name);
+    if (f == NULL) {
+        c->error("undefined function " + name);
+        return 0;
+    }
+    c->setTailCall(f, values);
+    return 0;
+}
+
+double Call::invoke(Context *c, double *args, bool tail) {
+    Function *f = c->getFunction(name);
+    if (f == NULL) {
+        c->error("undefined function " + name);
+        return 0;
+    }
+    std::vector<double> values(args, args + evs->size());
+    if (tail) {
+        c->setTailCall(f, values);
+        return 0;
+    }
+    return f->eval(values, c);
+}
+
+///////////////////////
+/////  Chebyshev  /////
+///////////////////////
+
+Chebyshev::Chebyshev(int pos, Evaluator *x, Evaluator *fallback, double lo, double hi, int degree, std::vector<double> &coefs)
+        : Evaluator(pos), x(x), fallback(fallback), lo(lo), hi(hi), degree(degree), coefs(coefs) {
+    scale = coefs.size() / (degree + 1) / (hi - lo);
+}
+
+Chebyshev::~Chebyshev() {
+    release(x);
+    release(fallback);
+}
+
+double Chebyshev::eval(Context *c) {
+    double v = x->eval(c);
+    return covers(v) ? evaluate(v) : fallback->eval(c);
+}
+
+double Chebyshev::evalTail(Context *c) {
+    double v = x->eval(c);
+    if (c->failed())
+        return 0;
+    return covers(v) ? evaluate(v) : fallback->evalTail(c);
+}
+
+// Clenshaw's recurrence, on the piece v is in, mapped to [-1, 1]
+double Chebyshev::evaluate(double v) {
+    int pieces = coefs.size() / (degree + 1);
+    double u = (v - lo) * scale;
+    int i = (int) u;
+    if (i >= pieces)
+        i = pieces - 1;
+    double t = 2 * (u - i) - 1;
+    const double *a = &coefs[i * (degree + 1)];
+    double b1 = 0, b2 = 0;
+    for (int k = degree; k >= 1; k--) {
+        double b0 = 2 * t * b1 - b2 + a[k];
+        b2 = b1;
+        b1 = b0;
+    }
+    return t * b1 - b2 + a[0];
+}
+
+// f at v, or false if it fails or isn't finite there
+static bool sample(Function *f, double v, Context *c, double *res, std::string *error) {
+    std::vector<double> args(1, v);
+    *res = f->eval(args, c);
+    if (!c->failed() && isfinite(*res))
+        return true;
+    char buf[50];
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    *error = std::string("Can't approximate at ") + buf + (c->failed() ? ": " + c->errorMessage() : ": not finite");
+    c->clearError();
+    return false;
+}
+
+Chebyshev *Chebyshev::fit(Function *f, double lo, double hi, double tol, Context *c, double *maxError, std::string *error) {
+    int n = FIT_DEGREE + 1;
+    std::vector<double> fv(n);
+    std::vector<std::string> none;
+    std::vector<double> noValues;
+    // Every piece gets a series of degree FIT_DEGREE, from its values at
+    // the Chebyshev nodes, and is cut into more pieces until all the series
+    // converge. The degree is then lowered as far as the pieces allow.
+    for (int pieces = 1; pieces <= MAX_PIECES; pieces *= 2) {
+        double width = (hi - lo) / pieces;
+        std::vector<double> all(pieces * n);
+        int degree = 0;
+        bool converged = true;
+        for (int i = 0; converged && i < pieces; i++) {
+            double mid = lo + (i + 0.5) * width;
+            for (int j = 0; j < n; j++)
+                if (!sample(f, mid + 0.5 * width * cos(M_PI * (j + 0.5) / n), c, &fv[j], error))
+                    return NULL;
+            double *a = &all[i * n];
+            for (int k = 0; k < n; k++) {
+                double sum = 0;
+                for (int j = 0; j < n; j++)
+                    sum += fv[j] * cos(M_PI * k * (j + 0.5) / n);
+                a[k] = (k == 0 ? 1 : 2) * sum / n;
+            }
+            if (fabs(a[n - 2]) + fabs(a[n - 1]) > tol / 8) {
+                converged = false;
+                break;
+            }
+            // Terms are dropped while their sum stays within tol / 2
+            int d = n - 1;
+            double dropped = 0;
+            while (d > 0 && dropped + fabs(a[d]) <= tol / 2)
+                dropped += fabs(a[d--]);
+            if (d > degree)
+                degree = d;
+        }
+        if (!converged)
+            continue;
+        std::vector<double> coefs(pieces * (degree + 1));
+        for (int i = 0; i < pieces; i++)
+            for (int k = 0; k <= degree; k++)
+                coefs[i * (degree + 1) + k] = all[i * n + k];
+        Chebyshev *ch = new Chebyshev(0, new Variable(0, f->params()[0]), Optimizer::copy(f->body(), none, noValues), lo, hi, degree, coefs);
+
+        // The error is measured between the nodes, and at the ends
+        int checks = 4 * (degree + 1) * pieces;
+        double err = 0;
+        for (int j = 0; j <= checks; j++) {
+            double v = j == checks ? hi : lo + (hi - lo) * j / checks;
+            double y;
+            if (!sample(f, v, c, &y, error)) {
+                delete ch;
+                return NULL;
+            }
+            double e = fabs(ch->evaluate(v) - y);
+            if (!(e <= err))
+                err = e;
+        }
+        if (err <= tol) {
+            *maxError = err;
+            return ch;
+        }
+        delete ch;
+    }
+    *error = "Can't approximate within the tolerance";
+    return NULL;
+}
+
+/////////////////
+/////  Cos  /////
+/////////////////
+
+Cos::~Cos() {
+    release(ev);
+}
+
+double Cos::eval(Context *c) {
+    return Math::cos(ev->eval(c), c->getPrecision());
+}
+
+////////////////////////
+/////  Difference  /////
+////////////////////////
+
+Difference::~Difference() {
+    release(left);
+    release(right);
+}
+
+double Difference::eval(Context *c) {
+    return left->eval(c) - right->eval(c);
+}
+
+/////////////////
+/////  Exp  /////
+/////////////////
+
+Exp::~Exp() {
+    release(ev);
+}
+
+double Exp::eval(Context *c) {
+    return Math::exp(ev->eval(c), c->getPrecision());
+}
+
+//////////////////
+/////  Fork  /////
+//////////////////
+
+class EvalTask : public TaskPool::Task {
+
+    public:
+
+    Evaluator *ev;
+    Context context;
+    double result;
+
+    EvalTask(Evaluator *ev, Context *parent) : ev(ev), context(parent), result(0) {}
+    void run() { result = ev->eval(&context); }
+};
+
+Fork::~Fork() {
+    release(ev);
+}
+
+double Fork::eval(Context *c) {
+    return run(c, false);
+}
+
+double Fork::evalTail(Context *c) {
+    return run(c, true);
+}
+
+double Fork::run(Context *c, bool tail) {
+    int n = ev->arity();
+    std::vector<double> args(n);
+    std::vector<EvalTask *> tasks(n);
+    TaskPool *pool = c->getPool();
+    if (pool != NULL) {
+        // Spawn all heavy operands except the last one, which this thread
+        // evaluates itself, along with the light ones.
+        int last = n - 1;
+        while (last >= 0 && !heavy[last])
+            last--;
+        for (int i = 0; i < last; i++)
+            if (heavy[i]) {
+                tasks[i] = new EvalTask(ev->operand(i), c);
+                pool->submit(tasks[i]);
+            }
+    }
+    int failedAt = -1;
+    for (int i = 0; i < n; i++)
+        if (tasks[i] == NULL) {
+            args[i] = ev->operand(i)->eval(c);
+            if (failedAt == -1 && c->failed())
+                failedAt = i;
+        }
+    for (int i = 0; i < n; i++)
+        if (tasks[i] != NULL) {
+            pool->wait(tasks[i]);
+            args[i] = tasks[i]->result;
+            Context *tc = &tasks[i]->context;
+            c->join(tc);
+            if (tc->failed() && (failedAt == -1 || i < failedAt)) {
+                // Report the error of the first operand that failed, as
+                // sequential evaluation would have.
+                c->clearError();
+                c->error(tc->errorMessage());
+                failedAt = i;
+            }
+            delete tasks[i];
+        }
+    if (c->failed())
+        return 0;
+    switch (ev->opcode()) {
+        case OP_CALL:
+            return ((Call *) ev)->invoke(c, &args[0], tail);
+        case OP_MAX: {
+            double res = -DBL_MAX;
+            for (int i = 0; i < n; i++)
+                if (args[i] > res)
+                    res = args[i];
+            return res;
+        }
+        case OP_MIN: {
+            double res = DBL_MAX;
+            for (int i = 0; i < n; i++)
+                if (args[i] < res)
+                    res = args[i];
+            return res;
+        }
+        case OP_DIFFERENCE: return args[0] - args[1];
+        case OP_POWER: return Math::pow(args[0], args[1], c->getPrecision());
+        case OP_PRODUCT: return args[0] * args[1];
+        case OP_QUOTIENT: return args[0] / args[1];
+        case OP_SUM: return args[0] + args[1];
+        default: return 0;
+    }
+}
+
+//////////////////////
+/////  Function  /////
+//////////////////////
+
+static int nodes(Evaluator *ev) {
+    std::vector<Evaluator *> stack;
+    stack.push_back(ev);
+    int n = 0;
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        n++;
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    return n;
+}
+
+// Whether a body refers to nothing but the given parameters: no other
+// variables, which a caller's frame could bind, and no calls, whose
+// targets would see the caller's frames
+static bool closedOver(Evaluator *ev, std::vector<std::string> &params) {
+    std::vector<Evaluator *> stack;
+    stack.push_back(ev);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        int op = e->opcode();
+        if (op == OP_CALL || isNumeric(op))
+            return false;
+        if (op == OP_VARIABLE && std::find(params.begin(), params.end(), ((Variable *) e)->getName()) == params.end())
+            return false;
+        if (op == OP_FORK)
+            stack.push_back(((Fork *) e)->getOperand());
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    return true;
+}
+
+// The bytes a tree takes: its nodes, and what they keep on the heap
+static size_t treeBytes(Evaluator *ev) {
+    std::vector<Evaluator *> stack;
+    stack.push_back(ev);
+    size_t n = 0;
+    const size_t VECTOR = sizeof(std::vector<Evaluator *>);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        switch (e->opcode()) {
+            case OP_ABS: n += sizeof(Abs); break;
+            case OP_ACOS: n += sizeof(Acos); break;
+            case OP_ASIN: n += sizeof(Asin); break;
+            case OP_ATAN: n += sizeof(Atan); break;
+            case OP_CALL: n += sizeof(Call) + heapBytes(((Call *) e)->getName()) + VECTOR + e->arity() * sizeof(Evaluator *); break;
+            case OP_INTEGRATE:
+            case OP_MINIMIZE:
+            case OP_RMAX:
+            case OP_RMIN:
+            case OP_RPROD:
+            case OP_RSUM:
+            case OP_SOLVE:
+                n += sizeof(Numeric) + heapBytes(((Numeric *) e)->getName()) + VECTOR + e->arity() * sizeof(Evaluator *);
+                break;
+            case OP_CHEBYSHEV: n += sizeof(Chebyshev) + ((Chebyshev *) e)->coefficients().capacity() * sizeof(double); break;
+            case OP_COS: n += sizeof(Cos); break;
+            case OP_DIFFERENCE: n += sizeof(Difference); break;
+            case OP_EXP: n += sizeof(Exp); break;
+            case OP_FORK:
+                n += sizeof(Fork);
+                stack.push_back(((Fork *) e)->getOperand());
+                break;
+            case OP_IDENTITY: n += sizeof(Identity); break;
+            case OP_IF: n += sizeof(If); break;
+            case OP_LITERAL: n += sizeof(Literal); break;
+            case OP_LOG: n += sizeof(Log); break;
+            case OP_MAX: n += sizeof(Max) + VECTOR + e->arity() * sizeof(Evaluator *); break;
+            case OP_MIN: n += sizeof(Min) + VECTOR + e->arity() * sizeof(Evaluator *); break;
+            case OP_NEGATIVE: n += sizeof(Negative); break;
+            case OP_POLY: n += sizeof(Polynomial) + VECTOR + e->arity() * sizeof(Evaluator *); break;
+            case OP_POSITIVE: n += sizeof(Positive); break;
+            case OP_POWER: n += sizeof(Power); break;
+            case OP_PROBE: n += sizeof(Probe); break;
+            case OP_PRODUCT: n += sizeof(Product); break;
+            case OP_QUOTIENT: n += sizeof(Quotient); break;
+            case OP_SIN: n += sizeof(Sin); break;
+            case OP_SQRT: n += sizeof(Sqrt); break;
+            case OP_SUM: n += sizeof(Sum); break;
+            case OP_TAN: n += sizeof(Tan); break;
+            case OP_VARIABLE: n += sizeof(Variable) + heapBytes(((Variable *) e)->getName()); break;
+            case OP_WINDOW: n += sizeof(Window) + ((Window *) e)->getSize() * sizeof(double); break;
+            default: n += sizeof(Evaluator); break;
+        }
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    return n;
+}
+
+Function::Function(std::vector<std::string> &paramNames, Evaluator *ev) : paramNames(paramNames), evaluator(ev), size(nodes(ev)), bytes(treeBytes(ev)), owner(NULL), program(NULL), native(NULL), calls(0), hotAt(HOT_CALLS), closed(closedOver(ev, this->paramNames)) {
+    // Deep trees can't be walked recursively, so they start out compiled
+    if (Program::depth(ev) > Program::DEEP_TREE)
+        program = new Program(ev, this->paramNames);
+}
+
+Function::~Function() {
+    delete program;
+    delete evaluator;
+}
+
+void Function::setBody(Evaluator *ev) {
+    if (owner != NULL)
+        owner->account(-(long long) bytes, -(long long) codeBytes());
+    evaluator = ev;
+    size = nodes(ev);
+    bytes = treeBytes(ev);
+    closed = closedOver(ev, paramNames);
+    delete program;
+    program = NULL;
+    native = NULL;
+    calls = 0;
+    hotAt = HOT_CALLS;
+    if (Program::depth(ev) > Program::DEEP_TREE)
+        program = new Program(ev, paramNames);
+    if (owner != NULL)
+        owner->account(bytes, codeBytes());
+}
+
+size_t Function::footprint() {
+    size_t n = sizeof(Function) + paramNames.capacity() * sizeof(std::string) + bytes;
+    for (int i = 0; i < paramNames.size(); i++)
+        n += heapBytes(paramNames[i]);
+    return n;
+}
+
+size_t Function::codeBytes() {
+    Program *p = program;
+    return p == NULL ? 0 : p->bytes();
+}
+
+size_t Function::evict() {
+    Program *p = program;
+    if (p == NULL || Program::depth(evaluator) > Program::DEEP_TREE)
+        return 0;
+    size_t n = p->bytes();
+    program = NULL;
+    hotAt = calls + HOT_CALLS;
+    delete p;
+    return n;
+}
+
+double Function::evalBody(Context *c, bool tail) {
+    // Every call counts, for explain; the count only decides promotion
+    // while there is no Program
+    Program *p = program.load(std::memory_order_acquire);
+    if (calls.fetch_add(1, std::memory_order_relaxed) + 1 >= hotAt.load(std::memory_order_relaxed) && p == NULL) {
+        promote(c);
+        p = program.load(std::memory_order_acquire);
+    }
+    if (p != NULL)
+        return tail ? p->evalTail(c) : p->eval(c);
+    else
+        return tail ? evaluator->evalTail(c) : evaluator->eval(c);
+}
+
+// Promotion stops at bytecode. Native code means running a compiler and
+// loading what it builds, which takes seconds and writes files, so it is
+// left to the export command rather than done in the middle of an
+// evaluation.
+void Function::promote(Context *c) {
+    // Programs skip Probes, so profiled functions stay on the tree, where
+    // they can be measured
+    if (c->isProfiling())
+        return;
+    std::lock_guard<std::mutex> g(promoting);
+    if (program == NULL) {
+        // Over the quota, the function stays on the tree, and tries again
+        // after as many calls more, by which time a definition may have
+        // evicted compiled code
+        Program *p = new Program(evaluator, paramNames);
+        if (owner != NULL && !owner->admitCode(p->bytes())) {
+            delete p;
+            hotAt = calls + HOT_CALLS;
+            return;
+        }
+        program.store(p, std::memory_order_release);
+    }
+}
+
+const char *Function::tierName() {
+    static const char *names[] = { "tree", "bytecode", "native" };
+    return names[tier()];
+}
+
+// Native code charges its steps through here, to the Context and function
+// it was entered from
+static thread_local Context *nativeContext;
+static thread_local Function *nativeFunction;
+
+// Returns the steps to take before the next call, or 0 to stop
+static long long settleNative(long long steps) {
+    if (nativeContext == NULL)
+        return Budget::CHECK_STEPS;
+    return nativeContext->charge(steps, nativeFunction) ? nativeContext->headroom() : 0;
+}
+
+double Function::evalNative(Native fn, std::vector<double> &params, Context *c) {
+    calls.fetch_add(1, std::memory_order_relaxed);
+    Context *oc = nativeContext;
+    Function *of = nativeFunction;
+    nativeContext = c;
+    nativeFunction = this;
+    int error = 0;
+    double ret = fn(params.empty() ? NULL : &params[0], c->available(), &error);
+    nativeContext = oc;
+    nativeFunction = of;
+    if (error == 1)
+        c->error("recursion too deep");
+    return ret;
+}
+
+double Function::eval(std::vector<double> params, Context *c) {
+    if (params.size() != paramNames.size()) {
+        c->error("wrong number of arguments");
+        return 0;
+    }
+    if (!c->charge(size, this))
+        return 0;
+    Native fn = native.load(std::memory_order_acquire);
+    if (fn != NULL)
+        return evalNative(fn, params, c);
+    if (!c->push(paramNames, params))
+        return 0;
+    if (!c->useTailCalls()) {
+        double ret = evalBody(c, false);
+        c->pop();
+        return ret;
+    }
+    // Tail calls made by the body come back here instead of recursing,
+    // so a chain of them runs in constant C++ stack, and in a single frame
+    // as long as the targets can't see what the frame held before.
+    Function *f = this;
+    int frames = 1;
+    double ret;
+    while (true) {
+        ret = f->evalBody(c, true);
+        f = c->takeTailCall(&params);
+        if (f == NULL || c->failed() || !c->charge(f->size, f))
+            break;
+        if (params.size() != f->paramNames.size()) {
+            c->error("wrong number of arguments");
+            break;
+        }
+        Native fn = f->native.load(std::memory_order_acquire);
+        if (fn != NULL) {
+            ret = f->evalNative(fn, params, c);
+            break;
+        }
+        if (!c->rebind(f->paramNames, params, f->closed)) {
+            if (!c->push(f->paramNames, params))
+                break;
+            frames++;
+        }
+    }
+    while (frames-- > 0)
+        c->pop();
+    return ret;
+}
+
+void Function::printAlg(OutputStream *os) {
+    os->write("(");
+    for (int i = 0; i < paramNames.size(); i++) {
+        if (i != 0)
+            os->write(",");
+        os->write(paramNames[i]);
+    }
+    os->write(")=>");
+    evaluator->printAlg(os);
+}
+
+void Function::printRpn(OutputStream *os) {
+    for (int i = 0; i < paramNames.size(); i++) {
+        os->write(paramNames[i]);
+        os->write(" ");
+    }
+    evaluator->printRpn(os);
+}
+
+//////////////////////
+/////  Identity  /////
+//////////////////////
+
+Identity::~Identity() {
+    release(ev);
+}
+
+double Identity::eval(Context *c) {
+    return ev->eval(c);
+}
+
+double Identity::evalTail(Context *c) {
+    return ev->evalTail(c);
+}
+
+////////////////
+/////  If  /////
+////////////////
+
+If::~If() {
+    release(cond);
+    release(ifTrue);
+    release(ifFalse);
+}
+
+double If::eval(Context *c) {
+    return cond->eval(c) != 0 ? ifTrue->eval(c) : ifFalse->eval(c);
+}
+
+double If::evalTail(Context *c) {
+    double x = cond->eval(c);
+    if (c->failed())
+        return 0;
+    return x != 0 ? ifTrue->evalTail(c) : ifFalse->evalTail(c);
+}
+
+/////////////////////
+/////  Literal  /////
+/////////////////////
+
+double Literal::eval(Context *c) {
+    return value;
+}
+
+/////////////////
+/////  Log  /////
+/////////////////
+
+Log::~Log() {
+    release(ev);
+}
+
+double Log::eval(Context *c) {
+    return Math::log(ev->eval(c), c->getPrecision());
+}
+
+/////////////////
+/////  Max  /////
+/////////////////
+
+Max::~Max() {
+    for (int i = 0; i < evs->size(); i++)
+        release((*evs)[i]);
+    delete evs;
+}
+
+double Max::eval(Context *c) {
+    double res = -DBL_MAX;
+    for (int i = 0; i < evs->size(); i++) {
+        double x = (*evs)[i]->eval(c);
+        if (x > res)
+            res = x;
+    }
+    return res;
+}
+
+/////////////////
+/////  Min  /////
+/////////////////
+
+Min::~Min() {
+    for (int i = 0; i < evs->size(); i++)
+        release((*evs)[i]);
+    delete evs;
+}
+
+double Min::eval(Context *c) {
+    double res = DBL_MAX;
+    for (int i = 0; i < evs->size(); i++) {
+        double x = (*evs)[i]->eval(c);
+        if (x < res)
+            res = x;
+    }
+    return res;
+}
+
+//////////////////////
+/////  Negative  /////
+//////////////////////
+
+Negative::~Negative() {
+    release(ev);
+}
+
+double Negative::eval(Context *c) {
+    return -ev->eval(c);
+}
+
+/////////////////////
+/////  Numeric  /////
+/////////////////////
+
+// Evaluates a function at many points at a time: through its native code,
+// if it has been exported, or else a TileProgram compiled from its body,
+// in double precision whatever the batch setting. Values that are not
+// finite are left for the caller to judge.
+class Sampler {
+
+    private:
+
+    Function *f;
+    Function::Native native;
+    TileProgram *tp;
+    int arity;
+
+    public:
+
+    Sampler(Function *f, Context *c) : f(f), native(f->getNative()), tp(NULL), arity(f->arity()) {
+        if (native == NULL)
+            tp = new TileProgram(f->body(), f->params(), c, true, f);
+    }
+    ~Sampler() { delete tp; }
+    // n points, with the values of parameter j in in[j]
+    bool eval(Context *c, const double **in, int n, double *out);
+    // For functions of one parameter
+    bool eval(Context *c, const double *x, int n, double *out) { return eval(c, &x, n, out); }
+    double eval(Context *c, double x);
+};
+
+bool Sampler::eval(Context *c, const double **in, int n, double *out) {
+    if (native != NULL) {
+        int available = c->available();
+        std::vector<double> args(arity);
+        Context *oc = nativeContext;
+        Function *of = nativeFunction;
+        nativeContext = c;
+        nativeFunction = f;
+        int error = 0;
+        for (int i = 0; i < n && error == 0; i++) {
+            for (int j = 0; j < arity; j++)
+                args[j] = in[j][i];
+            out[i] = native(args.empty() ? NULL : &args[0], available, &error);
+        }
+        nativeContext = oc;
+        nativeFunction = of;
+        if (error == 1)
+            c->error("recursion too deep");
+        return error == 0;
+    }
+    std::vector<const double *> tile(arity);
+    for (int i = 0; i < n; i += TileProgram::TILE) {
+        int m = n - i < TileProgram::TILE ? n - i : TileProgram::TILE;
+        for (int j = 0; j < arity; j++)
+            tile[j] = in[j] + i;
+        if (!tp->run(c, tile.empty() ? NULL : &tile[0], m, out + i))
+            return false;
+    }
+    return true;
+}
+
+// f(x), or NaN on error; the error stays set in c
+double Sampler::eval(Context *c, double x) {
+    double y;
+    return eval(c, &x, 1, &y) ? y : NAN;
+}
+
+// A share of a batch of points, evaluated on another thread, by a Sampler
+// of its own. The task is resubmitted for every batch.
+class SampleTask : public TaskPool::Task {
+
+    public:
+
+    Context context;
+    Sampler sampler;
+    const double *x;
+    int n;
+    double *out;
+    bool ok;
+
+    SampleTask(Function *f, Context *parent) : context(parent), sampler(f, &context), x(NULL), n(0), out(NULL), ok(true) {}
+    void run() { ok = sampler.eval(&context, x, n, out); }
+};
+
+// Evaluates f at n points, split in whole tiles over the threads of the
+// pool, if there is one and there is enough work; the values do not depend
+// on how the work is split. tasks holds the helpers, created on first use.
+static bool sampleAll(Function *f, Sampler &s, std::vector<SampleTask *> &tasks, Context *c, const double *x, int n, double *out) {
+    TaskPool *pool = c->getPool();
+    int tiles = (n + TileProgram::TILE - 1) / TileProgram::TILE;
+    int parts = pool == NULL ? 1 : pool->size() + 1;
+    if (parts > tiles)
+        parts = tiles;
+    if (parts <= 1)
+        return s.eval(c, x, n, out);
+    int share = (tiles + parts - 1) / parts * TileProgram::TILE;
+    while (tasks.size() < parts - 1)
+        tasks.push_back(new SampleTask(f, c));
+    int used = 0;
+    for (int start = share; start < n; start += share) {
+        SampleTask *t = tasks[used++];
+        t->x = x + start;
+        t->n = n - start < share ? n - start : share;
+        t->out = out + start;
+        t->done = false;
+        pool->submit(t);
+    }
+    bool ok = s.eval(c, x, share, out);
+    for (int i = 0; i < used; i++) {
+        pool->wait(tasks[i]);
+        if (!c->join(&tasks[i]->context))
+            ok = false;
+        if (!tasks[i]->ok) {
+            // The first error in the order of the points
+            if (ok)
+                c->error(tasks[i]->context.errorMessage());
+            tasks[i]->context.clearError();
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void notFinite(Context *c, std::string name, double x) {
+    char buf[50];
+    snprintf(buf, sizeof(buf), "%.17g", x);
+    c->error(name + " is not finite at " + buf);
+}
+
+// The 15-point Gauss-Kronrod rule, from QUADPACK: the nodes in [0, 1], and
+// their weights; every other node, from the second one on, belongs to the
+// 7-point Gauss rule too
+static const double XGK[8] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0
+};
+static const double WGK[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+static const double WG[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+};
+
+// Default tolerance of integrate, relative to the integral of |f|
+static const double INTEGRATE_TOL = 1e-10;
+
+struct Piece {
+    double a, b;
+    double integral, error, absolute;
+};
+
+// The points where f is needed for p: the centre, then the other nodes in
+// pairs
+static void nodes(Piece &p, double *x) {
+    double centre = 0.5 * (p.a + p.b);
+    double half = 0.5 * (p.b - p.a);
+    x[0] = centre;
+    for (int j = 0; j < 7; j++) {
+        x[1 + 2 * j] = centre - half * XGK[j];
+        x[2 + 2 * j] = centre + half * XGK[j];
+    }
+}
+
+// The integral over p, from the values of f at its nodes, and an estimate
+// of the error, which QUADPACK scales down when the Gauss and Kronrod
+// results agree well compared to the variation of f
+static void kronrod(Piece &p, const double *fv) {
+    double half = 0.5 * (p.b - p.a);
+    double resg = fv[0] * WG[3];
+    double resk = fv[0] * WGK[7];
+    double resabs = fabs(resk);
+    for (int j = 0; j < 7; j++) {
+        double f1 = fv[1 + 2 * j], f2 = fv[2 + 2 * j];
+        if (j % 2 == 1)
+            resg += WG[j / 2] * (f1 + f2);
+        resk += WGK[j] * (f1 + f2);
+        resabs += WGK[j] * (fabs(f1) + fabs(f2));
+    }
+    double mean = resk * 0.5;
+    double resasc = WGK[7] * fabs(fv[0] - mean);
+    for (int j = 0; j < 7; j++)
+        resasc += WGK[j] * (fabs(fv[1 + 2 * j] - mean) + fabs(fv[2 + 2 * j] - mean));
+    p.integral = resk * half;
+    p.absolute = resabs * fabs(half);
+    resasc *= fabs(half);
+    double err = fabs((resk - resg) * half);
+    if (resasc != 0 && err != 0)
+        err = resasc * fmin(1, pow(200 * err / resasc, 1.5));
+    if (p.absolute > DBL_MIN / (50 * DBL_EPSILON))
+        err = fmax(50 * DBL_EPSILON * p.absolute, err);
+    p.error = err;
+}
+
+// Adaptive quadrature, in rounds: every round bisects all pieces with more
+// than their share of the error, and evaluates f at the nodes of all the
+// new pieces in one batch, so the result does not depend on the threads.
+static double integrate(Function *f, std::string name, double a, double b, double tol, Context *c) {
+    if (!isfinite(a) || !isfinite(b)) {
+        c->error("integration limits must be finite");
+        return 0;
+    }
+    if (a == b)
+        return 0;
+    Sampler s(f, c);
+    std::vector<SampleTask *> tasks;
+    std::vector<Piece> pieces, fresh;
+    Piece whole = { a, b, 0, 0, 0 };
+    fresh.push_back(whole);
+    std::vector<double> x, fx;
+    double res = 0;
+    while (true) {
+        x.resize(15 * fresh.size());
+        fx.resize(x.size());
+        for (int i = 0; i < fresh.size(); i++)
+            nodes(fresh[i], &x[15 * i]);
+        if (!sampleAll(f, s, tasks, c, &x[0], x.size(), &fx[0]))
+            break;
+        int bad = -1;
+        for (int i = 0; bad == -1 && i < fx.size(); i++)
+            if (!isfinite(fx[i]))
+                bad = i;
+        if (bad != -1) {
+            notFinite(c, name, x[bad]);
+            break;
+        }
+        for (int i = 0; i < fresh.size(); i++) {
+            kronrod(fresh[i], &fx[15 * i]);
+            pieces.push_back(fresh[i]);
+        }
+        fresh.clear();
+
+        // Neumaier's summation, since the pieces can be many
+        double sum = 0, comp = 0, err = 0, absolute = 0;
+        for (int i = 0; i < pieces.size(); i++) {
+            double v = pieces[i].integral;
+            double t = sum + v;
+            comp += fabs(sum) >= fabs(v) ? (sum - t) + v : (v - t) + sum;
+            sum = t;
+            err += pieces[i].error;
+            absolute += pieces[i].absolute;
+        }
+        res = sum + comp;
+        double target = tol > 0 ? tol : INTEGRATE_TOL * absolute;
+        if (target < 100 * DBL_EPSILON * absolute)
+            target = 100 * DBL_EPSILON * absolute;
+        if (err <= target)
+            break;
+
+        double share = err / pieces.size();
+        int kept = 0;
+        for (int i = 0; i < pieces.size(); i++) {
+            Piece p = pieces[i];
+            double mid = 0.5 * (p.a + p.b);
+            if (p.error >= share && mid != p.a && mid != p.b) {
+                Piece left = { p.a, mid, 0, 0, 0 };
+                Piece right = { mid, p.b, 0, 0, 0 };
+                fresh.push_back(left);
+                fresh.push_back(right);
+            } else
+                pieces[kept++] = p;
+        }
+        pieces.resize(kept);
+        if (fresh.empty() || kept + fresh.size() > Numeric::MAX_PIECES) {
+            c->error("integral of " + name + " does not converge");
+            break;
+        }
+    }
+    for (int i = 0; i < tasks.size(); i++)
+        delete tasks[i];
+    return res;
+}
+
+static bool sameSign(double a, double b) {
+    return a > 0 ? b > 0 : b < 0;
+}
+
+// Brent's method, on [a, b], where f changes sign
+static double brent(Sampler &s, std::string name, double a, double fa, double b, double fb, Context *c) {
+    double cc = a, fc = fa;
+    double d = b - a, e = d;
+    for (int step = 0; step < Numeric::MAX_STEPS; step++) {
+        if (sameSign(fb, fc)) {
+            cc = a;
+            fc = fa;
+            d = e = b - a;
+        }
+        if (fabs(fc) < fabs(fb)) {
+            a = b; b = cc; cc = a;
+            fa = fb; fb = fc; fc = fa;
+        }
+        double tol = 2 * DBL_EPSILON * fabs(b) + DBL_MIN;
+        double m = 0.5 * (cc - b);
+        if (fabs(m) <= tol || fb == 0)
+            return b;
+        if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+            // Secant, or inverse quadratic interpolation
+            double r = fb / fa, p, q;
+            if (a == cc) {
+                p = 2 * m * r;
+                q = 1 - r;
+            } else {
+                double u = fa / fc, v = fb / fc;
+                p = r * (2 * m * u * (u - v) - (b - a) * (v - 1));
+                q = (u - 1) * (v - 1) * (r - 1);
+            }
+            if (p > 0)
+                q = -q;
+            p = fabs(p);
+            if (2 * p < fmin(3 * m * q - fabs(tol * q), fabs(e * q))) {
+                e = d;
+                d = p / q;
+            } else
+                d = e = m;
+        } else
+            d = e = m;
+        a = b;
+        fa = fb;
+        b += fabs(d) > tol ? d : m > 0 ? tol : -tol;
+        fb = s.eval(c, b);
+        if (c->failed())
+            return 0;
+        if (isnan(fb)) {
+            notFinite(c, name, b);
+            return 0;
+        }
+    }
+    c->error("solve did not converge");
+    return 0;
+}
+
+// A root near x0: the first sign change found stepping away from x0 on
+// both sides, in steps that double every time, up to some 1e27 times the
+// first, narrowed down by Brent's method; or if there is none, what the
+// secant method converges to
+static double solve(Function *f, std::string name, double x0, Context *c) {
+    Sampler s(f, c);
+    double f0 = s.eval(c, x0);
+    if (c->failed())
+        return 0;
+    if (!isfinite(f0)) {
+        notFinite(c, name, x0);
+        return 0;
+    }
+    if (f0 == 0)
+        return x0;
+    double first = 1e-3 * fmax(fabs(x0), 1);
+    double lo = x0, flo = f0, hi = x0, fhi = f0;
+    bool left = true, right = true;
+    double h = first;
+    for (int k = 0; k < 100 && (left || right); k++, h *= 2) {
+        for (int side = 0; side < 2; side++) {
+            bool &open = side == 0 ? right : left;
+            double &edge = side == 0 ? hi : lo;
+            double &fedge = side == 0 ? fhi : flo;
+            double x = side == 0 ? x0 + h : x0 - h;
+            if (!open)
+                continue;
+            double fx = isfinite(x) ? s.eval(c, x) : NAN;
+            if (c->failed())
+                return 0;
+            // Searching stops where f is undefined
+            if (!isfinite(fx)) {
+                open = false;
+                continue;
+            }
+            if (fx == 0)
+                return x;
+            if (!sameSign(fx, fedge))
+                return side == 0 ? brent(s, name, edge, fedge, x, fx, c) : brent(s, name, x, fx, edge, fedge, c);
+            edge = x;
+            fedge = fx;
+        }
+    }
+    double x1 = x0 + first;
+    double f1 = s.eval(c, x1);
+    for (int step = 0; step < Numeric::MAX_STEPS && isfinite(f1) && f1 != f0; step++) {
+        double x2 = x1 - f1 * (x1 - x0) / (f1 - f0);
+        x0 = x1;
+        f0 = f1;
+        x1 = x2;
+        f1 = isfinite(x1) ? s.eval(c, x1) : NAN;
+        if (c->failed())
+            return 0;
+        if (f1 == 0 || fabs(x1 - x0) <= 2 * DBL_EPSILON * fabs(x1))
+            return x1;
+    }
+    if (!c->failed())
+        c->error("no root of " + name + " found");
+    return 0;
+}
+
+static double solve(Function *f, std::string name, double a, double b, Context *c) {
+    Sampler s(f, c);
+    double x[2] = { a, b }, fx[2];
+    if (!s.eval(c, x, 2, fx))
+        return 0;
+    for (int i = 0; i < 2; i++)
+        if (!isfinite(fx[i])) {
+            notFinite(c, name, x[i]);
+            return 0;
+        }
+    if (fx[0] == 0)
+        return a;
+    if (fx[1] == 0)
+        return b;
+    if (sameSign(fx[0], fx[1])) {
+        c->error(name + " does not change sign in the interval");
+        return 0;
+    }
+    return brent(s, name, a, fx[0], b, fx[1], c);
+}
+
+// f(x) for minimizing: where f is undefined counts as infinitely high
+static double height(Sampler &s, Context *c, double x) {
+    double y = s.eval(c, x);
+    return isnan(y) ? INFINITY : y;
+}
+
+static const double GOLDEN = 0.3819660112501051;
+
+// Brent's minimization, on [a, b], starting from x, which is lower than
+// the ends; converges to a relative accuracy of about sqrt(DBL_EPSILON),
+// which is all a minimum allows
+static double localMin(Sampler &s, double a, double b, double x, double fx, Context *c) {
+    double w = x, v = x, fw = fx, fv = fx;
+    double d = 0, e = 0;
+    double eps = sqrt(DBL_EPSILON);
+    for (int step = 0; step < Numeric::MAX_STEPS; step++) {
+        double m = 0.5 * (a + b);
+        double tol = eps * fabs(x) + DBL_MIN;
+        if (fabs(x - m) <= 2 * tol - 0.5 * (b - a))
+            return x;
+        bool golden = true;
+        if (fabs(e) > tol) {
+            // A parabola through x, w and v
+            double r = (x - w) * (fx - fv);
+            double q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r;
+            q = 2 * (q - r);
+            if (q > 0)
+                p = -p;
+            q = fabs(q);
+            double last = e;
+            e = d;
+            if (fabs(p) < fabs(0.5 * q * last) && p > q * (a - x) && p < q * (b - x)) {
+                d = p / q;
+                double u = x + d;
+                if (u - a < 2 * tol || b - u < 2 * tol)
+                    d = m > x ? tol : -tol;
+                golden = false;
+            }
+        }
+        if (golden) {
+            e = x >= m ? a - x : b - x;
+            d = GOLDEN * e;
+        }
+        double u = fabs(d) >= tol ? x + d : d > 0 ? x + tol : x - tol;
+        double fu = height(s, c, u);
+        if (c->failed())
+            return 0;
+        if (fu <= fx) {
+            if (u >= x)
+                a = x;
+            else
+                b = x;
+            v = w; fv = fw;
+            w = x; fw = fx;
+            x = u; fx = fu;
+        } else {
+            if (u < x)
+                a = u;
+            else
+                b = u;
+            if (fu <= fw || w == x) {
+                v = w; fv = fw;
+                w = u; fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u; fv = fu;
+            }
+        }
+    }
+    c->error("minimize did not converge");
+    return 0;
+}
+
+// A local minimum near x0: downhill from x0 in steps that grow by the
+// golden ratio, until f rises again, then Brent's method on that bracket
+static double minimize(Function *f, std::string name, double x0, Context *c) {
+    Sampler s(f, c);
+    double a = x0, b = x0 + 1e-3 * fmax(fabs(x0), 1);
+    double fa = height(s, c, a), fb = height(s, c, b);
+    if (c->failed())
+        return 0;
+    if (fb > fa) {
+        std::swap(a, b);
+        std::swap(fa, fb);
+    }
+    double x = b + (b - a) / GOLDEN;
+    double fx = height(s, c, x);
+    for (int step = 0; fx < fb; step++) {
+        if (step == Numeric::MAX_STEPS || !isfinite(x) || fx == -INFINITY) {
+            c->error(name + " has no minimum near the starting point");
+            return 0;
+        }
+        a = b; fa = fb;
+        b = x; fb = fx;
+        x = b + (b - a) / GOLDEN;
+        fx = height(s, c, x);
+    }
+    if (c->failed())
+        return 0;
+    return a < x ? localMin(s, a, x, b, fb, c) : localMin(s, x, a, b, fb, c);
+}
+
+static double minimize(Function *f, std::string name, double a, double b, Context *c) {
+    if (!isfinite(a) || !isfinite(b)) {
+        c->error("interval must be finite");
+        return 0;
+    }
+    if (a > b)
+        std::swap(a, b);
+    Sampler s(f, c);
+    double x = a + GOLDEN * (b - a);
+    double fx = height(s, c, x);
+    if (c->failed())
+        return 0;
+    return localMin(s, a, b, x, fx, c);
+}
+
+static double identity(int op) {
+    switch (op) {
+        case OP_RSUM: return 0;
+        case OP_RPROD: return 1;
+        // Like Max and Min with no operands
+        case OP_RMAX: return -DBL_MAX;
+        default: return DBL_MAX;
+    }
+}
+
+static inline double combine(int op, double x, double y) {
+    switch (op) {
+        case OP_RSUM: return x + y;
+        case OP_RPROD: return x * y;
+        case OP_RMAX: return y > x ? y : x;
+        default: return y < x ? y : x;
+    }
+}
+
+// Combines n > 0 values as a balanced tree, so the rounding errors of
+// sums grow with log n rather than n
+static double pairwise(int op, const double *v, int n) {
+    if (n <= 8) {
+        double r = v[0];
+        for (int i = 1; i < n; i++)
+            r = combine(op, r, v[i]);
+        return r;
+    }
+    int h = n / 2;
+    return combine(op, pairwise(op, v, h), pairwise(op, v + h, n - h));
+}
+
+// f(a + first), ..., f(a + first + n - 1), combined tile by tile, with
+// the terms of sums added with Neumaier's compensation, and the tiles
+// pairwise; n is at most a superblock
+static bool block(Sampler &s, Context *c, int op, double a, long long first, long long n, double *res) {
+    double x[TileProgram::TILE], y[TileProgram::TILE];
+    double partial[Numeric::SUPERBLOCK];
+    int tiles = 0;
+    for (long long k = 0; k < n; k += TileProgram::TILE) {
+        int m = n - k < TileProgram::TILE ? n - k : TileProgram::TILE;
+        for (int j = 0; j < m; j++)
+            x[j] = a + (double) (first + k + j);
+        if (!s.eval(c, x, m, y))
+            return false;
+        double r = y[0];
+        if (op == OP_RSUM) {
+            double comp = 0;
+            for (int j = 1; j < m; j++) {
+                double t = r + y[j];
+                comp += fabs(r) >= fabs(y[j]) ? (r - t) + y[j] : (y[j] - t) + r;
+                r = t;
+            }
+            // Infinite terms leave the compensation NaN
+            if (isfinite(r))
+                r += comp;
+        } else
+            for (int j = 1; j < m; j++)
+                r = combine(op, r, y[j]);
+        partial[tiles++] = r;
+    }
+    *res = pairwise(op, partial, tiles);
+    return true;
+}
+
+// Takes the next superblock of a reduction until there are none left, or
+// an error occurs, which stops the other threads too
+static bool superblocks(Sampler &s, Context *c, int op, double a, long long count, std::atomic<long long> &next, std::vector<double> &partials) {
+    long long size = (long long) Numeric::SUPERBLOCK * TileProgram::TILE;
+    while (true) {
+        long long i = next++;
+        if (i >= (long long) partials.size())
+            return true;
+        long long first = i * size;
+        if (!block(s, c, op, a, first, count - first < size ? count - first : size, &partials[i])) {
+            next = partials.size();
+            return false;
+        }
+    }
+}
+
+// Superblocks of a reduction, taken on another thread
+class ReduceTask : public TaskPool::Task {
+
+    public:
+
+    Context context;
+    Sampler sampler;
+    int op;
+    double a;
+    long long count;
+    std::atomic<long long> *next;
+    std::vector<double> *partials;
+    bool ok;
+
+    ReduceTask(Function *f, Context *parent, int op, double a, long long count, std::atomic<long long> *next, std::vector<double> *partials)
+        : context(parent), sampler(f, &context), op(op), a(a), count(count), next(next), partials(partials), ok(true) {}
+    void run() { ok = superblocks(sampler, &context, op, a, count, *next, *partials); }
+};
+
+// f(a), f(a+1), ... up to b, combined. Every superblock is reduced to one
+// value by a single thread, and those values are combined pairwise in
+// order, so the result does not depend on the number of threads.
+static double reduce(Function *f, int op, double a, double b, Context *c) {
+    if (!isfinite(a) || !isfinite(b)) {
+        c->error("range must be finite");
+        return 0;
+    }
+    if (b < a)
+        return identity(op);
+    double span = floor(b - a);
+    if (span >= 9007199254740992.0 || a + span == a && span != 0) {
+        c->error("range too long");
+        return 0;
+    }
+    long long count = (long long) span + 1;
+    long long size = (long long) Numeric::SUPERBLOCK * TileProgram::TILE;
+    std::vector<double> partials((count + size - 1) / size);
+    std::atomic<long long> next(0);
+    Sampler s(f, c);
+    TaskPool *pool = c->getPool();
+    std::vector<ReduceTask *> tasks;
+    for (int i = 0; pool != NULL && i < pool->size() && i < (long long) partials.size() - 1; i++) {
+        tasks.push_back(new ReduceTask(f, c, op, a, count, &next, &partials));
+        pool->submit(tasks.back());
+    }
+    bool ok = superblocks(s, c, op, a, count, next, partials);
+    for (int i = 0; i < tasks.size(); i++) {
+        pool->wait(tasks[i]);
+        if (!c->join(&tasks[i]->context))
+            ok = false;
+        if (ok && !tasks[i]->ok) {
+            c->error(tasks[i]->context.errorMessage());
+            ok = false;
+        }
+        delete tasks[i];
+    }
+    if (!ok)
+        return 0;
+    return pairwise(op, &partials[0], partials.size());
+}
+
+Numeric::~Numeric() {
+    for (int i = 0; i < evs->size(); i++)
+        release((*evs)[i]);
+    delete evs;
+}
+
+double Numeric::eval(Context *c) {
+    double args[3];
+    for (int i = 0; i < evs->size(); i++)
+        args[i] = (*evs)[i]->eval(c);
+    if (c->failed())
+        return 0;
+    return compute(c, args);
+}
+
+double Numeric::compute(Context *c, const double *args) {
+    Function *f = c->getFunction(name);
+    if (f == NULL) {
+        c->error("undefined function " + name);
+        return 0;
+    }
+    if (f->arity() != 1) {
+        c->error(name + " is not a function of one parameter");
+        return 0;
+    }
+    bool interval = evs->size() == 2;
+    switch (op) {
+        case OP_INTEGRATE:
+            return integrate(f, name, args[0], args[1], evs->size() == 3 ? args[2] : 0, c);
+        case OP_SOLVE:
+            return interval ? solve(f, name, args[0], args[1], c) : solve(f, name, args[0], c);
+        case OP_MINIMIZE:
+            return interval ? minimize(f, name, args[0], args[1], c) : minimize(f, name, args[0], c);
+        default:
+            return reduce(f, op, args[0], args[1], c);
+    }
+}
+
+int Numeric::opcode(std::string keyword) {
+    for (int op = OP_INTEGRATE; op <= OP_SOLVE; op++)
+        if (keyword == Numeric::keyword(op))
+            return op;
+    return -1;
+}
+
+const char *Numeric::keyword(int op) {
+    static const char *keywords[] = {
+        "integrate", "minimize", "rmax", "rmin", "prod", "sum", "solve"
+    };
+    return keywords[op - OP_INTEGRATE];
+}
+
+////////////////////////
+/////  Polynomial  /////
+////////////////////////
+
+static inline double madd(double a, double b, double c) {
+#ifdef FP_FAST_FMA
+    return fma(a, b, c);
+#else
+    return a * b + c;
+#endif
+}
+
+Polynomial::~Polynomial() {
+    for (int i = 0; i < evs->size(); i++)
+        release((*evs)[i]);
+    delete evs;
+}
+
+double Polynomial::eval(Context *c) {
+    int n = evs->size();
+    double small[16];
+    std::vector<double> big;
+    double *v = small;
+    if (n > 16) {
+        big.resize(n);
+        v = &big[0];
+    }
+    for (int i = 0; i < n; i++)
+        v[i] = (*evs)[i]->eval(c);
+    return evaluate(v[0], v + 1, n - 1);
+}
+
+double Polynomial::evaluate(double x, const double *c, int n) {
+    if (n <= ESTRIN_DEGREE) {
+        double p = c[n - 1];
+        for (int i = n - 2; i >= 0; i--)
+            p = madd(p, x, c[i]);
+        return p;
+    }
+    // Neighbouring coefficients are combined with x, neighbouring results
+    // of that with x^2, and so on
+    double small[16];
+    std::vector<double> big;
+    double *b = small;
+    if (n > 16) {
+        big.resize(n);
+        b = &big[0];
+    }
+    memcpy(b, c, n * sizeof(double));
+    while (n > 1) {
+        int m = n / 2;
+        for (int i = 0; i < m; i++)
+            b[i] = madd(b[2 * i + 1], x, b[2 * i]);
+        if (n % 2 != 0)
+            b[m++] = b[n - 1];
+        n = m;
+        x *= x;
+    }
+    return b[0];
+}
+
+//////////////////////
+/////  Positive  /////
+//////////////////////
+
+Positive::~Positive() {
+    release(ev);
+}
+
+double Positive::eval(Context *c) {
+    return ev->eval(c);
+}
+
+double Positive::evalTail(Context *c) {
+    return ev->evalTail(c);
+}
+
+///////////////////
+/////  Power  /////
+///////////////////
+
+Power::~Power() {
+    release(left);
+    release(right);
+}
+
+double Power::eval(Context *c) {
+    return Math::pow(left->eval(c), right->eval(c), c->getPrecision());
+}
+
+///////////////////
+/////  Probe  /////
+///////////////////
+
+Probe::~Probe() {
+    release(ev);
+}
+
+uint64_t Probe::clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// The ticks the innermost probed call on this thread has spent in the
+// bodies of the functions it called so far
+static thread_local long *inCallees;
+
+double Probe::run(Context *c, bool tail) {
+    // A probed call collects the time of the bodies it runs, which the
+    // roots of those bodies report, so that its own time can leave them
+    // out. A tail call's body runs after it returns, and is reported to
+    // the call that is still running.
+    bool call = ev->opcode() == OP_CALL || isNumeric(ev->opcode());
+    long *outer = inCallees;
+    long inner = 0;
+    if (call)
+        inCallees = &inner;
+    uint64_t start = clock();
+    double res = tail ? ev->evalTail(c) : ev->eval(c);
+    long t = clock() - start;
+    inCallees = outer;
+    elapsed += t;
+    hits++;
+    if (call)
+        callees += inner;
+    if (body && outer != NULL)
+        *outer += t;
+    return res;
+}
+
+double Probe::eval(Context *c) {
+    return run(c, false);
+}
+
+double Probe::evalTail(Context *c) {
+    return run(c, true);
+}
+
+/////////////////////
+/////  Product  /////
+/////////////////////
+
+Product::~Product() {
+    release(left);
+    release(right);
+}
+
+double Product::eval(Context *c) {
+    return left->eval(c) * right->eval(c);
+}
+
+//////////////////////
+/////  Quotient  /////
+//////////////////////
+
+Quotient::~Quotient() {
+    release(left);
+    release(right);
+}
+
+double Quotient::eval(Context *c) {
+    return left->eval(c) / right->eval(c);
+}
+
+/////////////////
+/////  Sin  /////
+/////////////////
+
+Sin::~Sin() {
+    release(ev);
+}
+
+double Sin::eval(Context *c) {
+    return Math::sin(ev->eval(c), c->getPrecision());
+}
+
+//////////////////
+/////  Sqrt  /////
+//////////////////
+
+Sqrt::~Sqrt() {
+    release(ev);
+}
+
+double Sqrt::eval(Context *c) {
+    return sqrt(ev->eval(c));
+}
+
+/////////////////
+/////  Sum  /////
+/////////////////
+
+Sum::~Sum() {
+    release(left);
+    release(right);
+}
+
+double Sum::eval(Context *c) {
+    return left->eval(c) + right->eval(c);
+}
+
+/////////////////
+/////  Tan  /////
+/////////////////
+
+Tan::~Tan() {
+    release(ev);
+}
+
+double Tan::eval(Context *c) {
+    return Math::tan(ev->eval(c), c->getPrecision());
+}
+
+//////////////////////
+/////  Variable  /////
+//////////////////////
+
+double Variable::eval(Context *c) {
+    return c->getVariable(name);
+}
+
+////////////////////
+/////  Window  /////
+////////////////////
+
+Window::Window(int pos, int kind, Evaluator *x, int size)
+        : Evaluator(pos), kind(kind), size(size), x(x), ring(size), ticks(0),
+          count(0), sum(0), comp(0), mean(0), m2(0), nans(0), plus(0), minus(0) {}
+
+Window::~Window() {
+    release(x);
+}
+
+double Window::eval(Context *c) {
+    double v = x->eval(c);
+    if (c->failed())
+        return 0;
+    return update(v);
+}
+
+double Window::update(double v) {
+    std::lock_guard<std::mutex> g(lock);
+    long long t = ticks++;
+    int i = t % size;
+    bool full = t >= size;
+    double old = ring[i];
+    ring[i] = v;
+    if (kind == MIN || kind == MAX) {
+        // Values that can no longer be the extreme, because a later one is
+        // at least as extreme, are dropped from the back; the one that
+        // leaves the window, if it is still there, from the front. NaNs
+        // are passed over, as by min() and max().
+        bool max = kind == MAX;
+        if (!isnan(v)) {
+            while (!extremes.empty() && (max ? extremes.back().second <= v : extremes.back().second >= v))
+                extremes.pop_back();
+            extremes.push_back(std::make_pair(t, v));
+        }
+        if (!extremes.empty() && extremes.front().first <= t - size)
+            extremes.pop_front();
+        return extremes.empty() ? NAN : extremes.front().second;
+    }
+
+    // Infinities and NaNs are counted rather than summed, so that they
+    // stop mattering once they have left the window
+    if (full)
+        add(old, -1);
+    add(v, 1);
+    if (nans > 0 || plus > 0 && minus > 0)
+        return NAN;
+    if (plus > 0 || minus > 0)
+        return kind == VARIANCE ? NAN : plus > 0 ? HUGE_VAL : -HUGE_VAL;
+    if (kind == VARIANCE)
+        return count > 1 ? m2 / (count - 1) : 0;
+    double r = sum + comp;
+    return kind == SUM ? r : r / count;
+}
+
+// Adds v to the window (sign 1), or takes it off (sign -1)
+void Window::add(double v, int sign) {
+    if (isnan(v)) {
+        nans += sign;
+        return;
+    }
+    if (isinf(v)) {
+        (v > 0 ? plus : minus) += sign;
+        return;
+    }
+    if (kind == VARIANCE) {
+        // Welford's update, and the same taken back
+        count += sign;
+        if (count == 0) {
+            mean = m2 = 0;
+            return;
+        }
+        double d = v - mean;
+        mean += sign * d / count;
+        m2 += sign * d * (v - mean);
+        if (m2 < 0)
+            m2 = 0;
+        return;
+    }
+    // With compensation, so that rounding errors do not pile up over a
+    // long stream
+    count += sign;
+    if (count == 0) {
+        sum = comp = 0;
+        return;
+    }
+    double x = sign * v;
+    double s = sum + x;
+    if (fabs(sum) >= fabs(x))
+        comp += (sum - s) + x;
+    else
+        comp += (x - s) + sum;
+    sum = s;
+}
+
+int Window::kindOf(std::string keyword) {
+    for (int k = SUM; k <= VARIANCE; k++)
+        if (keyword == Window::keyword(k))
+            return k;
+    return -1;
+}
+
+const char *Window::keyword(int kind) {
+    static const char *keywords[] = { "msum", "mmean", "mmin", "mmax", "mvar" };
+    return keywords[kind];
+}
+
+//////////////////
+/////  Math  /////
+//////////////////
+
+static inline uint64_t bitsOf(double d) {
+    uint64_t b;
+    memcpy(&b, &d, sizeof(b));
+    return b;
+}
+
+static inline double fromBits(uint64_t b) {
+    double d;
+    memcpy(&d, &b, sizeof(d));
+    return d;
+}
+
+// Adding and subtracting this rounds to an integer, in the current
+// rounding mode, without a library call
+static const double TOINT = 1.5 / DBL_EPSILON;
+
+// Arguments of sin, cos and tan up to this size are reduced here; the
+// reduction by pi/2 in three pieces stays exact while the quotient fits in
+// 20 bits
+static const double TRIG_MAX = 1e6;
+
+// For exp: 2^(j/128). For log: the midpoints c of 128 intervals of
+// [1, 2), 1/c, and log(c), in two parts where long double is longer.
+struct MathTables {
+    double exp2[128];
+    double c[128];
+    double invc[128];
+    double logc[128];
+    double logcLo[128];
+
+    MathTables() {
+        for (int j = 0; j < 128; j++) {
+            exp2[j] = ::exp2(j / 128.0);
+            c[j] = 1 + (j + 0.5) / 128;
+            invc[j] = 1 / c[j];
+            long double l = logl(c[j]);
+            logc[j] = (double) l;
+            logcLo[j] = (double) (l - logc[j]);
+        }
+    }
+};
+
+static const MathTables tables;
+
+// x reduced to y0 + y1 in [-pi/4, pi/4], minus n times pi/2; returns n
+int Math::reduce(double x, double *y0, double *y1) {
+    static const double
+        INVPIO2 = 6.36619772367581382433e-01,
+        PIO2_1 = 1.57079632673412561417e+00,
+        PIO2_1T = 6.07710050650619224932e-11,
+        PIO2_2 = 6.07710050630396597660e-11,
+        PIO2_2T = 2.02226624879595063154e-21,
+        PIO2_3 = 2.02226624871116645580e-21,
+        PIO2_3T = 8.47842766036889956997e-32;
+    if (fabs(x) <= M_PI_4) {
+        *y0 = x;
+        *y1 = 0;
+        return 0;
+    }
+    double fn = x * INVPIO2 + TOINT - TOINT;
+    int n = (int) fn;
+    double r = x - fn * PIO2_1;
+    double w = fn * PIO2_1T;
+    *y0 = r - w;
+    // Another piece of pi/2 for every cancellation of 16 bits or more
+    int ex = bitsOf(x) >> 52 & 0x7ff;
+    int ey = bitsOf(*y0) >> 52 & 0x7ff;
+    if (ex - ey > 16) {
+        double t = r;
+        w = fn * PIO2_2;
+        r = t - w;
+        w = fn * PIO2_2T - ((t - r) - w);
+        *y0 = r - w;
+        ey = bitsOf(*y0) >> 52 & 0x7ff;
+        if (ex - ey > 49) {
+            t = r;
+            w = fn * PIO2_3;
+            r = t - w;
+            w = fn * PIO2_3T - ((t - r) - w);
+            *y0 = r - w;
+        }
+    }
+    *y1 = (r - *y0) - w;
+    return n;
+}
+
+double Math::kernelSin(double x, double y) {
+    static const double
+        S1 = -1.66666666666666324348e-01,
+        S2 = 8.33333333332248946124e-03,
+        S3 = -1.98412698298579493134e-04,
+        S4 = 2.75573137070700676789e-06,
+        S5 = -2.50507602534068634195e-08,
+        S6 = 1.58969099521155010221e-10;
+    double z = x * x;
+    double w = z * z;
+    double r = S2 + z * (S3 + z * S4) + z * w * (S5 + z * S6);
+    double v = z * x;
+    return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+double Math::kernelCos(double x, double y) {
+    static const double
+        C1 = 4.16666666666666019037e-02,
+        C2 = -1.38888888888741095749e-03,
+        C3 = 2.48015872894767294178e-05,
+        C4 = -2.75573143513906633035e-07,
+        C5 = 2.08757232129817482790e-09,
+        C6 = -1.13596475577881948265e-11;
+    double z = x * x;
+    double w = z * z;
+    double r = z * (C1 + z * (C2 + z * C3)) + w * w * (C4 + z * (C5 + z * C6));
+    double hz = 0.5 * z;
+    w = 1 - hz;
+    return w + (((1 - w) - hz) + (z * r - x * y));
+}
+
+double Math::fastSin(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::sin(x);
+    double y0, y1;
+    switch (reduce(x, &y0, &y1) & 3) {
+        case 0: return kernelSin(y0, y1);
+        case 1: return kernelCos(y0, y1);
+        case 2: return -kernelSin(y0, y1);
+        default: return -kernelCos(y0, y1);
+    }
+}
+
+double Math::fastCos(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::cos(x);
+    double y0, y1;
+    switch (reduce(x, &y0, &y1) & 3) {
+        case 0: return kernelCos(y0, y1);
+        case 1: return -kernelSin(y0, y1);
+        case 2: return -kernelCos(y0, y1);
+        default: return kernelSin(y0, y1);
+    }
+}
+
+double Math::fastTan(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::tan(x);
+    double y0, y1;
+    int n = reduce(x, &y0, &y1);
+    double s = kernelSin(y0, y1);
+    double c = kernelCos(y0, y1);
+    return n & 1 ? -c / s : s / c;
+}
+
+// exp(x) = 2^(k/128) exp(r), with |r| <= ln(2)/256, and exp(r) to degree 5
+double Math::fastExp(double x) {
+    static const double
+        LN2HI = 6.93147180369123816490e-01 / 128,
+        LN2LO = 1.90821492927058770002e-10 / 128;
+    // Results near overflow and underflow are left to the library
+    if (!(fabs(x) < 708))
+        return ::exp(x);
+    double fn = x * (128 / M_LN2) + TOINT - TOINT;
+    int k = (int) fn;
+    double r = (x - fn * LN2HI) - fn * LN2LO;
+    double p = r + r * r * (1 / 2.0 + r * (1 / 6.0 + r * (1 / 24.0 + r * (1 / 120.0))));
+    double t = tables.exp2[k & 127];
+    return (t + t * p) * fromBits((uint64_t) (0x3ff + (k >> 7)) << 52);
+}
+
+// log(x) = k log(2) + log(c) + log(1 + r), where x = 2^k m, c is the
+// midpoint of the interval m is in, and r = (m - c) / c; log(1 + r) is a
+// series to degree 7, and the rest is summed with its rounding errors.
+// Near 1, where those terms cancel, fdlibm's series is used instead.
+double Math::fastLog(double x) {
+    static const double
+        LN2HI = 6.93147180369123816490e-01,
+        LN2LO = 1.90821492927058770002e-10,
+        LG1 = 6.666666666666735130e-01,
+        LG2 = 3.999999999940941908e-01,
+        LG3 = 2.857142874366239149e-01,
+        LG4 = 2.222219843214978396e-01,
+        LG5 = 1.818357216161805012e-01,
+        LG6 = 1.531383769920937332e-01,
+        LG7 = 1.479819860511658591e-01;
+    if (!(x >= DBL_MIN && x <= DBL_MAX))
+        return ::log(x);
+    double f = x - 1;
+    if (fabs(f) < 1 / 128.0) {
+        double hfsq = 0.5 * f * f;
+        double s = f / (2 + f);
+        double z = s * s;
+        double w = z * z;
+        double t1 = w * (LG2 + w * (LG4 + w * LG6));
+        double t2 = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+        return s * (hfsq + t1 + t2) - hfsq + f;
+    }
+    uint64_t b = bitsOf(x);
+    int k = (int) (b >> 52) - 0x3ff;
+    int j = (int) (b >> 45) & 127;
+    double m = fromBits((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    double r = (m - tables.c[j]) * tables.invc[j];
+    double kh = k * LN2HI;
+    double w = kh + tables.logc[j];
+    double hi = w + r;
+    double lo = ((kh - w) + tables.logc[j]) + ((w - hi) + r) + k * LN2LO + tables.logcLo[j];
+    double p = r * r * (-1 / 2.0 + r * (1 / 3.0 + r * (-1 / 4.0 + r * (1 / 5.0 + r * (-1 / 6.0 + r * (1 / 7.0))))));
+    return hi + (lo + p);
+}
+
+double Math::fastAtan(double x) {
+    static const double ATANHI[] = {
+        4.63647609000806093515e-01,
+        7.85398163397448278999e-01,
+        9.82793723247329054082e-01,
+        1.57079632679489655800e+00
+    };
+    static const double ATANLO[] = {
+        2.26987774529616870924e-17,
+        3.06161699786838301793e-17,
+        1.39033110312309984516e-17,
+        6.12323399573676603587e-17
+    };
+    static const double AT[] = {
+        3.33333333333329318027e-01,
+        -1.99999999998764832476e-01,
+        1.42857142725034663711e-01,
+        -1.11111104054623557880e-01,
+        9.09088713343650656196e-02,
+        -7.69187620504482999495e-02,
+        6.66107313738753120669e-02,
+        -5.83357013379057348645e-02,
+        4.97687799461593236017e-02,
+        -3.65315727442169155270e-02,
+        1.62858201153657823623e-02
+    };
+    if (x != x)
+        return x;
+    double a = fabs(x);
+    if (a >= 0x1p66)
+        return copysign(ATANHI[3] + ATANLO[3], x);
+    int id;
+    if (a < 0.4375) {
+        if (a < 0x1p-27)
+            return x;
+        id = -1;
+    } else if (a < 0.6875) {
+        id = 0;
+        a = (2 * a - 1) / (2 + a);
+    } else if (a < 1.1875) {
+        id = 1;
+        a = (a - 1) / (a + 1);
+    } else if (a < 2.4375) {
+        id = 2;
+        a = (a - 1.5) / (1 + 1.5 * a);
+    } else {
+        id = 3;
+        a = -1 / a;
+    }
+    double z = a * a;
+    double w = z * z;
+    double s1 = z * (AT[0] + w * (AT[2] + w * (AT[4] + w * (AT[6] + w * (AT[8] + w * AT[10])))));
+    double s2 = w * (AT[1] + w * (AT[3] + w * (AT[5] + w * (AT[7] + w * AT[9]))));
+    if (id < 0)
+        return copysign(a - a * (s1 + s2), x);
+    return copysign(ATANHI[id] - ((a * (s1 + s2) - ATANLO[id]) - a), x);
+}
+
+double Math::fastAsin(double x) {
+    return fastAtan(x / ::sqrt((1 - x) * (1 + x)));
+}
+
+double Math::fastAcos(double x) {
+    return 2 * fastAtan(::sqrt((1 - x) / (1 + x)));
+}
+
+// Integer powers up to 4 by multiplication; the rest by the library
+double Math::fastPow(double x, double y) {
+    if (!(fabs(y) <= 4) || y != (int) y)
+        return ::pow(x, y);
+    int n = (int) fabs(y);
+    double x2 = x * x;
+    double r = (n & 1 ? x : 1) * (n & 2 ? x2 : 1) * (n & 4 ? x2 * x2 : 1);
+    return y < 0 ? 1 / r : r;
+}
+
+// Taylor series, to degree 9 and 8, on [-pi/4, pi/4]
+double Math::approxSinKernel(double x) {
+    double z = x * x;
+    return x * (1 + z * (-1 / 6.0 + z * (1 / 120.0 + z * (-1 / 5040.0 + z * (1 / 362880.0)))));
+}
+
+double Math::approxCosKernel(double x) {
+    double z = x * x;
+    return 1 + z * (-1 / 2.0 + z * (1 / 24.0 + z * (-1 / 720.0 + z * (1 / 40320.0))));
+}
+
+double Math::approxSin(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::sin(x);
+    double y0, y1;
+    switch (reduce(x, &y0, &y1) & 3) {
+        case 0: return approxSinKernel(y0);
+        case 1: return approxCosKernel(y0);
+        case 2: return -approxSinKernel(y0);
+        default: return -approxCosKernel(y0);
+    }
+}
+
+double Math::approxCos(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::cos(x);
+    double y0, y1;
+    switch (reduce(x, &y0, &y1) & 3) {
+        case 0: return approxCosKernel(y0);
+        case 1: return -approxSinKernel(y0);
+        case 2: return -approxCosKernel(y0);
+        default: return approxSinKernel(y0);
+    }
+}
+
+double Math::approxTan(double x) {
+    if (!(fabs(x) < TRIG_MAX))
+        return ::tan(x);
+    double y0, y1;
+    int n = reduce(x, &y0, &y1);
+    double s = approxSinKernel(y0);
+    double c = approxCosKernel(y0);
+    return n & 1 ? -c / s : s / c;
+}
+
+// As fastExp(), with exp(r) to degree 2
+double Math::approxExp(double x) {
+    if (!(fabs(x) < 708))
+        return ::exp(x);
+    double fn = x * (128 / M_LN2) + TOINT - TOINT;
+    int k = (int) fn;
+    double r = x - fn * (M_LN2 / 128);
+    double t = tables.exp2[k & 127];
+    return (t + t * (r + r * r * 0.5)) * fromBits((uint64_t) (0x3ff + (k >> 7)) << 52);
+}
+
+// As fastLog(), with log(1 + r) to degree 3, and a series to degree 4
+// near 1
+double Math::approxLog(double x) {
+    if (!(x >= DBL_MIN && x <= DBL_MAX))
+        return ::log(x);
+    double f = x - 1;
+    if (fabs(f) < 1 / 64.0)
+        return f - f * f * (1 / 2.0 - f * (1 / 3.0 - f * (1 / 4.0)));
+    uint64_t b = bitsOf(x);
+    int k = (int) (b >> 52) - 0x3ff;
+    int j = (int) (b >> 45) & 127;
+    double m = fromBits((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    double r = (m - tables.c[j]) * tables.invc[j];
+    return k * M_LN2 + tables.logc[j] + (r - r * r * (1 / 2.0 - r * (1 / 3.0)));
+}
+
+// atan(x) = pi/2 - atan(1/x) and pi/4 + atan((x - 1) / (x + 1)) bring the
+// argument to [-tan(pi/8), tan(pi/8)], for a series to degree 15
+double Math::approxAtan(double x) {
+    if (x != x)
+        return x;
+    double a = fabs(x);
+    bool inverted = a > 1;
+    if (inverted)
+        a = 1 / a;
+    bool shifted = a > M_SQRT2 - 1;
+    if (shifted)
+        a = (a - 1) / (a + 1);
+    double z = a * a;
+    double r = a * (1 + z * (-1 / 3.0 + z * (1 / 5.0 + z * (-1 / 7.0 + z * (1 / 9.0 + z * (-1 / 11.0 + z * (1 / 13.0 + z * (-1 / 15.0))))))));
+    if (shifted)
+        r += M_PI_4;
+    if (inverted)
+        r = M_PI_2 - r;
+    return copysign(r, x);
+}
+
+// asin(x) = pi/2 - 2 asin(sqrt((1 - x) / 2)) brings the argument to
+// [0, 1/2], for a series to degree 17
+double Math::approxAsinKernel(double x) {
+    double z = x * x;
+    return x * (1 + z * (1 / 6.0 + z * (3 / 40.0 + z * (5 / 112.0 + z * (35 / 1152.0 + z * (63 / 2816.0
+            + z * (231 / 13312.0 + z * (143 / 10240.0 + z * (6435 / 557056.0)))))))));
+}
+
+double Math::approxAsin(double x) {
+    double a = fabs(x);
+    if (a <= 0.5)
+        return approxAsinKernel(x);
+    if (!(a <= 1))
+        return ::asin(x);
+    return copysign(M_PI_2 - 2 * approxAsinKernel(::sqrt((1 - a) * 0.5)), x);
+}
+
+double Math::approxAcos(double x) {
+    if (fabs(x) <= 0.5)
+        return M_PI_2 - approxAsinKernel(x);
+    if (!(fabs(x) <= 1))
+        return ::acos(x);
+    double r = 2 * approxAsinKernel(::sqrt((1 - fabs(x)) * 0.5));
+    return x > 0 ? r : M_PI - r;
+}
+
+// The error of the logarithm is multiplied by y log(x) in the result
+double Math::approxPow(double x, double y) {
+    if (fabs(y) <= 4 && y == (int) y)
+        return fastPow(x, y);
+    if (!(x > 0) || !(fabs(y) < HUGE_VAL))
+        return ::pow(x, y);
+    return approxExp(y * approxLog(x));
+}
+
+template <class T> void Math::apply(int op, int p, const T *x, const T *y, T *out, int n) {
+    switch (op) {
+        case OP_ACOS: for (int i = 0; i < n; i++) out[i] = acos(x[i], p); break;
+        case OP_ASIN: for (int i = 0; i < n; i++) out[i] = asin(x[i], p); break;
+        case OP_ATAN: for (int i = 0; i < n; i++) out[i] = atan(x[i], p); break;
+        case OP_COS: for (int i = 0; i < n; i++) out[i] = cos(x[i], p); break;
+        case OP_EXP: for (int i = 0; i < n; i++) out[i] = exp(x[i], p); break;
+        case OP_LOG: for (int i = 0; i < n; i++) out[i] = log(x[i], p); break;
+        case OP_POWER: for (int i = 0; i < n; i++) out[i] = pow(x[i], y[i], p); break;
+        case OP_SIN: for (int i = 0; i < n; i++) out[i] = sin(x[i], p); break;
+        case OP_TAN: for (int i = 0; i < n; i++) out[i] = tan(x[i], p); break;
+    }
+}
+
+void Math::report(OutputStream *os) {
+    static const struct {
+        int op;
+        const char *name;
+        double lo, hi;
+        bool geometric;
+        bool integer;   // Integer exponents only
+    } cases[] = {
+        { OP_SIN, "sin", -10, 10, false, false },
+        { OP_COS, "cos", -10, 10, false, false },
+        { OP_TAN, "tan", -1.5, 1.5, false, false },
+        { OP_EXP, "exp", -50, 50, false, false },
+        { OP_LOG, "log", 1e-6, 1e6, true, false },
+        { OP_ASIN, "asin", -1, 1, false, false },
+        { OP_ACOS, "acos", -1, 1, false, false },
+        { OP_ATAN, "atan", -100, 100, false, false },
+        { OP_POWER, "pow", 1e-2, 1e2, true, false },
+        { OP_POWER, "pown", 1e-2, 1e2, true, true }
+    };
+    static const char *tiers[] = { "exact", "fast", "approx", "float" };
+    const int N = 100000;
+    std::vector<double> x(N), y(N), ref(N), res(N);
+    std::vector<float> xf(N), yf(N), resf(N);
+    std::vector<double> xr(N), yr(N), reff(N);
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    char buf[256];
+    // ULPs of float results are float ULPs, measured against the library's
+    // double results for the same, rounded, arguments
+    os->write("function  tier     max ulps  max rel err  ns/call");
+    os->newline();
+    for (int k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        for (int i = 0; i < N; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            double u = (seed >> 11) * (1.0 / 9007199254740992.0);
+            x[i] = cases[k].geometric ? cases[k].lo * ::pow(cases[k].hi / cases[k].lo, u) : cases[k].lo + (cases[k].hi - cases[k].lo) * u;
+            // Exponents from -6 to 6, or integers from -4 to 4, which are
+            // usually constants, so they change only every 1000 rows
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            u = (seed >> 11) * (1.0 / 9007199254740992.0);
+            if (!cases[k].integer)
+                y[i] = -6 + 12 * u;
+            else
+                y[i] = i % 1000 == 0 ? floor(9 * u) - 4 : y[i - 1];
+            xf[i] = (float) x[i];
+            yf[i] = (float) y[i];
+            xr[i] = xf[i];
+            yr[i] = yf[i];
+        }
+        apply(cases[k].op, PRECISION_EXACT, &x[0], &y[0], &ref[0], N);
+        apply(cases[k].op, PRECISION_EXACT, &xr[0], &yr[0], &reff[0], N);
+        for (int t = 0; t < 4; t++) {
+            double best = HUGE_VAL;
+            for (int rep = 0; rep < 5; rep++) {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                if (t == 3)
+                    apply(cases[k].op, PRECISION_EXACT, &xf[0], &yf[0], &resf[0], N);
+                else
+                    apply(cases[k].op, t, &x[0], &y[0], &res[0], N);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                double ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / N;
+                if (ns < best)
+                    best = ns;
+            }
+            double ulps = 0, rel = 0;
+            for (int i = 0; i < N; i++) {
+                double r = t == 3 ? reff[i] : ref[i];
+                double v = t == 3 ? resf[i] : res[i];
+                if (!isfinite(r) || r == 0 || v == r)
+                    continue;
+                double ulp = t == 3 ? nextafterf(fabsf((float) r), HUGE_VALF) - fabsf((float) r)
+                                    : nextafter(fabs(r), HUGE_VAL) - fabs(r);
+                double e = fabs(v - r);
+                if (e / ulp > ulps)
+                    ulps = e / ulp;
+                if (e / fabs(r) > rel)
+                    rel = e / fabs(r);
+            }
+            snprintf(buf, sizeof(buf), "%-9s %-7s %9.3g %12.2e %8.1f", cases[k].name, tiers[t], ulps, rel, best);
+            os->write(buf);
+            os->newline();
+        }
+    }
+}
+
+/////////////////////
+/////  Program  /////
+/////////////////////
+
+Program::Program(Evaluator *ev, std::vector<std::string> &params) : params(params) {
+    compile(ev);
+}
+
+Program::Program(Evaluator *ev) {
+    compile(ev);
+}
+
+size_t Program::bytes() {
+    size_t n = sizeof(Program) + code.capacity() * sizeof(Instr) + params.capacity() * sizeof(std::string);
+    for (int i = 0; i < params.size(); i++)
+        n += heapBytes(params[i]);
+    return n;
+}
+
+void Program::compile(Evaluator *ev) {
+    // Post-order walk with an explicit stack. 'next' is the index of the
+    // next operand to visit; for 'if', it counts the steps of emitting
+    // cond, jump-if-zero, ifTrue, jump, ifFalse.
+    struct Frame {
+        Evaluator *ev;
+        int next;
+        bool tail;
+        int patch;
+    };
+    std::vector<Frame> stack;
+    Frame root = { ev, 0, true, -1 };
+    stack.push_back(root);
+    int sp = 0;
+    maxStack = 0;
+    while (!stack.empty()) {
+        Frame &f = stack.back();
+        int op = f.ev->opcode();
+        Frame child = { NULL, 0, false, -1 };
+        Instr in = { op, 0, 0, f.ev };
+        if (op == OP_IF) {
+            switch (f.next++) {
+                case 0:
+                    child.ev = f.ev->operand(0);
+                    break;
+                case 1:
+                    in.op = OP_JUMPZERO;
+                    f.patch = code.size();
+                    code.push_back(in);
+                    sp--;
+                    child.ev = f.ev->operand(1);
+                    child.tail = f.tail;
+                    break;
+                case 2:
+                    in.op = OP_JUMP;
+                    code[f.patch].arg = code.size() + 1;
+                    f.patch = code.size();
+                    code.push_back(in);
+                    sp--;
+                    child.ev = f.ev->operand(2);
+                    child.tail = f.tail;
+                    break;
+                default:
+                    code[f.patch].arg = code.size();
+                    stack.pop_back();
+                    continue;
+            }
+            stack.push_back(child);
+            continue;
+        }
+        if (op == OP_CHEBYSHEV) {
+            // x, then the approximation, which either replaces x and
+            // jumps over the fallback, or drops x and falls through
+            switch (f.next++) {
+                case 0:
+                    child.ev = f.ev->operand(0);
+                    break;
+                case 1:
+                    f.patch = code.size();
+                    code.push_back(in);
+                    sp--;
+                    child.ev = f.ev->operand(1);
+                    child.tail = f.tail;
+                    break;
+                default:
+                    code[f.patch].arg = code.size();
+                    stack.pop_back();
+                    continue;
+            }
+            stack.push_back(child);
+            continue;
+        }
+        if (f.next < f.ev->arity()) {
+            child.ev = f.ev->operand(f.next++);
+            child.tail = f.tail && (op == OP_IDENTITY || op == OP_POSITIVE || op == OP_PROBE);
+            stack.push_back(child);
+            continue;
+        }
+        int n = f.ev->arity();
+        switch (op) {
+            case OP_IDENTITY:
+            case OP_POSITIVE:
+            case OP_PROBE:
+                // Nothing to do
+                stack.pop_back();
+                continue;
+            case OP_LITERAL:
+                in.value = ((Literal *) f.ev)->getValue();
+                break;
+            case OP_VARIABLE:
+                for (int i = 0; i < params.size(); i++)
+                    if (params[i] == ((Variable *) f.ev)->getName()) {
+                        in.op = OP_PARAM;
+                        in.arg = i;
+                        break;
+                    }
+                break;
+            case OP_CALL:
+                in.arg = f.tail;
+                break;
+            case OP_MAX:
+            case OP_MIN:
+            case OP_POLY:
+            case OP_INTEGRATE:
+            case OP_MINIMIZE:
+            case OP_RMAX:
+            case OP_RMIN:
+            case OP_RPROD:
+            case OP_RSUM:
+            case OP_SOLVE:
+                in.arg = n;
+                break;
+        }
+        code.push_back(in);
+        sp += 1 - n;
+        if (sp > maxStack)
+            maxStack = sp;
+        stack.pop_back();
+    }
+}
+
+double Program::run(Context *c, bool tail) {
+    // Function bodies recurse through here, so the frame is kept small;
+    // a deep recursion has to fit in the C++ stack.
+    double small[16];
+    std::vector<double> big;
+    double *stk = small;
+    if (maxStack > 16) {
+        big.resize(maxStack);
+        stk = &big[0];
+    }
+    double *slots[4];
+    std::vector<double *> moreSlots;
+    double **param = slots;
+    if (params.size() > 4) {
+        moreSlots.resize(params.size());
+        param = &moreSlots[0];
+    }
+    for (int i = 0; i < params.size(); i++)
+        if ((param[i] = c->parameter(params[i])) == NULL) {
+            c->error("missing parameter " + params[i]);
+            return 0;
+        }
+    int p = c->getPrecision();
+    int sp = 0;
+    int n = code.size();
+    for (int pc = 0; pc < n; pc++) {
+        Instr *in = &code[pc];
+        switch (in->op) {
+            case OP_LITERAL: stk[sp++] = in->value; break;
+            case OP_PARAM: stk[sp++] = *param[in->arg]; break;
+            case OP_VARIABLE:
+            case OP_FORK:
+                stk[sp++] = in->ev->eval(c);
+                break;
+            case OP_ABS: stk[sp - 1] = fabs(stk[sp - 1]); break;
+            case OP_ACOS: stk[sp - 1] = Math::acos(stk[sp - 1], p); break;
+            case OP_ASIN: stk[sp - 1] = Math::asin(stk[sp - 1], p); break;
+            case OP_ATAN: stk[sp - 1] = Math::atan(stk[sp - 1], p); break;
+            case OP_COS: stk[sp - 1] = Math::cos(stk[sp - 1], p); break;
+            case OP_EXP: stk[sp - 1] = Math::exp(stk[sp - 1], p); break;
+            case OP_LOG: stk[sp - 1] = Math::log(stk[sp - 1], p); break;
+            case OP_NEGATIVE: stk[sp - 1] = -stk[sp - 1]; break;
+            case OP_SIN: stk[sp - 1] = Math::sin(stk[sp - 1], p); break;
+            case OP_SQRT: stk[sp - 1] = sqrt(stk[sp - 1]); break;
+            case OP_TAN: stk[sp - 1] = Math::tan(stk[sp - 1], p); break;
+            case OP_DIFFERENCE: sp--; stk[sp - 1] -= stk[sp]; break;
+            case OP_POWER: sp--; stk[sp - 1] = Math::pow(stk[sp - 1], stk[sp], p); break;
+            case OP_PRODUCT: sp--; stk[sp - 1] *= stk[sp]; break;
+            case OP_QUOTIENT: sp--; stk[sp - 1] /= stk[sp]; break;
+            case OP_SUM: sp--; stk[sp - 1] += stk[sp]; break;
+            case OP_MAX: {
+                double res = -DBL_MAX;
+                for (int i = sp - in->arg; i < sp; i++)
+                    if (stk[i] > res)
+                        res = stk[i];
+                sp -= in->arg;
+                stk[sp++] = res;
+                break;
+            }
+            case OP_MIN: {
+                double res = DBL_MAX;
+                for (int i = sp - in->arg; i < sp; i++)
+                    if (stk[i] < res)
+                        res = stk[i];
+                sp -= in->arg;
+                stk[sp++] = res;
+                break;
+            }
+            case OP_POLY:
+                sp -= in->arg;
+                stk[sp] = Polynomial::evaluate(stk[sp], stk + sp + 1, in->arg - 1);
+                sp++;
+                break;
+            case OP_CALL: {
+                if (c->failed())
+                    return 0;
+                int nargs = in->ev->arity();
+                sp -= nargs;
+                if (in->arg && tail)
+                    return ((Call *) in->ev)->invoke(c, stk + sp, true);
+                stk[sp] = ((Call *) in->ev)->invoke(c, stk + sp, false);
+                sp++;
+                break;
+            }
+            case OP_INTEGRATE:
+            case OP_MINIMIZE:
+            case OP_RMAX:
+            case OP_RMIN:
+            case OP_RPROD:
+            case OP_RSUM:
+            case OP_SOLVE:
+                if (c->failed())
+                    return 0;
+                sp -= in->arg;
+                stk[sp] = ((Numeric *) in->ev)->compute(c, stk + sp);
+                sp++;
+                break;
+            case OP_WINDOW:
+                stk[sp - 1] = ((Window *) in->ev)->update(stk[sp - 1]);
+                break;
+            case OP_JUMPZERO:
+                if (stk[--sp] == 0)
+                    pc = in->arg - 1;
+                break;
+            case OP_CHEBYSHEV: {
+                Chebyshev *ch = (Chebyshev *) in->ev;
+                if (ch->covers(stk[sp - 1])) {
+                    stk[sp - 1] = ch->evaluate(stk[sp - 1]);
+                    pc = in->arg - 1;
+                } else
+                    sp--;
+                break;
+            }
+            case OP_JUMP:
+                pc = in->arg - 1;
+                break;
+        }
+    }
+    return stk[0];
+}
+
+int Program::depth(Evaluator *ev) {
+    std::vector<std::pair<Evaluator *, int> > stack;
+    stack.push_back(std::make_pair(ev, 1));
+    int max = 0;
+    while (!stack.empty()) {
+        Evaluator *e = stack.back().first;
+        int d = stack.back().second;
+        stack.pop_back();
+        if (d > max)
+            max = d;
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(std::make_pair(e->operand(i), d + 1));
+    }
+    return max;
+}
+
+/////////////////////////
+/////  TileProgram  /////
+/////////////////////////
+
+TileProgram::TileProgram(Evaluator *ev, std::vector<std::string> &inputs, Context *c, bool exact, Function *f) : inputs(inputs), used(inputs.size()), function(f), conditional(0), sp(0), maxStack(0) {
+    if (Program::depth(ev) > Program::DEEP_TREE)
+        fallback(ev, c);
+    else
+        compile(ev, c);
+    refs.clear();
+    single = c->useFloatBatches() && !exact;
+    if (single) {
+        scratchF.resize(maxStack * TILE);
+        curF.resize(maxStack);
+        inF.resize(inputs.size() * TILE);
+        outF.resize(TILE);
+        inPtrF.resize(inputs.size());
+        for (int i = 0; i < code.size(); i++)
+            code[i]->fillF.assign(code[i]->fill.begin(), code[i]->fill.end());
+    } else {
+        scratch.resize(maxStack * TILE);
+        cur.resize(maxStack);
+    }
+}
+
+TileProgram::~TileProgram() {
+    for (int i = 0; i < code.size(); i++) {
+        delete code[i]->program;
+        delete code[i];
+    }
+}
+
+void TileProgram::emit(Op *op, int pops, int pushes) {
+    code.push_back(op);
+    sp += pushes - pops;
+    if (sp > maxStack)
+        maxStack = sp;
+}
+
+// Where the value of a name comes from: a stack slot (>= 0) holding an
+// inlined parameter, an input (-1 - index), or the globals (INT_MIN)
+int TileProgram::source(std::string name) {
+    for (int i = scopes.size() - 1; i >= 0; i--) {
+        Scope &s = scopes[i];
+        for (int j = 0; j < s.names.size(); j++)
+            if (s.names[j] == name)
+                return s.slots[j];
+    }
+    for (int i = 0; i < inputs.size(); i++)
+        if (inputs[i] == name)
+            return -1 - i;
+    return INT_MIN;
+}
+
+// An op that evaluates ev one row at a time
+TileProgram::Op *TileProgram::rowwise(Evaluator *ev, Context *c) {
+    Op *op = new Op;
+    op->op = OP_FALLBACK;
+    op->arg = 0;
+    op->ev = ev;
+    op->program = Program::depth(ev) > Program::DEEP_TREE ? new Program(ev) : NULL;
+
+    // The names ev may refer to, directly or in the bodies of the functions
+    // it calls, since those see their callers' parameters
+    std::vector<std::string> &refs = references(ev, c).names;
+
+    // Everything in scope that it refers to is passed on in one parameter
+    // frame
+    for (int i = scopes.size() - 1; i >= -1; i--) {
+        std::vector<std::string> &names = i >= 0 ? scopes[i].names : inputs;
+        for (int j = 0; j < names.size(); j++) {
+            if (std::find(refs.begin(), refs.end(), names[j]) == refs.end()
+                    || std::find(op->names.begin(), op->names.end(), names[j]) != op->names.end())
+                continue;
+            int src = source(names[j]);
+            op->names.push_back(names[j]);
+            op->sources.push_back(src);
+            if (src < 0)
+                used[-1 - src] = true;
+        }
+    }
+    return op;
+}
+
+void TileProgram::fallback(Evaluator *ev, Context *c) {
+    emit(rowwise(ev, c), 0, 1);
+}
+
+// The Refs of ev, worked out for all of its nodes at once, the first time
+// it or a tree it is part of is looked at, so that compiling, which looks
+// at every node, takes time in proportion to the size of the tree. The
+// bodies of the functions called are looked at once each.
+TileProgram::Refs &TileProgram::references(Evaluator *ev, Context *c) {
+    std::map<Evaluator *, Refs>::iterator it = refs.find(ev);
+    if (it != refs.end())
+        return it->second;
+    std::map<Function *, std::vector<std::string> > bodies;
+    std::vector<std::pair<Evaluator *, bool> > stack;
+    stack.push_back(std::make_pair(ev, false));
+    while (!stack.empty()) {
+        Evaluator *e = stack.back().first;
+        bool visited = stack.back().second;
+        Evaluator *node = e->opcode() == OP_FORK ? ((Fork *) e)->getOperand() : e;
+        if (!visited) {
+            stack.back().second = true;
+            for (int i = 0; i < node->arity(); i++)
+                if (refs.find(node->operand(i)) == refs.end())
+                    stack.push_back(std::make_pair(node->operand(i), false));
+            if (node != e && refs.find(node) == refs.end())
+                stack.push_back(std::make_pair(node, false));
+            continue;
+        }
+        stack.pop_back();
+        Refs &r = refs[e];
+        r.calls = false;
+        std::vector<Evaluator *> parts;
+        if (node != e)
+            parts.push_back(node);
+        else
+            for (int i = 0; i < node->arity(); i++)
+                parts.push_back(node->operand(i));
+        for (int i = 0; i < parts.size(); i++) {
+            Refs &p = refs[parts[i]];
+            r.calls |= p.calls;
+            for (int j = 0; j < p.names.size(); j++)
+                if (std::find(r.names.begin(), r.names.end(), p.names[j]) == r.names.end())
+                    r.names.push_back(p.names[j]);
+        }
+        if (node != e)
+            continue;
+        int op = e->opcode();
+        std::vector<std::string> more;
+        if (op == OP_VARIABLE)
+            more.push_back(((Variable *) e)->getName());
+        else if (op == OP_CALL || isNumeric(op)) {
+            r.calls = true;
+            Function *f = c->getFunction(op == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName());
+            if (f != NULL) {
+                std::map<Function *, std::vector<std::string> >::iterator b = bodies.find(f);
+                if (b == bodies.end()) {
+                    b = bodies.insert(std::make_pair(f, std::vector<std::string>())).first;
+                    Optimizer::references(f->body(), c, &b->second);
+                }
+                more = b->second;
+            }
+        }
+        for (int j = 0; j < more.size(); j++)
+            if (std::find(r.names.begin(), r.names.end(), more[j]) == r.names.end())
+                r.names.push_back(more[j]);
+    }
+    return refs[ev];
+}
+
+// Evaluates ev in advance, if its value is the same for every row. In the
+// branches of an If, only if it calls no functions: those might fail, or
+// never finish, for the rows where the branch is not taken.
+bool TileProgram::hoist(Evaluator *ev, Context *c) {
+    Refs &r = references(ev, c);
+    if (conditional > 0 && r.calls)
+        return false;
+    std::vector<std::string> &refs = r.names;
+    std::vector<std::string> names;
+    std::vector<double> values;
+    for (int i = 0; i < refs.size(); i++) {
+        int src = source(refs[i]);
+        if (src == INT_MIN)
+            continue;
+        std::map<int, double>::iterator it = constants.find(src);
+        if (it == constants.end())
+            return false;
+        names.push_back(refs[i]);
+        values.push_back(it->second);
+    }
+    double value = 0;
+    if (c->push(names, values)) {
+        if (Program::depth(ev) > Program::DEEP_TREE) {
+            Program p(ev);
+            value = p.eval(c);
+        } else
+            value = ev->eval(c);
+        c->pop();
+    }
+    if (c->failed()) {
+        // Reported when the program is run
+        hoistError = c->errorMessage();
+        c->clearError();
+    }
+    Op *o = new Op;
+    o->op = OP_LITERAL;
+    o->ev = NULL;
+    o->program = NULL;
+    o->fill.resize(TILE, value);
+    emit(o, 0, 1);
+    return true;
+}
+
+void TileProgram::compile(Evaluator *ev, Context *c) {
+    int op = ev->opcode();
+    if (c->useHoisting() && op != OP_LITERAL && op != OP_VARIABLE && !Optimizer::stateful(ev, c) && hoist(ev, c))
+        return;
+    switch (op) {
+        case OP_IDENTITY:
+        case OP_POSITIVE:
+        case OP_PROBE:
+            compile(ev->operand(0), c);
+            return;
+        case OP_LITERAL:
+        case OP_VARIABLE: {
+            Op *o = new Op;
+            o->op = OP_LITERAL;
+            o->ev = NULL;
+            o->program = NULL;
+            int src = op == OP_VARIABLE ? source(((Variable *) ev)->getName()) : INT_MIN;
+            if (src != INT_MIN) {
+                o->op = OP_VARIABLE;
+                o->arg = src;
+                if (src < 0)
+                    used[-1 - src] = true;
+            } else
+                o->fill.resize(TILE, op == OP_LITERAL ? ((Literal *) ev)->getValue() : c->getVariable(((Variable *) ev)->getName()));
+            emit(o, 0, 1);
+            return;
+        }
+        case OP_IF: {
+            // Both branches are evaluated for every row, which is only
+            // acceptable if neither has to fall back on row-by-row
+            // evaluation, or has a Window; otherwise the branch not taken
+            // might recurse forever, or move a window along.
+            int start = code.size();
+            int sp0 = sp;
+            compile(ev->operand(0), c);
+            conditional++;
+            for (int i = 1; i < 3; i++)
+                compile(ev->operand(i), c);
+            conditional--;
+            bool ok = true;
+            for (int i = start; i < code.size(); i++)
+                ok &= code[i]->op != OP_FALLBACK && code[i]->op != OP_CHEBYSHEV && code[i]->op != OP_WINDOW;
+            if (!ok) {
+                for (int i = start; i < code.size(); i++) {
+                    delete code[i]->program;
+                    delete code[i];
+                }
+                code.resize(start);
+                sp = sp0;
+                fallback(ev, c);
+                return;
+            }
+            break;
+        }
+        case OP_CALL: {
+            Function *f = c->getFunction(((Call *) ev)->getName());
+            if (f == NULL || f->arity() != ev->arity()
+                    || std::find(active.begin(), active.end(), f) != active.end()) {
+                fallback(ev, c);
+                return;
+            }
+            int base = sp;
+            for (int i = 0; i < ev->arity(); i++) {
+                compile(ev->operand(i), c);
+                if (code.back()->op == OP_LITERAL)
+                    constants[base + i] = code.back()->fill[0];
+            }
+            Scope s;
+            s.names = f->params();
+            for (int i = 0; i < ev->arity(); i++)
+                s.slots.push_back(base + i);
+            scopes.push_back(s);
+            active.push_back(f);
+            compile(f->body(), c);
+            active.pop_back();
+            scopes.pop_back();
+            constants.erase(constants.lower_bound(base), constants.end());
+            Op *o = new Op;
+            o->op = OP_COLLAPSE;
+            o->arg = ev->arity();
+            o->ev = NULL;
+            o->program = NULL;
+            emit(o, ev->arity() + 1, 1);
+            return;
+        }
+        case OP_FORK:
+        case OP_INTEGRATE:
+        case OP_MINIMIZE:
+        case OP_RMAX:
+        case OP_RMIN:
+        case OP_RPROD:
+        case OP_RSUM:
+        case OP_SOLVE:
+            fallback(ev, c);
+            return;
+        case OP_CHEBYSHEV: {
+            // The fallback is evaluated for the rows out of range only
+            compile(ev->operand(0), c);
+            Op *o = rowwise(ev->operand(1), c);
+            o->op = OP_CHEBYSHEV;
+            o->arg = 1;
+            o->ev = ev;
+            emit(o, 1, 1);
+            return;
+        }
+        case OP_WINDOW: {
+            compile(ev->operand(0), c);
+            Op *o = new Op;
+            o->op = OP_WINDOW;
+            o->arg = 1;
+            o->ev = ev;
+            o->program = NULL;
+            emit(o, 1, 1);
+            return;
+        }
+        default:
+            for (int i = 0; i < ev->arity(); i++)
+                compile(ev->operand(i), c);
+            break;
+    }
+    Op *o = new Op;
+    o->op = op;
+    o->arg = ev->arity();
+    o->ev = NULL;
+    o->program = NULL;
+    emit(o, o->arg, 1);
+}
+
+bool TileProgram::run(Context *c, const double **in, int n, double *out) {
+    if (!hoistError.empty()) {
+        c->error(hoistError);
+        return false;
+    }
+    if (!c->charge((long long) n * code.size(), function))
+        return false;
+    if (!single)
+        return execute(c, in, n, out, &scratch[0], &cur[0]);
+    for (int i = 0; i < inputs.size(); i++) {
+        if (!used[i])
+            continue;
+        float *f = &inF[i * TILE];
+        for (int j = 0; j < n; j++)
+            f[j] = in[i][j];
+        inPtrF[i] = f;
+    }
+    if (!execute(c, inPtrF.data(), n, &outF[0], &scratchF[0], &curF[0]))
+        return false;
+    for (int i = 0; i < n; i++)
+        out[i] = outF[i];
+    return true;
+}
+
+// Evaluates ev for row i, with the names op passes on
+template <class T> bool TileProgram::row(Context *c, Op *op, Evaluator *ev, const T **in, T **cur, int i, std::vector<double> &values, double *res) {
+    values.resize(op->names.size());
+    for (int j = 0; j < values.size(); j++) {
+        int src = op->sources[j];
+        values[j] = src >= 0 ? cur[src][i] : in[-1 - src][i];
+    }
+    if (!c->push(op->names, values))
+        return false;
+    *res = op->program != NULL ? op->program->eval(c) : ev->eval(c);
+    c->pop();
+    return !c->failed();
+}
+
+template <class T> bool TileProgram::execute(Context *c, const T **in, int n, T *out, T *scr, T **cur) {
+    T *scrEnd = scr + maxStack * TILE;
+    int p = c->getPrecision();
+    int sp = 0;
+    for (int k = 0; k < code.size(); k++) {
+        Op *op = code[k];
+        T *d;
+        switch (op->op) {
+            case OP_LITERAL:
+                cur[sp++] = literal(op, (T *) NULL);
+                continue;
+            case OP_VARIABLE:
+                // Inputs and parameters are used where they are
+                cur[sp++] = op->arg >= 0 ? cur[op->arg] : (T *) in[-1 - op->arg];
+                continue;
+            case OP_COLLAPSE: {
+                // Replace the arguments of an inlined call by its result
+                T *res = cur[sp - 1];
+                sp -= op->arg;
+                d = scr + (sp - 1) * TILE;
+                if (res >= scr && res < scrEnd && res != d)
+                    memcpy(d, res, n * sizeof(T));
+                else if (res != d)
+                    d = res;
+                cur[sp - 1] = d;
+                continue;
+            }
+            case OP_FALLBACK: {
+                d = scr + sp * TILE;
+                std::vector<double> values;
+                for (int i = 0; i < n; i++) {
+                    double res;
+                    if (!row(c, op, op->ev, in, cur, i, values, &res))
+                        return false;
+                    d[i] = res;
+                }
+                cur[sp++] = d;
+                continue;
+            }
+            case OP_CHEBYSHEV: {
+                Chebyshev *ch = (Chebyshev *) op->ev;
+                T *x = cur[sp - 1];
+                d = scr + (sp - 1) * TILE;
+                std::vector<double> values;
+                for (int i = 0; i < n; i++) {
+                    double v = x[i];
+                    if (ch->covers(v))
+                        d[i] = ch->evaluate(v);
+                    else if (!row(c, op, ch->operand(1), in, cur, i, values, &v))
+                        return false;
+                    else
+                        d[i] = v;
+                }
+                cur[sp - 1] = d;
+                continue;
+            }
+            case OP_WINDOW: {
+                // Row by row, in order, since every row is a tick
+                Window *w = (Window *) op->ev;
+                T *x = cur[sp - 1];
+                d = scr + (sp - 1) * TILE;
+                for (int i = 0; i < n; i++)
+                    d[i] = w->update(x[i]);
+                cur[sp - 1] = d;
+                continue;
+            }
+        }
+        int a = op->arg;
+        d = scr + (sp - a) * TILE;
+        T *x = cur[sp - a];
+        T *y = a > 1 ? cur[sp - a + 1] : NULL;
+        switch (op->op) {
+            case OP_ABS: for (int i = 0; i < n; i++) d[i] = fabs(x[i]); break;
+            case OP_ACOS:
+            case OP_ASIN:
+            case OP_ATAN:
+            case OP_COS:
+            case OP_EXP:
+            case OP_LOG:
+            case OP_POWER:
+            case OP_SIN:
+            case OP_TAN:
+                Math::apply(op->op, p, (const T *) x, (const T *) y, d, n);
+                break;
+            case OP_NEGATIVE: for (int i = 0; i < n; i++) d[i] = -x[i]; break;
+            case OP_SQRT: for (int i = 0; i < n; i++) d[i] = sqrt(x[i]); break;
+            case OP_DIFFERENCE: for (int i = 0; i < n; i++) d[i] = x[i] - y[i]; break;
+            case OP_PRODUCT: for (int i = 0; i < n; i++) d[i] = x[i] * y[i]; break;
+            case OP_QUOTIENT: for (int i = 0; i < n; i++) d[i] = x[i] / y[i]; break;
+            case OP_SUM: for (int i = 0; i < n; i++) d[i] = x[i] + y[i]; break;
+            case OP_IF: {
+                T *z = cur[sp - 1];
+                for (int i = 0; i < n; i++)
+                    d[i] = x[i] != 0 ? y[i] : z[i];
+                break;
+            }
+            case OP_POLY: {
+                double cs[64];
+                std::vector<double> more;
+                double *coef = cs;
+                if (a > 64) {
+                    more.resize(a);
+                    coef = &more[0];
+                }
+                for (int i = 0; i < n; i++) {
+                    for (int j = 1; j < a; j++)
+                        coef[j - 1] = cur[sp - a + j][i];
+                    d[i] = Polynomial::evaluate(x[i], coef, a - 1);
+                }
+                break;
+            }
+            case OP_MAX:
+            case OP_MIN: {
+                bool max = op->op == OP_MAX;
+                for (int i = 0; i < n; i++) {
+                    double res = max ? -DBL_MAX : DBL_MAX;
+                    for (int j = sp - a; j < sp; j++) {
+                        double v = cur[j][i];
+                        if (max ? v > res : v < res)
+                            res = v;
+                    }
+                    d[i] = res;
+                }
+                break;
+            }
+        }
+        sp -= a;
+        cur[sp++] = d;
+    }
+    memcpy(out, cur[0], n * sizeof(T));
+    return true;
+}
+
+////////////////////
+/////  Column  /////
+////////////////////
+
+Column::~Column() {
+    if (size > 0)
+        munmap(map, size);
+}
+
+Column *Column::open(std::string file, std::string *error) {
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd == -1) {
+        *error = "Can't open " + file;
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if (size % sizeof(double) != 0) {
+        close(fd);
+        *error = file + " is not a column of doubles";
+        return NULL;
+    }
+    void *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            *error = "Can't map " + file;
+            return NULL;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return new Column(map, size, file);
+}
+
+///////////////////////
+/////  ColumnSet  /////
+///////////////////////
+
+ColumnSet::~ColumnSet() {
+    for (std::map<std::string, Column *>::iterator it = columns.begin(); it != columns.end(); it++)
+        delete it->second;
+}
+
+bool ColumnSet::bind(std::string name, std::string file, std::string *error) {
+    Column *col = Column::open(file, error);
+    if (col == NULL)
+        return false;
+    unbind(name);
+    columns[name] = col;
+    return true;
+}
+
+void ColumnSet::unbind(std::string name) {
+    std::map<std::string, Column *>::iterator it = columns.find(name);
+    if (it != columns.end()) {
+        delete it->second;
+        columns.erase(it);
+    }
+}
+
+std::vector<std::string> ColumnSet::names() {
+    std::vector<std::string> names;
+    for (std::map<std::string, Column *>::iterator it = columns.begin(); it != columns.end(); it++)
+        names.push_back(it->first);
+    return names;
+}
+
+Evaluator *ColumnSet::expand(Evaluator *ev, Context *c, std::string *error) {
+    if (ev->opcode() != OP_VARIABLE)
+        return ev;
+    std::string name = ((Variable *) ev)->getName();
+    Function *f = c->getFunction(name);
+    if (f == NULL || columns.find(name) != columns.end())
+        return ev;
+    std::vector<Evaluator *> *args = new std::vector<Evaluator *>;
+    for (int i = 0; i < f->arity(); i++) {
+        std::string param = name + "(" + f->params()[i] + ")";
+        if (columns.find(param) == columns.end()) {
+            *error = param + " is not bound";
+            for (int j = 0; j < args->size(); j++)
+                delete (*args)[j];
+            delete args;
+            delete ev;
+            return NULL;
+        }
+        args->push_back(new Variable(ev->pos(), param));
+    }
+    Evaluator *call = new Call(ev->pos(), name, args);
+    delete ev;
+    return call;
+}
+
+long ColumnSet::rows(TileProgram *tp, std::string *error) {
+    long rows = -1;
+    bool any = false;
+    int i = 0;
+    for (std::map<std::string, Column *>::iterator it = columns.begin(); it != columns.end(); it++)
+        any |= tp->uses(i++);
+    i = 0;
+    for (std::map<std::string, Column *>::iterator it = columns.begin(); it != columns.end(); it++) {
+        if (any && !tp->uses(i++))
+            continue;
+        if (rows != -1 && it->second->rows() != rows) {
+            *error = "Bound columns differ in length";
+            return -1;
+        }
+        rows = it->second->rows();
+    }
+    if (rows == -1)
+        *error = "No columns bound";
+    return rows;
+}
+
+bool ColumnSet::run(Context *c, TileProgram *tp, long first, long n, double *out) {
+    std::vector<const double *> in(columns.size());
+    for (long r = 0; r < n; r += TileProgram::TILE) {
+        int m = n - r < TileProgram::TILE ? n - r : TileProgram::TILE;
+        int i = 0;
+        for (std::map<std::string, Column *>::iterator it = columns.begin(); it != columns.end(); it++, i++)
+            in[i] = tp->uses(i) ? it->second->data() + first + r : NULL;
+        if (!tp->run(c, in.empty() ? NULL : &in[0], m, out + r))
+            return false;
+    }
+    return true;
+}
+
+long ColumnSet::evaluate(Context *c, Evaluator *ev, std::string file, std::string *error) {
+    std::vector<std::string> names = this->names();
+    TileProgram tp(ev, names, c);
+    long rows = this->rows(&tp, error);
+    if (rows == -1)
+        return -1;
+
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        *error = "Can't create " + file;
+        return -1;
+    }
+    size_t size = rows * sizeof(double);
+    double *out = NULL;
+    if (size > 0) {
+        if (ftruncate(fd, size) == -1
+                || (out = (double *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            *error = "Can't map " + file;
+            return -1;
+        }
+    }
+    close(fd);
+
+    bool ok = run(c, &tp, 0, rows, out);
+    if (size > 0)
+        munmap(out, size);
+    if (!ok) {
+        *error = "Error: " + c->errorMessage();
+        c->clearError();
+        return -1;
+    }
+    return rows;
+}
+
+////////////////////////
+/////  MonteCarlo  /////
+////////////////////////
+
+static inline void philox(uint32_t *ctr, uint32_t k0, uint32_t k1) {
+    for (int r = 0; r < 10; r++) {
+        if (r > 0) {
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        uint64_t p0 = (uint64_t) 0xD2511F53 * ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57 * ctr[2];
+        uint32_t c1 = ctr[1], c3 = ctr[3];
+        ctr[0] = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        ctr[1] = (uint32_t) p1;
+        ctr[2] = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        ctr[3] = (uint32_t) p0;
+    }
+}
+
+// Argument j of samples first, ..., first + n - 1 (n at most a tile). Each
+// sample takes one block of the generator, which gives two uniform
+// deviates in [0, 1); they are all generated first, in a loop the
+// compiler can vectorize, and then transformed.
+static void draw(MonteCarlo::Distribution &d, uint64_t seed, long long first, int j, int n, double *out) {
+    if (d.kind == MonteCarlo::CONSTANT) {
+        for (int i = 0; i < n; i++)
+            out[i] = d.p;
+        return;
+    }
+    const double scale = 1.0 / 9007199254740992.0;
+    double v[TileProgram::TILE];
+    for (int i = 0; i < n; i++) {
+        uint64_t k = first + i;
+        uint32_t ctr[4] = { (uint32_t) k, (uint32_t) (k >> 32), (uint32_t) j, 0 };
+        philox(ctr, (uint32_t) seed, (uint32_t) (seed >> 32));
+        out[i] = (((uint64_t) ctr[0] << 32 | ctr[1]) >> 11) * scale;
+        v[i] = (((uint64_t) ctr[2] << 32 | ctr[3]) >> 11) * scale;
+    }
+    switch (d.kind) {
+        case MonteCarlo::UNIFORM:
+            for (int i = 0; i < n; i++)
+                out[i] = d.p + (d.q - d.p) * out[i];
+            break;
+        case MonteCarlo::NORMAL:
+            // Box-Muller, one of the pair
+            for (int i = 0; i < n; i++)
+                out[i] = d.p + d.q * sqrt(-2 * log(1 - out[i])) * cos(2 * M_PI * v[i]);
+            break;
+        default:
+            for (int i = 0; i < n; i++)
+                out[i] = -log(1 - out[i]) / d.p;
+            break;
+    }
+}
+
+// The count, mean, and sum of squared deviations of a set of samples
+struct Moments {
+    double n, mean, m2;
+};
+
+// Chan et al.'s update, for the union of two sets
+static Moments merge(const Moments &a, const Moments &b) {
+    Moments r;
+    r.n = a.n + b.n;
+    double delta = b.mean - a.mean;
+    r.mean = a.mean + delta * (b.n / r.n);
+    r.m2 = a.m2 + b.m2 + delta * delta * (a.n * b.n / r.n);
+    return r;
+}
+
+static Moments mergeAll(const Moments *v, int n) {
+    if (n == 1)
+        return v[0];
+    int h = n / 2;
+    return merge(mergeAll(v, h), mergeAll(v + h, n - h));
+}
+
+// Samples first, ..., first + n - 1, a tile at a time, with the moments of
+// each tile computed in two passes, and the tiles merged pairwise
+static bool simulate(Sampler &s, Context *c, std::vector<MonteCarlo::Distribution> &dists, uint64_t seed, long long first, long long n, Moments *res) {
+    int k = dists.size();
+    std::vector<double> cols(k * TileProgram::TILE);
+    std::vector<const double *> in(k);
+    double y[TileProgram::TILE];
+    Moments partial[MonteCarlo::SUPERBLOCK];
+    int tiles = 0;
+    for (long long t = 0; t < n; t += TileProgram::TILE) {
+        int m = n - t < TileProgram::TILE ? n - t : TileProgram::TILE;
+        for (int j = 0; j < k; j++) {
+            draw(dists[j], seed, first + t, j, m, &cols[j * TileProgram::TILE]);
+            in[j] = &cols[j * TileProgram::TILE];
+        }
+        if (!s.eval(c, in.empty() ? NULL : &in[0], m, y))
+            return false;
+        double sum = 0;
+        for (int i = 0; i < m; i++)
+            sum += y[i];
+        Moments &p = partial[tiles++];
+        p.n = m;
+        p.mean = sum / m;
+        p.m2 = 0;
+        for (int i = 0; i < m; i++)
+            p.m2 += (y[i] - p.mean) * (y[i] - p.mean);
+    }
+    *res = mergeAll(partial, tiles);
+    return true;
+}
+
+// Takes the next superblock until there are none left, or an error occurs,
+// which stops the other threads too
+static bool simulateAll(Sampler &s, Context *c, std::vector<MonteCarlo::Distribution> &dists, uint64_t seed, long long count, std::atomic<long long> &next, std::vector<Moments> &partials) {
+    long long size = (long long) MonteCarlo::SUPERBLOCK * TileProgram::TILE;
+    while (true) {
+        long long i = next++;
+        if (i >= (long long) partials.size())
+            return true;
+        long long first = i * size;
+        if (!simulate(s, c, dists, seed, first, count - first < size ? count - first : size, &partials[i])) {
+            next = partials.size();
+            return false;
+        }
+    }
+}
+
+class SimulateTask : public TaskPool::Task {
+
+    public:
+
+    Context context;
+    Sampler sampler;
+    std::vector<MonteCarlo::Distribution> *dists;
+    uint64_t seed;
+    long long count;
+    std::atomic<long long> *next;
+    std::vector<Moments> *partials;
+    bool ok;
+
+    SimulateTask(Function *f, Context *parent, std::vector<MonteCarlo::Distribution> *dists, uint64_t seed, long long count, std::atomic<long long> *next, std::vector<Moments> *partials)
+        : context(parent), sampler(f, &context), dists(dists), seed(seed), count(count), next(next), partials(partials), ok(true) {}
+    void run() { ok = simulateAll(sampler, &context, *dists, seed, count, *next, *partials); }
+};
+
+bool MonteCarlo::run(Function *f, long long n, std::vector<Distribution> &dists, uint64_t seed, Context *c, Estimate *res) {
+    long long size = (long long) SUPERBLOCK * TileProgram::TILE;
+    std::vector<Moments> partials((n + size - 1) / size);
+    std::atomic<long long> next(0);
+    Sampler s(f, c);
+    TaskPool *pool = c->getPool();
+    std::vector<SimulateTask *> tasks;
+    for (int i = 0; pool != NULL && i < pool->size() && i < (long long) partials.size() - 1; i++) {
+        tasks.push_back(new SimulateTask(f, c, &dists, seed, n, &next, &partials));
+        pool->submit(tasks.back());
+    }
+    bool ok = simulateAll(s, c, dists, seed, n, next, partials);
+    for (int i = 0; i < tasks.size(); i++) {
+        pool->wait(tasks[i]);
+        if (!c->join(&tasks[i]->context))
+            ok = false;
+        if (ok && !tasks[i]->ok) {
+            c->error(tasks[i]->context.errorMessage());
+            ok = false;
+        }
+        delete tasks[i];
+    }
+    if (!ok)
+        return false;
+    Moments m = mergeAll(&partials[0], partials.size());
+    res->mean = m.mean;
+    res->variance = m.n > 1 ? m.m2 / (m.n - 1) : 0;
+    res->error = sqrt(res->variance / m.n);
+    return true;
+}
+
+//////////////////////
+/////  Profiler  /////
+//////////////////////
+
+Evaluator *Profiler::instrument(Evaluator *ev) {
+    if (ev->opcode() == OP_PROBE)
+        return ev;
+    ev = new Probe(ev, true);
+    std::vector<Evaluator *> work;
+    work.push_back(ev);
+    while (!work.empty()) {
+        // Every node on the work list is a Probe; wrap the operands of the
+        // node inside it.
+        Evaluator *node = work.back()->operand(0);
+        work.pop_back();
+        for (int i = 0; i < node->arity(); i++) {
+            Evaluator *p = new Probe(node->operand(i));
+            node->setOperand(i, p);
+            work.push_back(p);
+        }
+    }
+    return ev;
+}
+
+Evaluator *Profiler::strip(Evaluator *ev) {
+    while (ev->opcode() == OP_PROBE) {
+        Evaluator *p = ev;
+        ev = p->operand(0);
+        p->setOperand(0, NULL);
+        delete p;
+    }
+    std::vector<Evaluator *> work;
+    work.push_back(ev);
+    while (!work.empty()) {
+        Evaluator *node = work.back();
+        work.pop_back();
+        for (int i = 0; i < node->arity(); i++) {
+            Evaluator *e = node->operand(i);
+            while (e->opcode() == OP_PROBE) {
+                Evaluator *p = e;
+                e = p->operand(0);
+                p->setOperand(0, NULL);
+                delete p;
+            }
+            node->setOperand(i, e);
+            work.push_back(e);
+        }
+    }
+    return ev;
+}
+
+static std::string label(Evaluator *ev) {
+    static const char *names[] = {
+        "abs", "acos", "asin", "atan", "call", "cos", "-",
+        "exp", "()", "if", "literal", "log", "max", "min",
+        "neg", "+", "^", "*", "/", "sin",
+        "sqrt", "+", "tan", "variable", "fork", "probe",
+        "poly", "chebyshev", "window", "integrate", "minimize", "rmax", "rmin",
+        "prod", "sum", "solve"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == OP_JUMP, "a name for every opcode in trees");
+    int op = ev->opcode();
+    if (op == OP_CALL)
+        return ((Call *) ev)->getName() + "()";
+    if (isNumeric(op))
+        return std::string(names[op]) + "(" + ((Numeric *) ev)->getName() + ")";
+    if (op == OP_WINDOW)
+        return Window::keyword(((Window *) ev)->getKind());
+    if (op == OP_VARIABLE)
+        return ((Variable *) ev)->getName();
+    if (op == OP_LITERAL) {
+        StringOutputStream sos;
+        sos.write(((Literal *) ev)->getValue());
+        return sos.str();
+    }
+    return names[op];
+}
+
+// Time spent in a probed node itself, i.e. excluding the probed nodes
+// below, and the bodies of the functions it calls
+static long selfTicks(Probe *p) {
+    Evaluator *node = p->operand(0);
+    long t = p->ticks() - p->calleeTicks();
+    for (int i = 0; i < node->arity(); i++) {
+        Evaluator *e = node->operand(i);
+        if (e->opcode() == OP_PROBE)
+            t -= ((Probe *) e)->ticks();
+    }
+    return t;
+}
+
+long Profiler::selfTime(Function *f) {
+    long t = 0;
+    std::vector<Evaluator *> work(1, f->body());
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        if (e->opcode() == OP_PROBE)
+            t += selfTicks((Probe *) e);
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+    return t;
+}
+
+void Profiler::report(std::string name, Function *f, long total, OutputStream *os) {
+    Evaluator *body = f->body();
+    if (body->opcode() != OP_PROBE)
+        return;
+    Probe *root = (Probe *) body;
+    long self = selfTime(f);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s: %ld calls, %ld ticks, %ld in itself (%.1f%%)", name.c_str(),
+            root->count(), root->ticks(), self, total == 0 ? 0.0 : 100.0 * self / total);
+    os->write(buf);
+    os->newline();
+    os->write("  " + name + "=");
+    f->printAlg(os);
+    os->newline();
+    if (root->count() == 0)
+        return;
+
+    // Hottest nodes by self time
+    std::vector<std::pair<long, Probe *> > nodes;
+    std::vector<Evaluator *> work;
+    work.push_back(root);
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        if (e->opcode() == OP_PROBE) {
+            nodes.push_back(std::make_pair(-selfTicks((Probe *) e), (Probe *) e));
+            e = e->operand(0);
+        }
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+    std::sort(nodes.begin(), nodes.end());
+    os->write("     self%      count      ticks   pos  node");
+    os->newline();
+    for (int i = 0; i < nodes.size() && i < 10; i++) {
+        Probe *p = nodes[i].second;
+        if (p->count() == 0)
+            break;
+        StringOutputStream sos;
+        p->printAlg(&sos);
+        std::string text = sos.str();
+        if (text.length() > 60)
+            text = text.substr(0, 57) + "...";
+        snprintf(buf, sizeof(buf), "    %5.1f%% %10ld %10ld %5d  %s",
+                self <= 0 ? 0.0 : -100.0 * nodes[i].first / self,
+                p->count(), p->ticks(), p->pos(), text.c_str());
+        os->write(buf);
+        os->newline();
+    }
+}
+
+void Profiler::folded(std::string name, Function *f, OutputStream *os) {
+    // One line per probed node: the path of nodes leading to it, starting
+    // with the function name, separated by semicolons, then its self time.
+    // This is the input format of flamegraph.pl. The paths stay within the
+    // function: a call is a leaf, with only its own time, and the callee
+    // has paths of its own, starting with its name, whoever called it. So
+    // the graph has one tree per function, not the stacks across calls.
+    Evaluator *body = f->body();
+    if (body->opcode() != OP_PROBE)
+        return;
+    std::vector<std::pair<Probe *, std::string> > work;
+    work.push_back(std::make_pair((Probe *) body, name));
+    while (!work.empty()) {
+        Probe *p = work.back().first;
+        std::string path = work.back().second;
+        work.pop_back();
+        Evaluator *node = p->operand(0);
+        path += ";" + label(node);
+        long self = selfTicks(p);
+        if (self > 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), " %ld", self);
+            os->write(path + buf);
+            os->newline();
+        }
+        for (int i = node->arity() - 1; i >= 0; i--) {
+            Evaluator *e = node->operand(i);
+            if (e->opcode() == OP_PROBE)
+                work.push_back(std::make_pair((Probe *) e, path));
+        }
+    }
+}
+
+void Profiler::reset(Evaluator *ev) {
+    std::vector<Evaluator *> work;
+    work.push_back(ev);
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        if (e->opcode() == OP_PROBE)
+            ((Probe *) e)->reset();
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+}
+
+///////////////////////
+/////  Telemetry  /////
+///////////////////////
+
+static const char *commandNames[] = { "repl_eval", "repl_define", "repl_command", "server_eval", "server_define" };
+static const char *phaseNames[] = { "parse", "bind", "eval", "format", "total" };
+
+static Telemetry::Histogram latencies[Telemetry::COMMANDS][Telemetry::PHASES];
+static Telemetry::Histogram allocationCounts[Telemetry::COMMANDS];
+static std::atomic<uint64_t> allocationBytes[Telemetry::COMMANDS];
+
+// This thread's allocations so far, its command in progress, if any, the
+// time spent in each phase of that, and the phases it is in
+static thread_local uint64_t threadAllocations, threadBytes;
+static thread_local int threadCommand = -1;
+static thread_local uint64_t threadPhases[Telemetry::PHASES];
+static thread_local bool threadPhaseSeen[Telemetry::PHASES];
+static thread_local int threadPhaseDepth;
+
+static uint64_t nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int Telemetry::Histogram::bucket(uint64_t v) {
+    if (v >= (uint64_t) 1 << 40)
+        v = ((uint64_t) 1 << 40) - 1;
+    int msb = v == 0 ? 0 : 63 - __builtin_clzll(v);
+    int shift = msb > SUB_BITS ? msb - SUB_BITS : 0;
+    return shift * SUB + (int) (v >> shift);
+}
+
+uint64_t Telemetry::Histogram::upper(int b) {
+    if (b < 2 * SUB)
+        return b;
+    int shift = b / SUB - 1;
+    return (((uint64_t) (b - shift * SUB) + 1) << shift) - 1;
+}
+
+void Telemetry::Histogram::record(uint64_t v) {
+    buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    n.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+    uint64_t m = max.load(std::memory_order_relaxed);
+    while (v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed));
+}
+
+uint64_t Telemetry::Histogram::percentile(double q) {
+    uint64_t total = n, seen = 0;
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) ceil(q * total);
+    if (rank == 0)
+        rank = 1;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(upper(b), (uint64_t) max);
+    }
+    return max;
+}
+
+void Telemetry::Histogram::reset() {
+    for (int b = 0; b < BUCKETS; b++)
+        buckets[b] = 0;
+    n = 0;
+    sum = 0;
+    max = 0;
+}
+
+Telemetry::Command::Command(int kind) : kind(kind), start(nanoseconds()), allocations(threadAllocations), bytes(threadBytes) {
+    threadCommand = kind;
+    for (int i = 0; i < PHASES; i++) {
+        threadPhases[i] = 0;
+        threadPhaseSeen[i] = false;
+    }
+}
+
+Telemetry::Command::~Command() {
+    uint64_t elapsed = nanoseconds() - start;
+    for (int i = 0; i < TOTAL; i++)
+        if (threadPhaseSeen[i])
+            latencies[kind][i].record(threadPhases[i]);
+    latencies[kind][TOTAL].record(elapsed);
+    allocationCounts[kind].record(threadAllocations - allocations);
+    allocationBytes[kind].fetch_add(threadBytes - bytes, std::memory_order_relaxed);
+    threadCommand = -1;
+}
+
+Telemetry::Phase::Phase(int phase) : phase(phase), start(0) {
+    if (threadCommand != -1 && threadPhaseDepth++ == 0)
+        start = nanoseconds();
+}
+
+Telemetry::Phase::~Phase() {
+    if (threadCommand != -1 && --threadPhaseDepth == 0) {
+        threadPhases[phase] += nanoseconds() - start;
+        threadPhaseSeen[phase] = true;
+    }
+}
+
+void Telemetry::allocated(size_t n) {
+    threadAllocations++;
+    threadBytes += n;
+}
+
+static std::string duration(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000)
+        snprintf(buf, sizeof(buf), "%d ns", (int) ns);
+    else if (ns < 1000000)
+        snprintf(buf, sizeof(buf), "%.3g us", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, sizeof(buf), "%.3g ms", ns / 1e6);
+    else
+        snprintf(buf, sizeof(buf), "%.3g s", ns / 1e9);
+    return buf;
+}
+
+void Telemetry::report(OutputStream *os) {
+    char buf[256];
+    for (int k = 0; k < COMMANDS; k++) {
+        Histogram &all = latencies[k][TOTAL];
+        if (all.count() == 0)
+            continue;
+        snprintf(buf, sizeof(buf), "%s: %llu commands", commandNames[k], (unsigned long long) all.count());
+        os->write(buf);
+        os->newline();
+        for (int i = 0; i < PHASES; i++) {
+            Histogram &h = latencies[k][i];
+            if (h.count() == 0)
+                continue;
+            snprintf(buf, sizeof(buf), "  %s: p50 %s, p90 %s, p99 %s, max %s, mean %s", phaseNames[i],
+                    duration(h.percentile(0.5)).c_str(), duration(h.percentile(0.9)).c_str(),
+                    duration(h.percentile(0.99)).c_str(), duration(h.maximum()).c_str(),
+                    duration(h.total() / h.count()).c_str());
+            os->write(buf);
+            os->newline();
+        }
+        Histogram &a = allocationCounts[k];
+        snprintf(buf, sizeof(buf), "  allocations: p50 %llu, p90 %llu, p99 %llu, max %llu, mean %.1f, %llu bytes in all",
+                (unsigned long long) a.percentile(0.5), (unsigned long long) a.percentile(0.9),
+                (unsigned long long) a.percentile(0.99), (unsigned long long) a.maximum(),
+                (double) a.total() / a.count(), (unsigned long long) allocationBytes[k].load());
+        os->write(buf);
+        os->newline();
+    }
+}
+
+// A Prometheus summary: quantiles, sum and count, with labels
+static void summary(std::string *out, const char *name, std::string labels, Telemetry::Histogram &h, double scale) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 1 };
+    char buf[256];
+    for (int q = 0; q < 4; q++) {
+        snprintf(buf, sizeof(buf), "%s{%s,quantile=\"%g\"} %.9g\n", name, labels.c_str(), quantiles[q], h.percentile(quantiles[q]) * scale);
+        *out += buf;
+    }
+    snprintf(buf, sizeof(buf), "%s_sum{%s} %.9g\n%s_count{%s} %llu\n", name, labels.c_str(), h.total() * scale,
+            name, labels.c_str(), (unsigned long long) h.count());
+    *out += buf;
+}
+
+std::string Telemetry::prometheus() {
+    std::string out;
+    char buf[256];
+    out += "# HELP parser_command_duration_seconds Time taken by commands, by phase\n";
+    out += "# TYPE parser_command_duration_seconds summary\n";
+    for (int k = 0; k < COMMANDS; k++)
+        for (int i = 0; i < PHASES; i++)
+            if (latencies[k][i].count() > 0)
+                summary(&out, "parser_command_duration_seconds",
+                        std::string("command=\"") + commandNames[k] + "\",phase=\"" + phaseNames[i] + "\"", latencies[k][i], 1e-9);
+    out += "# HELP parser_command_allocations Heap allocations made by commands\n";
+    out += "# TYPE parser_command_allocations summary\n";
+    for (int k = 0; k < COMMANDS; k++)
+        if (allocationCounts[k].count() > 0)
+            summary(&out, "parser_command_allocations", std::string("command=\"") + commandNames[k] + "\"", allocationCounts[k], 1);
+    out += "# HELP parser_command_allocated_bytes_total Bytes allocated by commands\n";
+    out += "# TYPE parser_command_allocated_bytes_total counter\n";
+    for (int k = 0; k < COMMANDS; k++)
+        if (allocationCounts[k].count() > 0) {
+            snprintf(buf, sizeof(buf), "parser_command_allocated_bytes_total{command=\"%s\"} %llu\n",
+                    commandNames[k], (unsigned long long) allocationBytes[k].load());
+            out += buf;
+        }
+    return out;
+}
+
+bool Telemetry::write(std::string file, std::string text, std::string *error) {
+    std::string tmp = file + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+        *error = "Can't create " + tmp;
+        return false;
+    }
+    bool ok = fwrite(text.c_str(), 1, text.length(), f) == text.length();
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), file.c_str()) != 0) {
+        unlink(tmp.c_str());
+        *error = "Can't write " + file;
+        return false;
+    }
+    return true;
+}
+
+void Telemetry::reset() {
+    for (int k = 0; k < COMMANDS; k++) {
+        for (int i = 0; i < PHASES; i++)
+            latencies[k][i].reset();
+        allocationCounts[k].reset();
+        allocationBytes[k] = 0;
+    }
+}
+
+// Every allocation is counted, for the Command in progress on its thread.
+// The deletes are not inlined, where the compiler would see free()
+// called on what operator new returned, and warn.
+void *operator new(size_t n) {
+    Telemetry::allocated(n);
+    void *p = malloc(n == 0 ? 1 : n);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) {
+    return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+///////////////////////
+/////  Optimizer  /////
+///////////////////////
+
+struct Slot {
+    Evaluator *parent; // NULL for the root
+    int index;
+};
+
+static Evaluator *balance(int op, int pos, std::vector<Evaluator *> &terms, int from, int to, std::vector<Slot> &work) {
+    if (to - from == 1)
+        return terms[from];
+    int mid = (from + to) / 2;
+    Evaluator *left = balance(op, pos, terms, from, mid, work);
+    Evaluator *right = balance(op, pos, terms, mid, to, work);
+    Evaluator *ev;
+    if (op == OP_SUM)
+        ev = new Sum(pos, left, right);
+    else
+        ev = new Product(pos, left, right);
+    if (mid - from == 1) {
+        Slot s = { ev, 0 };
+        work.push_back(s);
+    }
+    if (to - mid == 1) {
+        Slot s = { ev, 1 };
+        work.push_back(s);
+    }
+    return ev;
+}
+
+Evaluator *Optimizer::reassociate(Evaluator *ev) {
+    // Every maximal chain of Sum or Product nodes is replaced by a balanced
+    // tree over the same terms, in the same order. This changes rounding,
+    // which is why it is only done on request.
+    std::vector<Slot> work;
+    Slot root = { NULL, 0 };
+    work.push_back(root);
+    while (!work.empty()) {
+        Slot s = work.back();
+        work.pop_back();
+        Evaluator *node = s.parent == NULL ? ev : s.parent->operand(s.index);
+        int op = node->opcode();
+        if (op != OP_SUM && op != OP_PRODUCT) {
+            for (int i = 0; i < node->arity(); i++) {
+                Slot t = { node, i };
+                work.push_back(t);
+            }
+            continue;
+        }
+        std::vector<Evaluator *> terms;
+        std::vector<Evaluator *> chain;
+        chain.push_back(node);
+        while (!chain.empty()) {
+            Evaluator *e = chain.back();
+            chain.pop_back();
+            if (e->opcode() != op) {
+                terms.push_back(e);
+                continue;
+            }
+            chain.push_back(e->operand(1));
+            chain.push_back(e->operand(0));
+            e->setOperand(0, NULL);
+            e->setOperand(1, NULL);
+            if (e != node)
+                delete e;
+        }
+        Evaluator *b = balance(op, node->pos(), terms, 0, terms.size(), work);
+        delete node;
+        if (s.parent == NULL)
+            ev = b;
+        else
+            s.parent->setOperand(s.index, b);
+    }
+    return ev;
+}
+
+// Cycles for each kind of node, besides its operands, by precision and
+// opcode: per operand for Max, Min and Poly, and for Calls and Numerics,
+// besides the function. Rough defaults, or as Optimizer::calibrate()
+// measured them.
+struct CycleTable {
+    double cycles[3][OP_SOLVE + 1];
+    double integerPower[3];     // ^ multiplied out; see multiplied()
+    bool calibrated;
+
+    CycleTable() : calibrated(false) {
+        for (int p = 0; p < 3; p++) {
+            for (int op = 0; op <= OP_SOLVE; op++)
+                cycles[p][op] = 50;     // Transcendental functions
+            double *t = cycles[p];
+            t[OP_LITERAL] = 1;
+            t[OP_VARIABLE] = 20;
+            t[OP_PROBE] = 0;
+            t[OP_ABS] = t[OP_NEGATIVE] = t[OP_POSITIVE] = t[OP_IDENTITY] = 1;
+            t[OP_SUM] = t[OP_DIFFERENCE] = t[OP_PRODUCT] = 1;
+            t[OP_QUOTIENT] = 10;
+            t[OP_SQRT] = 15;
+            t[OP_POWER] = 80;
+            integerPower[p] = p == PRECISION_EXACT ? 80 : 5;
+            t[OP_MAX] = t[OP_MIN] = 2;
+            t[OP_POLY] = 4;
+            t[OP_IF] = 2;
+            t[OP_WINDOW] = 20;
+            t[OP_FORK] = Optimizer::FORK_COST;
+            t[OP_CALL] = 100;
+            for (int op = OP_INTEGRATE; op <= OP_SOLVE; op++)
+                t[op] = 100;
+        }
+    }
+};
+
+static CycleTable defaultCycles, measuredCycles;
+
+// Timestamp counter ticks are about cycles; elsewhere, ticks are
+// nanoseconds, of a few cycles each
+#if defined(__x86_64__) || defined(__i386__)
+static const double CYCLES_PER_TICK = 1;
+#else
+static const double CYCLES_PER_TICK = 3;
+#endif
+
+// Cycles per evaluation of ev, the best of a few runs
+static double measure(Evaluator *ev, Context *c) {
+    const int N = 2000, RUNS = 3;
+    double best = 1e300, sum = 0;
+    for (int r = 0; r < RUNS; r++) {
+        uint64_t start = Probe::clock();
+        for (int i = 0; i < N; i++)
+            sum += ev->eval(c);
+        best = std::min(best, (double) (Probe::clock() - start) / N);
+    }
+    volatile double sink = sum;
+    (void) sink;
+    return best * CYCLES_PER_TICK;
+}
+
+// Whether the cost of an opcode depends on the precision
+static bool byPrecision(int op) {
+    switch (op) {
+        case OP_ACOS: case OP_ASIN: case OP_ATAN: case OP_COS: case OP_EXP:
+        case OP_LOG: case OP_SIN: case OP_SQRT: case OP_TAN: case OP_POWER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether ^ with this exponent is multiplied out rather than left to pow:
+// at fast and approximate precision, for integer literals up to 4 in
+// magnitude, as in Math::fastPow. At exact precision, every exponent goes
+// to pow, at the same cost.
+static bool multiplied(Evaluator *exponent, int precision) {
+    if (precision == PRECISION_EXACT || exponent->opcode() != OP_LITERAL)
+        return false;
+    double y = ((Literal *) exponent)->getValue();
+    return fabs(y) <= 4 && y == (int) y;
+}
+
+static Evaluator *literal(double v) {
+    return new Literal(0, v);
+}
+
+static std::vector<Evaluator *> *literals(int n) {
+    std::vector<Evaluator *> *evs = new std::vector<Evaluator *>();
+    for (int i = 0; i < n; i++)
+        evs->push_back(literal(0.3 + 0.1 * i));
+    return evs;
+}
+
+void Optimizer::calibrate() {
+    if (measuredCycles.calibrated)
+        return;
+    Context c;
+    c.setVariable("x", 0.7);
+    std::vector<std::string> params(1, "x");
+    c.setFunction("f", new Function(params, new Variable(0, "x")));
+
+    // Nodes with literal operands, minus the literals; the math functions
+    // at every precision, the rest once
+    for (int p = PRECISION_EXACT; p <= PRECISION_APPROX; p++) {
+        c.setPrecision(p);
+        double *t = measuredCycles.cycles[p];
+        Evaluator *lit = literal(0.7);
+        double base = measure(lit, &c);
+        delete lit;
+        std::vector<std::pair<Evaluator *, int> > nodes;    // With operand count
+        nodes.push_back(std::make_pair((Evaluator *) new Acos(0, literal(0.3)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Asin(0, literal(0.3)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Atan(0, literal(0.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Cos(0, literal(0.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Exp(0, literal(0.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Log(0, literal(1.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Sin(0, literal(0.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Sqrt(0, literal(1.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Tan(0, literal(0.7)), 1));
+        nodes.push_back(std::make_pair((Evaluator *) new Power(0, literal(1.7), literal(2.3)), 2));
+        if (p == PRECISION_EXACT) {
+            t[OP_LITERAL] = base;
+            nodes.push_back(std::make_pair((Evaluator *) new Abs(0, literal(-0.7)), 1));
+            nodes.push_back(std::make_pair((Evaluator *) new Identity(0, literal(0.7)), 1));
+            nodes.push_back(std::make_pair((Evaluator *) new Negative(0, literal(0.7)), 1));
+            nodes.push_back(std::make_pair((Evaluator *) new Positive(0, literal(0.7)), 1));
+            nodes.push_back(std::make_pair((Evaluator *) new Difference(0, literal(1.7), literal(0.7)), 2));
+            nodes.push_back(std::make_pair((Evaluator *) new Product(0, literal(1.7), literal(0.7)), 2));
+            nodes.push_back(std::make_pair((Evaluator *) new Quotient(0, literal(1.7), literal(0.7)), 2));
+            nodes.push_back(std::make_pair((Evaluator *) new Sum(0, literal(1.7), literal(0.7)), 2));
+            nodes.push_back(std::make_pair((Evaluator *) new If(0, literal(1), literal(1.7), literal(0.7)), 2));
+            nodes.push_back(std::make_pair((Evaluator *) new Variable(0, "x"), 0));
+            nodes.push_back(std::make_pair((Evaluator *) new Max(0, literals(4)), 4));
+            nodes.push_back(std::make_pair((Evaluator *) new Min(0, literals(4)), 4));
+            nodes.push_back(std::make_pair((Evaluator *) new Polynomial(0, literals(5)), 5));
+            nodes.push_back(std::make_pair((Evaluator *) new Call(0, "f", literals(1)), 1));
+        }
+        for (int i = 0; i < nodes.size(); i++) {
+            Evaluator *e = nodes[i].first;
+            int n = nodes[i].second, op = e->opcode();
+            double own = measure(e, &c) - n * base;
+            if (op == OP_MAX || op == OP_MIN || op == OP_POLY)
+                own /= n;
+            if (op == OP_CALL)
+                own -= t[OP_VARIABLE];
+            t[op] = std::max(own, 1.0);
+            delete e;
+        }
+        if (p == PRECISION_EXACT)
+            measuredCycles.integerPower[p] = t[OP_POWER];
+        else {
+            Evaluator *e = new Power(0, literal(1.7), literal(3));
+            measuredCycles.integerPower[p] = std::max(measure(e, &c) - 2 * base, 1.0);
+            delete e;
+        }
+    }
+    for (int p = PRECISION_EXACT + 1; p <= PRECISION_APPROX; p++)
+        for (int op = 0; op <= OP_SOLVE; op++)
+            if (!byPrecision(op))
+                measuredCycles.cycles[p][op] = measuredCycles.cycles[PRECISION_EXACT][op];
+    measuredCycles.calibrated = true;
+}
+
+bool Optimizer::calibrated() {
+    return measuredCycles.calibrated;
+}
+
+double Optimizer::cost(Evaluator *ev, Context *c, std::map<Evaluator *, double> *out, bool measured) {
+    // Cycle counts from the CycleTable. Calls cost their body; a recursive
+    // call could cost anything, so it is assumed to be worth a thread of
+    // its own.
+    static thread_local std::vector<Function *> active;
+    CycleTable &table = measured && measuredCycles.calibrated ? measuredCycles : defaultCycles;
+    const double *t = table.cycles[c->getPrecision()];
+    std::vector<std::pair<Evaluator *, int> > stack;
+    std::vector<double> costs;
+    stack.push_back(std::make_pair(ev, 0));
+    while (!stack.empty()) {
+        Evaluator *e = stack.back().first;
+        int next = stack.back().second;
+        if (next < e->arity()) {
+            stack.back().second++;
+            stack.push_back(std::make_pair(e->operand(next), 0));
+            continue;
+        }
+        stack.pop_back();
+        int n = e->arity();
+        double sum = 0;
+        for (int i = costs.size() - n; i < costs.size(); i++)
+            sum += costs[i];
+        double own = t[e->opcode()];
+        switch (e->opcode()) {
+            case OP_POWER:
+                if (multiplied(e->operand(1), c->getPrecision()))
+                    own = table.integerPower[c->getPrecision()];
+                break;
+            case OP_MAX: case OP_MIN: case OP_POLY: own *= n; break;
+            case OP_CHEBYSHEV:
+                // Counting on the fallback being rare
+                own = 4 * ((Chebyshev *) e)->getDegree() + 20;
+                sum = costs[costs.size() - 2];
+                break;
+            case OP_IF: {
+                double c0 = costs[costs.size() - 3];
+                double c1 = costs[costs.size() - 2];
+                double c2 = costs[costs.size() - 1];
+                sum = c0 + (c1 > c2 ? c1 : c2);
+                break;
+            }
+            case OP_CALL:
+            case OP_INTEGRATE:
+            case OP_MINIMIZE:
+            case OP_RMAX:
+            case OP_RMIN:
+            case OP_RPROD:
+            case OP_RSUM:
+            case OP_SOLVE: {
+                bool call = e->opcode() == OP_CALL;
+                Function *f = c->getFunction(call ? ((Call *) e)->getName() : ((Numeric *) e)->getName());
+                if (f == NULL)
+                    break;
+                bool recursive = false;
+                for (int i = 0; i < active.size(); i++)
+                    recursive |= active[i] == f;
+                if (recursive)
+                    own += FORK_COST;
+                else {
+                    // Typical numbers of evaluations of f
+                    int op = e->opcode();
+                    int times = call ? 1 : op == OP_INTEGRATE ? 300 : op == OP_SOLVE || op == OP_MINIMIZE ? 50 : 1000;
+                    active.push_back(f);
+                    own += times * cost(f->body(), c, NULL, measured);
+                    active.pop_back();
+                }
+                break;
+            }
+        }
+        costs.resize(costs.size() - n);
+        costs.push_back(sum + own);
+        if (out != NULL)
+            (*out)[e] = sum + own;
+    }
+    return costs[0];
+}
+
+Evaluator *Optimizer::parallelize(Evaluator *ev, Context *c) {
+    // Post-order, so that the operands of a node have been dealt with by
+    // the time the node itself is considered for forking.
+    std::vector<std::pair<Slot, int> > stack;
+    Slot root = { NULL, 0 };
+    stack.push_back(std::make_pair(root, 0));
+    while (!stack.empty()) {
+        Slot s = stack.back().first;
+        int next = stack.back().second;
+        Evaluator *node = s.parent == NULL ? ev : s.parent->operand(s.index);
+        int op = node->opcode();
+        if (op != OP_FORK && next < node->arity()) {
+            stack.back().second++;
+            Slot t = { node, next };
+            stack.push_back(std::make_pair(t, 0));
+            continue;
+        }
+        stack.pop_back();
+        if (op != OP_CALL && op != OP_MAX && op != OP_MIN && op != OP_SUM
+                && op != OP_DIFFERENCE && op != OP_PRODUCT
+                && op != OP_QUOTIENT && op != OP_POWER)
+            continue;
+        int n = node->arity();
+        std::vector<bool> heavy(n);
+        int count = 0;
+        for (int i = 0; i < n; i++)
+            if (heavy[i] = cost(node->operand(i), c) >= FORK_COST)
+                count++;
+        if (count < 2)
+            continue;
+        Evaluator *f = new Fork(node, heavy);
+        if (s.parent == NULL)
+            ev = f;
+        else
+            s.parent->setOperand(s.index, f);
+    }
+    return ev;
+}
+
+// A copy of one node, with the same operands as the original
+static Evaluator *shallowCopy(Evaluator *ev, std::vector<std::string> &names, std::vector<double> &values) {
+    // Probes and Forks are left out; they are added back on request
+    while (ev->opcode() == OP_PROBE || ev->opcode() == OP_FORK)
+        ev = ev->opcode() == OP_PROBE ? ev->operand(0) : ((Fork *) ev)->getOperand();
+    int pos = ev->pos();
+    Evaluator *e = NULL;
+    switch (ev->opcode()) {
+        case OP_ABS: e = new Abs(pos, NULL); break;
+        case OP_ACOS: e = new Acos(pos, NULL); break;
+        case OP_ASIN: e = new Asin(pos, NULL); break;
+        case OP_ATAN: e = new Atan(pos, NULL); break;
+        case OP_CALL: e = new Call(pos, ((Call *) ev)->getName(), new std::vector<Evaluator *>(ev->arity())); break;
+        case OP_INTEGRATE:
+        case OP_MINIMIZE:
+        case OP_RMAX:
+        case OP_RMIN:
+        case OP_RPROD:
+        case OP_RSUM:
+        case OP_SOLVE:
+            e = new Numeric(pos, ev->opcode(), ((Numeric *) ev)->getName(), new std::vector<Evaluator *>(ev->arity()));
+            break;
+        case OP_COS: e = new Cos(pos, NULL); break;
+        case OP_DIFFERENCE: e = new Difference(pos, NULL, NULL); break;
+        case OP_EXP: e = new Exp(pos, NULL); break;
+        case OP_IDENTITY: e = new Identity(pos, NULL); break;
+        case OP_IF: e = new If(pos, NULL, NULL, NULL); break;
+        case OP_LITERAL: return new Literal(pos, ((Literal *) ev)->getValue());
+        case OP_LOG: e = new Log(pos, NULL); break;
+        case OP_MAX: e = new Max(pos, new std::vector<Evaluator *>(ev->arity())); break;
+        case OP_MIN: e = new Min(pos, new std::vector<Evaluator *>(ev->arity())); break;
+        case OP_NEGATIVE: e = new Negative(pos, NULL); break;
+        case OP_POLY: e = new Polynomial(pos, new std::vector<Evaluator *>(ev->arity())); break;
+        case OP_CHEBYSHEV: {
+            Chebyshev *ch = (Chebyshev *) ev;
+            e = new Chebyshev(pos, NULL, NULL, ch->getLo(), ch->getHi(), ch->getDegree(), ch->coefficients());
+            break;
+        }
+        case OP_WINDOW: e = new Window(pos, ((Window *) ev)->getKind(), NULL, ((Window *) ev)->getSize()); break;
+        case OP_POSITIVE: e = new Positive(pos, NULL); break;
+        case OP_POWER: e = new Power(pos, NULL, NULL); break;
+        case OP_PRODUCT: e = new Product(pos, NULL, NULL); break;
+        case OP_QUOTIENT: e = new Quotient(pos, NULL, NULL); break;
+        case OP_SIN: e = new Sin(pos, NULL); break;
+        case OP_SQRT: e = new Sqrt(pos, NULL); break;
+        case OP_SUM: e = new Sum(pos, NULL, NULL); break;
+        case OP_TAN: e = new Tan(pos, NULL); break;
+        case OP_VARIABLE: {
+            std::string name = ((Variable *) ev)->getName();
+            for (int i = 0; i < names.size(); i++)
+                if (names[i] == name)
+                    return new Literal(pos, values[i]);
+            return new Variable(pos, name);
+        }
+    }
+    for (int i = 0; i < ev->arity(); i++)
+        e->setOperand(i, ev->operand(i));
+    return e;
+}
+
+Evaluator *Optimizer::copy(Evaluator *ev, std::vector<std::string> &names, std::vector<double> &values) {
+    // Every node is copied with the original's operands, which are then
+    // replaced by copies in turn
+    Evaluator *root = shallowCopy(ev, names, values);
+    std::vector<Evaluator *> work;
+    work.push_back(root);
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        for (int i = 0; i < e->arity(); i++) {
+            Evaluator *op = shallowCopy(e->operand(i), names, values);
+            e->setOperand(i, op);
+            work.push_back(op);
+        }
+    }
+    return root;
+}
+
+Evaluator *Optimizer::fold(Evaluator *ev, Context *c) {
+    // Post-order, so a node's operands have been folded by the time the
+    // node itself is looked at. Nodes whose operands are all literals are
+    // evaluated, except for Calls and Numerics, which might fail, or never
+    // finish, and depend on the functions they use anyway; an
+    // If with a literal condition is replaced by the branch it takes, and
+    // a Chebyshev with a literal x by its value or its fallback.
+    std::vector<std::pair<Slot, int> > stack;
+    Slot root = { NULL, 0 };
+    stack.push_back(std::make_pair(root, 0));
+    while (!stack.empty()) {
+        Slot s = stack.back().first;
+        int next = stack.back().second;
+        Evaluator *node = s.parent == NULL ? ev : s.parent->operand(s.index);
+        int op = node->opcode();
+        if (next < node->arity()) {
+            stack.back().second++;
+            Slot t = { node, next };
+            stack.push_back(std::make_pair(t, 0));
+            continue;
+        }
+        stack.pop_back();
+        Evaluator *r = node;
+        if (op == OP_IF) {
+            if (node->operand(0)->opcode() == OP_LITERAL) {
+                int branch = ((Literal *) node->operand(0))->getValue() != 0 ? 1 : 2;
+                r = node->operand(branch);
+                node->setOperand(branch, NULL);
+            }
+        } else if (op == OP_CHEBYSHEV) {
+            if (node->operand(0)->opcode() == OP_LITERAL) {
+                Chebyshev *ch = (Chebyshev *) node;
+                double v = ((Literal *) node->operand(0))->getValue();
+                if (ch->covers(v))
+                    r = new Literal(node->pos(), ch->evaluate(v));
+                else {
+                    r = node->operand(1);
+                    node->setOperand(1, NULL);
+                }
+            }
+        } else if (op == OP_IDENTITY || op == OP_POSITIVE) {
+            if (node->operand(0)->opcode() == OP_LITERAL) {
+                r = node->operand(0);
+                node->setOperand(0, NULL);
+            }
+        } else if (op != OP_LITERAL && op != OP_VARIABLE && op != OP_CALL && op != OP_FORK && op != OP_PROBE
+                && op != OP_WINDOW && !isNumeric(op)) {
+            bool constant = true;
+            for (int i = 0; constant && i < node->arity(); i++)
+                constant = node->operand(i)->opcode() == OP_LITERAL;
+            if (constant)
+                r = new Literal(node->pos(), node->eval(c));
+        }
+        if (r == node)
+            continue;
+        delete node;
+        if (s.parent == NULL)
+            ev = r;
+        else
+            s.parent->setOperand(s.index, r);
+    }
+    return ev;
+}
+
+void Optimizer::references(Evaluator *ev, Context *c, std::vector<std::string> *names) {
+    std::vector<Evaluator *> stack;
+    std::vector<Function *> seen;
+    stack.push_back(ev);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        if (e->opcode() == OP_VARIABLE) {
+            std::string name = ((Variable *) e)->getName();
+            if (std::find(names->begin(), names->end(), name) == names->end())
+                names->push_back(name);
+        } else if (e->opcode() == OP_FORK)
+            e = ((Fork *) e)->getOperand();
+        else if (e->opcode() == OP_CALL || isNumeric(e->opcode())) {
+            Function *f = c->getFunction(e->opcode() == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName());
+            if (f != NULL && std::find(seen.begin(), seen.end(), f) == seen.end()) {
+                seen.push_back(f);
+                stack.push_back(f->body());
+            }
+        }
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+}
+
+bool Optimizer::stateful(Evaluator *ev, Context *c) {
+    std::vector<Evaluator *> stack;
+    std::vector<Function *> seen;
+    stack.push_back(ev);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        if (e->opcode() == OP_WINDOW)
+            return true;
+        if (e->opcode() == OP_FORK)
+            e = ((Fork *) e)->getOperand();
+        else if (e->opcode() == OP_CALL || isNumeric(e->opcode())) {
+            Function *f = c->getFunction(e->opcode() == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName());
+            if (f != NULL && std::find(seen.begin(), seen.end(), f) == seen.end()) {
+                seen.push_back(f);
+                stack.push_back(f->body());
+            }
+        }
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    return false;
+}
+
+void Optimizer::repeats(Evaluator *ev, std::map<Evaluator *, double> &costs, double worth,
+        std::vector<std::pair<Evaluator *, int> > *out) {
+    std::map<std::string, std::pair<int, Evaluator *> > seen;
+    std::vector<Evaluator *> stack(1, ev);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+        int op = e->opcode();
+        if (e->arity() == 0 || op == OP_IDENTITY || op == OP_PROBE || costs[e] < worth)
+            continue;
+        StringOutputStream rpn;
+        e->printRpn(&rpn);
+        std::pair<int, Evaluator *> &s = seen[rpn.str()];
+        if (s.first++ == 0)
+            s.second = e;
+    }
+    std::vector<std::pair<double, std::pair<Evaluator *, int> > > repeated;
+    for (std::map<std::string, std::pair<int, Evaluator *> >::iterator it = seen.begin(); it != seen.end(); it++)
+        if (it->second.first > 1)
+            repeated.push_back(std::make_pair(-costs[it->second.second] * it->second.first,
+                    std::make_pair(it->second.second, it->second.first)));
+    std::sort(repeated.begin(), repeated.end());
+    for (int i = 0; i < repeated.size(); i++)
+        out->push_back(repeated[i].second);
+}
+
+Function *Optimizer::specialize(Function *f, std::vector<std::string> &names, std::vector<double> &values, Context *c, std::string *error) {
+    std::vector<std::string> &params = f->params();
+    for (int i = 0; i < names.size(); i++)
+        if (std::find(params.begin(), params.end(), names[i]) == params.end()) {
+            *error = "No parameter " + names[i];
+            return NULL;
+        }
+    // The functions f calls see its parameters too. If they use one that
+    // is being fixed, it would have to stay a parameter after all.
+    std::vector<std::string> refs;
+    std::vector<Evaluator *> stack;
+    stack.push_back(f->body());
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        if (e->opcode() == OP_FORK)
+            e = ((Fork *) e)->getOperand();
+        else if (e->opcode() == OP_CALL || isNumeric(e->opcode())) {
+            Function *g = c->getFunction(e->opcode() == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName());
+            if (g != NULL)
+                references(g->body(), c, &refs);
+        }
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    for (int i = 0; i < names.size(); i++)
+        if (std::find(refs.begin(), refs.end(), names[i]) != refs.end()) {
+            *error = "Parameter " + names[i] + " is used by a called function";
+            return NULL;
+        }
+    std::vector<std::string> rest;
+    for (int i = 0; i < params.size(); i++)
+        if (std::find(names.begin(), names.end(), params[i]) == names.end())
+            rest.push_back(params[i]);
+    return new Function(rest, fold(copy(f->body(), names, values), c));
+}
+
+// A polynomial in one variable, under construction: the coefficient of
+// x^i is the sum of the terms in [i], and a term is a factor times the
+// product of subtrees that don't depend on x (which stay owned by the
+// original tree)
+struct Term {
+    double k;
+    std::vector<Evaluator *> parts;
+};
+typedef std::vector<std::vector<Term> > Poly;
+
+static const int MAX_DEGREE = 32;
+static const int MAX_TERMS = 64;
+
+// Whether ev is the same for all values of x. Calls and Numerics might use
+// x, since functions see their callers' parameters.
+static bool independent(Evaluator *ev, std::string &x) {
+    std::vector<Evaluator *> stack;
+    stack.push_back(ev);
+    while (!stack.empty()) {
+        Evaluator *e = stack.back();
+        stack.pop_back();
+        int op = e->opcode();
+        if (op == OP_CALL || op == OP_FORK || op == OP_WINDOW || isNumeric(op)
+                || op == OP_VARIABLE && ((Variable *) e)->getName() == x)
+            return false;
+        for (int i = 0; i < e->arity(); i++)
+            stack.push_back(e->operand(i));
+    }
+    return true;
+}
+
+// Parts in a canonical order: variables by name, so that the same name
+// in different places is the same part, then the other subtrees
+static bool partBefore(Evaluator *a, Evaluator *b) {
+    bool va = a->opcode() == OP_VARIABLE, vb = b->opcode() == OP_VARIABLE;
+    if (va != vb)
+        return va;
+    if (va)
+        return ((Variable *) a)->getName() < ((Variable *) b)->getName();
+    return a < b;
+}
+
+static bool sameParts(std::vector<Evaluator *> &a, std::vector<Evaluator *> &b) {
+    if (a.size() != b.size())
+        return false;
+    for (int i = 0; i < a.size(); i++)
+        if (partBefore(a[i], b[i]) || partBefore(b[i], a[i]))
+            return false;
+    return true;
+}
+
+// Adds a term to a coefficient, into the term with the same parts, if
+// there is one, so that literal terms, and repeated products of the same
+// subtrees, take one term between them
+static void add(std::vector<Term> &terms, Term &t) {
+    std::sort(t.parts.begin(), t.parts.end(), partBefore);
+    for (int i = 0; i < terms.size(); i++)
+        if (sameParts(terms[i].parts, t.parts)) {
+            terms[i].k += t.k;
+            return;
+        }
+    terms.push_back(t);
+}
+
+static bool multiply(Poly &a, Poly &b, Poly *res) {
+    if (a.size() + b.size() - 2 > MAX_DEGREE)
+        return false;
+    res->clear();
+    res->resize(a.size() + b.size() - 1);
+    for (int i = 0; i < a.size(); i++)
+        for (int j = 0; j < b.size(); j++)
+            for (int s = 0; s < a[i].size(); s++)
+                for (int t = 0; t < b[j].size(); t++) {
+                    Term term = a[i][s];
+                    term.k *= b[j][t].k;
+                    term.parts.insert(term.parts.end(), b[j][t].parts.begin(), b[j][t].parts.end());
+                    add((*res)[i + j], term);
+                    if ((*res)[i + j].size() > MAX_TERMS)
+                        return false;
+                }
+    return true;
+}
+
+// Recursion is bounded, since polynomials() leaves deep trees alone
+static bool toPoly(Evaluator *ev, std::string &x, Poly *res) {
+    res->clear();
+    int op = ev->opcode();
+    if (op == OP_VARIABLE && ((Variable *) ev)->getName() == x) {
+        res->resize(2);
+        Term t = { 1 };
+        (*res)[1].push_back(t);
+        return true;
+    }
+    if (independent(ev, x)) {
+        res->resize(1);
+        Term t = { 1 };
+        if (op == OP_LITERAL)
+            t.k = ((Literal *) ev)->getValue();
+        else
+            t.parts.push_back(ev);
+        (*res)[0].push_back(t);
+        return true;
+    }
+    Poly a, b;
+    switch (op) {
+        case OP_IDENTITY:
+        case OP_POSITIVE:
+        case OP_PROBE:
+            return toPoly(ev->operand(0), x, res);
+        case OP_NEGATIVE:
+            if (!toPoly(ev->operand(0), x, res))
+                return false;
+            for (int i = 0; i < res->size(); i++)
+                for (int j = 0; j < (*res)[i].size(); j++)
+                    (*res)[i][j].k = -(*res)[i][j].k;
+            return true;
+        case OP_SUM:
+        case OP_DIFFERENCE:
+            if (!toPoly(ev->operand(0), x, &a) || !toPoly(ev->operand(1), x, &b))
+                return false;
+            if (b.size() > a.size())
+                a.resize(b.size());
+            for (int i = 0; i < b.size(); i++)
+                for (int j = 0; j < b[i].size(); j++) {
+                    Term t = b[i][j];
+                    if (op == OP_DIFFERENCE)
+                        t.k = -t.k;
+                    add(a[i], t);
+                    if (a[i].size() > MAX_TERMS)
+                        return false;
+                }
+            res->swap(a);
+            return true;
+        case OP_PRODUCT:
+            return toPoly(ev->operand(0), x, &a) && toPoly(ev->operand(1), x, &b)
+                && multiply(a, b, res);
+        case OP_QUOTIENT:
+            // Only by literals, which become multiplications by their
+            // reciprocals
+            if (ev->operand(1)->opcode() != OP_LITERAL || !toPoly(ev->operand(0), x, res))
+                return false;
+            for (int i = 0; i < res->size(); i++)
+                for (int j = 0; j < (*res)[i].size(); j++)
+                    (*res)[i][j].k /= ((Literal *) ev->operand(1))->getValue();
+            return true;
+        case OP_POWER: {
+            if (ev->operand(1)->opcode() != OP_LITERAL)
+                return false;
+            double e = ((Literal *) ev->operand(1))->getValue();
+            if (e != floor(e) || e < 0 || e > MAX_DEGREE || !toPoly(ev->operand(0), x, &a))
+                return false;
+            res->resize(1);
+            Term one = { 1 };
+            (*res)[0].push_back(one);
+            for (int i = 0; i < e; i++) {
+                if (!multiply(*res, a, &b))
+                    return false;
+                res->swap(b);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// The coefficient of one power of x, as a tree of its own
+static Evaluator *coefficient(std::vector<Term> &terms, int pos) {
+    std::vector<std::string> none;
+    std::vector<double> nothing;
+    double constant = 0;
+    Evaluator *ev = NULL;
+    for (int i = 0; i < terms.size(); i++) {
+        Term &t = terms[i];
+        if (t.parts.empty()) {
+            constant += t.k;
+            continue;
+        }
+        if (t.k == 0)
+            continue;
+        Evaluator *p = Optimizer::copy(t.parts[0], none, nothing);
+        for (int j = 1; j < t.parts.size(); j++)
+            p = new Product(pos, p, Optimizer::copy(t.parts[j], none, nothing));
+        if (t.k == -1)
+            p = new Negative(pos, p);
+        else if (t.k != 1)
+            p = new Product(pos, new Literal(pos, t.k), p);
+        ev = ev == NULL ? p : new Sum(pos, ev, p);
+    }
+    if (ev == NULL)
+        return new Literal(pos, constant);
+    if (constant != 0)
+        ev = new Sum(pos, ev, new Literal(pos, constant));
+    return ev;
+}
+
+// Evaluates the original and the rewritten subtree at a few points, with
+// all their variables set; they must agree to within rounding, relative
+// to the size of the terms
+static bool agree(Evaluator *orig, Evaluator *poly, std::string &x, Context *c) {
+    static const double xs[] = { -2.5, -1.3, -0.7, -0.1, 0.2, 0.9, 1.6, 3.1 };
+    static const double others[] = { 0.7, -1.3, 2.1 };
+    std::vector<std::string> names;
+    Optimizer::references(orig, c, &names);
+    std::vector<double> values(names.size());
+    bool ok = true;
+    for (int s = 0; ok && s < 8; s++) {
+        for (int i = 0; i < names.size(); i++)
+            values[i] = names[i] == x ? xs[s] : others[(s + i) % 3];
+        if (!c->push(names, values))
+            break;
+        double a = orig->eval(c);
+        double b = poly->eval(c);
+        double scale = 1, xp = 1;
+        for (int i = 1; i < poly->arity(); i++) {
+            scale += fabs(poly->operand(i)->eval(c)) * xp;
+            xp *= fabs(xs[s]);
+        }
+        c->pop();
+        if (a != b && !(fabs(a - b) <= 1e-10 * scale))
+            ok = false;
+    }
+    if (c->failed()) {
+        c->clearError();
+        ok = false;
+    }
+    return ok;
+}
+
+Evaluator *Optimizer::polynomials(Evaluator *ev, Context *c) {
+    if (Program::depth(ev) > Program::DEEP_TREE)
+        return ev;
+    // Top-down, so the largest polynomial subtrees are found first
+    std::vector<Slot> work;
+    Slot root = { NULL, 0 };
+    work.push_back(root);
+    while (!work.empty()) {
+        Slot s = work.back();
+        work.pop_back();
+        Evaluator *node = s.parent == NULL ? ev : s.parent->operand(s.index);
+        int op = node->opcode();
+        std::string var;
+        if (op == OP_SUM || op == OP_DIFFERENCE || op == OP_PRODUCT || op == OP_NEGATIVE
+                || op == OP_POWER || op == OP_QUOTIENT) {
+            // Any of its variables could be the one it's a polynomial in;
+            // the one giving the highest degree wins
+            std::vector<std::string> names;
+            std::vector<Evaluator *> stack;
+            stack.push_back(node);
+            while (!stack.empty()) {
+                Evaluator *e = stack.back();
+                stack.pop_back();
+                if (e->opcode() == OP_VARIABLE && std::find(names.begin(), names.end(), ((Variable *) e)->getName()) == names.end())
+                    names.push_back(((Variable *) e)->getName());
+                for (int i = 0; i < e->arity(); i++)
+                    stack.push_back(e->operand(i));
+            }
+            Poly best;
+            for (int i = 0; i < names.size() && i < 8; i++) {
+                Poly p;
+                if (!toPoly(node, names[i], &p))
+                    continue;
+                // Coefficients that cancel out don't count
+                while (p.size() > 1) {
+                    std::vector<Term> &top = p.back();
+                    bool zero = true;
+                    double sum = 0;
+                    for (int j = 0; j < top.size(); j++) {
+                        zero &= top[j].parts.empty();
+                        sum += top[j].k;
+                    }
+                    if (!zero || sum != 0)
+                        break;
+                    p.pop_back();
+                }
+                if (p.size() > best.size()) {
+                    best.swap(p);
+                    var = names[i];
+                }
+            }
+            if (best.size() >= 3) {
+                std::vector<Evaluator *> *evs = new std::vector<Evaluator *>;
+                evs->push_back(new Variable(node->pos(), var));
+                for (int i = 0; i < best.size(); i++)
+                    evs->push_back(coefficient(best[i], node->pos()));
+                Evaluator *poly = new Polynomial(node->pos(), evs);
+                if (agree(node, poly, var, c)) {
+                    delete node;
+                    if (s.parent == NULL)
+                        ev = poly;
+                    else
+                        s.parent->setOperand(s.index, poly);
+                    continue;
+                }
+                delete poly;
+            }
+        }
+        for (int i = 0; i < node->arity(); i++) {
+            Slot t = { node, i };
+            work.push_back(t);
+        }
+    }
+    return ev;
+}
+
+//////////////////////
+/////  Exporter  /////
+//////////////////////
+
+std::string Exporter::literal(double d) {
+    char buf[50];
+    if (d != d)
+        return "NAN";
+    if (isinf(d))
+        return d > 0 ? "HUGE_VAL" : "(-HUGE_VAL)";
+    sprintf(buf, "%.17g", d);
+    if (strspn(buf, "-0123456789") == strlen(buf))
+        strcat(buf, ".0");
+    return buf;
+}
+
+bool Exporter::identifier(const std::string &name) {
+    if (name.empty() || isdigit((unsigned char) name[0]))
+        return false;
+    for (int i = 0; i < name.length(); i++)
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_')
+            return false;
+    return true;
+}
+
+bool Exporter::exportable(Function *f, Context *c) {
+    if (Program::depth(f->body()) > Program::DEEP_TREE)
+        return false;
+    std::vector<std::string> &params = f->params();
+    for (int i = 0; i < params.size(); i++)
+        if (!identifier(params[i]))
+            return false;
+    std::vector<Evaluator *> stack;
+    stack.push_back(f->body());
+    while (!stack.empty()) {
+        Evaluator *ev = stack.back();
+        stack.pop_back();
+        if (ev->opcode() == OP_VARIABLE) {
+            if (std::find(params.begin(), params.end(), ((Variable *) ev)->getName()) == params.end())
+                return false;
+        } else if (ev->opcode() == OP_FORK)
+            ev = ((Fork *) ev)->getOperand();
+        else if (ev->opcode() == OP_CALL) {
+            Function *g = c->getFunction(((Call *) ev)->getName());
+            if (g == NULL || g->arity() != ev->arity())
+                return false;
+        } else if (isNumeric(ev->opcode()) || ev->opcode() == OP_WINDOW)
+            return false;
+        for (int i = 0; i < ev->arity(); i++)
+            stack.push_back(ev->operand(i));
+    }
+    return true;
+}
+
+// Each node becomes the C++ expression that computes the same double, in
+// the same way, so the results match the interpreter's bit for bit.
+void Exporter::expr(Evaluator *ev, std::string *out) {
+    static const char *calls[] = {
+        "fabs", "acos", "asin", "atan", NULL, "cos", NULL,
+        "exp", NULL, NULL, NULL, "log", NULL, NULL,
+        NULL, NULL, "pow", NULL, NULL, "sin",
+        "sqrt", NULL, "tan"
+    };
+    int op = ev->opcode();
+    switch (op) {
+        case OP_LITERAL:
+            *out += literal(((Literal *) ev)->getValue());
+            return;
+        case OP_VARIABLE:
+            *out += "p_" + ((Variable *) ev)->getName();
+            return;
+        case OP_IDENTITY:
+        case OP_POSITIVE:
+        case OP_PROBE:
+            expr(ev->operand(0), out);
+            return;
+        case OP_FORK:
+            expr(((Fork *) ev)->getOperand(), out);
+            return;
+        case OP_NEGATIVE:
+            *out += "(-";
+            expr(ev->operand(0), out);
+            *out += ")";
+            return;
+        case OP_SUM:
+        case OP_DIFFERENCE:
+        case OP_PRODUCT:
+        case OP_QUOTIENT:
+            *out += "(";
+            expr(ev->operand(0), out);
+            *out += op == OP_SUM ? " + " : op == OP_DIFFERENCE ? " - " : op == OP_PRODUCT ? " * " : " / ";
+            expr(ev->operand(1), out);
+            *out += ")";
+            return;
+        case OP_IF:
+            *out += "(";
+            expr(ev->operand(0), out);
+            *out += " != 0 ? ";
+            expr(ev->operand(1), out);
+            *out += " : ";
+            expr(ev->operand(2), out);
+            *out += ")";
+            return;
+        case OP_POLY:
+            *out += "poly_(";
+            expr(ev->operand(0), out);
+            *out += ", {";
+            for (int i = 1; i < ev->arity(); i++) {
+                if (i != 1)
+                    *out += ", ";
+                expr(ev->operand(i), out);
+            }
+            *out += "})";
+            return;
+        case OP_CHEBYSHEV: {
+            // x is evaluated once, and the fallback only when needed
+            Chebyshev *ch = (Chebyshev *) ev;
+            std::vector<double> &cs = ch->coefficients();
+            *out += "[&]() { double v = ";
+            expr(ev->operand(0), out);
+            *out += "; return v >= " + literal(ch->getLo()) + " && v <= " + literal(ch->getHi())
+                + " ? cheb_(v, " + literal(ch->getLo()) + ", " + literal(ch->getHi()) + ", "
+                + std::to_string(ch->getDegree()) + ", {";
+            for (int i = 0; i < cs.size(); i++) {
+                if (i != 0)
+                    *out += ", ";
+                *out += literal(cs[i]);
+            }
+            *out += "}) : ";
+            expr(ev->operand(1), out);
+            *out += "; }()";
+            return;
+        }
+        case OP_MAX:
+        case OP_MIN:
+            // Folded from -DBL_MAX or DBL_MAX, like Max and Min
+            for (int i = 0; i < ev->arity(); i++)
+                *out += op == OP_MAX ? "max_(" : "min_(";
+            *out += op == OP_MAX ? "-DBL_MAX" : "DBL_MAX";
+            for (int i = 0; i < ev->arity(); i++) {
+                *out += ", ";
+                expr(ev->operand(i), out);
+                *out += ")";
+            }
+            return;
+        case OP_CALL:
+            *out += symbol(((Call *) ev)->getName()) + "(";
+            for (int i = 0; i < ev->arity(); i++) {
+                if (i != 0)
+                    *out += ", ";
+                expr(ev->operand(i), out);
+            }
+            *out += ")";
+            return;
+    }
+    *out += calls[op];
+    *out += "(";
+    for (int i = 0; i < ev->arity(); i++) {
+        if (i != 0)
+            *out += ", ";
+        expr(ev->operand(i), out);
+    }
+    *out += ")";
+}
+
+// A function body in tail position: conditionals become if statements,
+// and tail calls run in constant stack, as they do in the interpreter.
+// Self-recursive ones become jumps back to the top; the others leave the
+// target and its arguments in next_ and targs_, for the caller's wrapper
+// to run in its place.
+void Exporter::tail(Evaluator *ev, std::string name, Function *self, std::map<std::string, int> &ids, std::string *out, int indent) {
+    std::string pad(indent, ' ');
+    int op = ev->opcode();
+    if (op == OP_IDENTITY || op == OP_POSITIVE || op == OP_PROBE) {
+        tail(ev->operand(0), name, self, ids, out, indent);
+    } else if (op == OP_FORK) {
+        tail(((Fork *) ev)->getOperand(), name, self, ids, out, indent);
+    } else if (op == OP_IF) {
+        *out += pad + "if (";
+        expr(ev->operand(0), out);
+        *out += " != 0) {\n";
+        tail(ev->operand(1), name, self, ids, out, indent + 4);
+        *out += pad + "} else {\n";
+        tail(ev->operand(2), name, self, ids, out, indent + 4);
+        *out += pad + "}\n";
+    } else if (op == OP_CALL && ((Call *) ev)->getName() == name) {
+        std::vector<std::string> &params = self->params();
+        char buf[20];
+        for (int i = 0; i < params.size(); i++) {
+            sprintf(buf, "t%d", i);
+            *out += pad + "double " + buf + " = ";
+            expr(ev->operand(i), out);
+            *out += ";\n";
+        }
+        for (int i = 0; i < params.size(); i++) {
+            sprintf(buf, "t%d", i);
+            *out += pad + "p_" + params[i] + " = " + buf + ";\n";
+        }
+        *out += pad + "if (charge_(" + std::to_string(nodes(self->body())) + "))\n";
+        *out += pad + "    return 0;\n";
+        *out += pad + "goto top;\n";
+    } else if (op == OP_CALL) {
+        // The arguments may make calls of their own, which use targs_
+        char buf[20];
+        for (int i = 0; i < ev->arity(); i++) {
+            sprintf(buf, "t%d", i);
+            *out += pad + "double " + buf + " = ";
+            expr(ev->operand(i), out);
+            *out += ";\n";
+        }
+        for (int i = 0; i < ev->arity(); i++) {
+            sprintf(buf, "%d", i);
+            *out += pad + "targs_[" + buf + "] = t" + buf + ";\n";
+        }
+        *out += pad + "next_ = " + std::to_string(ids[((Call *) ev)->getName()]) + ";\n";
+        *out += pad + "return 0;\n";
+    } else {
+        *out += pad + "return ";
+        expr(ev, out);
+        *out += ";\n";
+    }
+}
+
+int Exporter::run(Context *c, std::string base, std::string *error) {
+    std::map<std::string, Function *> &functions = c->getFunctions();
+    std::map<std::string, Function *>::iterator it;
+
+    // Drop functions that can't be translated, then the ones that call
+    // those, until nothing changes
+    std::map<std::string, Function *> chosen;
+    for (it = functions.begin(); it != functions.end(); it++)
+        if (identifier(it->first) && exportable(it->second, c))
+            chosen[it->first] = it->second;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (it = chosen.begin(); it != chosen.end(); ) {
+            bool ok = true;
+            std::vector<Evaluator *> stack;
+            stack.push_back(it->second->body());
+            while (ok && !stack.empty()) {
+                Evaluator *ev = stack.back();
+                stack.pop_back();
+                if (ev->opcode() == OP_FORK)
+                    ev = ((Fork *) ev)->getOperand();
+                else if (ev->opcode() == OP_CALL)
+                    ok = chosen.count(((Call *) ev)->getName()) != 0;
+                for (int i = 0; i < ev->arity(); i++)
+                    stack.push_back(ev->operand(i));
+            }
+            if (ok)
+                it++;
+            else {
+                chosen.erase(it++);
+                changed = true;
+            }
+        }
+    }
+    if (chosen.empty()) {
+        *error = "No functions can be exported";
+        return -1;
+    }
+    std::map<std::string, int> ids;
+    int arity = 1;
+    for (it = chosen.begin(); it != chosen.end(); it++) {
+        int id = ids.size();
+        ids[it->first] = id;
+        arity = std::max(arity, it->second->arity());
+    }
+
+    // Every function counts its depth, like Context::push(), and gives up
+    // once an error has occurred. It counts its steps too, like
+    // Function::eval(), and hands them to the interpreter through b_settle
+    // on the way in and out, and whenever there are as many as it says may
+    // be taken before the next call; 0 means the Budget has run out. The
+    // entry points take their arguments as an array, and the depth still
+    // available. Tail calls between functions are run by the wrapper of the
+    // caller, through tail_(), so that they take no stack.
+    std::string src =
+        "// Generated by the parser's export command\n"
+        "#include <math.h>\n"
+        "#include <float.h>\n"
+        "#include <initializer_list>\n"
+        "#include <vector>\n"
+        "\n"
+        "static thread_local int depth, limit, failed, next_;\n"
+        "static thread_local long long steps, check_;\n"
+        "static thread_local double targs_[" + std::to_string(arity) + "];\n"
+        "extern \"C\" { long long (*b_settle)(long long); }\n"
+        "static double tail_();\n"
+        "\n"
+        "static inline bool charge_(int n) {\n"
+        "    if ((steps += n) < check_)\n"
+        "        return false;\n"
+        "    long long s = steps;\n"
+        "    steps = 0;\n"
+        "    if ((check_ = b_settle(s)) != 0)\n"
+        "        return false;\n"
+        "    failed = 2;\n"
+        "    return true;\n"
+        "}\n"
+        "\n"
+        "static inline double max_(double r, double v) { return v > r ? v : r; }\n"
+        "static inline double min_(double r, double v) { return v < r ? v : r; }\n"
+        "\n"
+        // Polynomial::evaluate(), with the same choice of multiply-add
+#ifdef FP_FAST_FMA
+        "#define MADD(a, b, c) fma(a, b, c)\n"
+#else
+        "#define MADD(a, b, c) ((a) * (b) + (c))\n"
+#endif
+        "static double poly_(double x, std::initializer_list<double> cs) {\n"
+        "    int n = cs.size();\n"
+        "    std::vector<double> b(cs);\n"
+        "    if (n <= " + std::to_string(Polynomial::ESTRIN_DEGREE) + ") {\n"
+        "        double p = b[n - 1];\n"
+        "        for (int i = n - 2; i >= 0; i--)\n"
+        "            p = MADD(p, x, b[i]);\n"
+        "        return p;\n"
+        "    }\n"
+        "    while (n > 1) {\n"
+        "        int m = n / 2;\n"
+        "        for (int i = 0; i < m; i++)\n"
+        "            b[i] = MADD(b[2 * i + 1], x, b[2 * i]);\n"
+        "        if (n % 2 != 0)\n"
+        "            b[m++] = b[n - 1];\n"
+        "        n = m;\n"
+        "        x *= x;\n"
+        "    }\n"
+        "    return b[0];\n"
+        "}\n"
+        "\n"
+        // Chebyshev::evaluate()
+        "static double cheb_(double v, double lo, double hi, int degree, std::initializer_list<double> cs) {\n"
+        "    int pieces = cs.size() / (degree + 1);\n"
+        "    double u = (v - lo) * (pieces / (hi - lo));\n"
+        "    int i = (int) u;\n"
+        "    if (i >= pieces)\n"
+        "        i = pieces - 1;\n"
+        "    double t = 2 * (u - i) - 1;\n"
+        "    const double *a = cs.begin() + i * (degree + 1);\n"
+        "    double b1 = 0, b2 = 0;\n"
+        "    for (int k = degree; k >= 1; k--) {\n"
+        "        double b0 = 2 * t * b1 - b2 + a[k];\n"
+        "        b2 = b1;\n"
+        "        b1 = b0;\n"
+        "    }\n"
+        "    return t * b1 - b2 + a[0];\n"
+        "}\n"
+        "\n";
+    // Below exact precision, the transcendental functions are the
+    // interpreter's, through pointers that are set when the code is loaded
+    static const char *redirected[] = { "acos", "asin", "atan", "cos", "exp", "log", "sin", "tan" };
+    int n = sizeof(redirected) / sizeof(redirected[0]);
+    if (c->getPrecision() != PRECISION_EXACT) {
+        src += "extern \"C\" {\n";
+        for (int i = 0; i < n; i++)
+            src += std::string("double (*m_") + redirected[i] + ")(double);\n";
+        src += "double (*m_pow)(double, double);\n";
+        src += "}\n";
+        for (int i = 0; i < n; i++)
+            src += std::string("#define ") + redirected[i] + " m_" + redirected[i] + "\n";
+        src += "#define pow m_pow\n\n";
+    }
+    for (it = chosen.begin(); it != chosen.end(); it++) {
+        std::vector<std::string> &params = it->second->params();
+        std::string decl;
+        for (int i = 0; i < params.size(); i++)
+            decl += (i == 0 ? "double p_" : ", double p_") + params[i];
+        src += "static double " + symbol(it->first) + "(" + decl + ");\n";
+        src += "static double b_" + it->first + "(" + decl + ");\n";
+    }
+    for (it = chosen.begin(); it != chosen.end(); it++) {
+        std::vector<std::string> &params = it->second->params();
+        std::string decl, args, array;
+        char buf[20];
+        for (int i = 0; i < params.size(); i++) {
+            sprintf(buf, "%d", i);
+            decl += (i == 0 ? "double p_" : ", double p_") + params[i];
+            args += (i == 0 ? "p_" : ", p_") + params[i];
+            array += (i == 0 ? "args[" : ", args[") + std::string(buf) + "]";
+        }
+        std::string name = symbol(it->first);
+        src += "\nstatic double b_" + it->first + "(" + decl + ") {\n";
+        src += "    top:\n";
+        tail(it->second->body(), it->first, it->second, ids, &src, 4);
+        src += "}\n\n";
+        src += "static double " + name + "(" + decl + ") {\n";
+        src += "    if (failed || charge_(" + std::to_string(nodes(it->second->body())) + "))\n";
+        src += "        return 0;\n";
+        src += "    if (depth >= limit) {\n";
+        src += "        failed = 1;\n";
+        src += "        return 0;\n";
+        src += "    }\n";
+        src += "    depth++;\n";
+        src += "    double r = b_" + it->first + "(" + args + ");\n";
+        src += "    while (next_ != -1 && !failed)\n";
+        src += "        r = tail_();\n";
+        src += "    depth--;\n";
+        src += "    return r;\n";
+        src += "}\n\n";
+        src += "extern \"C\" double x_" + it->first + "(const double *args, int available, int *error) {\n";
+        src += "    depth = 0;\n";
+        src += "    limit = available;\n";
+        src += "    failed = 0;\n";
+        src += "    next_ = -1;\n";
+        src += "    steps = 0;\n";
+        src += "    check_ = b_settle(0);\n";
+        src += "    double r = " + name + "(" + array + ");\n";
+        src += "    if (!failed && b_settle(steps) == 0)\n";
+        src += "        failed = 2;\n";
+        src += "    *error = failed;\n";
+        src += "    return r;\n";
+        src += "}\n";
+    }
+    // Charged like a call, without the depth
+    src += "\nstatic double tail_() {\n";
+    src += "    int k = next_;\n";
+    src += "    next_ = -1;\n";
+    src += "    switch (k) {\n";
+    for (it = chosen.begin(); it != chosen.end(); it++) {
+        std::string args;
+        char buf[20];
+        for (int i = 0; i < it->second->arity(); i++) {
+            sprintf(buf, "targs_[%d]", i);
+            args += (i == 0 ? "" : ", ") + std::string(buf);
+        }
+        src += "        case " + std::to_string(ids[it->first]) + ":\n";
+        src += "            return charge_(" + std::to_string(nodes(it->second->body())) + ") ? 0 : b_" + it->first + "(" + args + ");\n";
+    }
+    src += "    }\n";
+    src += "    return 0;\n";
+    src += "}\n";
+
+    std::string cc = base + ".cc";
+    std::string so = base + ".so";
+    FILE *f = fopen(cc.c_str(), "w");
+    if (f == NULL) {
+        *error = "Can't create " + cc;
+        return -1;
+    }
+    fwrite(src.c_str(), 1, src.length(), f);
+    fclose(f);
+
+    // Contraction into fused multiply-adds would change the results. The
+    // compiler is run without a shell, so the file names are only file
+    // names; $CXX may have arguments of its own, separated by spaces.
+    const char *compiler = getenv("CXX");
+    std::vector<std::string> words;
+    std::string cxx = compiler != NULL ? compiler : "c++";
+    for (size_t p = cxx.find_first_not_of(' '); p != std::string::npos; ) {
+        size_t e = cxx.find(' ', p);
+        words.push_back(cxx.substr(p, e == std::string::npos ? e : e - p));
+        p = cxx.find_first_not_of(' ', e);
+    }
+    if (words.empty())
+        words.push_back("c++");
+    const char *flags[] = { "-std=c++11", "-O2", "-ffp-contract=off", "-fPIC", "-shared", "-o" };
+    words.insert(words.end(), flags, flags + sizeof(flags) / sizeof(flags[0]));
+    words.push_back(so);
+    words.push_back(cc);
+    std::vector<char *> argv;
+    std::string cmd;
+    for (int i = 0; i < words.size(); i++) {
+        argv.push_back((char *) words[i].c_str());
+        cmd += (i == 0 ? "" : " ") + words[i];
+    }
+    argv.push_back(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], &argv[0]);
+        _exit(127);
+    }
+    int status = -1;
+    if (pid != -1)
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        *error = "Compilation failed: " + cmd;
+        return -1;
+    }
+    // dlopen() only looks in the search path for names without a slash
+    void *lib = dlopen((so.find('/') == std::string::npos ? "./" + so : so).c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        *error = dlerror();
+        return -1;
+    }
+    struct stat st;
+    c->addLibrary(lib, stat(so.c_str(), &st) == 0 ? st.st_size : 0);
+    long long (**settle)(long long) = (long long (**)(long long)) dlsym(lib, "b_settle");
+    if (settle == NULL) {
+        *error = dlerror();
+        return -1;
+    }
+    *settle = settleNative;
+    if (c->getPrecision() != PRECISION_EXACT) {
+        typedef double (*Unary)(double);
+        typedef double (*Binary)(double, double);
+        bool fast = c->getPrecision() == PRECISION_FAST;
+        Unary unary[] = {
+            fast ? Math::fastAcos : Math::approxAcos,
+            fast ? Math::fastAsin : Math::approxAsin,
+            fast ? Math::fastAtan : Math::approxAtan,
+            fast ? Math::fastCos : Math::approxCos,
+            fast ? Math::fastExp : Math::approxExp,
+            fast ? Math::fastLog : Math::approxLog,
+            fast ? Math::fastSin : Math::approxSin,
+            fast ? Math::fastTan : Math::approxTan
+        };
+        for (int i = 0; i < n; i++) {
+            Unary *slot = (Unary *) dlsym(lib, (std::string("m_") + redirected[i]).c_str());
+            if (slot == NULL) {
+                *error = dlerror();
+                return -1;
+            }
+            *slot = unary[i];
+        }
+        Binary *slot = (Binary *) dlsym(lib, "m_pow");
+        if (slot == NULL) {
+            *error = dlerror();
+            return -1;
+        }
+        *slot = fast ? Math::fastPow : Math::approxPow;
+    }
+    for (it = chosen.begin(); it != chosen.end(); it++) {
+        Function::Native fn = (Function::Native) dlsym(lib, ("x_" + it->first).c_str());
+        if (fn == NULL) {
+            *error = dlerror();
+            return -1;
+        }
+        it->second->setNative(fn);
+    }
+    return chosen.size();
+}
+
+////////////////////////
+/////  DumpWriter  /////
+////////////////////////
+
+DumpWriter::~DumpWriter() {
+    if (thread.joinable()) {
+        thread.join();
+        delete dest;
+    } else
+        flush();
+    for (int i = 0; i < functions.size(); i++)
+        Evaluator::release(functions[i].body);
+}
+
+void DumpWriter::write(std::string text) {
+    buffer += text;
+    if (buffer.length() >= BUFSIZE)
+        flush();
+}
+
+void DumpWriter::write(double d) {
+    char buf[50];
+    buffer.append(buf, format(d, buf, sizeof(buf)));
+    if (buffer.length() >= BUFSIZE)
+        flush();
+}
+
+int DumpWriter::format(double d, char *buf, int size) {
+    // What "%.9g" writes, which takes snprintf() a while to work out. The
+    // numbers in definitions mostly have few digits, and those are written
+    // here: if d is the double nearest to n/10^k, for an n of 9 digits at
+    // most, it reads n/10^k to 9 digits, and for k of 4 at most, "%.9g"
+    // writes that in fixed notation. The smallest such k leaves no
+    // trailing zeros.
+    static const double scale[] = { 1, 10, 100, 1000, 10000 };
+    for (int k = 0; k <= 4; k++) {
+        double n = nearbyint(d * scale[k]);
+        if (!(fabs(n) < 1e9))
+            break;
+        if (n / scale[k] != d)
+            continue;
+        long digits = (long) fabs(n);
+        char *p = buf + size;
+        for (int i = 0; i < k; i++) {
+            *--p = '0' + digits % 10;
+            digits /= 10;
+        }
+        if (k > 0)
+            *--p = '.';
+        do {
+            *--p = '0' + digits % 10;
+            digits /= 10;
+        } while (digits != 0);
+        if (signbit(d))
+            *--p = '-';
+        int len = buf + size - p;
+        memmove(buf, p, len);
+        return len;
+    }
+    return snprintf(buf, size, "%.9g", d);
+}
+
+void DumpWriter::variable(const std::string &name, double value) {
+    buffer += name;
+    buffer += '=';
+    write(value);
+    buffer += '\n';
+}
+
+void DumpWriter::function(const std::string &name, std::vector<std::string> &params, Evaluator *body, const char *tier) {
+    buffer += name;
+    if (alg) {
+        buffer += "=(";
+        for (int i = 0; i < params.size(); i++) {
+            if (i != 0)
+                buffer += ',';
+            buffer += params[i];
+        }
+        buffer += ")=>";
+        algebraic(body, &buffer);
+    } else {
+        buffer += ':';
+        for (int i = 0; i < params.size(); i++) {
+            buffer += params[i];
+            buffer += ' ';
+        }
+        rpn(body, &buffer);
+    }
+    buffer += "  [";
+    buffer += tier;
+    buffer += "]\n";
+    if (buffer.length() >= BUFSIZE)
+        flush();
+}
+
+void DumpWriter::flush() {
+    if (!buffer.empty()) {
+        dest->write(buffer);
+        buffer.clear();
+    }
+}
+
+// The names of the builtins written as calls, by opcode
+static const char *builtinNames[] = {
+    "abs", "acos", "asin", "atan", NULL, "cos", NULL,
+    "exp", NULL, "if", NULL, "log", "max", "min",
+    NULL, NULL, NULL, NULL, NULL, "sin",
+    "sqrt", NULL, "tan", NULL, NULL, NULL, "poly"
+};
+
+// Parentheses, Forks and Probes leave no trace in the text
+static Evaluator *printed(Evaluator *ev) {
+    while (true) {
+        if (ev->opcode() == OP_IDENTITY || ev->opcode() == OP_PROBE)
+            ev = ev->operand(0);
+        else if (ev->opcode() == OP_FORK)
+            ev = ((Fork *) ev)->getOperand();
+        else
+            return ev;
+    }
+}
+
+void DumpWriter::number(double d, std::string *out, bool exact) {
+    char buf[50];
+    if (!exact)
+        out->append(buf, format(d, buf, sizeof(buf)));
+    else if (isnan(d))
+        *out += "(0/0)";
+    else if (isinf(d))
+        *out += d > 0 ? "(1/0)" : "(-1/0)";
+    else
+        out->append(buf, snprintf(buf, sizeof(buf), "%.17g", d));
+}
+
+// Every node is written where an operand of a given precedence is
+// expected. start says if it begins a term, and tight if an operator that
+// binds more tightly than + and - follows it. Those matter for signs: at
+// the start of a term, the parser takes the whole term after a sign as its
+// operand; elsewhere, only the number, name or call that comes next, so
+// that -x^2 is -(x^2), but a*-x^2 is a*(-x)^2. Negative numbers are read
+// the same way, so -2^x is -(2^x). The tree is walked with an explicit
+// stack, so it can be of any depth.
+void DumpWriter::algebraic(Evaluator *ev, std::string *out, bool exact) {
+    // Kept from one tree to the next
+    static thread_local std::vector<Frame> stack;
+    Frame root = { ev, EXPR, true, false, false, -1 };
+    stack.push_back(root);
+    while (!stack.empty()) {
+        Frame &f = stack.back();
+        if (f.next == -1) {
+            f.ev = printed(f.ev);
+            f.next = 0;
+            int op = f.ev->opcode();
+            // Exact infinities and NaNs come in parentheses of their own
+            if (op == OP_NEGATIVE || op == OP_POSITIVE || op == OP_LITERAL && signbit(((Literal *) f.ev)->getValue())
+                    && !(exact && !isfinite(((Literal *) f.ev)->getValue())))
+                f.parens = f.start && f.tight;
+            else if (op == OP_SUM || op == OP_DIFFERENCE)
+                f.parens = f.level > EXPR;
+            else if (op == OP_PRODUCT || op == OP_QUOTIENT)
+                f.parens = f.level > TERM;
+            else if (op == OP_POWER)
+                f.parens = f.level > FACTOR;
+            if (f.parens) {
+                *out += '(';
+                f.start = true;
+                f.tight = false;
+            }
+            switch (op) {
+                case OP_LITERAL:
+                    number(((Literal *) f.ev)->getValue(), out, exact);
+                    break;
+                case OP_VARIABLE:
+                    *out += ((Variable *) f.ev)->getName();
+                    break;
+                case OP_SUM:
+                case OP_DIFFERENCE:
+                case OP_PRODUCT:
+                case OP_QUOTIENT:
+                case OP_POWER:
+                    break;
+                case OP_NEGATIVE:
+                case OP_POSITIVE:
+                    *out += op == OP_NEGATIVE ? '-' : '+';
+                    break;
+                case OP_CALL:
+                    *out += ((Call *) f.ev)->getName();
+                    *out += '(';
+                    break;
+                case OP_WINDOW:
+                    *out += Window::keyword(((Window *) f.ev)->getKind());
+                    *out += '(';
+                    break;
+                case OP_CHEBYSHEV:
+                    *out += "chebyshev(";
+                    break;
+                default:
+                    if (isNumeric(op)) {
+                        *out += Numeric::keyword(op);
+                        *out += '(';
+                        *out += ((Numeric *) f.ev)->getName();
+                    } else {
+                        *out += builtinNames[op];
+                        *out += '(';
+                    }
+                    break;
+            }
+        }
+        int op = f.ev->opcode();
+        if (f.next < f.ev->arity()) {
+            int i = f.next++;
+            // Arguments are whole expressions
+            Frame child = { f.ev->operand(i), EXPR, true, false, false, -1 };
+            switch (op) {
+                case OP_SUM:
+                case OP_DIFFERENCE:
+                    // Left-associative, like the others
+                    if (i == 0)
+                        child.start = f.start;
+                    else {
+                        *out += op == OP_SUM ? '+' : '-';
+                        child.level = TERM;
+                    }
+                    break;
+                case OP_PRODUCT:
+                case OP_QUOTIENT:
+                case OP_POWER:
+                    if (i == 0) {
+                        child.level = op == OP_POWER ? FACTOR : TERM;
+                        child.start = f.start;
+                        child.tight = true;
+                    } else {
+                        *out += op == OP_PRODUCT ? '*' : op == OP_QUOTIENT ? '/' : '^';
+                        child.level = op == OP_POWER ? THING : FACTOR;
+                        child.start = false;
+                        child.tight = f.tight;
+                    }
+                    break;
+                case OP_NEGATIVE:
+                case OP_POSITIVE:
+                    if (f.start)
+                        child.level = TERM;
+                    else {
+                        child.level = THING;
+                        child.start = false;
+                        child.tight = f.tight;
+                    }
+                    break;
+                default:
+                    if (i > 0 || isNumeric(op))
+                        *out += ',';
+                    break;
+            }
+            stack.push_back(child);
+            continue;
+        }
+        switch (op) {
+            case OP_LITERAL:
+            case OP_VARIABLE:
+            case OP_SUM:
+            case OP_DIFFERENCE:
+            case OP_PRODUCT:
+            case OP_QUOTIENT:
+            case OP_POWER:
+            case OP_NEGATIVE:
+            case OP_POSITIVE:
+                break;
+            case OP_WINDOW:
+                *out += ',';
+                number(((Window *) f.ev)->getSize(), out);
+                *out += ')';
+                break;
+            case OP_CHEBYSHEV: {
+                Chebyshev *ch = (Chebyshev *) f.ev;
+                std::vector<double> &cs = ch->coefficients();
+                char buf[80];
+                // Coefficients are written in full, always
+                out->append(buf, snprintf(buf, sizeof(buf), ",%.17g,%.17g,%d", ch->getLo(), ch->getHi(), ch->getDegree()));
+                for (int i = 0; i < cs.size(); i++)
+                    out->append(buf, snprintf(buf, sizeof(buf), ",%.17g", cs[i]));
+                *out += ')';
+                break;
+            }
+            default:
+                *out += ')';
+                break;
+        }
+        if (f.parens)
+            *out += ')';
+        stack.pop_back();
+    }
+    // Not the frames of a very deep one, though
+    if (stack.capacity() > 4096)
+        std::vector<Frame>().swap(stack);
+}
+
+// Operands first, separated by spaces, then the operator, and for those
+// that take any number of operands, how many; Numerics have the name of
+// their function in front
+void DumpWriter::rpn(Evaluator *ev, std::string *out) {
+    static thread_local std::vector<std::pair<Evaluator *, int> > stack;
+    stack.push_back(std::make_pair(printed(ev), 0));
+    while (!stack.empty()) {
+        Evaluator *e = stack.back().first;
+        int i = stack.back().second++;
+        int op = e->opcode();
+        if (i == 0 && isNumeric(op)) {
+            *out += ((Numeric *) e)->getName();
+            *out += ' ';
+        } else if (i > 0 && i < e->arity())
+            *out += ' ';
+        if (i < e->arity()) {
+            stack.push_back(std::make_pair(printed(e->operand(i)), 0));
+            continue;
+        }
+        stack.pop_back();
+        int n = e->arity();
+        switch (op) {
+            case OP_LITERAL:
+                number(((Literal *) e)->getValue(), out);
+                break;
+            case OP_VARIABLE:
+                *out += ((Variable *) e)->getName();
+                break;
+            case OP_SUM:
+                *out += " +";
+                break;
+            case OP_DIFFERENCE:
+                *out += " -";
+                break;
+            case OP_PRODUCT:
+                *out += " *";
+                break;
+            case OP_QUOTIENT:
+                *out += " /";
+                break;
+            case OP_POWER:
+                *out += " ^";
+                break;
+            case OP_NEGATIVE:
+                *out += " +/-";
+                break;
+            case OP_POSITIVE:
+                *out += " nop";
+                break;
+            case OP_CALL:
+                if (n > 0)
+                    *out += ' ';
+                *out += ((Call *) e)->getName();
+                break;
+            case OP_MAX:
+            case OP_MIN:
+            case OP_POLY:
+                if (n > 0)
+                    *out += ' ';
+                number(n, out);
+                *out += ' ';
+                *out += builtinNames[op];
+                break;
+            case OP_WINDOW:
+                *out += ' ';
+                number(((Window *) e)->getSize(), out);
+                *out += ' ';
+                *out += Window::keyword(((Window *) e)->getKind());
+                break;
+            case OP_CHEBYSHEV: {
+                Chebyshev *ch = (Chebyshev *) e;
+                std::vector<double> &cs = ch->coefficients();
+                char buf[80];
+                out->append(buf, snprintf(buf, sizeof(buf), " %.17g %.17g %d", ch->getLo(), ch->getHi(), ch->getDegree()));
+                for (int j = 0; j < cs.size(); j++)
+                    out->append(buf, snprintf(buf, sizeof(buf), " %.17g", cs[j]));
+                *out += ' ';
+                number(cs.size() + 5, out);
+                *out += " chebyshev";
+                break;
+            }
+            default:
+                if (isNumeric(op)) {
+                    *out += ' ';
+                    number(n + 1, out);
+                    *out += ' ';
+                    *out += Numeric::keyword(op);
+                } else {
+                    *out += ' ';
+                    *out += builtinNames[op];
+                }
+                break;
+        }
+    }
+    if (stack.capacity() > 4096)
+        std::vector<std::pair<Evaluator *, int> >().swap(stack);
+}
+
+void DumpWriter::start(Context *c) {
+    // The copies make the snapshot; writing them takes no locks, and
+    // nothing the Context does from here on affects them
+    std::vector<std::string> names;
+    std::vector<double> values;
+    std::map<std::string, double> &vars = c->getVariables();
+    std::map<std::string, Function *> &funcs = c->getFunctions();
+    variables.assign(vars.begin(), vars.end());
+    functions.reserve(funcs.size());
+    for (std::map<std::string, Function *>::iterator it = funcs.begin(); it != funcs.end(); it++) {
+        Definition d;
+        d.name = it->first;
+        d.params = it->second->params();
+        d.body = Optimizer::copy(it->second->body(), names, values);
+        d.tier = it->second->tierName();
+        functions.push_back(d);
+    }
+    thread = std::thread(&DumpWriter::run, this);
+}
+
+void DumpWriter::run() {
+    for (int i = 0; i < variables.size(); i++)
+        variable(variables[i].first, variables[i].second);
+    for (int i = 0; i < functions.size(); i++)
+        function(functions[i].name, functions[i].params, functions[i].body, functions[i].tier);
+    flush();
+    finished = true;
+}
+
+//////////////////////
+/////  TaskPool  /////
+//////////////////////
+
+thread_local TaskPool *TaskPool::current = NULL;
+thread_local int TaskPool::self = -1;
+
+TaskPool::TaskPool(int threads) : pending(0), stopping(false) {
+    // One queue per worker, plus one shared by all other threads
+    for (int i = 0; i <= threads; i++)
+        queues.push_back(new Queue);
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&TaskPool::work, this, i));
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> g(idleLock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (int i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (int i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+void TaskPool::submit(Task *t) {
+    int me = current == this ? self : queues.size() - 1;
+    {
+        std::lock_guard<std::mutex> g(queues[me]->lock);
+        queues[me]->tasks.push_back(t);
+    }
+    pending++;
+    std::lock_guard<std::mutex> g(idleLock);
+    idle.notify_one();
+}
+
+TaskPool::Task *TaskPool::find(int me) {
+    int n = queues.size();
+    for (int k = 0; k < n; k++) {
+        int i = (me + k) % n;
+        Queue *q = queues[i];
+        std::lock_guard<std::mutex> g(q->lock);
+        if (q->tasks.empty())
+            continue;
+        Task *t;
+        if (k == 0) {
+            t = q->tasks.back();
+            q->tasks.pop_back();
+        } else {
+            t = q->tasks.front();
+            q->tasks.pop_front();
+        }
+        pending--;
+        return t;
+    }
+    return NULL;
+}
+
+void TaskPool::work(int me) {
+    current = this;
+    self = me;
+    while (true) {
+        Task *t = find(me);
+        if (t != NULL) {
+            t->run();
+            t->done = true;
+            continue;
+        }
+        std::unique_lock<std::mutex> g(idleLock);
+        idle.wait(g, [this] { return pending > 0 || stopping; });
+        if (stopping)
+            break;
+    }
+}
+
+void TaskPool::wait(Task *t) {
+    int me = current == this ? self : queues.size() - 1;
+    while (!t->done) {
+        Task *o = find(me);
+        if (o != NULL) {
+            o->run();
+            o->done = true;
+        } else
+            std::this_thread::yield();
+    }
+}
+
+//////////////////////////////////////
+/////  here is where it happens  /////
+//////////////////////////////////////
+
+class Lexer {
+
+    private:
+
+    std::string text;
+    int pos;
+
+    public:
+
+    Lexer(std::string text) {
+        this->text = text;
+        pos = 0;
+    }
+
+    int lpos() {
+        return pos;
+    }
+
+    bool nextToken(std::string *tok, int *tpos) {
+        while (pos < text.length() && text[pos] == ' ')
+            pos++;
+        if (pos == text.length()) {
+            *tok = "";
+            *tpos = pos;
+            return true;
+        }
+        int start = pos;
+        *tpos = start;
+        char c = text[pos++];
+        // Compound symbols
+        if (c == '<' || c == '>') {
+            if (pos < text.length()) {
+                char c2 = text[pos + 1];
+                if (c2 == '=' || c == '<' && c2 == '>') {
+                    pos++;
+                    *tok = text.substr(start, 2);
+                    return true;
+                }
+            }
+            *tok = text.substr(start, 1);
+            return true;
+        }
+        // One-character symbols
+        if (c == '+' || c == '-' || c == '*' || c == '/'
+                || c == '(' || c == ')' || c == '[' || c == ']'
+                || c == '^' || c == ':' || c == '=' || c == ',') {
+                // Note: 42S mul/div/NE/LE/GE symbols!
+            *tok = text.substr(start, 1);
+            return true;
+        }
+        // What's left at this point is numbers and names.
+        // Which one we're currently looking at depends on its
+        // first character; if that's a digit or a decimal,
+        // it's a number; anything else, it's a name.
+        bool multi_dot = false;
+        if (c == '.' || c >= '0' && c <= '9') {
+            int state = c == '.' ? 1 : 0;
+            int d0 = c == '.' ? 0 : 1;
+            int d1 = 0, d2 = 0;
+            while (pos < text.length()) {
+                c = text[pos];
+                switch (state) {
+                    case 0:
+                        if (c == '.')
+                            state = 1;
+                        else if (c == 'E' || c == 'e')
+                            // Note: 42S exponent symbol!
+                            state = 2;
+                        else if (c >= '0' && c <= '9')
+                            d0++;
+                        else
+                            goto done;
+                        break;
+                    case 1:
+                        if (c == '.') {
+                            multi_dot = true;
+                            goto done;
+                        }
+                        else if (c == 'E' || c == 'e')
+                            // Note: 42S exponent symbol!
+                            state = 2;
+                        else if (c >= '0' && c <= '9')
+                            d1++;
+                        else
+                            goto done;
+                        break;
+                    case 2:
+                        if (c == '-' || c == '+')
+                            state = 3;
+                        else if (c >= '0' && c <= '9') {
+                            d2++;
+                            state = 3;
+                        } else
+                            goto done;
+                        break;
+                    case 3:
+                        if (c >= '0' && c <= '9')
+                            d2++;
+                        else
                             goto done;
                         break;
                 }
                 pos++;
             }
-            done:
-            // Invalid number scenarios:
-            if (d0 == 0 && d1 == 0 // A '.' not followed by a digit.
-                    || multi_dot // Multiple periods
-                    || state == 2  // An 'E' not followed by a valid character.
-                    || state == 3 && d2 == 0) { // An 'E' not followed by at least one digit
-                *tok = "";
-                return false;
+            done:
+            // Invalid number scenarios:
+            if (d0 == 0 && d1 == 0 // A '.' not followed by a digit.
+                    || multi_dot // Multiple periods
+                    || state == 2  // An 'E' not followed by a valid character.
+                    || state == 3 && d2 == 0) { // An 'E' not followed by at least one digit
+                *tok = "";
+                return false;
+            }
+            *tok = text.substr(start, pos - start);
+            return true;
+        } else {
+            while (pos < text.length()) {
+                char c = text[pos];
+                if (c == '+' || c == '-' || c == '*' || c == '/'
+                        || c == '(' || c == ')' || c == '[' || c == ']'
+                        || c == '^' || c == ':' || c == '=' || c == ','
+                        // Note: 42S mul/div/NE/LE/GE symbols!
+                        || c == '<' || c == '>')
+                    break;
+                pos++;
+            }
+            *tok = text.substr(start, pos - start);
+            return true;
+        }
+    }
+};
+
+class Parser {
+
+    private:
+
+    std::string text;
+    Lexer *lex;
+    std::string pb;
+    int pbpos;
+    // Parentheses, argument lists and signs open; input nested more deeply
+    // than MAX_DEPTH is rejected, before the recursion runs out of stack
+    int depth;
+    static const int MAX_DEPTH = 5000;
+
+    public:
+
+    static Evaluator *parse(std::string expr, int *errpos) {
+        Parser pz(expr);
+        Evaluator *ev = pz.parseExpr();
+        if (ev == NULL)
+            *errpos = pz.lex->lpos();
+        return ev;
+    }
+
+    private:
+
+    Parser(std::string expr) : text(expr), pbpos(-1), depth(0) {
+        lex = new Lexer(expr);
+    }
+
+    ~Parser() {
+        delete lex;
+    }
+
+    Evaluator *parseExpr() {
+        Evaluator *ev = parseTerm();
+        if (ev == NULL)
+            return NULL;
+        while (true) {
+            std::string t;
+            int tpos;
+            if (!nextToken(&t, &tpos)) {
+                delete ev;
+                return NULL;
+            }
+            if (t == "")
+                return ev;
+            if (t == "+" || t == "-") {
+                Evaluator *ev2 = parseTerm();
+                if (ev2 == NULL) {
+                    delete ev;
+                    return NULL;
+                }
+                if (t == "+")
+                    ev = new Sum(tpos, ev, ev2);
+                else
+                    ev = new Difference(tpos, ev, ev2);
+            } else {
+                pushback(t, tpos);
+                return ev;
+            }
+        }
+    }
+
+    Evaluator *parseTerm() {
+        std::string t;
+        int tpos;
+        if (!nextToken(&t, &tpos) || t == "")
+            return NULL;
+        if (t == "-" || t == "+") {
+            if (++depth > MAX_DEPTH)
+                return NULL;
+            Evaluator *ev = parseTerm();
+            if (ev == NULL)
+                return NULL;
+            depth--;
+            if (t == "+")
+                return new Positive(tpos, ev);
+            else
+                return new Negative(tpos, ev);
+        } else {
+            pushback(t, tpos);
+            Evaluator *ev = parseFactor();
+            if (ev == NULL)
+                return NULL;
+            while (true) {
+                if (!nextToken(&t, &tpos)) {
+                    delete ev;
+                    return NULL;
+                }
+                if (t == "")
+                    return ev;
+                if (t == "*" || t == "/") {
+                    Evaluator *ev2 = parseFactor();
+                    if (ev2 == NULL) {
+                        delete ev;
+                        return NULL;
+                    }
+                    if (t == "*")
+                        ev = new Product(tpos, ev, ev2);
+                    else
+                        ev = new Quotient(tpos, ev, ev2);
+                } else {
+                    pushback(t, tpos);
+                    return ev;
+                }
+            }
+        }
+    }
+
+    Evaluator *parseFactor() {
+        Evaluator *ev = parseThing();
+        if (ev == NULL)
+            return NULL;
+        while (true) {
+            std::string t;
+            int tpos;
+            if (!nextToken(&t, &tpos)) {
+                fail:
+                delete ev;
+                return NULL;
+            }
+            if (t == "^") {
+                Evaluator *ev2 = parseThing();
+                if (ev2 == NULL)
+                    goto fail;
+                ev = new Power(tpos, ev, ev2);
+            } else {
+                pushback(t, tpos);
+                return ev;
+            }
+        }
+    }
+
+    Evaluator *parseThing() {
+        std::string t;
+        int tpos;
+        if (!nextToken(&t, &tpos) || t == "")
+            return NULL;
+        if (t == "-" || t == "+") {
+            if (++depth > MAX_DEPTH)
+                return NULL;
+            Evaluator *ev = parseThing();
+            if (ev == NULL)
+                return NULL;
+            depth--;
+            if (t == "+")
+                return new Positive(tpos, ev);
+            else
+                return new Negative(tpos, ev);
+        }
+        double d;
+        if (sscanf(t.c_str(), "%lf", &d) == 1) {
+            return new Literal(tpos, d);
+        } else if (!isOperator(t)) {
+            std::string t2;
+            int t2pos;
+            if (!nextToken(&t2, &t2pos))
+                return NULL;
+            if (t2 == "(") {
+                if (++depth > MAX_DEPTH)
+                    return NULL;
+                std::vector<Evaluator *> *evs = parseExprList();
+                if (evs == NULL)
+                    return NULL;
+                depth--;
+                if (!nextToken(&t2, &t2pos) || t2 != ")") {
+                    fail:
+                    for (int i = 0; i < evs->size(); i++)
+                        delete (*evs)[i];
+                    delete evs;
+                    return NULL;
+                }
+                /* TODO: Parsing an arbitrarily long argument list when you
+                 * know you know exactly one seems a bit stupid, and will lead
+                 * to unhelpful error messages.
+                 */
+                if (t == "sin" || t == "cos" || t == "tan"
+                        || t == "asin" || t == "acos" || t == "atan"
+                        || t == "log" || t == "exp" || t == "sqrt"
+                        || t == "abs") {
+                    if (evs->size() != 1)
+                        goto fail;
+                    Evaluator *ev = (*evs)[0];
+                    delete evs;
+                    if (t == "sin")
+                        return new Sin(tpos, ev);
+                    else if (t == "cos")
+                        return new Cos(tpos, ev);
+                    else if (t == "tan")
+                        return new Tan(tpos, ev);
+                    else if (t == "asin")
+                        return new Asin(tpos, ev);
+                    else if (t == "acos")
+                        return new Acos(tpos, ev);
+                    else if (t == "atan")
+                        return new Atan(tpos, ev);
+                    else if (t == "log")
+                        return new Log(tpos, ev);
+                    else if (t == "exp")
+                        return new Exp(tpos, ev);
+                    else if (t == "sqrt")
+                        return new Sqrt(tpos, ev);
+                    else // t == "abs"
+                        return new Abs(tpos, ev);
+                } else if (t == "if") {
+                    if (evs->size() != 3)
+                        goto fail;
+                    Evaluator *ev = new If(tpos, (*evs)[0], (*evs)[1], (*evs)[2]);
+                    delete evs;
+                    return ev;
+                } else if (t == "poly") {
+                    if (evs->size() < 2)
+                        goto fail;
+                    return new Polynomial(tpos, evs);
+                } else if (t == "chebyshev") {
+                    // chebyshev(x, fallback, lo, hi, degree, coefficients...),
+                    // all numbers after the fallback
+                    std::vector<double> nums;
+                    for (int i = 2; i < evs->size(); i++) {
+                        double d;
+                        if (!number((*evs)[i], &d))
+                            goto fail;
+                        nums.push_back(d);
+                    }
+                    if (nums.size() < 4 || !(nums[0] < nums[1]) || !(nums[2] >= 0 && nums[2] <= Chebyshev::FIT_DEGREE)
+                            || nums[2] != (int) nums[2] || (nums.size() - 3) % ((int) nums[2] + 1) != 0)
+                        goto fail;
+                    std::vector<double> coefs(nums.begin() + 3, nums.end());
+                    Evaluator *ev = new Chebyshev(tpos, (*evs)[0], (*evs)[1], nums[0], nums[1], (int) nums[2], coefs);
+                    for (int i = 2; i < evs->size(); i++)
+                        delete (*evs)[i];
+                    delete evs;
+                    return ev;
+                } else if (Window::kindOf(t) != -1) {
+                    // The window's length is a number
+                    double n;
+                    if (evs->size() != 2 || !number((*evs)[1], &n) || !(n >= 1 && n <= Window::MAX_SIZE) || n != (int) n)
+                        goto fail;
+                    Evaluator *ev = new Window(tpos, Window::kindOf(t), (*evs)[0], (int) n);
+                    delete (*evs)[1];
+                    delete evs;
+                    return ev;
+                } else if (Numeric::opcode(t) != -1) {
+                    // The function by name, then the numbers it takes
+                    int op = Numeric::opcode(t);
+                    int min = op == OP_INTEGRATE ? 3 : op == OP_SOLVE || op == OP_MINIMIZE ? 2 : 3;
+                    int max = op == OP_INTEGRATE || op == OP_SOLVE || op == OP_MINIMIZE ? min + 1 : min;
+                    if (evs->size() < min || evs->size() > max || (*evs)[0]->opcode() != OP_VARIABLE)
+                        goto fail;
+                    std::string name = ((Variable *) (*evs)[0])->getName();
+                    delete (*evs)[0];
+                    evs->erase(evs->begin());
+                    return new Numeric(tpos, op, name, evs);
+                } else if (t == "max")
+                    return new Max(tpos, evs);
+                else if (t == "min")
+                    return new Min(tpos, evs);
+                else
+                    return new Call(tpos, t, evs);
+            } else {
+                pushback(t2, t2pos);
+                return new Variable(tpos, t);
+            }
+        } else if (t == "(") {
+            if (++depth > MAX_DEPTH)
+                return NULL;
+            Evaluator *ev = parseExpr();
+            if (ev == NULL)
+                return NULL;
+            depth--;
+            std::string t2;
+            int t2pos;
+            if (!nextToken(&t2, &t2pos) || t2 != ")") {
+                delete ev;
+                return NULL;
+            }
+            return new Identity(tpos, ev);
+        } else
+            return NULL;
+    }
+
+    std::vector<Evaluator *> *parseExprList() {
+        std::vector<Evaluator *> *evs = new std::vector<Evaluator *>;
+        while (true) {
+            std::string t;
+            int tpos;
+            if (!nextToken(&t, &tpos)) {
+                fail:
+                for (int i = 0; i < evs->size(); i++)
+                    delete (*evs)[i];
+                delete evs;
+                return NULL;
+            }
+            pushback(t, tpos);
+            if (t == ")")
+                return evs;
+            Evaluator *ev = parseExpr();
+            if (ev == NULL)
+                goto fail;
+            evs->push_back(ev);
+            if (!nextToken(&t, &tpos))
+                goto fail;
+            if (t != ",") {
+                pushback(t, tpos);
+                return evs;
             }
-            *tok = text.substr(start, pos - start);
+        }
+    }
+
+    bool nextToken(std::string *tok, int *tpos) {
+        if (pbpos != -1) {
+            *tok = pb;
+            *tpos = pbpos;
+            pbpos = -1;
             return true;
-        } else {
-            while (pos < text.length()) {
-                char c = text[pos];
-                if (c == '+' || c == '-' || c == '*' || c == '/'
-                        || c == '(' || c == ')' || c == '[' || c == ']'
-                        || c == '^' || c == ':' || c == '='
-                        // Note: 42S mul/div/NE/LE/GE symbols!
-                        || c == '<' || c == '>')
-                    break;
-                pos++;
-            }
-            *tok = text.substr(start, pos - start);
+        } else
+            return lex->nextToken(tok, tpos);
+    }
+
+    void pushback(std::string o, int p) {
+        pb = o;
+        pbpos = p;
+    }
+
+    // The value of a literal, possibly negated
+    static bool number(Evaluator *ev, double *d) {
+        if (ev->opcode() == OP_NEGATIVE && number(ev->operand(0), d)) {
+            *d = -*d;
+            return true;
+        }
+        if (ev->opcode() != OP_LITERAL)
+            return false;
+        *d = ((Literal *) ev)->getValue();
+        return true;
+    }
+
+    static bool isOperator(const std::string &s) {
+        return s.find_first_of("+-*/^(),") != std::string::npos;
+    }
+};
+
+#ifdef BENCHMARK
+
+////////////////////////////
+/////  Benchmark suite  /////
+////////////////////////////
+
+// Built instead of the REPL when compiled with -DBENCHMARK, as the bench
+// target in the Xcode project does, or e.g.
+//
+//     c++ -std=gnu++14 -O2 -DBENCHMARK -o bench parser.cc
+//
+// Usage: bench [-seed N] [-time seconds] [-filter text] [-o file]
+//
+// Every workload is generated from the seed, so runs with the same seed
+// measure the same work. Results are written as JSON. Workloads that
+// know their answer check it first, and the exit status is 1 if one is
+// wrong.
+
+class Random {
+
+    private:
+
+    uint64_t state;
+
+    public:
+
+    Random(uint64_t seed) : state(seed) {}
+
+    // SplitMix64, so that workloads don't depend on the standard library
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    int below(int n) {
+        return next() % n;
+    }
+
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+class NullOutputStream : public OutputStream {
+    public:
+    long bytes;
+    NullOutputStream() : bytes(0) {}
+    void write(std::string text) { bytes += text.length(); }
+};
+
+static std::string randomLiteral(Random &r) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", 0.5 + r.uniform() * 10);
+    return buf;
+}
+
+// A random expression with the given number of operators. The leaves are
+// literals and the given variables; 'funcs' chooses the unary functions
+// mixed in, if any.
+static std::string randomExpr(Random &r, int ops, std::vector<std::string> &vars, const char **funcs, int nfuncs) {
+    if (ops == 0)
+        return r.below(3) == 0 || vars.empty() ? randomLiteral(r) : vars[r.below(vars.size())];
+    if (nfuncs > 0 && r.below(3) == 0)
+        return std::string(funcs[r.below(nfuncs)]) + "(" + randomExpr(r, ops - 1, vars, funcs, nfuncs) + ")";
+    static const char *binops[] = { "+", "-", "*", "/" };
+    int left = r.below(ops);
+    std::string l = randomExpr(r, left, vars, funcs, nfuncs);
+    std::string rt = randomExpr(r, ops - 1 - left, vars, funcs, nfuncs);
+    return "(" + l + binops[r.below(4)] + rt + ")";
+}
+
+static Evaluator *mustParse(std::string text) {
+    int errpos = 0;
+    Evaluator *ev = Parser::parse(text, &errpos);
+    if (ev == NULL) {
+        fprintf(stderr, "Benchmark expression does not parse (at %d)\n", errpos);
+        exit(1);
+    }
+    return ev;
+}
+
+static void define(Context *c, std::string name, std::string params, std::string body) {
+    std::vector<std::string> paramNames;
+    int p = 0;
+    while (p < params.length()) {
+        int q = params.find(',', p);
+        if (q == std::string::npos)
+            q = params.length();
+        paramNames.push_back(params.substr(p, q - p));
+        p = q + 1;
+    }
+    c->setFunction(name, new Function(paramNames, mustParse(body)));
+}
+
+class Benchmark {
+
+    public:
+
+    std::string name;
+
+    Benchmark(std::string name) : name(name) {}
+    virtual ~Benchmark() {}
+    // Performs one repetition, and returns the number of operations done
+    virtual long run() = 0;
+    // Whether the workload computes what it should; false, with the
+    // message in *error, if it doesn't
+    virtual bool check(std::string *error) { return true; }
+};
+
+class LexBenchmark : public Benchmark {
+    std::string text;
+    public:
+    LexBenchmark(Random &r) : Benchmark("lex_wide") {
+        std::vector<std::string> vars;
+        vars.push_back("x");
+        vars.push_back("alpha");
+        text = randomExpr(r, 20000, vars, NULL, 0);
+    }
+    long run() {
+        Lexer lex(text);
+        std::string tok;
+        int tpos;
+        long n = 0;
+        while (lex.nextToken(&tok, &tpos) && tok != "")
+            n++;
+        return n;
+    }
+};
+
+class ParseBenchmark : public Benchmark {
+    std::string text;
+    public:
+    ParseBenchmark(std::string name, std::string text) : Benchmark(name), text(text) {}
+    long run() {
+        delete mustParse(text);
+        return 1;
+    }
+};
+
+class EvalBenchmark : public Benchmark {
+    Context c;
+    Evaluator *ev;
+    int reps;
+    bool checked;
+    double expected;
+    public:
+    EvalBenchmark(std::string name, std::string text, int reps) : Benchmark(name), ev(mustParse(text)), reps(reps), checked(false) {
+        c.setVariable("x", 1.25);
+        c.setVariable("y", 2.5);
+        c.setVariable("z", 0.75);
+    }
+    ~EvalBenchmark() { delete ev; }
+    Context *context() { return &c; }
+    // The value the expression must have
+    void expect(double d) {
+        checked = true;
+        expected = d;
+    }
+    long run() {
+        volatile double sink = 0;
+        for (int i = 0; i < reps; i++)
+            sink = sink + ev->eval(&c);
+        return reps;
+    }
+    bool check(std::string *error) {
+        if (!checked)
+            return true;
+        double d = ev->eval(&c);
+        if (c.failed()) {
+            *error = c.errorMessage();
+            c.clearError();
+            return false;
+        }
+        if (d == expected)
+            return true;
+        char buf[100];
+        snprintf(buf, sizeof(buf), "got %.17g, expected %.17g", d, expected);
+        *error = buf;
+        return false;
+    }
+};
+
+// Explain's search for repeated subtrees
+class RepeatBenchmark : public Benchmark {
+    Context c;
+    Evaluator *ev;
+    std::map<Evaluator *, double> costs;
+    std::string subtree;
+    int times;
+    public:
+    // The costliest repeated subtree must be the one given, in algebraic
+    // notation, occurring the given number of times
+    RepeatBenchmark(std::string name, std::string text, std::string subtree, int times)
+            : Benchmark(name), ev(mustParse(text)), subtree(subtree), times(times) {
+        Optimizer::cost(ev, &c, &costs);
+    }
+    ~RepeatBenchmark() { delete ev; }
+    long run() {
+        std::vector<std::pair<Evaluator *, int> > repeated;
+        Optimizer::repeats(ev, costs, 10, &repeated);
+        return 1;
+    }
+    bool check(std::string *error) {
+        std::vector<std::pair<Evaluator *, int> > repeated;
+        Optimizer::repeats(ev, costs, 10, &repeated);
+        if (repeated.empty()) {
+            *error = "nothing repeated";
+            return false;
+        }
+        StringOutputStream alg;
+        repeated[0].first->printAlg(&alg);
+        if (alg.str() == subtree && repeated[0].second == times)
             return true;
+        char buf[32];
+        snprintf(buf, sizeof(buf), " %d times", repeated[0].second);
+        *error = "got " + alg.str() + buf;
+        return false;
+    }
+};
+
+class DumpBenchmark : public Benchmark {
+    Context c;
+    bool alg;
+    public:
+    DumpBenchmark(Random &r, bool alg) : Benchmark(alg ? "dump_alg" : "dump_rpn"), alg(alg) {
+        static const char *funcs[] = { "sin", "exp", "sqrt" };
+        std::vector<std::string> vars;
+        vars.push_back("a");
+        vars.push_back("b");
+        char name[32];
+        for (int i = 0; i < 2000; i++) {
+            snprintf(name, sizeof(name), "v%d", i);
+            c.setVariable(name, r.uniform() * 1000);
+            snprintf(name, sizeof(name), "f%d", i);
+            define(&c, name, "a,b", randomExpr(r, 20, vars, funcs, 3));
+        }
+    }
+    long run() {
+        FileOutputStream os(fopen("/dev/null", "w"));
+        c.dump(&os, alg);
+        return 4000;
+    }
+};
+
+class OutputBenchmark : public Benchmark {
+    std::vector<double> values;
+    public:
+    OutputBenchmark(Random &r) : Benchmark("output_numbers") {
+        for (int i = 0; i < 100000; i++)
+            values.push_back((r.uniform() - 0.5) * pow(10, r.below(20) - 10));
+    }
+    long run() {
+        OutputStream *os = new FileOutputStream(fopen("/dev/null", "w"));
+        for (int i = 0; i < values.size(); i++) {
+            os->write(values[i]);
+            os->newline();
+        }
+        delete os;
+        return values.size();
+    }
+};
+
+static std::vector<Benchmark *> makeBenchmarks(uint64_t seed) {
+    std::vector<Benchmark *> bs;
+    Random r(seed);
+    std::vector<std::string> xyz;
+    xyz.push_back("x");
+    xyz.push_back("y");
+    xyz.push_back("z");
+    static const char *trig[] = { "sin", "cos", "exp", "log", "sqrt", "atan" };
+
+    bs.push_back(new LexBenchmark(r));
+
+    bs.push_back(new ParseBenchmark("parse_wide", randomExpr(r, 20000, xyz, NULL, 0)));
+    std::string deep = "x";
+    for (int i = 0; i < 500; i++)
+        deep = "(" + deep + (r.below(2) ? "+" : "*") + randomLiteral(r) + ")";
+    bs.push_back(new ParseBenchmark("parse_deep", deep));
+    std::string chain = "x";
+    for (int i = 0; i < 20000; i++)
+        chain += "+" + xyz[r.below(3)];
+    bs.push_back(new ParseBenchmark("parse_chain", chain));
+
+    bs.push_back(new EvalBenchmark("eval_arith", randomExpr(r, 1000, xyz, NULL, 0), 100));
+    bs.push_back(new EvalBenchmark("eval_transcendental", randomExpr(r, 1000, xyz, trig, 6), 100));
+
+    EvalBenchmark *fib = new EvalBenchmark("eval_call_fib", "fib(20)", 1);
+    define(fib->context(), "fib", "n", "if(n-1,if(n-2,fib(n-1)+fib(n-2),1),1)");
+    bs.push_back(fib);
+    EvalBenchmark *loop = new EvalBenchmark("eval_call_tail", "loop(100000,0)", 1);
+    define(loop->context(), "loop", "n,acc", "if(n,loop(n-1,acc+n*0.5),acc)");
+    loop->expect(2500025000.0);
+    bs.push_back(loop);
+    // A tail call must not take away the caller's parameters from a
+    // target that refers to them
+    EvalBenchmark *scope = new EvalBenchmark("eval_call_tail_scope", "f(5)", 1000);
+    define(scope->context(), "g", "y", "y+a");
+    define(scope->context(), "f", "a", "g(1)");
+    scope->expect(6);
+    bs.push_back(scope);
+
+    // Lookups of many globals, and of parameters through nested calls
+    std::vector<std::string> globals;
+    char name[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "v%d", i);
+        globals.push_back(name);
+    }
+    std::vector<int> picked;
+    for (int i = 0; i <= 200; i++)
+        picked.push_back(r.below(1000));
+    std::string lookups = globals[picked[0]];
+    for (int i = 1; i <= 200; i++)
+        lookups += "+" + globals[picked[i]];
+    EvalBenchmark *vars = new EvalBenchmark("eval_globals", lookups, 100);
+    std::vector<double> values;
+    for (int i = 0; i < 1000; i++) {
+        values.push_back(r.uniform());
+        vars->context()->setVariable(globals[i], values[i]);
+    }
+    // The sum, added up in the same order, so exactly
+    double sum = values[picked[0]];
+    for (int i = 1; i <= 200; i++)
+        sum += values[picked[i]];
+    vars->expect(sum);
+    bs.push_back(vars);
+    EvalBenchmark *params = new EvalBenchmark("eval_params", "g4(x,y,z,1)", 1000);
+    define(params->context(), "g1", "a,b,c,d", "a*b+c*d+x*y");
+    define(params->context(), "g2", "e,f,g,h", "g1(e,f,g,h)+e*h+a");
+    define(params->context(), "g3", "i,j,k,l", "g2(i,j,k,l)+i*j+e+a");
+    define(params->context(), "g4", "m,n,o,p", "g3(m,n,o,p)+m*p+i+e+a");
+    bs.push_back(params);
+
+    // Parentheses print like what they enclose, and mustn't count twice
+    bs.push_back(new RepeatBenchmark("explain_repeats", "(x+1)*(x+1)+sin(x+1)", "x+1", 3));
+
+    bs.push_back(new DumpBenchmark(r, true));
+    bs.push_back(new DumpBenchmark(r, false));
+    bs.push_back(new OutputBenchmark(r));
+    return bs;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 42;
+    double minTime = 0.5;
+    const char *filter = NULL;
+    const char *outName = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+            minTime = atof(argv[++i]);
+        else if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            outName = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [-seed N] [-time seconds] [-filter text] [-o file]\n", argv[0]);
+            return 1;
+        }
+    }
+    FILE *f = outName == NULL ? stdout : fopen(outName, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Can't open %s\n", outName);
+        return 1;
+    }
+    OutputStream *out = new FileOutputStream(f);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "{\n  \"seed\": %llu,\n  \"benchmarks\": [", (unsigned long long) seed);
+    out->write(buf);
+
+    std::vector<Benchmark *> bs = makeBenchmarks(seed);
+    bool first = true, wrong = false;
+    for (int i = 0; i < bs.size(); i++) {
+        Benchmark *b = bs[i];
+        if (filter != NULL && b->name.find(filter) == std::string::npos)
+            continue;
+        // A workload that computes the wrong thing isn't worth timing
+        std::string error;
+        if (!b->check(&error)) {
+            fprintf(stderr, "%-22s FAILED: %s\n", b->name.c_str(), error.c_str());
+            wrong = true;
+            continue;
+        }
+        // One repetition to warm up, then repeat until minTime has passed,
+        // and report the median repetition.
+        b->run();
+        std::vector<double> times;
+        long ops = 0;
+        double start = now();
+        do {
+            double t0 = now();
+            ops = b->run();
+            times.push_back(now() - t0);
+        } while (now() - start < minTime || times.size() < 5);
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        snprintf(buf, sizeof(buf), "%s\n    { \"name\": \"%s\", \"repetitions\": %d, \"ops\": %ld, "
+                "\"median_ns\": %.0f, \"min_ns\": %.0f, \"ns_per_op\": %.3f }",
+                first ? "" : ",", b->name.c_str(), (int) times.size(), ops,
+                median * 1e9, times[0] * 1e9, median * 1e9 / ops);
+        out->write(buf);
+        first = false;
+        fprintf(stderr, "%-22s %12.3f ns/op\n", b->name.c_str(), median * 1e9 / ops);
+    }
+    out->write("\n  ]\n}\n");
+    for (int i = 0; i < bs.size(); i++)
+        delete bs[i];
+    delete out;
+    return wrong ? 1 : 0;
+}
+
+#else
+
+static Evaluator *parse(std::string expr, int *errpos, Context *c) {
+    Evaluator *ev;
+    {
+        Telemetry::Phase phase(Telemetry::PARSE);
+        ev = Parser::parse(expr, errpos);
+    }
+    Telemetry::Phase phase(Telemetry::BIND);
+    if (ev != NULL && c->usePolynomials())
+        ev = Optimizer::polynomials(ev, c);
+    if (ev != NULL && c->useReassociation())
+        ev = Optimizer::reassociate(ev);
+    if (ev != NULL && c->getPool() != NULL)
+        ev = Optimizer::parallelize(ev, c);
+    return ev;
+}
+
+static double evaluate(Evaluator *ev, Context *c) {
+    Telemetry::Phase phase(Telemetry::EVAL);
+    if (Program::depth(ev) > Program::DEEP_TREE) {
+        Program p(ev);
+        return p.eval(c);
+    } else
+        return ev->eval(c);
+}
+
+static std::string errorText(int errpos) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Error at %d", errpos);
+    return buf;
+}
+
+static std::string trim(std::string s) {
+    int start = s.find_first_not_of(" \t");
+    int end = s.find_last_not_of(" \t");
+    return start == std::string::npos ? "" : s.substr(start, end - start + 1);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Splits the arguments of a builtin on the commas that are not inside
+// parentheses
+static std::vector<std::string> split(std::string args) {
+    std::vector<std::string> parts;
+    int depth = 0;
+    int start = 0;
+    for (int i = 0; i <= args.length(); i++) {
+        if (i == args.length() || args[i] == ',' && depth == 0) {
+            parts.push_back(trim(args.substr(start, i - start)));
+            start = i + 1;
+        } else if (args[i] == '(')
+            depth++;
+        else if (args[i] == ')')
+            depth--;
+    }
+    return parts;
+}
+
+// Parses and evaluates an argument of a builtin; errors are reported at
+// their position in the argument
+static bool value(Context *c, std::string expr, int offset, double *res, std::string *error) {
+    int errpos;
+    Evaluator *ev = parse(expr, &errpos, c);
+    if (ev == NULL) {
+        *error = errorText(errpos + offset);
+        return false;
+    }
+    *res = evaluate(ev, c);
+    delete ev;
+    if (c->failed()) {
+        *error = "Error: " + c->errorMessage();
+        c->clearError();
+        return false;
+    }
+    return true;
+}
+
+// Handles name=specialize(f, param=expr, ...): defines name as f, with the
+// given parameters fixed, and constant subtrees folded.
+static bool specialize(Context *c, std::string name, std::string args, std::string *error) {
+    std::vector<std::string> parts = split(args);
+    Function *f = c->getFunction(parts[0]);
+    if (f == NULL) {
+        *error = "Undefined function " + parts[0];
+        return false;
+    }
+    std::vector<std::string> names;
+    std::vector<double> values;
+    for (int i = 1; i < parts.size(); i++) {
+        int eqpos = parts[i].find('=');
+        if (eqpos == std::string::npos) {
+            *error = "Expected param=value: " + parts[i];
+            return false;
+        }
+        double v;
+        if (!value(c, parts[i].substr(eqpos + 1), eqpos + 1, &v, error))
+            return false;
+        names.push_back(trim(parts[i].substr(0, eqpos)));
+        values.push_back(v);
+    }
+    Function *g = Optimizer::specialize(f, names, values, c, error);
+    if (g == NULL)
+        return false;
+    return c->define(name, g, error);
+}
+
+// Handles name=approximate(f, lo, hi, tol): defines name as a piecewise
+// Chebyshev approximation of f, within tol on [lo, hi], that evaluates f's
+// body elsewhere. *note tells how it went.
+static bool approximate(Context *c, std::string name, std::string args, std::string *error, std::string *note) {
+    std::vector<std::string> parts = split(args);
+    if (parts.size() != 4) {
+        *error = "Usage: name=approximate(f, lo, hi, tol)";
+        return false;
+    }
+    Function *f = c->getFunction(parts[0]);
+    if (f == NULL) {
+        *error = "Undefined function " + parts[0];
+        return false;
+    }
+    if (f->arity() != 1) {
+        *error = "Only functions of one parameter can be approximated";
+        return false;
+    }
+    double v[3];
+    for (int i = 0; i < 3; i++)
+        if (!value(c, parts[i + 1], 0, &v[i], error))
+            return false;
+    double lo = v[0], hi = v[1], tol = v[2];
+    if (!(lo < hi) || !(tol > 0) || isinf(hi - lo)) {
+        *error = "Expected lo < hi, and tol > 0";
+        return false;
+    }
+    double maxError;
+    Chebyshev *ch = Chebyshev::fit(f, lo, hi, tol, c, &maxError, error);
+    if (ch == NULL)
+        return false;
+    Function *g = new Function(f->params(), ch);
+
+    // Both, over the interval, through whatever tier they are in
+    const int N = 20000;
+    std::vector<double> arg(1);
+    double t[3];
+    t[0] = now();
+    for (int k = 0; k < 2; k++) {
+        Function *h = k == 0 ? f : g;
+        for (int i = 0; i < N; i++) {
+            arg[0] = lo + (hi - lo) * i / (N - 1);
+            h->eval(arg, c);
+        }
+        t[k + 1] = now();
+    }
+    c->clearError();
+    char buf[200];
+    int pieces = ch->coefficients().size() / (ch->getDegree() + 1);
+    snprintf(buf, sizeof(buf), "%s: %d piece%s of degree %d, max error %.3g, %.1fx faster",
+            name.c_str(), pieces, pieces == 1 ? "" : "s", ch->getDegree(), maxError,
+            (t[1] - t[0]) / (t[2] - t[1]));
+    *note = buf;
+    return c->define(name, g, error);
+}
+
+// Handles montecarlo(f, n, dist, ...[, seed]), with a distribution for
+// every parameter of f: uniform(a, b), normal(mean, sd), exponential(rate)
+// or a constant. Returns the estimated mean, with the details in *note.
+static bool montecarlo(Context *c, std::string args, double *mean, std::string *error, std::string *note) {
+    std::vector<std::string> parts = split(args);
+    if (parts.size() < 2) {
+        *error = "Usage: montecarlo(f, n, dist, ...[, seed])";
+        return false;
+    }
+    Function *f = c->getFunction(parts[0]);
+    if (f == NULL) {
+        *error = "Undefined function " + parts[0];
+        return false;
+    }
+    int k = f->arity();
+    if (parts.size() != k + 2 && parts.size() != k + 3) {
+        *error = "Expected a distribution for every parameter of " + parts[0];
+        return false;
+    }
+    double n;
+    if (!value(c, parts[1], 0, &n, error))
+        return false;
+    if (!(n >= 1 && n <= 9007199254740992.0) || n != floor(n)) {
+        *error = "The number of samples must be a positive integer";
+        return false;
+    }
+    std::vector<MonteCarlo::Distribution> dists;
+    for (int j = 0; j < k; j++) {
+        std::string d = parts[2 + j];
+        size_t paren = d.find('(');
+        std::string kind = paren == std::string::npos ? "" : trim(d.substr(0, paren));
+        MonteCarlo::Distribution dist = { MonteCarlo::CONSTANT, 0, 0 };
+        if ((kind == "uniform" || kind == "normal" || kind == "exponential") && d[d.length() - 1] == ')') {
+            dist.kind = kind == "uniform" ? MonteCarlo::UNIFORM : kind == "normal" ? MonteCarlo::NORMAL : MonteCarlo::EXPONENTIAL;
+            std::vector<std::string> ps = split(d.substr(paren + 1, d.length() - paren - 2));
+            if (ps.size() != (dist.kind == MonteCarlo::EXPONENTIAL ? 1 : 2)) {
+                *error = "Usage: uniform(a, b), normal(mean, sd) or exponential(rate)";
+                return false;
+            }
+            if (!value(c, ps[0], 0, &dist.p, error) || ps.size() > 1 && !value(c, ps[1], 0, &dist.q, error))
+                return false;
+            if (dist.kind == MonteCarlo::EXPONENTIAL && !(dist.p > 0)) {
+                *error = "The rate of an exponential distribution must be positive";
+                return false;
+            }
+        } else if (!value(c, d, 0, &dist.p, error))
+            return false;
+        dists.push_back(dist);
+    }
+    double seed = 0;
+    if (parts.size() == k + 3) {
+        if (!value(c, parts[k + 2], 0, &seed, error))
+            return false;
+        if (!(seed >= 0 && seed < 18446744073709551616.0) || seed != floor(seed)) {
+            *error = "The seed must be an integer from 0 to 2^64-1";
+            return false;
+        }
+    }
+    MonteCarlo::Estimate est;
+    if (!MonteCarlo::run(f, (long long) n, dists, (uint64_t) seed, c, &est)) {
+        *error = "Error: " + c->errorMessage();
+        c->clearError();
+        return false;
+    }
+    char buf[100];
+    snprintf(buf, sizeof(buf), "mean %.10g, variance %.6g, standard error %.3g", est.mean, est.variance, est.error);
+    *note = buf;
+    *mean = est.mean;
+    return true;
+}
+
+// Handles a line of the form name=expr or name(params)=expr. On failure,
+// returns false, with the message in *error. Some builtins leave a message
+// in *note on success.
+static bool assign(Context *c, std::string line, std::string *error, std::string *note = NULL) {
+    int eqpos = line.find('=');
+    std::string left = line.substr(0, eqpos);
+    std::string right = line.substr(eqpos + 1);
+    std::string rhs = trim(right);
+    std::string ignored;
+    if (rhs.compare(0, 11, "specialize(") == 0 && rhs[rhs.length() - 1] == ')')
+        return specialize(c, trim(left), rhs.substr(11, rhs.length() - 12), error);
+    if (rhs.compare(0, 12, "approximate(") == 0 && rhs[rhs.length() - 1] == ')')
+        return approximate(c, trim(left), rhs.substr(12, rhs.length() - 13), error, note != NULL ? note : &ignored);
+    if (rhs.compare(0, 11, "montecarlo(") == 0 && rhs[rhs.length() - 1] == ')') {
+        double mean;
+        if (!montecarlo(c, rhs.substr(11, rhs.length() - 12), &mean, error, note != NULL ? note : &ignored))
+            return false;
+        return c->define(trim(left), mean, error);
+    }
+    int p1 = left.find('(');
+    std::string name = left.substr(0, p1);
+    int errpos;
+    if (p1 != std::string::npos) {
+        // Function definition
+        std::vector<std::string> paramNames;
+        while (++p1 < left.length()) {
+            int p2 = left.find_first_of(",)", p1);
+            if (p2 == std::string::npos) {
+                paramNames.push_back(left.substr(p1));
+                break;
+            }
+            paramNames.push_back(left.substr(p1, p2 - p1));
+            p1 = p2;
+        }
+        Evaluator *ev = parse(right, &errpos, c);
+        if (ev == NULL) {
+            *error = errorText(errpos);
+            return false;
+        }
+        if (!c->define(name, new Function(paramNames, ev), error))
+            return false;
+    } else {
+        // Variable assignment
+        Evaluator *ev = parse(right, &errpos, c);
+        if (ev == NULL) {
+            *error = errorText(errpos);
+            return false;
+        }
+        double value = evaluate(ev, c);
+        delete ev;
+        if (c->failed()) {
+            *error = "Error: " + c->errorMessage();
+            c->clearError();
+            return false;
+        }
+        if (!c->define(left, value, error))
+            return false;
+    }
+    return true;
+}
+
+static bool evaluateLine(Context *c, std::string expr, double *result, std::string *error) {
+    int errpos;
+    Evaluator *ev = parse(expr, &errpos, c);
+    if (ev == NULL) {
+        *error = errorText(errpos);
+        return false;
+    }
+    *result = evaluate(ev, c);
+    delete ev;
+    if (c->failed()) {
+        *error = "Error: " + c->errorMessage();
+        c->clearError();
+        return false;
+    }
+    return true;
+}
+
+// Whether the function calls itself, directly or not
+static bool recursive(Context *c, std::string name) {
+    std::vector<std::string> visited;
+    Function *f = c->getFunction(name);
+    std::vector<Evaluator *> work;
+    if (f != NULL)
+        work.push_back(f->body());
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        int op = e->opcode();
+        if (op == OP_CALL || isNumeric(op)) {
+            std::string callee = op == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName();
+            if (callee == name)
+                return true;
+            Function *g = std::find(visited.begin(), visited.end(), callee) == visited.end() ? c->getFunction(callee) : NULL;
+            visited.push_back(callee);
+            if (g != NULL)
+                work.push_back(g->body());
+        }
+        if (op == OP_FORK)
+            work.push_back(((Fork *) e)->getOperand());
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+    return false;
+}
+
+// Handles explain <expr>: the expression as it is evaluated, after the
+// rewrites parse() makes, and as constant folding would leave it; every
+// node with the cycles it is estimated to take, operands included, and
+// its share of the total; the subexpressions that are evaluated more than
+// once; and the functions it uses, with their tiers.
+static bool explain(Context *c, std::string expr, OutputStream *os, std::string *error) {
+    int errpos;
+    Evaluator *ev = parse(expr, &errpos, c);
+    if (ev == NULL) {
+        *error = errorText(errpos);
+        return false;
+    }
+    char buf[256];
+    StringOutputStream plan, folded;
+    ev->printAlg(&plan);
+    os->write("plan: " + plan.str());
+    os->newline();
+
+    // Forks, which are costed as a whole, are counted, and left out
+    int forks = 0;
+    std::vector<Evaluator *> work(1, ev);
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        if (e->opcode() == OP_FORK) {
+            forks++;
+            work.push_back(((Fork *) e)->getOperand());
+        }
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+    if (forks > 0) {
+        snprintf(buf, sizeof(buf), "parallel: %d node%s with operands evaluated on other threads", forks, forks == 1 ? "" : "s");
+        os->write(buf);
+        os->newline();
+    }
+    std::vector<std::string> noNames;
+    std::vector<double> noValues;
+    Evaluator *parsed = ev;
+    ev = Optimizer::copy(parsed, noNames, noValues);
+    delete parsed;
+    Evaluator *f = Optimizer::fold(Optimizer::copy(ev, noNames, noValues), c);
+    f->printAlg(&folded);
+    delete f;
+    c->clearError();
+    if (folded.str() != plan.str()) {
+        os->write("folded: " + folded.str());
+        os->newline();
+    }
+    std::map<Evaluator *, double> costs;
+    double total = Optimizer::cost(ev, c, &costs, true);
+    static const char *precisions[] = { "exact", "fast", "approximate" };
+    snprintf(buf, sizeof(buf), "cost: %.0f cycles, %s, at %s precision", total,
+            Optimizer::calibrated() ? "calibrated" : "estimated", precisions[c->getPrecision()]);
+    os->write(buf);
+    os->newline();
+
+    // The nodes, in preorder, as many as fit on a screen or two
+    const int SHOWN = 100;
+    std::vector<std::pair<Evaluator *, int> > stack;
+    stack.push_back(std::make_pair(ev, 0));
+    int shown = 0, hidden = 0;
+    std::vector<Evaluator *> all;
+    while (!stack.empty()) {
+        Evaluator *e = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        all.push_back(e);
+        if (shown < SHOWN) {
+            std::string note;
+            if (e->opcode() == OP_POWER && c->getPrecision() != PRECISION_EXACT)
+                note = multiplied(e->operand(1), c->getPrecision()) ? "  multiplied out" : "  pow: exponent not an integer up to 4";
+            else if ((e->opcode() == OP_CALL || isNumeric(e->opcode())) && recursive(c, e->opcode() == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName()))
+                note = "  recursive: a guess";
+            double cycles = costs[e];
+            snprintf(buf, sizeof(buf), "%12.0f %6.1f%%  %*s", cycles, total > 0 ? 100 * cycles / total : 0.0, 2 * depth, "");
+            os->write(buf + label(e) + note);
+            os->newline();
+            shown++;
+        } else
+            hidden++;
+        for (int i = e->arity() - 1; i >= 0; i--)
+            stack.push_back(std::make_pair(e->operand(i), depth + 1));
+    }
+    if (hidden > 0) {
+        snprintf(buf, sizeof(buf), "and %d more nodes", hidden);
+        os->write(buf);
+        os->newline();
+    }
+
+    // Subtrees worth computing once that occur more than once, by their
+    // RPN, costliest first; in trees small enough for that to be quick
+    const int MAX_NODES = 5000;
+    const double WORTH = 10;
+    if (all.size() <= MAX_NODES) {
+        std::vector<std::pair<Evaluator *, int> > repeated;
+        Optimizer::repeats(ev, costs, WORTH, &repeated);
+        for (int i = 0; i < repeated.size() && i < 5; i++) {
+            Evaluator *e = repeated[i].first;
+            StringOutputStream alg;
+            e->printAlg(&alg);
+            snprintf(buf, sizeof(buf), ": %d times, %.0f cycles each", repeated[i].second, costs[e]);
+            os->write((i == 0 ? "repeated: " : "          ") + alg.str() + buf);
+            os->newline();
+        }
+    }
+
+    // The functions it calls, directly or not
+    std::vector<std::string> names;
+    work.push_back(ev);
+    while (!work.empty()) {
+        Evaluator *e = work.back();
+        work.pop_back();
+        int op = e->opcode();
+        if (op == OP_CALL || isNumeric(op)) {
+            std::string name = op == OP_CALL ? ((Call *) e)->getName() : ((Numeric *) e)->getName();
+            Function *g = std::find(names.begin(), names.end(), name) == names.end() ? c->getFunction(name) : NULL;
+            names.push_back(name);
+            if (g != NULL)
+                work.push_back(g->body());
+        }
+        if (op == OP_FORK)
+            work.push_back(((Fork *) e)->getOperand());
+        for (int i = 0; i < e->arity(); i++)
+            work.push_back(e->operand(i));
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    for (int i = 0; i < names.size(); i++) {
+        Function *g = c->getFunction(names[i]);
+        if (g == NULL)
+            snprintf(buf, sizeof(buf), "%s: undefined", names[i].c_str());
+        else if (recursive(c, names[i]))
+            snprintf(buf, sizeof(buf), "%s: %s, %ld calls so far, recursive, so its cost depends on its arguments", names[i].c_str(),
+                    g->tierName(), g->callCount());
+        else
+            snprintf(buf, sizeof(buf), "%s: %s, %ld calls so far, %.0f cycles a call", names[i].c_str(),
+                    g->tierName(), g->callCount(), Optimizer::cost(g->body(), c, NULL, true));
+        os->write((i == 0 ? "functions: " : "           ") + std::string(buf));
+        os->newline();
+    }
+    delete ev;
+    return true;
+}
+
+////////////////////
+/////  Server  /////
+////////////////////
+
+// The server protocol. Every message is a frame: a 4-byte little-endian
+// payload length, then the payload. The first byte of a request payload is
+// its type, the rest is text:
+//
+//     'D'  definitions: one or more lines of the form name=expr or
+//          name(params)=expr, separated by newlines
+//     'E'  an expression to evaluate
+//     'B'  a batch of expressions to evaluate, separated by newlines
+//     'R'  a batch, with the results as raw doubles
+//     'F'  a batch, with the results as framed records
+//     'M'  the metrics kept by Telemetry; with the text "prometheus", in
+//          the Prometheus format instead. The server writes no files for
+//          clients; the client writes them.
+//
+// The first byte of a response payload is 'O' if the request succeeded, or
+// 'E' if it failed, followed by the result text: nothing for definitions,
+// one result per line for evaluations, and a message for errors. In a
+// batch, failed expressions show their error message in place of a result.
+// The results of 'R' and 'F' batches are in the formats written by
+// BinaryOutputStream.
+// Clients may send any number of requests without waiting for responses;
+// the responses on a connection come back in request order. A client that
+// shuts down its side of the connection after sending still gets the
+// responses to everything it sent.
+
+static const int MAX_FRAME = 64 << 20;
+
+static std::string frame(char type, std::string text) {
+    std::string f(5, 0);
+    uint32_t n = text.length() + 1;
+    for (int i = 0; i < 4; i++)
+        f[i] = (char) (n >> (8 * i));
+    f[4] = type;
+    return f + text;
+}
+
+// Splits off a complete frame from the front of buf, if there is one.
+// Returns -1 if the frame is invalid.
+static int unframe(std::string &buf, std::string *payload) {
+    if (buf.length() < 4)
+        return 0;
+    uint32_t n = 0;
+    for (int i = 0; i < 4; i++)
+        n |= (uint32_t) (unsigned char) buf[i] << (8 * i);
+    if (n == 0 || n > MAX_FRAME)
+        return -1;
+    if (buf.length() < n + 4)
+        return 0;
+    *payload = buf.substr(4, n);
+    buf.erase(0, n + 4);
+    return 1;
+}
+
+// Parses "path" as a Unix domain socket address, and ":port" as a TCP port
+// on the loopback interface
+static int openSocket(std::string addr, bool listening) {
+    int fd;
+    if (addr[0] == ':') {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            return -1;
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(atoi(addr.c_str() + 1));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int on = 1;
+        if (listening)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        else
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (listening ? bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1 || listen(fd, 64) == -1
+                      : connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un sun;
+        if (addr.length() >= sizeof(sun.sun_path))
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1)
+            return -1;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, addr.c_str());
+        if (listening)
+            unlink(sun.sun_path);
+        if (listening ? bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 || listen(fd, 64) == -1
+                      : connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+            close(fd);
+            return -1;
         }
     }
-};
+    return fd;
+}
 
-class Parser {
+static bool writeFully(int fd, const char *buf, int n) {
+    while (n > 0) {
+        int w = write(fd, buf, n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        buf += w;
+        n -= w;
+    }
+    return true;
+}
+
+class Server {
 
     private:
 
-    std::string text;
-    Lexer *lex;
-    std::string pb;
-    int pbpos;
+    struct Connection {
+        int fd;
+        std::string in;
+        std::deque<std::string> requests;
+        std::mutex lock;
+        std::string out;    // Guarded by lock
+        bool busy;          // Guarded by lock; true while a worker owns it
+        bool eof;           // Guarded by lock; the client sends no more,
+                            // but still gets the responses to what it sent
+        bool closed;        // Guarded by lock; the connection is gone
+        Connection(int fd) : fd(fd), busy(false), eof(false), closed(false) {}
+        bool finished() { return closed || eof && !busy && requests.empty() && out.empty(); }
+    };
+
+    // Definitions take the context exclusively; evaluations share it,
+    // each in a child Context of its own.
+    Context *context;
+    std::mutex contextLock;
+    std::condition_variable contextIdle;
+    int readers;
+
+    // Parsed expressions, and the bytes they take, which count against
+    // the memory quota. Once the quota or CACHE_SIZE is reached, the
+    // cache is full, and is cleared after the evaluations in progress.
+    std::mutex cacheLock;
+    std::map<std::string, Evaluator *> cache;
+    size_t cacheBytes;
+    bool cacheFull;
+
+    static const int CACHE_SIZE = 4096;
+
+    int listenFd;
+    int wakeFds[2];
+    std::vector<Connection *> connections;
+
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::deque<Connection *> queue;
+    std::vector<std::thread> workers;
 
     public:
 
-    static Evaluator *parse(std::string expr, int *errpos) {
-        Parser pz(expr);
-        Evaluator *ev = pz.parseExpr();
-        if (ev == NULL)
-            *errpos = pz.lex->lpos();
-        return ev;
+    Server(Context *c, int fd, int threads) : context(c), readers(0), cacheBytes(0), cacheFull(false), listenFd(fd) {
+        pipe(wakeFds);
+        fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(listenFd, F_SETFL, O_NONBLOCK);
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&Server::work, this));
+    }
+
+    void run() {
+        while (true) {
+            std::vector<struct pollfd> fds(2 + connections.size());
+            fds[0].fd = listenFd;
+            fds[0].events = POLLIN;
+            fds[1].fd = wakeFds[0];
+            fds[1].events = POLLIN;
+            for (int i = 0; i < connections.size(); i++) {
+                Connection *conn = connections[i];
+                std::lock_guard<std::mutex> g(conn->lock);
+                fds[i + 2].fd = conn->fd;
+                fds[i + 2].events = (conn->closed || conn->eof ? 0 : POLLIN) | (conn->out.empty() ? 0 : POLLOUT);
+            }
+            if (poll(&fds[0], fds.size(), -1) == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                int fd;
+                while ((fd = accept(listenFd, NULL, NULL)) != -1) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    connections.push_back(new Connection(fd));
+                }
+            }
+            if (fds[1].revents & POLLIN) {
+                char buf[256];
+                while (read(wakeFds[0], buf, sizeof(buf)) > 0);
+            }
+            for (int i = 0; i < fds.size() - 2; i++) {
+                Connection *conn = connections[i];
+                if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive(conn);
+                flush(conn);
+            }
+            for (int i = connections.size() - 1; i >= 0; i--) {
+                Connection *conn = connections[i];
+                std::unique_lock<std::mutex> g(conn->lock);
+                if (conn->finished() && !conn->busy) {
+                    g.unlock();
+                    close(conn->fd);
+                    delete conn;
+                    connections.erase(connections.begin() + i);
+                }
+            }
+        }
     }
 
     private:
 
-    Parser(std::string expr) : text(expr), pbpos(-1) {
-        lex = new Lexer(expr);
+    void receive(Connection *conn) {
+        char buf[65536];
+        {
+            // After a half-close, a hangup means the responses can no
+            // longer be delivered
+            std::lock_guard<std::mutex> g(conn->lock);
+            if (conn->eof) {
+                conn->closed = true;
+                return;
+            }
+        }
+        while (true) {
+            int n = read(conn->fd, buf, sizeof(buf));
+            if (n > 0) {
+                conn->in.append(buf, n);
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n == -1 && errno == EINTR)
+                continue;
+            // The requests received so far are still answered
+            std::lock_guard<std::mutex> g(conn->lock);
+            if (n == 0)
+                conn->eof = true;
+            else
+                conn->closed = true;
+            break;
+        }
+        std::string payload;
+        int res;
+        bool added = false;
+        std::lock_guard<std::mutex> g(conn->lock);
+        while ((res = unframe(conn->in, &payload)) == 1) {
+            conn->requests.push_back(payload);
+            added = true;
+        }
+        if (res == -1)
+            conn->closed = true;
+        if (added && !conn->busy) {
+            conn->busy = true;
+            std::lock_guard<std::mutex> q(queueLock);
+            queue.push_back(conn);
+            queueReady.notify_one();
+        }
     }
 
-    ~Parser() {
-        delete lex;
+    void flush(Connection *conn) {
+        std::lock_guard<std::mutex> g(conn->lock);
+        while (!conn->out.empty() && !conn->closed) {
+            int n = write(conn->fd, conn->out.c_str(), conn->out.length());
+            if (n > 0)
+                conn->out.erase(0, n);
+            else if (n == -1 && errno == EINTR)
+                continue;
+            else {
+                if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    conn->closed = true;
+                break;
+            }
+        }
     }
 
-    Evaluator *parseExpr() {
-        Evaluator *ev = parseTerm();
-        if (ev == NULL)
-            return NULL;
+    // Worker threads handle the requests of one connection at a time, in
+    // order, so responses need no reordering.
+    void work() {
         while (true) {
-            std::string t;
-            int tpos;
-            if (!nextToken(&t, &tpos)) {
-                delete ev;
-                return NULL;
+            Connection *conn;
+            {
+                std::unique_lock<std::mutex> q(queueLock);
+                queueReady.wait(q, [this] { return !queue.empty(); });
+                conn = queue.front();
+                queue.pop_front();
             }
-            if (t == "")
-                return ev;
-            if (t == "+" || t == "-") {
-                Evaluator *ev2 = parseTerm();
-                if (ev2 == NULL) {
-                    delete ev;
-                    return NULL;
+            while (true) {
+                std::string request;
+                {
+                    std::lock_guard<std::mutex> g(conn->lock);
+                    if (conn->requests.empty() || conn->closed) {
+                        conn->requests.clear();
+                        conn->busy = false;
+                        break;
+                    }
+                    request = conn->requests.front();
+                    conn->requests.pop_front();
                 }
-                if (t == "+")
-                    ev = new Sum(tpos, ev, ev2);
+                std::string response = handle(request);
+                {
+                    std::lock_guard<std::mutex> g(conn->lock);
+                    conn->out += response;
+                }
+                write(wakeFds[1], "", 1);
+            }
+            write(wakeFds[1], "", 1);
+        }
+    }
+
+    std::string handle(std::string request) {
+        char type = request[0];
+        std::string text = request.substr(1);
+        if (type == 'D') {
+            Telemetry::Command command(Telemetry::SERVER_DEFINE);
+            std::unique_lock<std::mutex> g(contextLock);
+            contextIdle.wait(g, [this] { return readers == 0; });
+            clearCache();
+            std::string error;
+            int p = 0;
+            while (p < text.length()) {
+                int q = text.find('\n', p);
+                if (q == std::string::npos)
+                    q = text.length();
+                std::string line = text.substr(p, q - p);
+                p = q + 1;
+                if (line.empty())
+                    continue;
+                if (line.find('=') == std::string::npos)
+                    return frame('E', "Not a definition: " + line);
+                if (!assign(context, line, &error))
+                    return frame('E', error);
+            }
+            return frame('O', "");
+        } else if (type == 'E' || type == 'B' || type == 'R' || type == 'F') {
+            Telemetry::Command command(Telemetry::SERVER_EVAL);
+            {
+                std::lock_guard<std::mutex> g(contextLock);
+                readers++;
+            }
+            StringOutputStream sos;
+            BinaryOutputStream bos(&sos, type == 'F');
+            OutputStream *os = type == 'R' || type == 'F' ? (OutputStream *) &bos : &sos;
+            bool ok = true;
+            int p = 0;
+            while (p < text.length() || p == 0) {
+                int q = type == 'E' ? std::string::npos : text.find('\n', p);
+                if (q == std::string::npos)
+                    q = text.length();
+                std::string expr = text.substr(p, q - p);
+                p = q + 1;
+                std::string error;
+                double value;
+                bool done = evaluate(expr, &value, &error);
+                Telemetry::Phase phase(Telemetry::FORMAT);
+                if (type == 'E') {
+                    if (done)
+                        os->write(value);
+                    else {
+                        os->write(error);
+                        ok = false;
+                    }
+                } else if (type == 'B') {
+                    if (done)
+                        os->write(value);
+                    else
+                        os->write(error);
+                    os->newline();
+                } else if (done)
+                    os->writeResult(value);
                 else
-                    ev = new Difference(tpos, ev, ev2);
+                    os->writeError(error);
+            }
+            {
+                std::lock_guard<std::mutex> g(contextLock);
+                if (--readers == 0)
+                    contextIdle.notify_all();
+            }
+            trimCache();
+            bos.flush();
+            return frame(ok ? 'O' : 'E', sos.str());
+        } else if (type == 'M') {
+            // The metrics, as text, or in the Prometheus format
+            if (text.empty()) {
+                StringOutputStream sos;
+                Telemetry::report(&sos);
+                return frame('O', sos.str());
+            }
+            if (text == "prometheus")
+                return frame('O', Telemetry::prometheus());
+            return frame('E', "Unknown metrics format");
+        } else
+            return frame('E', "Unknown request type");
+    }
+
+    bool evaluate(std::string expr, double *value, std::string *error) {
+        // Parsed expressions are cached until the next definition, so
+        // repeated requests skip parsing. Other evaluations may be using
+        // the trees in the cache, so when it is full, or the quota is
+        // reached, an expression that is not in it is evaluated on its
+        // own, and the cache is cleared once no evaluations are in
+        // progress; see trimCache().
+        Evaluator *ev;
+        bool cached = true;
+        {
+            std::lock_guard<std::mutex> g(cacheLock);
+            std::map<std::string, Evaluator *>::iterator it = cache.find(expr);
+            ev = it == cache.end() ? NULL : it->second;
+        }
+        if (ev == NULL) {
+            int errpos;
+            ev = parse(expr, &errpos, context);
+            if (ev == NULL) {
+                *error = errorText(errpos);
+                return false;
+            }
+            std::lock_guard<std::mutex> g(cacheLock);
+            std::map<std::string, Evaluator *>::iterator it = cache.find(expr);
+            if (it != cache.end()) {
+                delete ev;
+                ev = it->second;
             } else {
-                pushback(t, tpos);
-                return ev;
+                size_t bytes = MAP_NODE + sizeof(std::pair<const std::string, Evaluator *>) + heapBytes(expr) + treeBytes(ev);
+                if (cacheFull || cache.size() >= CACHE_SIZE || !context->admitCode(bytes)) {
+                    cacheFull = true;
+                    cached = false;
+                } else {
+                    cache.insert(std::make_pair(expr, ev));
+                    cacheBytes += bytes;
+                }
             }
         }
+        // The Budget outlives the Context, which charges it as it goes
+        Budget budget(context->getStepLimit(), context->getTimeLimit());
+        Context c(context);
+        if (c.getStepLimit() > 0 || c.getTimeLimit() > 0)
+            c.setBudget(&budget);
+        *value = ::evaluate(ev, &c);
+        if (!cached)
+            delete ev;
+        if (c.failed()) {
+            *error = "Error: " + c.errorMessage();
+            return false;
+        }
+        return true;
     }
 
-    Evaluator *parseTerm() {
-        std::string t;
-        int tpos;
-        if (!nextToken(&t, &tpos) || t == "")
-            return NULL;
-        if (t == "-" || t == "+") {
-            Evaluator *ev = parseTerm();
-            if (ev == NULL)
-                return NULL;
-            if (t == "+")
-                return new Positive(tpos, ev);
+    // Clears a full cache, which takes the context exclusively, like a
+    // definition
+    void trimCache() {
+        {
+            std::lock_guard<std::mutex> g(cacheLock);
+            if (!cacheFull)
+                return;
+        }
+        std::unique_lock<std::mutex> g(contextLock);
+        contextIdle.wait(g, [this] { return readers == 0; });
+        std::lock_guard<std::mutex> c(cacheLock);
+        clearCache();
+    }
+
+    void clearCache() {
+        // Only called with no evaluations in progress
+        for (std::map<std::string, Evaluator *>::iterator it = cache.begin(); it != cache.end(); it++)
+            delete it->second;
+        cache.clear();
+        context->account(0, -(long long) cacheBytes);
+        cacheBytes = 0;
+        cacheFull = false;
+    }
+};
+
+////////////////////
+/////  Client  /////
+////////////////////
+
+// Sends the lines read from stdin to a server: lines containing '=' as
+// definitions, the rest as expressions to evaluate, one request each, or
+// all in one batch request with -batch (-binary makes that a framed binary
+// batch, which is decoded for printing). Without -n, prints the responses. With -n, it is a load generator instead: the definitions are
+// sent once, then each of 'conns' connections sends n evaluation requests,
+// cycling through the expressions, with up to 'depth' requests in flight,
+// and throughput and latency are reported.
+class Client {
+
+    private:
+
+    std::string addr;
+    std::vector<std::string> defs;
+    std::vector<std::string> exprs;
+
+    static bool readFrame(int fd, std::string &buf, std::string *payload) {
+        char tmp[65536];
+        while (true) {
+            int res = unframe(buf, payload);
+            if (res == 1)
+                return true;
+            if (res == -1)
+                return false;
+            int n = read(fd, tmp, sizeof(tmp));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buf.append(tmp, n);
+        }
+    }
+
+    static double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    public:
+
+    Client(std::string addr) : addr(addr) {
+        char *line = NULL;
+        size_t linecap = 0;
+        while (getline(&line, &linecap, stdin) != -1) {
+            std::string s(line);
+            while (!s.empty() && isspace(s[s.length() - 1]))
+                s.erase(s.length() - 1);
+            if (s.empty())
+                continue;
+            if (s.find('=') != std::string::npos)
+                defs.push_back(s);
             else
-                return new Negative(tpos, ev);
+                exprs.push_back(s);
+        }
+        free(line);
+    }
+
+    // Prints the results of a framed binary batch
+    static void decode(std::string data) {
+        int p = 0;
+        while (p < data.length()) {
+            if (data[p] == 0 && p + 9 <= data.length()) {
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; i++)
+                    bits |= (uint64_t) (unsigned char) data[p + 1 + i] << (8 * i);
+                double d;
+                memcpy(&d, &bits, 8);
+                printf("%.17g\n", d);
+                p += 9;
+            } else if (data[p] == 1 && p + 5 <= data.length()) {
+                uint32_t n = 0;
+                for (int i = 0; i < 4; i++)
+                    n |= (uint32_t) (unsigned char) data[p + 1 + i] << (8 * i);
+                printf("%s\n", data.substr(p + 5, n).c_str());
+                p += 5 + n;
+            } else {
+                printf("Bad record\n");
+                break;
+            }
+        }
+    }
+
+    int run(bool batch, bool binary) {
+        int fd = openSocket(addr, false);
+        if (fd == -1) {
+            perror(addr.c_str());
+            return 1;
+        }
+        std::string text;
+        for (int i = 0; i < defs.size(); i++)
+            text += defs[i] + "\n";
+        std::string req = frame('D', text);
+        int responses = 1;
+        if (batch && !exprs.empty()) {
+            text = "";
+            for (int i = 0; i < exprs.size(); i++)
+                text += exprs[i] + (i + 1 < exprs.size() ? "\n" : "");
+            req += frame(binary ? 'F' : 'B', text);
+            responses++;
         } else {
-            pushback(t, tpos);
-            Evaluator *ev = parseFactor();
-            if (ev == NULL)
-                return NULL;
-            while (true) {
-                if (!nextToken(&t, &tpos)) {
-                    delete ev;
-                    return NULL;
+            for (int i = 0; i < exprs.size(); i++)
+                req += frame('E', exprs[i]);
+            responses += exprs.size();
+        }
+        if (!writeFully(fd, req.c_str(), req.length()))
+            return 1;
+        std::string buf, payload;
+        int failures = 0;
+        for (int i = 0; i < responses; i++) {
+            if (!readFrame(fd, buf, &payload))
+                return 1;
+            if (payload[0] != 'O')
+                failures++;
+            if (i > 0 && batch && binary && payload[0] == 'O')
+                decode(payload.substr(1));
+            else if (i > 0 || payload[0] != 'O')
+                printf("%s%s", payload.c_str() + 1, batch && i > 0 ? "" : "\n");
+        }
+        close(fd);
+        return failures == 0 ? 0 : 2;
+    }
+
+    // Prints the server's metrics, or writes them to file in the
+    // Prometheus format; reads nothing from stdin
+    static int metrics(std::string addr, std::string file) {
+        int fd = openSocket(addr, false);
+        if (fd == -1) {
+            perror(addr.c_str());
+            return 1;
+        }
+        std::string req = frame('M', file.empty() ? "" : "prometheus"), buf, payload;
+        if (!writeFully(fd, req.c_str(), req.length()) || !readFrame(fd, buf, &payload))
+            return 1;
+        close(fd);
+        if (payload[0] != 'O') {
+            fprintf(stderr, "%s\n", payload.c_str() + 1);
+            return 2;
+        }
+        if (!file.empty()) {
+            std::string error;
+            if (!Telemetry::write(file, payload.substr(1), &error)) {
+                fprintf(stderr, "%s\n", error.c_str());
+                return 1;
+            }
+        } else
+            printf("%s", payload.c_str() + 1);
+        return 0;
+    }
+
+    int load(int n, int depth, int conns) {
+        if (exprs.empty()) {
+            fprintf(stderr, "No expressions to send\n");
+            return 1;
+        }
+        int fd = openSocket(addr, false);
+        if (fd == -1) {
+            perror(addr.c_str());
+            return 1;
+        }
+        std::string text;
+        for (int i = 0; i < defs.size(); i++)
+            text += defs[i] + "\n";
+        std::string req = frame('D', text), buf, payload;
+        if (!writeFully(fd, req.c_str(), req.length()) || !readFrame(fd, buf, &payload))
+            return 1;
+        close(fd);
+        if (payload[0] != 'O') {
+            fprintf(stderr, "%s\n", payload.c_str() + 1);
+            return 1;
+        }
+
+        std::vector<std::vector<double> > latencies(conns);
+        std::vector<int> errors(conns);
+        std::vector<std::thread> threads;
+        double start = now();
+        for (int c = 0; c < conns; c++)
+            threads.push_back(std::thread(&Client::drive, this, n, depth, &latencies[c], &errors[c]));
+        for (int c = 0; c < conns; c++)
+            threads[c].join();
+        double elapsed = now() - start;
+
+        std::vector<double> all;
+        int failed = 0;
+        for (int c = 0; c < conns; c++) {
+            all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+            failed += errors[c];
+        }
+        std::sort(all.begin(), all.end());
+        if (all.empty())
+            return 1;
+        printf("requests %d, errors %d, %.3f s, %.0f req/s\n", (int) all.size(), failed, elapsed, all.size() / elapsed);
+        printf("latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+                all[all.size() / 2] * 1e6, all[all.size() * 9 / 10] * 1e6,
+                all[all.size() * 99 / 100] * 1e6, all.back() * 1e6);
+        return failed == 0 ? 0 : 2;
+    }
+
+    private:
+
+    void drive(int n, int depth, std::vector<double> *latencies, int *errors) {
+        int fd = openSocket(addr, false);
+        if (fd == -1) {
+            *errors = n;
+            return;
+        }
+        std::deque<double> sent;
+        std::string buf, payload;
+        int next = 0;
+        while (latencies->size() + *errors < n) {
+            std::string req;
+            while (next < n && sent.size() < depth) {
+                req += frame('E', exprs[next % exprs.size()]);
+                sent.push_back(now());
+                next++;
+            }
+            if (!req.empty() && !writeFully(fd, req.c_str(), req.length()))
+                break;
+            if (!readFrame(fd, buf, &payload))
+                break;
+            latencies->push_back(now() - sent.front());
+            sent.pop_front();
+            if (payload[0] != 'O')
+                (*errors)++;
+        }
+        if (latencies->size() + *errors < n)
+            *errors = n - latencies->size();
+        close(fd);
+    }
+};
+
+// Evaluates an expression for every row of a CSV file whose first line
+// names the columns, and writes the results, one per line. Reading and
+// writing have a thread each; in between, workers take chunks of whole
+// lines, parse the fields they need into column blocks, evaluate those a
+// tile at a time, and format the results. Chunks are written in the order
+// they were read, and only a few per worker are in flight at any time.
+// Live, for a stream whose rows arrive over time, a chunk is whatever whole
+// lines have arrived, so that every row's result is written as soon as it
+// can be.
+class CsvPipeline {
+
+    private:
+
+    struct Chunk {
+        long seq;
+        long line;      // Line number of the first row
+        long rows;
+        std::string text;
+        std::string out;
+        std::string error;
+    };
+
+    static const int CHUNK = 1 << 20;
+
+    Context *context;
+    Evaluator *ev;
+    int inFd, outFd;
+    int threads;
+    bool live;
+    std::vector<std::string> names;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Chunk *> pending;
+    std::map<long, Chunk *> finished;
+    int inFlight;
+    long chunks;        // Valid once eof is set
+    bool eof;
+    bool stopping;
+    std::string readError;
+
+    public:
+
+    CsvPipeline(Context *c, Evaluator *ev, int inFd, int outFd, int threads, bool live = false)
+        : context(c), ev(ev), inFd(inFd), outFd(outFd), threads(threads), live(live),
+          inFlight(0), chunks(0), eof(false), stopping(false) {}
+
+    // Returns the number of rows, or -1 on error
+    long run(std::string *error) {
+        std::string text;
+        size_t eol;
+        char buf[4096];
+        int n = 1;
+        while ((eol = text.find('\n')) == std::string::npos && n > 0)
+            if ((n = ::read(inFd, buf, sizeof(buf))) > 0)
+                text.append(buf, n);
+        if (eol == std::string::npos)
+            eol = text.length();
+        std::string header = text.substr(0, eol);
+        text.erase(0, eol + 1);
+        size_t start = 0;
+        while (start <= header.length()) {
+            size_t end = header.find(',', start);
+            if (end == std::string::npos)
+                end = header.length();
+            std::string name = header.substr(start, end - start);
+            while (!name.empty() && isspace(name[name.length() - 1]))
+                name.erase(name.length() - 1);
+            while (!name.empty() && isspace(name[0]))
+                name.erase(0, 1);
+            names.push_back(name);
+            start = end + 1;
+        }
+        if (header.find_first_not_of(" \t\r") == std::string::npos) {
+            *error = "No header line";
+            return -1;
+        }
+
+        std::thread reader(&CsvPipeline::read, this, text);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++)
+            workers.push_back(std::thread(&CsvPipeline::work, this));
+
+        long rows = 0;
+        for (long next = 0; ; next++) {
+            std::unique_lock<std::mutex> g(lock);
+            changed.wait(g, [this, next] { return finished.count(next) != 0 || eof && next == chunks; });
+            if (finished.count(next) == 0)
+                break;
+            Chunk *ch = finished[next];
+            finished.erase(next);
+            inFlight--;
+            changed.notify_all();
+            g.unlock();
+            bool ok = ch->error.empty();
+            if (!ok)
+                *error = ch->error;
+            else if (!writeFully(outFd, ch->out.c_str(), ch->out.length())) {
+                *error = "Write error";
+                ok = false;
+            }
+            rows += ch->rows;
+            delete ch;
+            if (!ok) {
+                g.lock();
+                stopping = true;
+                changed.notify_all();
+                rows = -1;
+                break;
+            }
+        }
+
+        reader.join();
+        for (int i = 0; i < workers.size(); i++)
+            workers[i].join();
+        for (int i = 0; i < pending.size(); i++)
+            delete pending[i];
+        for (std::map<long, Chunk *>::iterator it = finished.begin(); it != finished.end(); it++)
+            delete it->second;
+        if (rows != -1 && !readError.empty()) {
+            *error = readError;
+            rows = -1;
+        }
+        return rows;
+    }
+
+    private:
+
+    void read(std::string text) {
+        long seq = 0;
+        long line = 2;
+        size_t want = CHUNK;
+        bool end = false;
+        while (!end) {
+            size_t have = text.length();
+            // Live, whole lines are handed on without waiting for more
+            bool ready = live && text.find('\n') != std::string::npos;
+            text.resize(want);
+            while (have < want && !ready) {
+                int n = ::read(inFd, &text[have], want - have);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1)
+                    readError = strerror(errno);
+                if (n <= 0) {
+                    end = true;
+                    break;
                 }
-                if (t == "")
-                    return ev;
-                if (t == "*" || t == "/") {
-                    Evaluator *ev2 = parseFactor();
-                    if (ev2 == NULL) {
-                        delete ev;
-                        return NULL;
-                    }
-                    if (t == "*")
-                        ev = new Product(tpos, ev, ev2);
-                    else
-                        ev = new Quotient(tpos, ev, ev2);
+                have += n;
+                ready = live && memchr(&text[have - n], '\n', n) != NULL;
+            }
+            text.resize(have);
+            size_t cut = end ? have : text.rfind('\n') + 1;
+            if (cut == 0) {
+                // A line longer than a chunk
+                want *= 2;
+                continue;
+            }
+            want = CHUNK;
+            Chunk *ch = new Chunk;
+            ch->seq = seq++;
+            ch->line = line;
+            ch->rows = 0;
+            ch->text = text.substr(0, cut);
+            text.erase(0, cut);
+            line += std::count(ch->text.begin(), ch->text.end(), '\n');
+            std::unique_lock<std::mutex> g(lock);
+            changed.wait(g, [this] { return inFlight < 2 * threads || stopping; });
+            if (stopping) {
+                delete ch;
+                break;
+            }
+            pending.push_back(ch);
+            inFlight++;
+            changed.notify_all();
+        }
+        std::lock_guard<std::mutex> g(lock);
+        eof = true;
+        chunks = seq;
+        changed.notify_all();
+    }
+
+    void work() {
+        // Each worker has a Context of its own, for the rows that have to
+        // be evaluated one at a time, and a TileProgram of its own, because
+        // a TileProgram keeps intermediate results in scratch space.
+        Context c(context);
+        TileProgram tp(ev, names, &c);
+        std::vector<std::vector<double> > blocks(names.size());
+        std::vector<const double *> in(names.size());
+        for (int i = 0; i < names.size(); i++)
+            if (tp.uses(i)) {
+                blocks[i].resize(TileProgram::TILE);
+                in[i] = &blocks[i][0];
+            }
+        while (true) {
+            std::unique_lock<std::mutex> g(lock);
+            changed.wait(g, [this] { return !pending.empty() || eof || stopping; });
+            if (pending.empty() || stopping)
+                return;
+            Chunk *ch = pending.front();
+            pending.pop_front();
+            g.unlock();
+            process(ch, &c, &tp, in, blocks);
+            g.lock();
+            finished[ch->seq] = ch;
+            changed.notify_all();
+        }
+    }
+
+    void process(Chunk *ch, Context *c, TileProgram *tp, std::vector<const double *> &in, std::vector<std::vector<double> > &blocks) {
+        double results[TileProgram::TILE];
+        char buf[50];
+        const char *p = ch->text.c_str();
+        const char *end = p + ch->text.length();
+        long line = ch->line;
+        int n = 0;
+        while (p < end || n > 0) {
+            if (p < end) {
+                const char *eol = (const char *) memchr(p, '\n', end - p);
+                if (eol == NULL)
+                    eol = end;
+                const char *f = p;
+                while (f < eol && isspace(*f))
+                    f++;
+                if (f == eol) {
+                    // Blank lines are skipped
+                    p = eol + 1;
+                    line++;
+                    if (p < end || n == 0)
+                        continue;
                 } else {
-                    pushback(t, tpos);
-                    return ev;
+                    for (int i = 0; i < names.size(); i++) {
+                        const char *fe = (const char *) memchr(f, ',', eol - f);
+                        if (fe == NULL)
+                            fe = eol;
+                        if (!blocks[i].empty()) {
+                            char *stop;
+                            blocks[i][n] = strtod(f, &stop);
+                            while (stop < fe && isspace(*stop))
+                                stop++;
+                            if (stop != fe || f == fe) {
+                                sprintf(buf, "Line %ld: ", line);
+                                ch->error = buf + ("bad value for " + names[i]);
+                                return;
+                            }
+                        }
+                        if (fe == eol && i < names.size() - 1) {
+                            sprintf(buf, "Line %ld: ", line);
+                            ch->error = buf + std::string("too few fields");
+                            return;
+                        }
+                        f = fe + 1;
+                    }
+                    p = eol + 1;
+                    line++;
+                    if (++n < TileProgram::TILE && p < end)
+                        continue;
                 }
             }
+            if (!tp->run(c, &in[0], n, results)) {
+                ch->error = "Error: " + c->errorMessage();
+                c->clearError();
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                int len = sprintf(buf, "%.9g\n", results[i]);
+                ch->out.append(buf, len);
+            }
+            ch->rows += n;
+            n = 0;
         }
     }
+};
 
-    Evaluator *parseFactor() {
-        Evaluator *ev = parseThing();
-        if (ev == NULL)
-            return NULL;
-        while (true) {
-            std::string t;
-            int tpos;
-            if (!nextToken(&t, &tpos)) {
-                fail:
-                delete ev;
-                return NULL;
+// Evaluates an expression over the bound columns in worker processes, for
+// jobs too big for one. A worker is this program, run with -worker, which
+// is sent the settings, the column bindings, and the variables and
+// functions serialized as definitions, over a socket, and is then asked
+// for ranges of rows. Anything that speaks the same protocol on its stdin
+// and stdout, and sees the same column files, would do as well. Every
+// worker has a few ranges in flight, and the results are written to the
+// output in row order as they come back, holding back only so far. When a
+// worker dies, its ranges go back to the front of the queue and another
+// takes its place; a range that has been lost MAX_TRIES times fails the
+// job, since it is most likely what killed them.
+//
+// Requests are two int64s, the first row and the number of rows. Replies
+// are the number of rows as an int64, then as many doubles, or -1, the
+// length of an error message, and the message. All are in native byte
+// order.
+class Coordinator {
+
+    private:
+
+    struct Worker {
+        pid_t pid;
+        int fd;
+        std::deque<long> ranges;    // In flight, in the order requested
+        std::string in;             // Replies, as far as they have come
+        bool answered;
+    };
+
+    static const long RANGE = 1 << 16;  // Rows per range
+    static const int DEPTH = 2;         // Ranges in flight per worker
+    static const int AHEAD = 8;         // Ranges finished early per worker
+    static const int MAX_TRIES = 3;
+
+    std::string setup;
+    long rows;
+    int outFd;
+    std::vector<Worker *> workers;
+    std::deque<long> pending;
+    std::vector<int> lost;
+    int failedStarts;
+    std::map<long, std::string> finished;
+    long written;
+
+    long length(long range) { return rows - range * RANGE < RANGE ? rows - range * RANGE : RANGE; }
+    bool spawn(std::string *error);
+    void feed(Worker *w);
+    bool receive(Worker *w, std::string *error);
+    bool lose(Worker *w, std::string *error);
+    static void reap(Worker *w);
+
+    public:
+
+    Coordinator(std::string setup, long rows, int outFd)
+        : setup(setup), rows(rows), outFd(outFd), failedStarts(0), written(0) {}
+    ~Coordinator();
+    // Runs the job on n workers; returns the number of rows, or -1 on
+    // error
+    long run(int n, std::string *error);
+
+    // The worker's side, on stdin and stdout; returns the exit status
+    static int work();
+};
+
+Coordinator::~Coordinator() {
+    for (int i = 0; i < workers.size(); i++)
+        reap(workers[i]);
+}
+
+long Coordinator::run(int n, std::string *error) {
+    long ranges = (rows + RANGE - 1) / RANGE;
+    for (long r = 0; r < ranges; r++)
+        pending.push_back(r);
+    lost.assign(ranges, 0);
+    for (int i = 0; i < n && i < ranges; i++)
+        if (!spawn(error))
+            return -1;
+    while (written < ranges) {
+        std::vector<struct pollfd> fds(workers.size());
+        for (int i = 0; i < fds.size(); i++) {
+            fds[i].fd = workers[i]->fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(&fds[0], fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            *error = strerror(errno);
+            return -1;
+        }
+        // Backwards, since workers that die are taken out, and their
+        // replacements added at the end
+        for (int i = fds.size() - 1; i >= 0; i--) {
+            if (fds[i].revents == 0)
+                continue;
+            Worker *w = workers[i];
+            char buf[65536];
+            int k = ::read(w->fd, buf, sizeof(buf));
+            if (k == -1 && errno == EINTR)
+                continue;
+            if (k > 0) {
+                w->in.append(buf, k);
+                if (!receive(w, error))
+                    return -1;
+                continue;
             }
-            if (t == "^") {
-                Evaluator *ev2 = parseThing();
-                if (ev2 == NULL)
-                    goto fail;
-                ev = new Power(tpos, ev, ev2);
-            } else {
-                pushback(t, tpos);
-                return ev;
+            workers.erase(workers.begin() + i);
+            bool ok = lose(w, error);
+            reap(w);
+            if (!ok || !pending.empty() && !spawn(error))
+                return -1;
+        }
+        bool progress = false;
+        for (std::map<long, std::string>::iterator it; (it = finished.find(written)) != finished.end(); written++) {
+            if (!writeFully(outFd, it->second.data(), it->second.length())) {
+                *error = "Write error";
+                return -1;
             }
+            finished.erase(it);
+            progress = true;
         }
+        if (progress)
+            for (int i = 0; i < workers.size(); i++)
+                feed(workers[i]);
     }
+    return rows;
+}
 
-    Evaluator *parseThing() {
-        std::string t;
-        int tpos;
-        if (!nextToken(&t, &tpos) || t == "")
-            return NULL;
-        if (t == "-" || t == "+") {
-            Evaluator *ev = parseThing();
-            if (ev == NULL)
-                return NULL;
-            if (t == "+")
-                return new Positive(tpos, ev);
-            else
-                return new Negative(tpos, ev);
+bool Coordinator::spawn(std::string *error) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        *error = strerror(errno);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only what is safe between fork and exec in a process that may
+        // have other threads
+        dup2(sv[1], 0);
+        dup2(sv[1], 1);
+        execl("/proc/self/exe", "parser", "-worker", (char *) NULL);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        close(sv[0]);
+        *error = strerror(errno);
+        return false;
+    }
+    Worker *w = new Worker;
+    w->pid = pid;
+    w->fd = sv[0];
+    w->answered = false;
+    workers.push_back(w);
+    // The worker reads all of this before it replies to anything. If it
+    // can't be sent, the worker is gone, which poll() will show.
+    const char *p = setup.data();
+    size_t left = setup.length();
+    while (left > 0) {
+        ssize_t k = send(w->fd, p, left, MSG_NOSIGNAL);
+        if (k == -1 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return true;
+        p += k;
+        left -= k;
+    }
+    feed(w);
+    return true;
+}
+
+// Hands out ranges until w has DEPTH in flight, but not too far ahead of
+// what has been written
+void Coordinator::feed(Worker *w) {
+    while (w->ranges.size() < DEPTH && !pending.empty()
+            && pending.front() < written + (long) AHEAD * workers.size()) {
+        long r = pending.front();
+        int64_t req[2] = { r * RANGE, length(r) };
+        if (send(w->fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+            return;
+        pending.pop_front();
+        w->ranges.push_back(r);
+    }
+}
+
+// Takes the complete replies from what w has sent
+bool Coordinator::receive(Worker *w, std::string *error) {
+    size_t p = 0;
+    size_t len = w->in.length();
+    while (len - p >= 8) {
+        int64_t k;
+        memcpy(&k, &w->in[p], 8);
+        if (k < 0) {
+            int64_t m;
+            if (len - p < 16)
+                break;
+            memcpy(&m, &w->in[p + 8], 8);
+            if (len - p - 16 < m)
+                break;
+            *error = w->in.substr(p + 16, m);
+            return false;
         }
-        double d;
-        if (sscanf(t.c_str(), "%lf", &d) == 1) {
-            return new Literal(tpos, d);
-        } else if (!isOperator(t)) {
-            std::string t2;
-            int t2pos;
-            if (!nextToken(&t2, &t2pos))
-                return NULL;
-            if (t2 == "(") {
-                std::vector<Evaluator *> *evs = parseExprList();
-                if (evs == NULL)
-                    return NULL;
-                if (!nextToken(&t2, &t2pos) || t2 != ")") {
-                    fail:
-                    for (int i = 0; i < evs->size(); i++)
-                        delete (*evs)[i];
-                    delete evs;
-                    return NULL;
-                }
-                /* TODO: Parsing an arbitrarily long argument list when you
-                 * know you know exactly one seems a bit stupid, and will lead
-                 * to unhelpful error messages.
-                 */
-                if (t == "sin" || t == "cos" || t == "tan"
-                        || t == "asin" || t == "acos" || t == "atan"
-                        || t == "log" || t == "exp" || t == "sqrt"
-                        || t == "abs") {
-                    if (evs->size() != 1)
-                        goto fail;
-                    Evaluator *ev = (*evs)[0];
-                    delete evs;
-                    if (t == "sin")
-                        return new Sin(tpos, ev);
-                    else if (t == "cos")
-                        return new Cos(tpos, ev);
-                    else if (t == "tan")
-                        return new Tan(tpos, ev);
-                    else if (t == "asin")
-                        return new Asin(tpos, ev);
-                    else if (t == "acos")
-                        return new Acos(tpos, ev);
-                    else if (t == "atan")
-                        return new Atan(tpos, ev);
-                    else if (t == "log")
-                        return new Log(tpos, ev);
-                    else if (t == "exp")
-                        return new Exp(tpos, ev);
-                    else if (t == "sqrt")
-                        return new Sqrt(tpos, ev);
-                    else // t == "abs"
-                        return new Abs(tpos, ev);
-                } else if (t == "max")
-                    return new Max(tpos, evs);
-                else if (t == "min")
-                    return new Min(tpos, evs);
-                else
-                    return new Call(tpos, t, evs);
-            } else {
-                pushback(t2, t2pos);
-                return new Variable(tpos, t);
-            }
-        } else if (t == "(") {
-            Evaluator *ev = parseExpr();
-            if (ev == NULL)
-                return NULL;
-            std::string t2;
-            int t2pos;
-            if (!nextToken(&t2, &t2pos) || t2 != ")") {
-                delete ev;
-                return NULL;
-            }
-            return new Identity(tpos, ev);
-        } else
-            return NULL;
+        if (len - p - 8 < k * 8)
+            break;
+        if (w->ranges.empty() || k != length(w->ranges.front())) {
+            *error = "Worker out of step";
+            return false;
+        }
+        finished[w->ranges.front()] = w->in.substr(p + 8, k * 8);
+        w->ranges.pop_front();
+        w->answered = true;
+        p += 8 + k * 8;
     }
+    w->in.erase(0, p);
+    feed(w);
+    return true;
+}
 
-    std::vector<Evaluator *> *parseExprList() {
-        std::vector<Evaluator *> *evs = new std::vector<Evaluator *>;
-        while (true) {
-            std::string t;
-            int tpos;
-            if (!nextToken(&t, &tpos)) {
-                fail:
-                for (int i = 0; i < evs->size(); i++)
-                    delete (*evs)[i];
-                delete evs;
-                return NULL;
+// Puts the ranges of a worker that died back at the front of the queue,
+// in order; false if that has happened too often
+bool Coordinator::lose(Worker *w, std::string *error) {
+    if (w->ranges.empty() && !w->answered && ++failedStarts >= MAX_TRIES) {
+        *error = "Workers exit before taking any work";
+        return false;
+    }
+    for (int i = w->ranges.size() - 1; i >= 0; i--) {
+        long r = w->ranges[i];
+        if (++lost[r] >= MAX_TRIES) {
+            char buf[100];
+            snprintf(buf, sizeof(buf), "Rows %ld to %ld lost %d workers", r * RANGE, r * RANGE + length(r) - 1, MAX_TRIES);
+            *error = buf;
+            return false;
+        }
+        pending.push_front(r);
+    }
+    return true;
+}
+
+void Coordinator::reap(Worker *w) {
+    close(w->fd);
+    kill(w->pid, SIGKILL);
+    while (waitpid(w->pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+    delete w;
+}
+
+int Coordinator::work() {
+    Context c;
+    ColumnSet columns;
+    Evaluator *ev = NULL;
+    std::string error;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (ev == NULL && error.empty() && (len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = 0;
+        if (strncmp(line, "settings ", 9) == 0) {
+            int tail, reassoc, hoist, poly, precision, single, depth;
+            if (sscanf(line + 9, "%d %d %d %d %d %d %d", &tail, &reassoc, &hoist, &poly, &precision, &single, &depth) != 7) {
+                error = "Bad settings";
+                break;
             }
-            pushback(t, tpos);
-            if (t == ")")
-                return evs;
-            Evaluator *ev = parseExpr();
+            c.setTailCalls(tail);
+            c.setReassociation(reassoc);
+            c.setHoisting(hoist);
+            c.setPolynomials(poly);
+            c.setPrecision(precision);
+            c.setFloatBatches(single);
+            c.setMaxDepth(depth);
+        } else if (strncmp(line, "bind ", 5) == 0) {
+            char *file = strchr(line + 5, ' ');
+            if (file == NULL)
+                error = "Bad binding";
+            else
+                columns.bind(std::string(line + 5, file - line - 5), file + 1, &error);
+        } else if (strncmp(line, "def ", 4) == 0)
+            assign(&c, line + 4, &error);
+        else if (strncmp(line, "eval ", 5) == 0) {
+            int errpos;
+            ev = parse(line + 5, &errpos, &c);
             if (ev == NULL)
-                goto fail;
-            evs->push_back(ev);
-            if (!nextToken(&t, &tpos))
-                goto fail;
-            if (t != ",") {
-                pushback(t, tpos);
-                return evs;
+                error = errorText(errpos);
+            else
+                ev = columns.expand(ev, &c, &error);
+        } else
+            error = "Bad setup";
+    }
+    free(line);
+    if (ev == NULL && error.empty())
+        return 0;
+    std::vector<std::string> names = columns.names();
+    TileProgram *tp = error.empty() ? new TileProgram(ev, names, &c) : NULL;
+    long rows = error.empty() ? columns.rows(tp, &error) : -1;
+    std::vector<double> out;
+    int64_t req[2];
+    while (fread(req, sizeof(req), 1, stdin) == 1) {
+        if (error.empty() && (req[0] < 0 || req[1] < 0 || req[0] + req[1] > rows))
+            error = "Rows out of range";
+        if (error.empty()) {
+            out.resize(req[1] > 0 ? req[1] : 1);
+            if (!columns.run(&c, tp, req[0], req[1], &out[0])) {
+                error = "Error: " + c.errorMessage();
+                c.clearError();
             }
         }
+        if (!error.empty()) {
+            int64_t head[2] = { -1, (int64_t) error.length() };
+            fwrite(head, sizeof(head), 1, stdout);
+            fwrite(error.data(), 1, error.length(), stdout);
+            fflush(stdout);
+            break;
+        }
+        fwrite(&req[1], sizeof(req[1]), 1, stdout);
+        fwrite(&out[0], sizeof(double), req[1], stdout);
+        fflush(stdout);
     }
+    delete tp;
+    delete ev;
+    return error.empty() ? 0 : 1;
+}
 
-    bool nextToken(std::string *tok, int *tpos) {
-        if (pbpos != -1) {
-            *tok = pb;
-            *tpos = pbpos;
-            pbpos = -1;
-            return true;
-        } else
-            return lex->nextToken(tok, tpos);
+static int serve(std::string addr, int threads, long long steps, double seconds, size_t bytes) {
+    int fd = openSocket(addr, true);
+    if (fd == -1) {
+        perror(addr.c_str());
+        return 1;
     }
+    signal(SIGPIPE, SIG_IGN);
+    Context c;
+    c.setStepLimit(steps);
+    c.setTimeLimit(seconds);
+    c.setMemoryLimit(bytes);
+    Optimizer::calibrate();
+    Server server(&c, fd, threads);
+    server.run();
+    return 1;
+}
 
-    void pushback(std::string o, int p) {
-        pb = o;
-        pbpos = p;
+// Runs a CsvPipeline; "-" stands for stdin or stdout. Uses as many
+// workers as the parallel setting, or as there are cores; only one, if the
+// expression has windows, which have to see the rows in order.
+static long csv(Context *c, std::string expr, std::string in, std::string out, int threads, bool live, std::string *error) {
+    int errpos;
+    Evaluator *ev = parse(expr, &errpos, c);
+    if (ev == NULL) {
+        *error = errorText(errpos);
+        return -1;
     }
+    int inFd = in == "-" ? 0 : open(in.c_str(), O_RDONLY);
+    int outFd = out == "-" ? 1 : open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    long rows = -1;
+    if (inFd == -1)
+        *error = "Can't open " + in;
+    else if (outFd == -1)
+        *error = "Can't create " + out;
+    else {
+        if (Optimizer::stateful(ev, c))
+            threads = 1;
+        else if (threads < 1)
+            threads = c->getPool() != NULL ? c->getPool()->size() : std::thread::hardware_concurrency();
+        CsvPipeline pipeline(c, ev, inFd, outFd, threads > 0 ? threads : 1, live);
+        rows = pipeline.run(error);
+    }
+    if (inFd > 0)
+        close(inFd);
+    if (outFd > 1)
+        close(outFd);
+    delete ev;
+    return rows;
+}
 
-    static bool isOperator(const std::string &s) {
-        return s.find_first_of("+-*/^(),") != std::string::npos;
+// Checks that the definitions serialized from c read back as what they
+// were, the way the workers of shard() read them: the same variables, and
+// functions that evaluate to the same, at 0.5 for every parameter, within
+// a few steps. Those that run out of steps, or fail, on either side, are
+// not compared.
+static bool roundTrip(Context *c, std::string &defs, std::string *error) {
+    static const long long STEPS = 100000;
+    Context copy;
+    copy.setTailCalls(c->useTailCalls());
+    copy.setReassociation(c->useReassociation());
+    copy.setHoisting(c->useHoisting());
+    copy.setPolynomials(c->usePolynomials());
+    copy.setPrecision(c->getPrecision());
+    copy.setFloatBatches(c->useFloatBatches());
+    copy.setMaxDepth(c->getMaxDepth());
+    for (size_t p = 0, eol; p < defs.length(); p = eol + 1) {
+        eol = defs.find('\n', p);
+        std::string line = defs.substr(p, eol - p);
+        if (!assign(&copy, line, error)) {
+            *error = "Can't read back " + line + ": " + *error;
+            return false;
+        }
     }
-};
+    std::map<std::string, double> &vars = c->getVariables();
+    for (std::map<std::string, double>::iterator it = vars.begin(); it != vars.end(); it++) {
+        double d = copy.getVariable(it->first);
+        if (!(d == it->second && signbit(d) == signbit(it->second) || isnan(d) && isnan(it->second))) {
+            *error = "Variable " + it->first + " doesn't read back";
+            return false;
+        }
+    }
+    std::map<std::string, Function *> &funcs = c->getFunctions();
+    for (std::map<std::string, Function *>::iterator it = funcs.begin(); it != funcs.end(); it++) {
+        Function *g = copy.getFunction(it->first);
+        if (g == NULL || g->params().size() != it->second->params().size()) {
+            *error = "Function " + it->first + " doesn't read back";
+            return false;
+        }
+        std::vector<double> args(g->params().size(), 0.5);
+        Budget b1(STEPS), b2(STEPS);
+        Context c1(c), c2(&copy);
+        c1.setBudget(&b1);
+        c2.setBudget(&b2);
+        double d1 = it->second->eval(args, &c1);
+        double d2 = g->eval(args, &c2);
+        if (c1.failed() || c2.failed())
+            continue;
+        if (!(d1 == d2 || isnan(d1) && isnan(d2))) {
+            *error = "Function " + it->first + " doesn't read back";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs a Coordinator over the bound columns, with the settings, variables
+// and functions of c, and writes the results to a new column file
+static long shard(Context *c, ColumnSet *columns, int workers, std::string file, std::string expr, std::string *error) {
+    int errpos;
+    Evaluator *ev = parse(expr, &errpos, c);
+    if (ev == NULL) {
+        *error = errorText(errpos);
+        return -1;
+    }
+    if ((ev = columns->expand(ev, c, error)) == NULL)
+        return -1;
+    if (Optimizer::stateful(ev, c)) {
+        *error = "Windows need the rows in order";
+        delete ev;
+        return -1;
+    }
+    std::vector<std::string> names = columns->names();
+    TileProgram *tp = new TileProgram(ev, names, c);
+    long rows = columns->rows(tp, error);
+    delete tp;
+    delete ev;
+    if (rows == -1)
+        return -1;
+
+    char buf[100];
+    snprintf(buf, sizeof(buf), "settings %d %d %d %d %d %d %d\n", c->useTailCalls(), c->useReassociation(),
+            c->useHoisting(), c->usePolynomials(), c->getPrecision(), c->useFloatBatches(), c->getMaxDepth());
+    std::string setup = buf;
+    for (int i = 0; i < names.size(); i++)
+        setup += "bind " + names[i] + " " + columns->path(names[i]) + "\n";
+    std::string defs = c->serialize();
+    if (!roundTrip(c, defs, error))
+        return -1;
+    for (size_t p = 0, eol; p < defs.length(); p = eol + 1) {
+        eol = defs.find('\n', p);
+        setup += "def " + defs.substr(p, eol - p + 1);
+    }
+    setup += "eval " + expr + "\n";
+
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        *error = "Can't create " + file;
+        return -1;
+    }
+    Coordinator coordinator(setup, rows, fd);
+    rows = coordinator.run(workers > 0 ? workers : 1, error);
+    close(fd);
+    return rows;
+}
+
+// The Budget of the REPL's evaluation in progress, if any, for Ctrl-C to
+// cancel. Without one, Ctrl-C quits, as usual.
+static std::atomic<Budget *> running(NULL);
+
+static void interrupt(int sig) {
+    Budget *b = running;
+    if (b != NULL) {
+        b->cancel();
+        return;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
 int main(int argc, char *argv[]) {
+    // Server and client modes; see the Server and Client classes.
+    // -server <addr> [threads [steps [seconds [bytes]]]]: the limits apply
+    // to every request, and the quota to the definitions; 0 for none.
+    if (argc >= 3 && strcmp(argv[1], "-server") == 0) {
+        int threads = argc >= 4 ? atoi(argv[3]) : 4;
+        long long steps = argc >= 5 ? atoll(argv[4]) : 0;
+        double seconds = argc >= 6 ? atof(argv[5]) : 0;
+        double bytes = argc >= 7 ? atof(argv[6]) : 0;
+        return serve(argv[2], threads > 0 ? threads : 1, steps, seconds, bytes > 0 ? (size_t) bytes : 0);
+    }
+    if (argc >= 4 && strcmp(argv[1], "-client") == 0 && strcmp(argv[3], "-metrics") == 0)
+        return Client::metrics(argv[2], argc >= 5 ? argv[4] : "");
+    if (argc >= 3 && strcmp(argv[1], "-client") == 0) {
+        Client client(argv[2]);
+        int n = 0, depth = 16, conns = 1;
+        bool batch = false, binary = false;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-batch") == 0)
+                batch = true;
+            else if (strcmp(argv[i], "-binary") == 0)
+                binary = true;
+            else if (i + 1 == argc)
+                break;
+            else if (strcmp(argv[i], "-n") == 0)
+                n = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-depth") == 0)
+                depth = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-c") == 0)
+                conns = atoi(argv[++i]);
+        }
+        return n > 0 ? client.load(n, depth > 0 ? depth : 1, conns > 0 ? conns : 1) : client.run(batch, binary);
+    }
+
+    // -worker: evaluate rows for a Coordinator, on stdin and stdout
+    if (argc == 2 && strcmp(argv[1], "-worker") == 0)
+        return Coordinator::work();
+
+    // -csv [-t threads] [-d definition]... <expr> [file]: evaluate expr
+    // for every row of a CSV file, or stdin; see CsvPipeline. -stream does
+    // the same live, writing every row's result as soon as the row is in.
+    if (argc >= 3 && (strcmp(argv[1], "-csv") == 0 || strcmp(argv[1], "-stream") == 0)) {
+        bool live = strcmp(argv[1], "-stream") == 0;
+        Context c;
+        int threads = 0;
+        int i = 2;
+        std::string error;
+        for (; i < argc - 1 && argv[i][0] == '-' && argv[i][1] != 0; i += 2) {
+            if (strcmp(argv[i], "-t") == 0)
+                threads = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-d") != 0 || !assign(&c, argv[i + 1], &error)) {
+                if (error.empty())
+                    error = std::string("Usage: ") + argv[0] + " " + argv[1] + " [-t threads] [-d definition]... <expr> [file]";
+                fprintf(stderr, "%s\n", error.c_str());
+                return 1;
+            }
+        }
+        if (i >= argc) {
+            fprintf(stderr, "Usage: %s %s [-t threads] [-d definition]... <expr> [file]\n", argv[0], argv[1]);
+            return 1;
+        }
+        if (csv(&c, argv[i], i + 1 < argc ? argv[i + 1] : "-", "-", threads, live, &error) == -1) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        return 0;
+    }
+
+    // -binary raw|framed: read a script from stdin, without prompts, and
+    // write the results to stdout in binary, and the text commands print
+    // to stderr; see BinaryOutputStream.
+    bool prompt = true;
+    OutputStream *file, *out, *text = NULL;
+    if (argc >= 3 && strcmp(argv[1], "-binary") == 0) {
+        if (strcmp(argv[2], "raw") != 0 && strcmp(argv[2], "framed") != 0) {
+            fprintf(stderr, "Usage: %s -binary raw|framed\n", argv[0]);
+            return 1;
+        }
+        file = new FileOutputStream(stdout);
+        text = new FileOutputStream(stderr, true);
+        out = new BinaryOutputStream(file, strcmp(argv[2], "framed") == 0, text);
+        prompt = false;
+    } else
+        file = out = new FileOutputStream(stdout, true);
+
     Context c;
-    char line[1024];
-    char *eqpos;
-    OutputStream *out = new FileOutputStream(stdout, true);
+    ColumnSet columns;
+    char *line = NULL;
+    size_t linecap = 0;
+    Budget budget;
+    DumpWriter *dumping = NULL;
+    signal(SIGINT, interrupt);
+    Optimizer::calibrate();
 
     while (true) {
-        printf("> ");
-        fflush(stdout);
-        if (fgets(line, 1024, stdin) == NULL)
+        running = NULL;
+        if (dumping != NULL && dumping->done()) {
+            delete dumping;
+            dumping = NULL;
+        }
+        if (prompt) {
+            printf("> ");
+            fflush(stdout);
+        }
+        if (getline(&line, &linecap, stdin) == -1)
             break;
+        Telemetry::Command command(Telemetry::REPL_COMMAND);
+        // Every command gets a fresh Budget, with the current limits
+        budget.restart(c.getStepLimit(), c.getTimeLimit());
+        c.setBudget(&budget);
+        running = &budget;
         //strcpy(line, "sin(1.57)");
         int linelen = strlen(line);
         while (linelen > 0 && isspace(line[0]))
@@ -1566,56 +11136,265 @@ int main(int argc, char *argv[]) {
             c.dump(out, true);
         } else if (strcmp(line, "dumprpn") == 0) {
             c.dump(out, false);
-        } else if ((eqpos = strchr(line, '=')) != NULL) {
-            // Assignment
-            std::string left(line, eqpos - line);
-            std::string right(eqpos + 1);
-            int p1 = left.find('(');
-            std::string name = left.substr(0, p1);
-            if (p1 != std::string::npos) {
-                // Function definition
-                std::vector<std::string> paramNames;
-                while (++p1 < left.length()) {
-                    int p2 = left.find_first_of(",)", p1);
-                    if (p2 == std::string::npos) {
-                        paramNames.push_back(left.substr(p1));
-                        break;
-                    }
-                    paramNames.push_back(left.substr(p1, p2 - p1));
-                    p1 = p2;
-                }
-                int errpos;
-                Evaluator *ev = Parser::parse(right, &errpos);
-                if (ev == NULL) {
-                    fprintf(stderr, "Error at %d\n", errpos);
-                    continue;
-                }
-                Function *f = new Function(paramNames, ev);
-                c.setFunction(name, f);
+        } else if (strncmp(line, "dump ", 5) == 0 || strncmp(line, "dumpalg ", 8) == 0 || strncmp(line, "dumprpn ", 8) == 0) {
+            // dump <file> [&], and the same for dumpalg and dumprpn: with
+            // the &, a snapshot is written in the background, while the
+            // REPL goes on; one at a time
+            bool alg = line[4] != 'r';
+            char *name = line + (line[4] == ' ' ? 5 : 8);
+            bool background = linelen > 2 && strcmp(line + linelen - 2, " &") == 0;
+            if (background) {
+                linelen -= 2;
+                while (linelen > 0 && isspace(line[linelen - 1]))
+                    linelen--;
+                line[linelen] = 0;
+            }
+            FILE *f = fopen(name, "w");
+            if (f == NULL) {
+                fprintf(stderr, "Can't open %s\n", name);
+                continue;
+            }
+            if (background) {
+                delete dumping;
+                dumping = new DumpWriter(new FileOutputStream(f), alg);
+                dumping->start(&c);
             } else {
-                // Variable assignment
-                int errpos;
-                Evaluator *ev = Parser::parse(right, &errpos);
-                if (ev == NULL) {
-                    fprintf(stderr, "Error at %d\n", errpos);
-                    continue;
-                }
-                c.setVariable(left, ev->eval(&c));
-                delete ev;
+                FileOutputStream fos(f);
+                c.dump(&fos, alg);
+            }
+        } else if (strcmp(line, "tailcalls on") == 0) {
+            c.setTailCalls(true);
+        } else if (strcmp(line, "tailcalls off") == 0) {
+            c.setTailCalls(false);
+        } else if (strncmp(line, "parallel", 8) == 0 && (line[8] == 0 || line[8] == ' ')) {
+            int threads;
+            if (strcmp(line + 8, " off") == 0)
+                c.setThreads(0);
+            else if (sscanf(line + 8, "%d", &threads) == 1)
+                c.setThreads(threads);
+            else {
+                out->write((double) (c.getPool() == NULL ? 0 : c.getPool()->size()));
+                out->newline();
+            }
+        } else if (strcmp(line, "profile") == 0) {
+            c.profile(out);
+        } else if (strcmp(line, "profile on") == 0) {
+            c.setProfiling(true);
+        } else if (strcmp(line, "profile off") == 0) {
+            c.setProfiling(false);
+        } else if (strcmp(line, "profile reset") == 0) {
+            c.resetProfile();
+        } else if (strncmp(line, "profile dump ", 13) == 0) {
+            // profile dump <file>: the profile in folded stacks, for
+            // flamegraph.pl; one stack per function, since the paths stop
+            // at calls (see Profiler::folded)
+            FILE *f = fopen(line + 13, "w");
+            if (f == NULL) {
+                fprintf(stderr, "Can't open %s\n", line + 13);
+                continue;
+            }
+            FileOutputStream fos(f);
+            c.profileFolded(&fos);
+        } else if (strncmp(line, "bind ", 5) == 0) {
+            // bind <name> <file>, or bind <function>(<param>) <file>
+            char *name = line + 5;
+            char *file = strchr(name, ' ');
+            std::string error;
+            if (file == NULL)
+                fprintf(stderr, "Usage: bind <name> <file>\n");
+            else if (!columns.bind(std::string(name, file - name), file + 1, &error))
+                fprintf(stderr, "%s\n", error.c_str());
+        } else if (strncmp(line, "unbind ", 7) == 0) {
+            columns.unbind(line + 7);
+        } else if (strncmp(line, "colmap ", 7) == 0) {
+            // colmap <file> <expr>
+            char *file = line + 7;
+            char *expr = strchr(file, ' ');
+            if (expr == NULL) {
+                fprintf(stderr, "Usage: colmap <file> <expr>\n");
+                continue;
             }
-        } else {
-            // Immediate evaluation
             int errpos;
-            Evaluator *ev = Parser::parse(line, &errpos);
+            Evaluator *ev = parse(expr + 1, &errpos, &c);
             if (ev == NULL) {
-                fprintf(stderr, "Error at %d\n", errpos);
+                fprintf(stderr, "%s\n", errorText(errpos).c_str());
+                continue;
+            }
+            std::string error;
+            if ((ev = columns.expand(ev, &c, &error)) == NULL) {
+                fprintf(stderr, "%s\n", error.c_str());
                 continue;
             }
-            out->write(ev->eval(&c));
-            out->newline();
+            long rows = columns.evaluate(&c, ev, std::string(file, expr - file), &error);
             delete ev;
+            if (rows == -1)
+                fprintf(stderr, "%s\n", error.c_str());
+            else
+                out->writeResult((double) rows);
+        } else if (strncmp(line, "shard ", 6) == 0) {
+            // shard <workers> <file> <expr>
+            char *file = strchr(line + 6, ' ');
+            char *expr = file == NULL ? NULL : strchr(file + 1, ' ');
+            if (expr == NULL) {
+                fprintf(stderr, "Usage: shard <workers> <file> <expr>\n");
+                continue;
+            }
+            std::string error;
+            long rows = shard(&c, &columns, atoi(line + 6), std::string(file + 1, expr - file - 1), expr + 1, &error);
+            if (rows == -1)
+                fprintf(stderr, "%s\n", error.c_str());
+            else
+                out->writeResult((double) rows);
+        } else if (strncmp(line, "explain ", 8) == 0) {
+            std::string error;
+            if (!explain(&c, line + 8, out, &error))
+                fprintf(stderr, "%s\n", error.c_str());
+        } else if (strncmp(line, "export ", 7) == 0) {
+            std::string error;
+            fflush(stdout);
+            int n = Exporter::run(&c, line + 7, &error);
+            if (n == -1)
+                fprintf(stderr, "%s\n", error.c_str());
+            else
+                out->writeResult(n);
+        } else if (strncmp(line, "csv ", 4) == 0 || strncmp(line, "stream ", 7) == 0) {
+            // csv <infile> <outfile> <expr>, or stream, the same live
+            bool live = line[0] == 's';
+            char *in = line + (live ? 7 : 4);
+            char *outFile = strchr(in, ' ');
+            char *expr = outFile == NULL ? NULL : strchr(outFile + 1, ' ');
+            if (expr == NULL) {
+                fprintf(stderr, "Usage: %s <infile> <outfile> <expr>\n", live ? "stream" : "csv");
+                continue;
+            }
+            std::string error;
+            fflush(stdout);
+            long rows = csv(&c, expr + 1, std::string(in, outFile - in), std::string(outFile + 1, expr - outFile - 1), 0, live, &error);
+            if (rows == -1)
+                fprintf(stderr, "%s\n", error.c_str());
+            else
+                out->writeResult((double) rows);
+        } else if (strcmp(line, "polynomials on") == 0) {
+            c.setPolynomials(true);
+        } else if (strcmp(line, "polynomials off") == 0) {
+            c.setPolynomials(false);
+        } else if (strcmp(line, "precision exact") == 0) {
+            c.setPrecision(PRECISION_EXACT);
+        } else if (strcmp(line, "precision fast") == 0) {
+            c.setPrecision(PRECISION_FAST);
+        } else if (strcmp(line, "precision approx") == 0) {
+            c.setPrecision(PRECISION_APPROX);
+        } else if (strcmp(line, "batch double") == 0) {
+            c.setFloatBatches(false);
+        } else if (strcmp(line, "batch float") == 0) {
+            c.setFloatBatches(true);
+        } else if (strcmp(line, "accuracy") == 0) {
+            Math::report(out);
+        } else if (strcmp(line, "hoist on") == 0) {
+            c.setHoisting(true);
+        } else if (strcmp(line, "hoist off") == 0) {
+            c.setHoisting(false);
+        } else if (strcmp(line, "reassociate on") == 0) {
+            c.setReassociation(true);
+        } else if (strcmp(line, "reassociate off") == 0) {
+            c.setReassociation(false);
+        } else if (strncmp(line, "maxdepth", 8) == 0 && (line[8] == 0 || line[8] == ' ')) {
+            // maxdepth <n>; without an argument, prints it. Recursion also
+            // stops short of the end of the stack, however large n is.
+            int depth;
+            if (sscanf(line + 8, "%d", &depth) == 1 && depth > 0)
+                c.setMaxDepth(depth);
+            else {
+                out->write((double) c.getMaxDepth());
+                out->newline();
+            }
+        } else if (strncmp(line, "budget", 6) == 0 && (line[6] == 0 || line[6] == ' ')) {
+            // budget steps <n> | budget time <seconds> | budget off;
+            // without arguments, prints the step and time limits
+            long long steps;
+            double seconds;
+            if (sscanf(line + 6, " steps %lld", &steps) == 1 && steps >= 0)
+                c.setStepLimit(steps);
+            else if (sscanf(line + 6, " time %lf", &seconds) == 1 && seconds >= 0)
+                c.setTimeLimit(seconds);
+            else if (strcmp(line + 6, " off") == 0) {
+                c.setStepLimit(0);
+                c.setTimeLimit(0);
+            } else {
+                out->write((double) c.getStepLimit());
+                out->write(" ");
+                out->write(c.getTimeLimit());
+                out->newline();
+            }
+        } else if (strcmp(line, "metrics") == 0) {
+            Telemetry::report(out);
+        } else if (strcmp(line, "metrics reset") == 0) {
+            Telemetry::reset();
+        } else if (strncmp(line, "metrics ", 8) == 0) {
+            // metrics <file>: writes them in the Prometheus format
+            std::string error;
+            if (!Telemetry::write(line + 8, Telemetry::prometheus(), &error))
+                fprintf(stderr, "%s\n", error.c_str());
+        } else if (strcmp(line, "stats") == 0) {
+            c.stats(out);
+        } else if (strncmp(line, "quota", 5) == 0 && (line[5] == 0 || line[5] == ' ')) {
+            // quota memory <bytes> | quota function <bytes> | quota off;
+            // without arguments, prints both quotas
+            double bytes;
+            if (sscanf(line + 5, " memory %lf", &bytes) == 1 && bytes >= 0)
+                c.setMemoryLimit((size_t) bytes);
+            else if (sscanf(line + 5, " function %lf", &bytes) == 1 && bytes >= 0)
+                c.setFunctionLimit((size_t) bytes);
+            else if (strcmp(line + 5, " off") == 0) {
+                c.setMemoryLimit(0);
+                c.setFunctionLimit(0);
+            } else {
+                out->write((double) c.getMemoryLimit());
+                out->write(" ");
+                out->write((double) c.getFunctionLimit());
+                out->newline();
+            }
+        } else if (strncmp(line, "montecarlo(", 11) == 0 && line[strlen(line) - 1] == ')') {
+            std::string error, note;
+            double mean;
+            std::string args(line + 11, strlen(line) - 12);
+            if (!montecarlo(&c, args, &mean, &error, &note))
+                fprintf(stderr, "%s\n", error.c_str());
+            else {
+                out->write(note);
+                out->newline();
+            }
+        } else if (strchr(line, '=') != NULL) {
+            command.setKind(Telemetry::REPL_DEFINE);
+            std::string error, note;
+            if (!assign(&c, line, &error, &note))
+                fprintf(stderr, "%s\n", error.c_str());
+            else if (note != "") {
+                Telemetry::Phase phase(Telemetry::FORMAT);
+                out->write(note);
+                out->newline();
+            }
+        } else {
+            // Immediate evaluation
+            command.setKind(Telemetry::REPL_EVAL);
+            std::string error;
+            double value;
+            if (!evaluateLine(&c, line, &value, &error)) {
+                fprintf(stderr, "%s\n", error.c_str());
+                out->writeError(error);
+                continue;
+            }
+            Telemetry::Phase phase(Telemetry::FORMAT);
+            out->writeResult(value);
         }
     }
-    delete out;
+    free(line);
+    delete dumping;
+    if (out != file)
+        delete out;
+    delete file;
+    delete text;
     return 0;
 }
+
+#endif